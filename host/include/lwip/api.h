@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HOST_LWIP_API_H__
+#define __UROB_HOST_LWIP_API_H__
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+
+enum netconn_type
+{
+    NETCONN_INVALID = 0,
+    NETCONN_TCP = 0x10,
+    NETCONN_TCP_IPV6 = 0x18
+};
+
+enum netconn_state
+{
+    NETCONN_NONE,
+    NETCONN_WRITE,
+    NETCONN_LISTEN,
+    NETCONN_CONNECT,
+    NETCONN_CLOSE
+};
+
+enum netconn_evt
+{
+    NETCONN_EVT_RCVPLUS,
+    NETCONN_EVT_RCVMINUS,
+    NETCONN_EVT_SENDPLUS,
+    NETCONN_EVT_SENDMINUS,
+    NETCONN_EVT_ERROR
+};
+
+#define NETCONN_NOFLAG (0x00)
+#define NETCONN_NOCOPY (0x00)
+#define NETCONN_COPY (0x01)
+#define NETCONN_MORE (0x02)
+#define NETCONN_DONTBLOCK (0x04)
+
+#define NETCONN_FLAG_NON_BLOCKING (0x02)
+
+struct netconn;
+typedef void (* netconn_callback)(struct netconn * conn, enum netconn_evt evt, u16_t len);
+
+struct netconn
+{
+    enum netconn_type type;
+    enum netconn_state state;
+    union
+    {
+        struct tcp_pcb * tcp;
+    } pcb;
+    err_t pending_err;
+    s32_t send_timeout;
+    u32_t recv_timeout;
+    u8_t flags;
+    netconn_callback callback;
+};
+
+struct netbuf
+{
+    struct pbuf * p;
+    struct pbuf * ptr;
+};
+
+struct netvector
+{
+    const void * ptr;
+    size_t len;
+};
+
+struct netconn * netconn_new_with_proto_and_callback(enum netconn_type type, u8_t proto, netconn_callback callback);
+#define netconn_new(type) netconn_new_with_proto_and_callback(type, 0, NULL)
+#define netconn_new_with_callback(type, callback) netconn_new_with_proto_and_callback(type, 0, callback)
+
+err_t netconn_delete(struct netconn * conn);
+err_t netconn_bind(struct netconn * conn, const ip_addr_t * addr, u16_t port);
+err_t netconn_connect(struct netconn * conn, const ip_addr_t * addr, u16_t port);
+err_t netconn_disconnect(struct netconn * conn);
+err_t netconn_listen_with_backlog(struct netconn * conn, u8_t backlog);
+#define netconn_listen(conn) netconn_listen_with_backlog(conn, 0xff)
+err_t netconn_accept(struct netconn * conn, struct netconn ** new_conn);
+err_t netconn_recv(struct netconn * conn, struct netbuf ** new_buf);
+err_t netconn_recv_tcp_pbuf(struct netconn * conn, struct pbuf ** new_buf);
+err_t netconn_recv_tcp_pbuf_flags(struct netconn * conn, struct pbuf ** new_buf, u8_t apiflags);
+err_t netconn_write_partly(struct netconn * conn, const void * dataptr, size_t size, u8_t apiflags, size_t * bytes_written);
+#define netconn_write(conn, dataptr, size, apiflags) netconn_write_partly(conn, dataptr, size, apiflags, NULL)
+err_t netconn_write_vectors_partly(struct netconn * conn, struct netvector * vectors, u16_t vectorcnt, u8_t apiflags, size_t * bytes_written);
+err_t netconn_close(struct netconn * conn);
+err_t netconn_shutdown(struct netconn * conn, u8_t shut_rx, u8_t shut_tx);
+err_t netconn_getaddr(struct netconn * conn, ip_addr_t * addr, u16_t * port, u8_t local);
+#define netconn_peer(conn, addr, port) netconn_getaddr(conn, addr, port, 0)
+
+#define netconn_set_flags(conn, set_flags) do { (conn)->flags = (u8_t) ((conn)->flags | (set_flags)); } while (0)
+#define netconn_clear_flags(conn, clr_flags) do { (conn)->flags = (u8_t) ((conn)->flags & (u8_t) (~(clr_flags) & 0xff)); } while (0)
+#define netconn_is_flag_set(conn, flag) (((conn)->flags & (flag)) != 0)
+#define netconn_set_nonblocking(conn, val) do { if (val) { netconn_set_flags(conn, NETCONN_FLAG_NON_BLOCKING); } \
+    else { netconn_clear_flags(conn, NETCONN_FLAG_NON_BLOCKING); } } while (0)
+#define netconn_is_nonblocking(conn) netconn_is_flag_set(conn, NETCONN_FLAG_NON_BLOCKING)
+#define netconn_set_recvtimeout(conn, timeout) ((conn)->recv_timeout = (timeout))
+#define netconn_err(conn) ((conn)->pending_err)
+
+void netbuf_delete(struct netbuf * buf);
+err_t netbuf_data(struct netbuf * buf, void ** dataptr, u16_t * len);
+
+#endif // __UROB_HOST_LWIP_API_H__
@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HOST_LWIP_IP_ADDR_H__
+#define __UROB_HOST_LWIP_IP_ADDR_H__
+
+#include "lwip/opt.h"
+
+// IPv4 only (LWIP_IPV6 is 0), in network order
+typedef struct
+{
+    u32_t addr;
+} ip4_addr_t;
+
+typedef ip4_addr_t ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+#define IP6_ADDR_ANY IP_ADDR_ANY
+
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip4_addr_get_u32(src_ipaddr) ((src_ipaddr)->addr)
+#define ip_addr_cmp(addr1, addr2) ((addr1)->addr == (addr2)->addr)
+#define ip_addr_set_zero(ipaddr) ((ipaddr)->addr = 0)
+#define IPADDR_LOOPBACK (0x7f000001UL)
+#define PP_HTONL(x) __builtin_bswap32((u32_t) (x)) // little endian hosts
+#define ip_addr_set_loopback(is_ipv6, ipaddr) ((void) (is_ipv6), (ipaddr)->addr = PP_HTONL(IPADDR_LOOPBACK))
+
+char * ipaddr_ntoa(const ip_addr_t * addr);
+
+#endif // __UROB_HOST_LWIP_IP_ADDR_H__
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HOST_LWIP_PBUF_H__
+#define __UROB_HOST_LWIP_PBUF_H__
+
+#include "lwip/err.h"
+
+typedef enum
+{
+    PBUF_TRANSPORT = 74,
+    PBUF_IP = 54,
+    PBUF_LINK = 14,
+    PBUF_RAW_TX = 0,
+    PBUF_RAW = 0
+} pbuf_layer;
+
+typedef enum
+{
+    PBUF_RAM = 0x280,
+    PBUF_ROM = 0x01,
+    PBUF_REF = 0x41,
+    PBUF_POOL = 0x182
+} pbuf_type;
+
+struct pbuf
+{
+    struct pbuf * next;
+    void * payload;
+    u16_t tot_len;
+    u16_t len;
+    u8_t type_internal;
+    u8_t flags;
+    u16_t ref;
+    u8_t if_idx;
+};
+
+struct pbuf * pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf * p);
+void pbuf_ref(struct pbuf * p);
+void pbuf_cat(struct pbuf * head, struct pbuf * tail);
+void pbuf_chain(struct pbuf * head, struct pbuf * tail);
+void pbuf_realloc(struct pbuf * p, u16_t size);
+u16_t pbuf_clen(const struct pbuf * p);
+u16_t pbuf_copy_partial(const struct pbuf * p, void * dataptr, u16_t len, u16_t offset);
+
+#endif // __UROB_HOST_LWIP_PBUF_H__
@@ -0,0 +1,39 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HOST_LWIP_TCPIP_PRIV_H__
+#define __UROB_HOST_LWIP_TCPIP_PRIV_H__
+
+#include "lwip/tcpip.h"
+
+struct tcpip_api_call_data
+{
+    err_t err;
+};
+
+typedef err_t (* tcpip_api_call_fn)(struct tcpip_api_call_data * call);
+
+// urob_netsim calls fn right away, its only thread stands for the tcpip thread
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data * call);
+
+#endif // __UROB_HOST_LWIP_TCPIP_PRIV_H__
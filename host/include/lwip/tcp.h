@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HOST_LWIP_TCP_H__
+#define __UROB_HOST_LWIP_TCP_H__
+
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+enum tcp_state
+{
+    CLOSED = 0,
+    LISTEN,
+    SYN_SENT,
+    SYN_RCVD,
+    ESTABLISHED,
+    FIN_WAIT_1,
+    FIN_WAIT_2,
+    CLOSE_WAIT,
+    CLOSING,
+    LAST_ACK,
+    TIME_WAIT
+};
+
+#define TF_NODELAY (0x40U)
+
+// The fields read by urob (urob_tcp_info, nagle), filled by urob_netsim from its link
+struct tcp_pcb
+{
+    struct tcp_pcb * next; // see lwip/priv/tcp_priv.h
+    enum tcp_state state;
+    u8_t flags;
+    u16_t mss;
+    s16_t sa;
+    s16_t sv;
+    s16_t rto;
+    u8_t nrtx;
+    u8_t dupacks;
+    u32_t lastack;
+    u32_t snd_nxt;
+    tcpwnd_size_t rcv_wnd;
+    tcpwnd_size_t cwnd;
+    tcpwnd_size_t ssthresh;
+    tcpwnd_size_t snd_wnd;
+    tcpwnd_size_t snd_buf;
+    u16_t snd_queuelen;
+};
+
+void tcp_abort(struct tcp_pcb * pcb);
+
+#define tcp_nagle_disable(pcb) ((pcb)->flags |= TF_NODELAY)
+#define tcp_nagle_enable(pcb) ((pcb)->flags &= (u8_t) ~TF_NODELAY)
+
+#endif // __UROB_HOST_LWIP_TCP_H__
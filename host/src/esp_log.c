@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int _level = -1; // read from the environment at the first write
+
+void esp_log_write(esp_log_level_t level, const char * tag, const char * format, ...)
+{
+    if (_level < 0)
+    {
+        const char * variable = getenv("UROB_LOG_LEVEL");
+        _level = variable != NULL ? atoi(variable) : ESP_LOG_INFO;
+    }
+
+    if ((int) level > _level)
+    {
+        return;
+    }
+
+    static const char letters[] = "NEWIDV";
+    fprintf(stderr, "%c %s: ", letters[level <= ESP_LOG_VERBOSE ? level : ESP_LOG_VERBOSE], tag);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
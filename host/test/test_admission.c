@@ -0,0 +1,176 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_admission: the tcp pcbs left decide between accepting, rejecting and resetting, and rejected
+// clients get their 503 and close first, so that TIME_WAIT stays on their side
+
+#include "urob_admission.h"
+#include "urob_http_server.h"
+#include "urob_metrics.h"
+#include "urob_netsim.h"
+#include "urob_teardown.h"
+#include "urob_test.h"
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define TEST_PORT (8000)
+
+// @return the verdict on one more loopback connection, which takes two pcbs
+static urob_admission_verdict _check_connection(urob_admission * admission, struct netconn * listener, struct netconn ** client)
+{
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    * client = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(* client, true);
+    netconn_connect(* client, &address, TEST_PORT);
+    urob_netsim_advance(UROB_NETSIM_WIFI_LINK.rtt_us * 4);
+
+    struct netconn * accepted = NULL;
+    UROB_TEST_CHECK(netconn_accept(listener, &accepted) == ERR_OK);
+    urob_admission_verdict verdict = urob_admission_check(admission, &address);
+    netconn_delete(accepted);
+    return verdict;
+}
+
+static void _test_free_pcbs(void)
+{
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    urob_netsim_init(&link, 1);
+
+    struct netconn * listener = netconn_new(NETCONN_TCP);
+    netconn_bind(listener, IP_ADDR_ANY, TEST_PORT);
+    netconn_listen(listener);
+    netconn_set_nonblocking(listener, true);
+
+    urob_admission admission;
+    urob_admission_config config = {
+        .min_free_pcbs = MEMP_NUM_TCP_PCB - 3,
+        .reset_free_pcbs = MEMP_NUM_TCP_PCB - 4,
+        .retry_after_s = 1
+    };
+    urob_admission_init(&admission, &config);
+
+    // Each client's accepted end is deleted after the check, the client keeps holding its own pcb
+    struct netconn * clients[4];
+    UROB_TEST_CHECK(_check_connection(&admission, listener, &clients[0]) == ADMISSION_ACCEPT); // 2 pcbs in use
+    UROB_TEST_CHECK(_check_connection(&admission, listener, &clients[1]) == ADMISSION_ACCEPT); // 3
+    UROB_TEST_CHECK(_check_connection(&admission, listener, &clients[2]) == ADMISSION_REJECT); // 4
+    UROB_TEST_CHECK(_check_connection(&admission, listener, &clients[3]) == ADMISSION_RESET); // 5
+
+    for (int index = 0; index < 4; index ++)
+    {
+        netconn_delete(clients[index]);
+    }
+    netconn_delete(listener);
+    urob_netsim_uninit();
+}
+
+typedef struct
+{
+    urob_http_server server;
+    urob_admission admission;
+    struct netconn * held; // admitted, sends nothing
+    struct netconn * rejected;
+    char response[256];
+    size_t response_length;
+} rejection;
+
+static void _rejection_loop(void * arg)
+{
+    rejection * test = arg;
+    urob_http_server_loop(&test->server);
+
+    struct pbuf * p = NULL;
+    if (test->rejected != NULL && netconn_recv_tcp_pbuf_flags(test->rejected, &p, NETCONN_DONTBLOCK) == ERR_OK)
+    {
+        size_t room = sizeof(test->response) - 1 - test->response_length;
+        test->response_length += pbuf_copy_partial(p, test->response + test->response_length, p->tot_len < room ? p->tot_len : room, 0);
+        pbuf_free(p);
+    }
+
+    // Like a browser, the client closes once it has the response
+    if (test->rejected != NULL && strstr(test->response, "\r\n\r\n") != NULL)
+    {
+        netconn_close(test->rejected);
+        netconn_delete(test->rejected);
+        test->rejected = NULL;
+    }
+}
+
+static bool _rejection_done(void * arg)
+{
+    rejection * test = arg;
+    return test->rejected == NULL && test->server.rejected_count == 0;
+}
+
+static void _test_rejection(void)
+{
+    static rejection test;
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    urob_netsim_init(&link, 2);
+    test = (rejection) {0};
+
+    urob_admission_config config = {.max_connections = 1, .retry_after_s = 1};
+    urob_admission_init(&test.admission, &config);
+    urob_http_server_init(&test.server);
+    urob_http_server_set_admission(&test.server, &test.admission);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    test.held = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(test.held, true);
+    netconn_connect(test.held, &address, 80);
+
+    while (test.server.connection_count == 0)
+    {
+        urob_http_server_loop(&test.server);
+        urob_netsim_advance(1000);
+    }
+
+    test.rejected = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(test.rejected, true);
+    netconn_connect(test.rejected, &address, 80);
+
+    uint32_t passive = urob_metrics_counter(UROB_METRICS_TEARDOWN_PASSIVE);
+    uint32_t active = urob_metrics_counter(UROB_METRICS_TEARDOWN_ACTIVE);
+    uint32_t start = urob_netsim_now_us();
+    urob_netsim_run(_rejection_loop, _rejection_done, &test, 1000, 10 * 1000000);
+
+    UROB_TEST_CHECK(strncmp(test.response, "HTTP/1.1 503", 12) == 0);
+    UROB_TEST_CHECK(test.server.rejected_count == 0);
+    UROB_TEST_CHECK(urob_metrics_counter(UROB_METRICS_TEARDOWN_PASSIVE) == passive + 1); // the client closed first
+    UROB_TEST_CHECK(urob_metrics_counter(UROB_METRICS_TEARDOWN_ACTIVE) == active);
+    UROB_TEST_CHECK(urob_netsim_now_us() - start < UROB_TEARDOWN_LINGER_US);
+
+    netconn_delete(test.held);
+    urob_http_server_uninit(&test.server);
+    urob_netsim_uninit();
+}
+
+int main(void)
+{
+    _test_free_pcbs();
+    _test_rejection();
+    return UROB_TEST_RESULT();
+}
@@ -0,0 +1,138 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_http_cache with flash storage: bodies are written by the writer while the loop keeps going,
+// and the slots are loaded back (stale) by the next cache on the same target
+
+#include "urob_http_cache.h"
+#include "urob_test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BODY_LENGTH (6000) // spans two sectors with the header
+
+static uint8_t _body[BODY_LENGTH];
+
+static void _store(urob_http_cache * cache, const char * path)
+{
+    urob_http_cache_request request = {.cache = cache};
+    UROB_TEST_CHECK(! urob_http_cache_begin(&request, "example.com", path));
+    urob_http_cache_header(&request, "ETag: \"v1\"", false);
+    UROB_TEST_CHECK(! urob_http_cache_response(&request, 200, sizeof(_body)));
+    urob_http_cache_store(&request, (const char *) _body, sizeof(_body));
+    urob_http_cache_end(&request, true);
+}
+
+// Loops until the writer is done, the loop itself never waits for it
+static bool _committed(urob_http_cache * cache)
+{
+    for (int attempt = 0; attempt < 5000; attempt ++)
+    {
+        urob_http_cache_loop(cache);
+
+        bool committing = false;
+        for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+        {
+            committing |= cache->entries[entry_index].committing;
+        }
+
+        if (! committing)
+        {
+            return true;
+        }
+
+        nanosleep(&(struct timespec) {.tv_nsec = 1000000}, NULL);
+    }
+
+    return false;
+}
+
+static bool _mapped(urob_http_cache * cache, const uint8_t * body)
+{
+    return body >= cache->base && body < cache->base + cache->entry_count * cache->slot_size;
+}
+
+int main(void)
+{
+    char target[] = "/tmp/urob_http_cache_XXXXXX";
+    int fd = mkstemp(target);
+    UROB_TEST_CHECK(fd >= 0);
+    close(fd);
+
+    for (size_t index = 0; index < sizeof(_body); index ++)
+    {
+        _body[index] = (uint8_t) (index * 7);
+    }
+
+    urob_http_cache_config config = {.storage = UROB_HTTP_CACHE_FLASH, .max_body = 8192, .target = target};
+    urob_http_cache cache;
+    urob_http_cache_init(&cache, &config);
+    UROB_TEST_CHECK(cache.base != NULL);
+
+    _store(&cache, "/a");
+    _store(&cache, "/b");
+
+    // Served from the heap until written
+    urob_http_cache_request request = {.cache = &cache};
+    urob_http_cache_begin(&request, "example.com", "/a");
+    UROB_TEST_CHECK(request.entry != NULL && request.entry->length == sizeof(_body));
+    urob_http_cache_end(&request, false);
+
+    UROB_TEST_CHECK(_committed(&cache));
+    for (int entry_index = 0; entry_index < 2; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache.entries[entry_index];
+        UROB_TEST_CHECK(entry->valid && _mapped(&cache, entry->body));
+        UROB_TEST_CHECK(memcmp(entry->body, _body, sizeof(_body)) == 0);
+    }
+
+    // A store queued right before uninit is waited for, or left unwritten
+    _store(&cache, "/c");
+    urob_http_cache_uninit(&cache);
+
+    urob_http_cache_init(&cache, &config);
+    int loaded = 0;
+    for (int entry_index = 0; entry_index < cache.entry_count; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache.entries[entry_index];
+        if (entry->valid)
+        {
+            loaded ++;
+            UROB_TEST_CHECK(strcmp(entry->etag, "\"v1\"") == 0);
+            UROB_TEST_CHECK(entry->length == sizeof(_body) && memcmp(entry->body, _body, sizeof(_body)) == 0);
+        }
+    }
+    UROB_TEST_CHECK(loaded >= 2);
+
+    // Stale after a reboot: looked up, but not served without a request
+    request = (urob_http_cache_request) {.cache = &cache};
+    UROB_TEST_CHECK(! urob_http_cache_begin(&request, "example.com", "/b"));
+    UROB_TEST_CHECK(request.entry != NULL);
+    urob_http_cache_end(&request, false);
+
+    urob_http_cache_uninit(&cache);
+    unlink(target);
+    return UROB_TEST_RESULT();
+}
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_http_server: paths that don't fit the path buffer, or even the request line, are answered with 414
+// instead of being served truncated
+
+#include "urob_http_server.h"
+#include "urob_netsim.h"
+#include "urob_test.h"
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define RESPONSE_SIZE (512)
+
+typedef struct
+{
+    urob_http_server server;
+    struct netconn * client;
+    const char * request;
+    size_t written;
+    char response[RESPONSE_SIZE];
+    size_t response_length;
+    bool closed;
+} exchange;
+
+static char _handled_path[UROB_HTTP_SERVER_PATH_SIZE]; // as the handler saw it
+
+static void _test_handler(urob_http_server_connection * connection, void * arg)
+{
+    static const char page[] = "found\n";
+    strcpy(_handled_path, connection->path);
+    urob_http_server_respond_static(connection, 200, "text/plain", page, sizeof(page) - 1);
+}
+
+static void _exchange_loop(void * arg)
+{
+    exchange * test = arg;
+    urob_http_server_loop(&test->server);
+
+    size_t length = strlen(test->request);
+    if (test->written < length)
+    {
+        size_t progress = 0;
+        netconn_write_partly(test->client, test->request + test->written, length - test->written, NETCONN_COPY | NETCONN_DONTBLOCK, &progress);
+        test->written += progress;
+    }
+
+    struct pbuf * p = NULL;
+    err_t err = netconn_recv_tcp_pbuf_flags(test->client, &p, NETCONN_DONTBLOCK);
+    if (err == ERR_OK)
+    {
+        size_t room = RESPONSE_SIZE - 1 - test->response_length;
+        test->response_length += pbuf_copy_partial(p, test->response + test->response_length, p->tot_len < room ? p->tot_len : room, 0);
+        pbuf_free(p);
+    } else if (err != ERR_WOULDBLOCK && err != ERR_INPROGRESS && err != ERR_CONN)
+    {
+        test->closed = true;
+    }
+}
+
+static bool _exchange_done(void * arg)
+{
+    exchange * test = arg;
+    return test->closed;
+}
+
+// @return the status of the response to the request
+static int _exchange(const char * request)
+{
+    static exchange test;
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    urob_netsim_init(&link, 5);
+    test = (exchange) { .request = request };
+
+    urob_http_server_init(&test.server);
+    urob_http_server_set_fallback(&test.server, _test_handler, NULL);
+    _handled_path[0] = '\0';
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    test.client = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(test.client, true);
+    netconn_connect(test.client, &address, 80);
+
+    urob_netsim_run(_exchange_loop, _exchange_done, &test, 1000, 10 * 1000000);
+
+    int status = 0;
+    sscanf(test.response, "HTTP/1.1 %d", &status);
+
+    netconn_delete(test.client);
+    urob_http_server_uninit(&test.server);
+    urob_netsim_uninit();
+    return status;
+}
+
+static void _test_path_length(void)
+{
+    char request[512];
+    char path[300];
+
+    UROB_TEST_CHECK(_exchange("GET /found HTTP/1.1\r\nHost: test\r\n\r\n") == 200);
+    UROB_TEST_CHECK(strcmp(_handled_path, "/found") == 0);
+
+    // Longest path that fits with its slash and terminator
+    memset(path, 'a', UROB_HTTP_SERVER_PATH_SIZE - 2);
+    path[UROB_HTTP_SERVER_PATH_SIZE - 2] = '\0';
+    snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\n\r\n", path);
+    UROB_TEST_CHECK(_exchange(request) == 200);
+    UROB_TEST_CHECK(strlen(_handled_path) == UROB_HTTP_SERVER_PATH_SIZE - 1);
+
+    // One more character
+    memset(path, 'a', UROB_HTTP_SERVER_PATH_SIZE - 1);
+    path[UROB_HTTP_SERVER_PATH_SIZE - 1] = '\0';
+    snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\n\r\n", path);
+    UROB_TEST_CHECK(_exchange(request) == 414);
+    UROB_TEST_CHECK(_handled_path[0] == '\0');
+
+    // Longer than the request line, the version is cut off
+    memset(path, 'a', sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\n\r\n", path);
+    UROB_TEST_CHECK(_exchange(request) == 414);
+    UROB_TEST_CHECK(_handled_path[0] == '\0');
+}
+
+int main(void)
+{
+    _test_path_length();
+    return UROB_TEST_RESULT();
+}
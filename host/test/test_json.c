@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_json: documents are done as soon as their root value closes, numbers follow json's grammar,
+// and extraction works whatever the slicing
+
+#include "urob_json.h"
+#include "urob_test.h"
+#include <string.h>
+
+// Feeds a document at once, then finishes it
+static err_t _parse(const char * document, bool * done_before_finish)
+{
+    urob_json json;
+    urob_json_init(&json, NULL, NULL);
+
+    err_t err = urob_json_feed(&json, document, strlen(document));
+    if (done_before_finish != NULL)
+    {
+        * done_before_finish = urob_json_done(&json);
+    }
+
+    return err != ERR_OK ? err : urob_json_finish(&json);
+}
+
+static void _test_done(void)
+{
+    static const char * const closed[] = {"{}", "[]", "{\"a\":1}", "[1,[2,{}]]", "\"s\"", "true", "false", "null", " {\"a\":[true]} "};
+    for (size_t index = 0; index < sizeof(closed) / sizeof(closed[0]); index ++)
+    {
+        bool done = false;
+        UROB_TEST_CHECK(_parse(closed[index], &done) == ERR_OK);
+        UROB_TEST_CHECK(done);
+    }
+
+    // A root number could go on, until finished
+    static const char * const numbers[] = {"1", "0", "-0", "12", "-0.5", "1e3", "1E+3", "2.5e-3"};
+    for (size_t index = 0; index < sizeof(numbers) / sizeof(numbers[0]); index ++)
+    {
+        bool done = true;
+        UROB_TEST_CHECK(_parse(numbers[index], &done) == ERR_OK);
+        UROB_TEST_CHECK(! done);
+    }
+}
+
+static void _test_malformed(void)
+{
+    static const char * const malformed[] = {
+        "01", "1.", "-", "1e", "1e+", ".5", "+1", "-01", "1.e3", "0x1", "1-2",
+        "{\"a\":01}", "[1.]", "tru", "truex", "nul", "{} x", "[1,]x", "{\"a\"}", "[", "{\"a\":", ""
+    };
+
+    for (size_t index = 0; index < sizeof(malformed) / sizeof(malformed[0]); index ++)
+    {
+        err_t err = _parse(malformed[index], NULL);
+        UROB_TEST_CHECK(err == ERR_VAL);
+        if (err != ERR_VAL)
+        {
+            fprintf(stderr, "accepted: %s\n", malformed[index]);
+        }
+    }
+}
+
+typedef struct
+{
+    char ip[16];
+    bool success;
+    double latitude;
+    int32_t asn;
+    char isp[32];
+    char second[8];
+} location;
+
+static const urob_json_field _fields[] = {
+    UROB_JSON_FIELD(location, ip, "ip", UROB_JSON_FIELD_STRING),
+    UROB_JSON_FIELD(location, success, "success", UROB_JSON_FIELD_BOOL),
+    UROB_JSON_FIELD(location, latitude, "latitude", UROB_JSON_FIELD_DOUBLE),
+    UROB_JSON_FIELD(location, asn, "connection.asn", UROB_JSON_FIELD_INT),
+    UROB_JSON_FIELD(location, isp, "connection.isp", UROB_JSON_FIELD_STRING),
+    UROB_JSON_FIELD(location, second, "tags[1]", UROB_JSON_FIELD_STRING),
+};
+
+// Sliced one byte at a time, as pbufs might
+static void _test_extract(void)
+{
+    static const char document[] = "{\"ip\":\"192.0.2.1\",\"success\":true,\"latitude\":45.4642,"
+        "\"connection\":{\"asn\":3269,\"isp\":\"Telecom \\u00e9\"},\"tags\":[\"a\",\"b\\\"c\"]}";
+
+    location target = {0};
+    urob_json json;
+    urob_json_extract_init(&json, _fields, sizeof(_fields) / sizeof(_fields[0]), &target);
+
+    for (size_t index = 0; index < sizeof(document) - 1; index ++)
+    {
+        UROB_TEST_CHECK(urob_json_feed(&json, document + index, 1) == ERR_OK);
+    }
+
+    UROB_TEST_CHECK(urob_json_done(&json));
+    UROB_TEST_CHECK(urob_json_finish(&json) == ERR_OK);
+    UROB_TEST_CHECK(strcmp(target.ip, "192.0.2.1") == 0);
+    UROB_TEST_CHECK(target.success);
+    UROB_TEST_CHECK(target.latitude > 45.46 && target.latitude < 45.47);
+    UROB_TEST_CHECK(target.asn == 3269);
+    UROB_TEST_CHECK(strcmp(target.isp, "Telecom \xc3\xa9") == 0);
+    UROB_TEST_CHECK(strcmp(target.second, "b\"c") == 0);
+
+    for (size_t field_index = 0; field_index < sizeof(_fields) / sizeof(_fields[0]); field_index ++)
+    {
+        UROB_TEST_CHECK(urob_json_found(&json, field_index));
+    }
+}
+
+int main(void)
+{
+    _test_done();
+    _test_malformed();
+    _test_extract();
+    return UROB_TEST_RESULT();
+}
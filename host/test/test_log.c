@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_log: deferred records keep their %s arguments, even when the buffers they came from are reused
+// before the drain, and a dump decodes to the same lines
+
+#define UROB_DEFERRED_LOG (1)
+#include "urob_log.h"
+#include "urob_test.h"
+#include <string.h>
+
+#define TAG "test"
+
+typedef struct
+{
+    char data[4096];
+    size_t length;
+} output;
+
+static bool _write(const void * data, size_t length, void * arg)
+{
+    output * out = arg;
+    if (out->length + length > sizeof(out->data))
+    {
+        return false;
+    }
+
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+    return true;
+}
+
+static void _log_transient(const char * method, int status)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/status/%d", status);
+    UROB_LOGI(TAG, "%s %s: %d", method, path, status);
+    memset(path, 'x', sizeof(path) - 1); // gone before the drain
+}
+
+int main(void)
+{
+    static output dump, text;
+
+    _log_transient("GET", 200);
+    _log_transient("POST", 404);
+    UROB_LOGW(TAG, "%d%% done, %s", 50, "a string much longer than the room left for the strings of a record");
+    UROB_LOGE(TAG, "no strings: %u %x", 7u, 0xbeefu);
+
+    urob_log_dump(_write, &dump);
+    UROB_TEST_CHECK(urob_log_decode(dump.data, dump.length, _write, &text));
+    text.data[text.length] = '\0';
+    printf("%s", text.data);
+
+    UROB_TEST_CHECK(strstr(text.data, " test: GET /status/200: 200\n") != NULL);
+    UROB_TEST_CHECK(strstr(text.data, " test: POST /status/404: 404\n") != NULL);
+    UROB_TEST_CHECK(strstr(text.data, " test: 50% done, a string much longer") != NULL); // truncated
+    UROB_TEST_CHECK(strstr(text.data, " test: no strings: 7 beef\n") != NULL);
+    UROB_TEST_CHECK(strchr(text.data, 'x') == NULL);
+
+    // Truncated or corrupted dumps are refused
+    text.length = 0;
+    UROB_TEST_CHECK(! urob_log_decode(dump.data, dump.length - 1, _write, &text));
+    dump.data[0] = 'X';
+    UROB_TEST_CHECK(! urob_log_decode(dump.data, dump.length, _write, &text));
+
+    // Records drained in the device format the same way
+    _log_transient("PUT", 201);
+    UROB_TEST_CHECK(urob_log_drain(10) == 1);
+    return UROB_TEST_RESULT();
+}
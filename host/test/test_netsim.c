@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_netsim: data gets through a lossy link intact, a seed replays the same run, blocking calls
+// wait in simulated time and resets reach the application
+
+#include "urob_netsim.h"
+#include "urob_test.h"
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define ECHO_SIZE (20000)
+#define ECHO_PORT (7)
+
+typedef struct
+{
+    struct netconn * listener;
+    struct netconn * server;
+    struct netconn * client;
+    char sent[ECHO_SIZE];
+    char echoed[ECHO_SIZE];
+    char server_buffer[ECHO_SIZE];
+    size_t sent_length;
+    size_t server_received;
+    size_t server_written;
+    size_t echoed_length;
+    err_t err; // first unexpected error
+} echo;
+
+static bool _echo_pending(err_t err)
+{
+    return err == ERR_WOULDBLOCK || err == ERR_INPROGRESS;
+}
+
+static void _echo_write(echo * test, struct netconn * conn, const char * data, size_t length, size_t * written)
+{
+    size_t progress = 0;
+    err_t err = netconn_write_partly(conn, data + * written, length - * written, NETCONN_COPY | NETCONN_DONTBLOCK, &progress);
+    * written += progress;
+    test->err = err == ERR_OK || _echo_pending(err) || err == ERR_CONN ? test->err : err; // ERR_CONN until connected
+}
+
+// Both ends stay nonblocking: the client writes the pattern as fast as the send buffer takes it, the server
+// writes back what it has read
+static void _echo_loop(void * arg)
+{
+    echo * test = arg;
+
+    if (test->server == NULL && netconn_accept(test->listener, &test->server) == ERR_OK)
+    {
+        netconn_set_nonblocking(test->server, true);
+    }
+
+    if (test->sent_length < ECHO_SIZE)
+    {
+        _echo_write(test, test->client, test->sent, ECHO_SIZE, &test->sent_length);
+    }
+
+    struct pbuf * p = NULL;
+    if (test->server != NULL && netconn_recv_tcp_pbuf_flags(test->server, &p, NETCONN_DONTBLOCK) == ERR_OK)
+    {
+        test->server_received += pbuf_copy_partial(p, test->server_buffer + test->server_received, p->tot_len, 0);
+        pbuf_free(p);
+    }
+
+    if (test->server_written < test->server_received)
+    {
+        _echo_write(test, test->server, test->server_buffer, test->server_received, &test->server_written);
+    }
+
+    if (netconn_recv_tcp_pbuf_flags(test->client, &p, NETCONN_DONTBLOCK) == ERR_OK)
+    {
+        test->echoed_length += pbuf_copy_partial(p, test->echoed + test->echoed_length, p->tot_len, 0);
+        pbuf_free(p);
+    }
+}
+
+static bool _echo_done(void * arg)
+{
+    echo * test = arg;
+    return test->echoed_length == ECHO_SIZE || test->err != ERR_OK;
+}
+
+static urob_netsim_stats _echo_run(const urob_netsim_link * link, uint32_t seed, echo * test)
+{
+    urob_netsim_init(link, seed);
+    * test = (echo) {0};
+
+    for (int index = 0; index < ECHO_SIZE; index ++)
+    {
+        test->sent[index] = (char) ('a' + index % 23);
+    }
+
+    test->listener = netconn_new(NETCONN_TCP);
+    netconn_bind(test->listener, IP_ADDR_ANY, ECHO_PORT);
+    netconn_listen(test->listener);
+    netconn_set_nonblocking(test->listener, true);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    test->client = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(test->client, true);
+    netconn_connect(test->client, &address, ECHO_PORT);
+
+    urob_netsim_run(_echo_loop, _echo_done, test, 1000, 10 * 1000000);
+
+    urob_netsim_stats stats = * urob_netsim_get_stats();
+    netconn_delete(test->client);
+    netconn_delete(test->server);
+    netconn_delete(test->listener);
+    urob_netsim_uninit();
+    return stats;
+}
+
+static void _test_echo(void)
+{
+    static echo first, second;
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    link.split_permille = 300;
+    link.short_write_permille = 300;
+
+    urob_netsim_stats stats = _echo_run(&link, 11, &first);
+    UROB_TEST_CHECK(first.err == ERR_OK);
+    UROB_TEST_CHECK(first.echoed_length == ECHO_SIZE);
+    UROB_TEST_CHECK(memcmp(first.sent, first.echoed, ECHO_SIZE) == 0);
+    UROB_TEST_CHECK(stats.splits > 0 && stats.short_writes > 0);
+    UROB_TEST_CHECK(stats.would_block > 0); // the send buffer filled up
+
+    // Same seed, same run
+    urob_netsim_stats again = _echo_run(&link, 11, &second);
+    UROB_TEST_CHECK(memcmp(&stats, &again, sizeof(stats)) == 0);
+
+    printf("echo: %u segments, %u splits, %u short writes, %u would block, %u iterations\n",
+        stats.segments, stats.splits, stats.short_writes, stats.would_block, stats.loop_iterations);
+}
+
+static void _test_blocking_connect(void)
+{
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    link.jitter_us = 0;
+    urob_netsim_init(&link, 1);
+
+    struct netconn * listener = netconn_new(NETCONN_TCP);
+    netconn_bind(listener, IP_ADDR_ANY, ECHO_PORT);
+    netconn_listen(listener);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    struct netconn * client = netconn_new(NETCONN_TCP);
+    uint32_t start = urob_netsim_now_us();
+
+    UROB_TEST_CHECK(netconn_connect(client, &address, ECHO_PORT) == ERR_OK);
+    UROB_TEST_CHECK(urob_netsim_now_us() - start >= link.rtt_us);
+    UROB_TEST_CHECK(urob_netsim_get_stats()->blocking_waits == 1);
+
+    // Nobody listening on this one
+    struct netconn * refused = netconn_new(NETCONN_TCP);
+    netconn_set_nonblocking(refused, true);
+    UROB_TEST_CHECK(netconn_connect(refused, &address, ECHO_PORT + 1) == ERR_INPROGRESS);
+    urob_netsim_advance(2 * link.rtt_us);
+    UROB_TEST_CHECK(urob_netsim_get_stats()->refused == 1);
+
+    netconn_delete(refused);
+    netconn_delete(client);
+    netconn_delete(listener);
+    urob_netsim_uninit();
+}
+
+static void _test_reset(void)
+{
+    static echo test;
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    link.reset_permille = 1000; // the first data segment resets the connection
+
+    urob_netsim_stats stats = _echo_run(&link, 3, &test);
+    UROB_TEST_CHECK(stats.resets > 0);
+    UROB_TEST_CHECK(test.echoed_length < ECHO_SIZE);
+}
+
+int main(void)
+{
+    _test_echo();
+    _test_blocking_connect();
+    _test_reset();
+    return UROB_TEST_RESULT();
+}
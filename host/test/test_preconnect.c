@@ -0,0 +1,229 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_preconnect: with connections kept ready, a request gets its response about a round trip sooner
+
+#include "urob_http_client.h"
+#include "urob_metrics.h"
+#include "urob_netsim.h"
+#include "urob_preconnect.h"
+#include "urob_test.h"
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define PRECONNECT_FETCHES (10)
+#define PRECONNECT_CONNECTIONS (8)
+#define PRECONNECT_HOST "example.com"
+#define PRECONNECT_RESPONSE "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+
+typedef struct
+{
+    struct netconn * conn;
+    char request[512];
+    size_t length;
+    size_t sent; // of the response, once the request is in
+} server_connection;
+
+typedef struct
+{
+    bool use_pool;
+    urob_preconnect pool;
+    urob_http_client client;
+    bool fetching;
+    struct netconn * listener;
+    server_connection connections[PRECONNECT_CONNECTIONS];
+    int fetches;
+    int failures;
+    uint32_t next_fetch_us;
+    uint32_t started_us;
+    uint32_t total_us; // of all fetches but the first, which finds the pool still connecting
+} preconnect;
+
+static void _server_close(server_connection * connection)
+{
+    netconn_close(connection->conn);
+    netconn_delete(connection->conn);
+    connection->conn = NULL;
+}
+
+// Answers each request once its headers are in, then closes
+static void _server_loop(preconnect * test)
+{
+    struct netconn * conn = NULL;
+    if (netconn_accept(test->listener, &conn) == ERR_OK)
+    {
+        netconn_set_nonblocking(conn, true);
+        for (int index = 0; index < PRECONNECT_CONNECTIONS; index ++)
+        {
+            if (test->connections[index].conn == NULL)
+            {
+                test->connections[index] = (server_connection) { .conn = conn };
+                conn = NULL;
+                break;
+            }
+        }
+        UROB_TEST_CHECK(conn == NULL);
+    }
+
+    for (int index = 0; index < PRECONNECT_CONNECTIONS; index ++)
+    {
+        server_connection * connection = &test->connections[index];
+        struct pbuf * p = NULL;
+
+        if (connection->conn == NULL)
+        {
+            continue;
+        }
+
+        if (strstr(connection->request, "\r\n\r\n") != NULL) // the connection doesn't block, writes may be short
+        {
+            size_t written = 0;
+            err_t err = netconn_write_partly(connection->conn, PRECONNECT_RESPONSE + connection->sent,
+                strlen(PRECONNECT_RESPONSE) - connection->sent, NETCONN_COPY, &written);
+            connection->sent += written;
+
+            if ((err != ERR_OK && err != ERR_WOULDBLOCK) || connection->sent == strlen(PRECONNECT_RESPONSE))
+            {
+                _server_close(connection);
+            }
+            continue;
+        }
+
+        err_t err = netconn_recv_tcp_pbuf_flags(connection->conn, &p, NETCONN_DONTBLOCK);
+        if (err == ERR_OK)
+        {
+            connection->length += pbuf_copy_partial(p, connection->request + connection->length,
+                sizeof(connection->request) - 1 - connection->length, 0);
+            connection->request[connection->length] = '\0';
+            pbuf_free(p);
+        }
+        else if (err != ERR_WOULDBLOCK)
+        {
+            _server_close(connection);
+        }
+    }
+}
+
+// A fetch every 300 ms, with a longer pause every third one, so the pool has time to replace and refresh
+static void _preconnect_loop(void * arg)
+{
+    preconnect * test = arg;
+    uint32_t now = urob_netsim_now_us();
+
+    _server_loop(test);
+    urob_preconnect_loop(&test->pool);
+
+    if (! test->fetching)
+    {
+        if (now < test->next_fetch_us)
+        {
+            return;
+        }
+
+        ip_addr_t address;
+        ip_addr_set_loopback(false, &address);
+        urob_http_client_init(&test->client, &address, 80);
+        urob_http_client_set_request(&test->client, PRECONNECT_HOST, "/", NULL);
+        if (test->use_pool)
+        {
+            urob_http_client_set_preconnect(&test->client, &test->pool);
+        }
+
+        test->started_us = now;
+        test->fetching = true;
+    }
+
+    urob_http_client_loop(&test->client);
+
+    if (test->client.state == CLIENT_STATE_RESP_RECVD || test->client.state == CLIENT_STATE_ERROR)
+    {
+        test->failures += test->client.state == CLIENT_STATE_ERROR || test->client.status != 200;
+        test->total_us += test->fetches > 0 ? now - test->started_us : 0;
+        urob_http_client_uninit(&test->client);
+        test->fetching = false;
+        test->fetches ++;
+        test->next_fetch_us = now + (test->fetches % 3 == 0 ? 2500000 : 300000);
+    }
+}
+
+static bool _preconnect_done(void * arg)
+{
+    preconnect * test = arg;
+    return test->fetches == PRECONNECT_FETCHES;
+}
+
+// Returns the average time to a response
+static uint32_t _preconnect_run(bool use_pool)
+{
+    static preconnect test;
+    test = (preconnect) { .use_pool = use_pool, .next_fetch_us = 500000 };
+
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    urob_netsim_init(&link, 7);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    urob_netsim_add_host(PRECONNECT_HOST, &address);
+
+    test.listener = netconn_new(NETCONN_TCP);
+    netconn_bind(test.listener, IP_ADDR_ANY, 80);
+    netconn_listen(test.listener);
+    netconn_set_nonblocking(test.listener, true);
+
+    urob_preconnect_config config = { .idle_ms = 1000, .connect_timeout_ms = 3000, .retry_ms = 500 };
+    urob_preconnect_init(&test.pool, &config);
+    if (use_pool)
+    {
+        UROB_TEST_CHECK(urob_preconnect_add(&test.pool, PRECONNECT_HOST, 80, 2));
+    }
+
+    urob_netsim_run(_preconnect_loop, _preconnect_done, &test, 1000, 60 * 1000000);
+    UROB_TEST_CHECK(test.fetches == PRECONNECT_FETCHES);
+    UROB_TEST_CHECK(test.failures == 0);
+
+    urob_preconnect_uninit(&test.pool);
+    for (int index = 0; index < PRECONNECT_CONNECTIONS; index ++)
+    {
+        if (test.connections[index].conn != NULL)
+        {
+            _server_close(&test.connections[index]);
+        }
+    }
+    netconn_delete(test.listener);
+    urob_netsim_uninit();
+    return test.total_us / (PRECONNECT_FETCHES - 1);
+}
+
+int main(void)
+{
+    uint32_t plain_us = _preconnect_run(false);
+    uint32_t hits = urob_metrics_counter(UROB_METRICS_PRECONNECT_HIT);
+    uint32_t pooled_us = _preconnect_run(true);
+    hits = urob_metrics_counter(UROB_METRICS_PRECONNECT_HIT) - hits;
+
+    printf("time to response: %u us, %u us with a pool (%u hits)\n", plain_us, pooled_us, hits);
+    UROB_TEST_CHECK(hits >= PRECONNECT_FETCHES - 1);
+    UROB_TEST_CHECK(pooled_us * 3 / 2 < plain_us);
+    return UROB_TEST_RESULT();
+}
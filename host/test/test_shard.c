@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_shard: items handed over between threads arrive once and in order, and an idle shard wakes up on
+// a handoff instead of sleeping out its timeout
+
+#include "urob_shard.h"
+#include "urob_test.h"
+#include <stdint.h>
+#include <time.h>
+
+#define SHARD_ITEMS (100000)
+#define SHARD_IDLE_MS (10000) // the test times out long before, unless handoffs wake the idle shard
+
+typedef struct
+{
+    urob_shard_group group;
+    uintptr_t sent;
+    atomic_uint received;
+    uintptr_t last_received;
+    int out_of_order;
+    int idle_calls;
+} shard_test;
+
+// Shard 0 produces, shard 1 consumes and sleeps while its inbox is empty
+static void _shard_loop(urob_shard * shard, void * arg)
+{
+    shard_test * test = arg;
+
+    if (shard->index == 0)
+    {
+        if (test->sent < SHARD_ITEMS && urob_shard_handoff(shard, 1, (void *) (test->sent + 1)))
+        {
+            test->sent ++;
+        }
+    } else
+    {
+        test->idle_calls ++;
+        urob_shard_idle(shard, SHARD_IDLE_MS);
+    }
+}
+
+static void _shard_handoff(urob_shard * shard, void * item, void * arg)
+{
+    shard_test * test = arg;
+    uintptr_t value = (uintptr_t) item;
+
+    test->out_of_order += value != test->last_received + 1;
+    test->last_received = value;
+    atomic_fetch_add(&test->received, 1);
+}
+
+int main(void)
+{
+    static shard_test test;
+    urob_shard_group_init(&test.group, 2);
+
+    for (int shard_index = 0; shard_index < 2; shard_index ++)
+    {
+        urob_shard_set_loop(&test.group, shard_index, _shard_loop, _shard_handoff, &test);
+    }
+
+    UROB_TEST_CHECK(urob_shard_group_start(&test.group, 0, 0));
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        struct timespec pause = { .tv_nsec = 1000000 };
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (atomic_load(&test.received) < SHARD_ITEMS && now.tv_sec - start.tv_sec < 5);
+
+    urob_shard_group_uninit(&test.group);
+
+    printf("%u items, %d idle calls\n", atomic_load(&test.received), test.idle_calls);
+    UROB_TEST_CHECK(atomic_load(&test.received) == SHARD_ITEMS);
+    UROB_TEST_CHECK(test.out_of_order == 0);
+    UROB_TEST_CHECK(now.tv_sec - start.tv_sec < 5);
+    return UROB_TEST_RESULT();
+}
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_tcp coalescing: 200 messages of about 35 bytes, 0.5 ms apart, arrive intact and in order in far fewer
+// segments with a 5 ms deadline than without coalescing
+
+#include "urob_netsim.h"
+#include "urob_tcp.h"
+#include "urob_test.h"
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define COALESCE_MESSAGES (200)
+#define COALESCE_PORT (9000)
+#define COALESCE_INTERVAL_US (500)
+#define COALESCE_FORMAT "msg %03d: some telemetry value %d;\n"
+
+typedef struct
+{
+    urob_tcp tcp;
+    urob_tcp_message messages[COALESCE_MESSAGES];
+    struct netconn * listener;
+    struct netconn * server;
+    char received[COALESCE_MESSAGES * 40];
+    size_t received_length;
+    size_t expected_length;
+    int added;
+    uint32_t last_added_us;
+    uint32_t deadline_us;
+} coalesce;
+
+static void _coalesce_loop(void * arg)
+{
+    coalesce * test = arg;
+    urob_tcp_loop(&test->tcp);
+
+    struct pbuf * p = NULL;
+    if (test->server == NULL && netconn_accept(test->listener, &test->server) == ERR_OK)
+    {
+        netconn_set_nonblocking(test->server, true);
+    }
+    else if (test->server != NULL && netconn_recv_tcp_pbuf_flags(test->server, &p, NETCONN_DONTBLOCK) == ERR_OK)
+    {
+        test->received_length += pbuf_copy_partial(p, test->received + test->received_length, p->tot_len, 0);
+        pbuf_free(p);
+    }
+
+    uint32_t now = urob_netsim_now_us();
+    if (test->tcp.state == UROB_TCP_STATE_CONNECTED && test->added < COALESCE_MESSAGES && now - test->last_added_us >= COALESCE_INTERVAL_US)
+    {
+        int index = test->added ++;
+        urob_tcp_message_init(&test->messages[index], UROB_TCP_MESSAGE_TYPE_OUTGOING);
+        urob_tcp_message_payload_printf(&test->messages[index], COALESCE_FORMAT, index, index * 7);
+
+        if (index == COALESCE_MESSAGES - 1 && test->deadline_us > 0)
+        {
+            urob_tcp_flush(&test->tcp);
+        }
+
+        urob_tcp_add_message(&test->tcp, &test->messages[index]);
+        test->last_added_us = now;
+    }
+}
+
+static bool _coalesce_done(void * arg)
+{
+    coalesce * test = arg;
+    return test->added == COALESCE_MESSAGES && test->received_length >= test->expected_length;
+}
+
+// Returns the segments it took
+static uint32_t _coalesce_run(uint32_t deadline_us)
+{
+    static coalesce test;
+    test = (coalesce) { .deadline_us = deadline_us };
+
+    char expected[COALESCE_MESSAGES * 40];
+    for (int index = 0; index < COALESCE_MESSAGES; index ++)
+    {
+        test.expected_length += sprintf(expected + test.expected_length, COALESCE_FORMAT, index, index * 7);
+    }
+
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    link.split_permille = 0;
+    urob_netsim_init(&link, 7);
+
+    test.listener = netconn_new(NETCONN_TCP);
+    netconn_bind(test.listener, IP_ADDR_ANY, COALESCE_PORT);
+    netconn_listen(test.listener);
+    netconn_set_nonblocking(test.listener, true);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    urob_tcp_init_client(&test.tcp, &address, COALESCE_PORT);
+
+    if (deadline_us > 0)
+    {
+        urob_tcp_set_coalescing(&test.tcp, deadline_us);
+    }
+
+    urob_netsim_run(_coalesce_loop, _coalesce_done, &test, 100, 5 * 1000000);
+    uint32_t segments = urob_netsim_get_stats()->segments;
+
+    UROB_TEST_CHECK(test.received_length == test.expected_length);
+    UROB_TEST_CHECK(memcmp(test.received, expected, test.expected_length) == 0);
+
+    for (int index = 0; index < test.added; index ++)
+    {
+        urob_tcp_message_uninit(&test.messages[index]);
+    }
+
+    urob_tcp_uninit(&test.tcp);
+    netconn_delete(test.server);
+    netconn_delete(test.listener);
+    urob_netsim_uninit();
+    return segments;
+}
+
+int main(void)
+{
+    uint32_t plain = _coalesce_run(0);
+    uint32_t coalesced = _coalesce_run(5000);
+
+    printf("%d messages: %u segments, %u coalesced with a 5 ms deadline\n", COALESCE_MESSAGES, plain, coalesced);
+    UROB_TEST_CHECK(coalesced * 5 < plain);
+    return UROB_TEST_RESULT();
+}
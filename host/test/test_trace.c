@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// urob_trace: a connection's state transitions and netconn events share its timeline, and a dump
+// converts to chrome trace events
+
+#include "urob_netsim.h"
+#include "urob_tcp.h"
+#include "urob_test.h"
+#include "urob_trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/api.h"
+
+#define TRACE_PORT (9000)
+
+typedef struct
+{
+    char * data;
+    size_t length;
+    size_t capacity;
+} output;
+
+static bool _write(const void * data, size_t length, void * arg)
+{
+    output * out = arg;
+    if (out->length + length + 1 > out->capacity)
+    {
+        out->capacity = (out->length + length + 1) * 2;
+        out->data = realloc(out->data, out->capacity);
+    }
+
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+    out->data[out->length] = '\0';
+    return true;
+}
+
+typedef struct
+{
+    urob_tcp tcp;
+    urob_tcp_message message;
+    struct netconn * listener;
+    struct netconn * server;
+    bool added;
+} trace_test;
+
+static void _trace_loop(void * arg)
+{
+    trace_test * test = arg;
+    urob_tcp_loop(&test->tcp);
+
+    if (test->server == NULL)
+    {
+        netconn_accept(test->listener, &test->server);
+    }
+
+    if (test->tcp.state == UROB_TCP_STATE_CONNECTED && ! test->added)
+    {
+        urob_tcp_message_init(&test->message, UROB_TCP_MESSAGE_TYPE_OUTGOING);
+        urob_tcp_message_payload_printf(&test->message, "hello");
+        urob_tcp_add_message(&test->tcp, &test->message);
+        test->added = true;
+    }
+}
+
+static bool _trace_done(void * arg)
+{
+    trace_test * test = arg;
+    return test->added && test->message.state == UROB_TCP_MESSAGE_STATE_SENT;
+}
+
+int main(void)
+{
+    static trace_test test;
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    urob_netsim_init(&link, 5);
+
+    test.listener = netconn_new(NETCONN_TCP);
+    netconn_bind(test.listener, IP_ADDR_ANY, TRACE_PORT);
+    netconn_listen(test.listener);
+    netconn_set_nonblocking(test.listener, true);
+
+    ip_addr_t address;
+    ip_addr_set_loopback(false, &address);
+    urob_tcp_init_client(&test.tcp, &address, TRACE_PORT);
+    uint32_t conn = (uint32_t) (uintptr_t) test.tcp.conn;
+
+    urob_netsim_run(_trace_loop, _trace_done, &test, 1000, 1000000);
+    UROB_TEST_CHECK(_trace_done(&test));
+
+    static output dump, json;
+    urob_trace_dump(_write, &dump);
+    UROB_TEST_CHECK(urob_trace_to_chrome_json(dump.data, dump.length, _write, &json));
+
+    // The connecting slice and the netconn events are on the netconn's timeline
+    char expected[64];
+    snprintf(expected, sizeof(expected), "\"name\":\"connecting\",\"cat\":\"tcp\"");
+    const char * connecting = strstr(json.data, expected);
+    snprintf(expected, sizeof(expected), "\"tid\":%u}", conn);
+    UROB_TEST_CHECK(connecting != NULL && strstr(connecting, expected) != NULL);
+    snprintf(expected, sizeof(expected), "\"cat\":\"netconn\",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+    const char * event = strstr(json.data, expected);
+    snprintf(expected, sizeof(expected), "\"pid\":1,\"tid\":%u,", conn);
+    UROB_TEST_CHECK(event != NULL && strstr(event, expected) != NULL);
+
+    UROB_TEST_CHECK(strncmp(json.data, "{\"displayTimeUnit\"", 18) == 0);
+    UROB_TEST_CHECK(strcmp(json.data + json.length - 4, "\n]}\n") == 0);
+    UROB_TEST_CHECK(! urob_trace_to_chrome_json(dump.data, dump.length - 1, _write, &json));
+
+    urob_tcp_message_uninit(&test.message);
+    urob_tcp_uninit(&test.tcp);
+    netconn_delete(test.server);
+    netconn_delete(test.listener);
+    urob_netsim_uninit();
+    free(dump.data);
+    free(json.data);
+    return UROB_TEST_RESULT();
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Formats a urob_log_dump, read from a file or stdin, to stdout:
+//   urob_log_decode [dump]
+
+#include "urob_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static bool _write(const void * data, size_t length, void * arg)
+{
+    return fwrite(data, 1, length, (FILE *) arg) == length;
+}
+
+int main(int argc, char ** argv)
+{
+    FILE * input = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (input == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    size_t size = 0, capacity = 0;
+    char * dump = NULL;
+    while (! feof(input) && ! ferror(input))
+    {
+        if (size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 65536;
+            dump = realloc(dump, capacity);
+            if (dump == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        size += fread(dump + size, 1, capacity - size, input);
+    }
+
+    bool decoded = urob_log_decode(dump, size, _write, stdout);
+    free(dump);
+
+    if (! decoded)
+    {
+        fprintf(stderr, "not a valid log dump\n");
+        return 1;
+    }
+
+    return 0;
+}
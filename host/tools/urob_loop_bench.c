@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Runs urob_loop_bench on the simulator and prints its json results, one object per table size:
+//   urob_loop_bench [-l label] [-r rounds] [connections ...] > bench.json
+// Sizes default to 8 32 128 512, each needs two of the simulator's sockets per connection (see
+// UROB_NETSIM_MAX_SOCKETS in CMakeLists.txt)
+
+#include "urob_loop_bench.h"
+#include "urob_netsim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static bool _write(const char * text, size_t length, void * arg)
+{
+    return fwrite(text, 1, length, (FILE *) arg) == length;
+}
+
+int main(int argc, char ** argv)
+{
+    urob_loop_bench_config config = {.rounds = 200, .port = 9000, .label = ""};
+    int option;
+
+    while ((option = getopt(argc, argv, "l:r:")) != -1)
+    {
+        switch (option)
+        {
+            case 'l':
+                config.label = optarg;
+            break;
+            case 'r':
+                config.rounds = atoi(optarg);
+            break;
+            default:
+                fprintf(stderr, "usage: %s [-l label] [-r rounds] [connections ...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (; optind < argc && config.size_count < UROB_LOOP_BENCH_MAX_SIZES; optind ++)
+    {
+        config.connections[config.size_count ++] = atoi(argv[optind]);
+    }
+
+    if (config.size_count == 0)
+    {
+        static const int sizes[] = {8, 32, 128, 512};
+        for (; config.size_count < (int) (sizeof(sizes) / sizeof(sizes[0])); config.size_count ++)
+        {
+            config.connections[config.size_count] = sizes[config.size_count];
+        }
+    }
+
+    // A lossless link: connections only have to be set up, the loop is timed in real time
+    urob_netsim_link link = UROB_NETSIM_WIFI_LINK;
+    link.jitter_us = 0;
+    link.split_permille = link.short_write_permille = 0;
+    urob_netsim_init(&link, 1);
+
+    bool measured = urob_loop_bench_run(&config, _write, stdout);
+
+    urob_netsim_uninit();
+    return measured && fflush(stdout) == 0 ? 0 : 1;
+}
@@ -25,9 +25,12 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef __GENERAL_H__
 #define __GENERAL_H__
 
+#include "urob_log.h"
+
+// Error logs go through urob_log, deferred when UROB_DEFERRED_LOG is set
 #define _chk(condition, action, format, ...) \
 if (condition) {\
-    ESP_LOGE(TAG, format, ##__VA_ARGS__);\
+    UROB_LOGE(TAG, format, ##__VA_ARGS__);\
     action;\
 }
 
@@ -0,0 +1,280 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_accounting.h"
+#include <stdio.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#include "lwip/pbuf.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#define UROB_ACCOUNTING_NO_SCOPE (-1)
+#define UROB_ACCOUNTING_STACK_SCOPE (-2) // lwip's tcpip thread, charged to the transport being measured
+
+static urob_accounting_counters _counters[UROB_ACCOUNTING_TRANSPORT_COUNT][UROB_ACCOUNTING_ROLE_COUNT];
+
+static atomic_int _stack_transport = UROB_ACCOUNTING_NO_SCOPE;
+
+// Scope of the calling thread, as transport * UROB_ACCOUNTING_ROLE_COUNT + role
+static __thread int _scope = UROB_ACCOUNTING_NO_SCOPE;
+
+static const char * _transport_names[UROB_ACCOUNTING_TRANSPORT_COUNT] = {"netconn", "sockets"};
+static const char * _role_names[UROB_ACCOUNTING_ROLE_COUNT] = {"server", "client", "stack"};
+
+static err_t _urob_accounting_tag_stack(struct tcpip_api_call_data * call)
+{
+    _scope = UROB_ACCOUNTING_STACK_SCOPE;
+    return ERR_OK;
+}
+
+void urob_accounting_start(urob_accounting_transport transport)
+{
+    static bool stack_tagged;
+    if (! stack_tagged)
+    {
+        struct tcpip_api_call_data call;
+        stack_tagged = tcpip_api_call(_urob_accounting_tag_stack, &call) == ERR_OK;
+    }
+
+    atomic_store(&_stack_transport, (int) transport);
+}
+
+void urob_accounting_stop(void)
+{
+    atomic_store(&_stack_transport, UROB_ACCOUNTING_NO_SCOPE);
+}
+
+int urob_accounting_enter(urob_accounting_transport transport, urob_accounting_role role)
+{
+    int previous = _scope;
+    _scope = transport * UROB_ACCOUNTING_ROLE_COUNT + role;
+    return previous;
+}
+
+void urob_accounting_leave(int previous)
+{
+    _scope = previous;
+}
+
+// Counters of the current scope, NULL when not counting
+static IRAM_ATTR urob_accounting_counters * _urob_accounting_current(void)
+{
+    int scope = _scope;
+
+    if (scope == UROB_ACCOUNTING_NO_SCOPE)
+    {
+        return NULL;
+    }
+
+    if (scope == UROB_ACCOUNTING_STACK_SCOPE)
+    {
+        int transport = atomic_load_explicit(&_stack_transport, memory_order_relaxed);
+        return transport == UROB_ACCOUNTING_NO_SCOPE ? NULL : &_counters[transport][UROB_ACCOUNTING_STACK];
+    }
+
+    return &_counters[scope / UROB_ACCOUNTING_ROLE_COUNT][scope % UROB_ACCOUNTING_ROLE_COUNT];
+}
+
+void urob_accounting_request(void)
+{
+    urob_accounting_counters * counters = _urob_accounting_current();
+    if (counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->requests, 1, memory_order_relaxed);
+    }
+}
+
+IRAM_ATTR void urob_accounting_copy(size_t length)
+{
+    urob_accounting_counters * counters = _urob_accounting_current();
+    if (counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->copies, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->bytes_copied, length, memory_order_relaxed);
+    }
+}
+
+IRAM_ATTR void urob_accounting_alloc(size_t size)
+{
+    urob_accounting_counters * counters = _urob_accounting_current();
+    if (counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters->bytes_allocated, size, memory_order_relaxed);
+    }
+}
+
+IRAM_ATTR void urob_accounting_free(void)
+{
+    urob_accounting_counters * counters = _urob_accounting_current();
+    if (counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->frees, 1, memory_order_relaxed);
+    }
+}
+
+void urob_accounting_pbuf(void)
+{
+    urob_accounting_counters * counters = _urob_accounting_current();
+    if (counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->pbufs, 1, memory_order_relaxed);
+    }
+}
+
+const urob_accounting_counters * urob_accounting_get(urob_accounting_transport transport, urob_accounting_role role)
+{
+    return &_counters[transport][role];
+}
+
+void urob_accounting_reset(void)
+{
+    for (int transport = 0; transport < UROB_ACCOUNTING_TRANSPORT_COUNT; transport ++)
+    {
+        for (int role = 0; role < UROB_ACCOUNTING_ROLE_COUNT; role ++)
+        {
+            urob_accounting_counters * counters = &_counters[transport][role];
+            atomic_store(&counters->requests, 0);
+            atomic_store(&counters->copies, 0);
+            atomic_store(&counters->bytes_copied, 0);
+            atomic_store(&counters->allocations, 0);
+            atomic_store(&counters->frees, 0);
+            atomic_store(&counters->bytes_allocated, 0);
+            atomic_store(&counters->pbufs, 0);
+        }
+    }
+}
+
+static float _urob_accounting_per_request(atomic_uint * counter, uint32_t requests)
+{
+    return requests ? (float) atomic_load(counter) / requests : 0;
+}
+
+void urob_accounting_write_json(urob_accounting_write_fn write, void * arg)
+{
+    // Formatting isn't counted against whatever scope is current
+    int previous = _scope;
+    int stack_transport = atomic_exchange(&_stack_transport, UROB_ACCOUNTING_NO_SCOPE);
+    _scope = UROB_ACCOUNTING_NO_SCOPE;
+
+    char line[256];
+    int length = 0;
+
+    write("{", 1, arg);
+
+    for (int transport = 0; transport < UROB_ACCOUNTING_TRANSPORT_COUNT; transport ++)
+    {
+        length = snprintf(line, sizeof(line), "%s\"%s\":{", transport ? "," : "", _transport_names[transport]);
+        write(line, length, arg);
+
+        uint32_t client_requests = atomic_load(&_counters[transport][UROB_ACCOUNTING_CLIENT].requests);
+
+        for (int role = 0; role < UROB_ACCOUNTING_ROLE_COUNT; role ++)
+        {
+            urob_accounting_counters * counters = &_counters[transport][role];
+            uint32_t requests = role == UROB_ACCOUNTING_STACK ? client_requests : atomic_load(&counters->requests);
+
+            length = snprintf(line, sizeof(line),
+                "%s\"%s\":{\"requests\":%u,\"copies\":%.1f,\"bytes_copied\":%.1f,\"allocations\":%.1f,"
+                "\"frees\":%.1f,\"bytes_allocated\":%.1f,\"pbufs\":%.1f}",
+                role ? "," : "",
+                _role_names[role],
+                (unsigned) requests,
+                _urob_accounting_per_request(&counters->copies, requests),
+                _urob_accounting_per_request(&counters->bytes_copied, requests),
+                _urob_accounting_per_request(&counters->allocations, requests),
+                _urob_accounting_per_request(&counters->frees, requests),
+                _urob_accounting_per_request(&counters->bytes_allocated, requests),
+                _urob_accounting_per_request(&counters->pbufs, requests));
+            write(line, length, arg);
+        }
+
+        write("}", 1, arg);
+    }
+
+    write("}", 1, arg);
+
+    _scope = previous;
+    atomic_store(&_stack_transport, stack_transport);
+}
+
+#if UROB_ACCOUNTING
+
+// Linker wraps, see urob_accounting.h
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * pointer, size_t size);
+void __real_free(void * pointer);
+void * __real_memcpy(void * destination, const void * source, size_t length);
+
+IRAM_ATTR void * __wrap_malloc(size_t size)
+{
+    urob_accounting_alloc(size);
+    return __real_malloc(size);
+}
+
+IRAM_ATTR void * __wrap_calloc(size_t count, size_t size)
+{
+    urob_accounting_alloc(count * size);
+    return __real_calloc(count, size);
+}
+
+IRAM_ATTR void * __wrap_realloc(void * pointer, size_t size)
+{
+    urob_accounting_alloc(size);
+    return __real_realloc(pointer, size);
+}
+
+IRAM_ATTR void __wrap_free(void * pointer)
+{
+    if (pointer != NULL)
+    {
+        urob_accounting_free();
+    }
+    __real_free(pointer);
+}
+
+IRAM_ATTR void * __wrap_memcpy(void * destination, const void * source, size_t length)
+{
+    urob_accounting_copy(length);
+    return __real_memcpy(destination, source, length);
+}
+
+#ifdef ESP_PLATFORM
+// The simulated pbufs of host builds call urob_accounting_pbuf themselves
+struct pbuf * __real_pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+
+struct pbuf * __wrap_pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+    urob_accounting_pbuf();
+    return __real_pbuf_alloc(layer, length, type);
+}
+#endif
+
+#endif // UROB_ACCOUNTING
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_ACCOUNTING_H__
+#define __UROB_ACCOUNTING_H__
+
+// Copy and allocation accounting, to compare the cost per request of the netconn and sockets paths.
+// Build with -DUROB_ACCOUNTING=1 and link with
+//   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free,--wrap=memcpy,--wrap=pbuf_alloc
+// (and -fno-builtin-memcpy so that copies aren't inlined). Every call is counted against the
+// scope of the calling thread; lwip's tcpip thread is tagged as the "stack" of the transport being
+// measured, between start and stop, and calls from other threads outside a scope (the wifi driver,
+// the event loop) aren't counted.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef UROB_ACCOUNTING
+#define UROB_ACCOUNTING (0)
+#endif
+
+typedef enum
+{
+    UROB_ACCOUNTING_NETCONN,
+    UROB_ACCOUNTING_SOCKETS,
+    UROB_ACCOUNTING_TRANSPORT_COUNT
+} urob_accounting_transport;
+
+typedef enum
+{
+    UROB_ACCOUNTING_SERVER,
+    UROB_ACCOUNTING_CLIENT,
+    UROB_ACCOUNTING_STACK,
+    UROB_ACCOUNTING_ROLE_COUNT
+} urob_accounting_role;
+
+typedef struct
+{
+    atomic_uint requests;
+    atomic_uint copies;
+    atomic_uint bytes_copied;
+    atomic_uint allocations;
+    atomic_uint frees;
+    atomic_uint bytes_allocated;
+    atomic_uint pbufs;
+} urob_accounting_counters;
+
+// Work done by lwip's tcpip thread is charged to transport until stop is called
+// @discussion the first call tags the tcpip thread, and waits for it
+void urob_accounting_start(urob_accounting_transport transport);
+void urob_accounting_stop(void);
+
+// Scopes nest: enter returns the previous one, to be passed to leave
+int urob_accounting_enter(urob_accounting_transport transport, urob_accounting_role role);
+void urob_accounting_leave(int previous);
+
+// Called by components when a request is complete, in the current scope
+void urob_accounting_request(void);
+
+void urob_accounting_copy(size_t length);
+void urob_accounting_alloc(size_t size);
+void urob_accounting_free(void);
+void urob_accounting_pbuf(void);
+
+const urob_accounting_counters * urob_accounting_get(urob_accounting_transport transport, urob_accounting_role role);
+void urob_accounting_reset(void);
+
+typedef bool (* urob_accounting_write_fn)(const char * text, size_t length, void * arg);
+
+// Per request averages for each transport and role, as a json object. Server and client
+// costs are divided by their own request counts, stack costs by the transport's client requests.
+void urob_accounting_write_json(urob_accounting_write_fn write, void * arg);
+
+#if UROB_ACCOUNTING
+#define UROB_ACCOUNTING_SCOPE(transport, role, statement) do { \
+    int _urob_accounting_previous = urob_accounting_enter(transport, role); \
+    statement; \
+    urob_accounting_leave(_urob_accounting_previous); \
+} while (0)
+#define UROB_ACCOUNTING_REQUEST() urob_accounting_request()
+#else
+#define UROB_ACCOUNTING_SCOPE(transport, role, statement) do { statement; } while (0)
+#define UROB_ACCOUNTING_REQUEST() do { } while (0)
+#endif
+
+#endif // __UROB_ACCOUNTING_H__
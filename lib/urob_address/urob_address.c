@@ -22,12 +22,16 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "urob_address.h"
+#include "urob_trace.h"
 #include "lwip/dns.h"
 #include <esp_log.h>
 #define TAG "address"
 
 #include "general.h"
 
+// The definition used where the inline one isn't (e.g. unoptimized builds)
+extern inline bool netconn_address_resolved(urob_address * address);
+
 static void _urob_address_dns_found(const char *name, const ip_addr_t *resolved_address, void *arg)
 {
   LWIP_UNUSED_ARG(arg);
@@ -44,19 +48,25 @@ static void _urob_address_dns_found(const char *name, const ip_addr_t *resolved_
   }
 
   atomic_store_explicit(&address->state, ADDRESS_STATE_RESOLVED, memory_order_release);
+  UROB_TRACE_STATE(UROB_TRACE_ADDRESS, address, ADDRESS_STATE_RESOLVING, ADDRESS_STATE_RESOLVED);
 }
 
 void urob_address_init(urob_address * address, const char * dnsname)
 {
   * address = (urob_address){0};
   atomic_store_explicit(&address->state, ADDRESS_STATE_RESOLVING, memory_order_release);
+  UROB_TRACE_STATE(UROB_TRACE_ADDRESS, address, ADDRESS_STATE_NONE, ADDRESS_STATE_RESOLVING);
 
   address->err = dns_gethostbyname(dnsname, &address->address, _urob_address_dns_found, address);
   if (address->err == ERR_OK)
   {
     _urob_address_dns_found(dnsname, &address->address, address);
   }
-  _chk(address->err != ERR_INPROGRESS, address->state = ADDRESS_STATE_ERROR, "error resolving address: %d", address->err);
+  // ERR_OK: the address was cached and already resolved by the callback above
+  _chk(address->err != ERR_INPROGRESS && address->err != ERR_OK, {
+      address->state = ADDRESS_STATE_ERROR;
+      UROB_TRACE_STATE(UROB_TRACE_ADDRESS, address, ADDRESS_STATE_RESOLVING, ADDRESS_STATE_ERROR);
+    }, "error resolving address: %d", address->err);
 
   ESP_LOGI(TAG, "resolving address..");
 }
@@ -0,0 +1,182 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_admission.h"
+#include "urob_metrics.h"
+#include <stdio.h>
+
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "esp_log.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+
+#define TAG "admission"
+#include "general.h"
+
+static const char reject_format_string[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+void urob_admission_init(urob_admission * admission, const urob_admission_config * config)
+{
+    * admission = (urob_admission) {0};
+    admission->config = * config;
+
+    int length = snprintf(admission->reject, sizeof(admission->reject), reject_format_string, config->retry_after_s);
+    admission->reject_length = length > 0 && length < (int) sizeof(admission->reject) ? length : 0;
+}
+
+static size_t _urob_admission_free_heap(void)
+{
+#ifdef ESP_PLATFORM
+    return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+#else
+    return SIZE_MAX; // not bounded on the host
+#endif
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    int available;
+} urob_admission_call;
+
+static int _urob_admission_count(struct tcp_pcb * list)
+{
+    int count = 0;
+
+    for (struct tcp_pcb * pcb = list; pcb != NULL; pcb = pcb->next)
+    {
+        count ++;
+    }
+
+    return count;
+}
+
+// Runs in the tcpip thread, which owns the pcb lists. TIME_WAIT pcbs count as free: lwip reuses the
+// oldest when the pool runs out, and urob_teardown reclaims them ahead of it
+static err_t _urob_admission_do_count(struct tcpip_api_call_data * call)
+{
+    ((urob_admission_call *) call)->available = MEMP_NUM_TCP_PCB - _urob_admission_count(tcp_bound_pcbs) -
+        _urob_admission_count(tcp_active_pcbs);
+    return ERR_OK;
+}
+
+static int _urob_admission_free_pcbs(const urob_admission_config * config)
+{
+    if (config->min_free_pcbs <= 0 && config->reset_free_pcbs <= 0) // not worth a call into the tcpip thread
+    {
+        return INT32_MAX;
+    }
+
+    urob_admission_call call = {0};
+    tcpip_api_call(_urob_admission_do_count, &call.call);
+    return call.available;
+}
+
+// Refills at config.rate per second up to config.burst, then takes a connection's worth if there is one
+static bool _urob_admission_take_token(urob_admission * admission, const ip_addr_t * client)
+{
+    if (admission->config.rate == 0)
+    {
+        return true;
+    }
+
+    uint32_t now = urob_metrics_time_us();
+    uint32_t full = (admission->config.burst > 0 ? admission->config.burst : 1) * 1000;
+    urob_admission_bucket * bucket = NULL;
+    urob_admission_bucket * oldest = &admission->buckets[0];
+
+    for (int index = 0; index < UROB_ADMISSION_MAX_CLIENTS && bucket == NULL; index ++)
+    {
+        urob_admission_bucket * candidate = &admission->buckets[index];
+
+        if (candidate->used && ip_addr_cmp(&candidate->address, client))
+        {
+            bucket = candidate;
+        } else if (! candidate->used || (oldest->used && (int32_t) (candidate->updated_us - oldest->updated_us) < 0))
+        {
+            oldest = candidate;
+        }
+    }
+
+    if (bucket == NULL)
+    {
+        bucket = oldest;
+        * bucket = (urob_admission_bucket) {.address = * client, .tokens = full, .updated_us = now, .used = true};
+    }
+
+    uint64_t refill = (uint64_t) (now - bucket->updated_us) * admission->config.rate / 1000;
+    bucket->tokens = bucket->tokens + refill < full ? bucket->tokens + (uint32_t) refill : full;
+    bucket->updated_us = now;
+
+    if (bucket->tokens < 1000)
+    {
+        return false;
+    }
+
+    bucket->tokens -= 1000;
+    return true;
+}
+
+urob_admission_verdict urob_admission_check(urob_admission * admission, const ip_addr_t * client)
+{
+    const urob_admission_config * config = &admission->config;
+    size_t free_heap = _urob_admission_free_heap();
+    int free_pcbs = _urob_admission_free_pcbs(config);
+
+    if (free_heap < config->reset_free_heap || free_pcbs < config->reset_free_pcbs)
+    {
+        UROB_LOGW(TAG, "resetting, %u bytes and %d pcbs free", (unsigned) free_heap, free_pcbs);
+        UROB_METRICS_ADD(UROB_METRICS_ADMISSION_RESET, 1);
+        return ADMISSION_RESET;
+    }
+
+    int active = atomic_load_explicit(&admission->active, memory_order_relaxed);
+    unsigned int queued_bytes = atomic_load_explicit(&admission->queued_bytes, memory_order_relaxed);
+
+    bool overloaded =
+        (config->max_connections > 0 && active >= config->max_connections) ||
+        (config->max_queued_bytes > 0 && queued_bytes >= config->max_queued_bytes) ||
+        free_heap < config->min_free_heap ||
+        free_pcbs < config->min_free_pcbs;
+
+    // Only clients that would be served pay a token, so that shedding doesn't starve them later
+    if (overloaded || ! _urob_admission_take_token(admission, client))
+    {
+        UROB_LOGD(TAG, "rejecting, %d active, %u bytes queued", active, queued_bytes);
+        UROB_METRICS_ADD(UROB_METRICS_ADMISSION_REJECTED, 1);
+        return admission->reject_length > 0 ? ADMISSION_REJECT : ADMISSION_RESET;
+    }
+
+    atomic_fetch_add_explicit(&admission->active, 1, memory_order_relaxed);
+    return ADMISSION_ACCEPT;
+}
+
+void urob_admission_release(urob_admission * admission)
+{
+    atomic_fetch_sub_explicit(&admission->active, 1, memory_order_relaxed);
+}
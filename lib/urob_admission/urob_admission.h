@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_ADMISSION_H__
+#define __UROB_ADMISSION_H__
+
+#include "lwip/ip_addr.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UROB_ADMISSION_MAX_CLIENTS (8) // token buckets, the least recently seen client is forgotten first
+#define UROB_ADMISSION_REJECT_SIZE (128)
+
+typedef enum
+{
+    ADMISSION_ACCEPT = 0,
+    ADMISSION_REJECT, // answered with the precomputed 503
+    ADMISSION_RESET // not even a 503 is affordable, the connection is aborted
+} urob_admission_verdict;
+
+// Limits of 0 are not enforced
+typedef struct
+{
+    int max_connections; // admitted and not released yet
+    size_t max_queued_bytes; // received and held by connections, see urob_admission_queue
+    size_t min_free_heap; // rejects below this
+    size_t reset_free_heap; // resets below this
+    int min_free_pcbs; // rejects below this many tcp pcbs left out of MEMP_NUM_TCP_PCB, the new connection's taken
+    int reset_free_pcbs; // resets below this
+
+    // Per client ip
+    uint32_t rate; // connections per second
+    uint32_t burst; // connections accepted at once after a quiet period
+
+    int retry_after_s;
+} urob_admission_config;
+
+typedef struct
+{
+    ip_addr_t address;
+    uint32_t tokens; // thousandths of a connection
+    uint32_t updated_us;
+    bool used;
+} urob_admission_bucket;
+
+// Shared by the loops serving admitted connections, checked by the accepting one
+typedef struct
+{
+    urob_admission_config config;
+    atomic_int active;
+    atomic_uint queued_bytes;
+
+    urob_admission_bucket buckets[UROB_ADMISSION_MAX_CLIENTS]; // accepting loop only
+
+    char reject[UROB_ADMISSION_REJECT_SIZE]; // formatted once, sent without copies
+    size_t reject_length;
+} urob_admission;
+
+void urob_admission_init(urob_admission * admission, const urob_admission_config * config);
+
+// Decides on a new connection from client, an accepted one counts as active until released
+urob_admission_verdict urob_admission_check(urob_admission * admission, const ip_addr_t * client);
+void urob_admission_release(urob_admission * admission);
+
+// Accounts for bytes received and held (length > 0) or consumed (length < 0) by admitted connections
+static inline void urob_admission_queue(urob_admission * admission, long length)
+{
+    atomic_fetch_add_explicit(&admission->queued_bytes, (unsigned int) length, memory_order_relaxed);
+}
+
+#endif // __UROB_ADMISSION_H__
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_BUDGET_H__
+#define __UROB_BUDGET_H__
+
+#include "urob_metrics.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Work a component (or a connection) may do in one loop iteration, so that a busy one can't delay
+// the other components sharing the loop. Limits of 0 are not enforced.
+typedef struct
+{
+    size_t bytes; // sent and received
+    int messages; // message (or connection) handler calls
+    uint32_t cycles; // urob_metrics_cycles units: cpu cycles on esp32, ns on the host
+} urob_budget_config;
+
+typedef struct
+{
+    size_t bytes;
+    int messages;
+    uint32_t started;
+    bool exhausted; // some work was left for the next iteration
+} urob_budget;
+
+static inline void urob_budget_start(urob_budget * budget, const urob_budget_config * config)
+{
+    * budget = (urob_budget) {
+        .bytes = config->bytes > 0 ? config->bytes : SIZE_MAX,
+        .messages = config->messages > 0 ? config->messages : INT32_MAX,
+        .started = config->cycles > 0 ? urob_metrics_cycles() : 0
+    };
+}
+
+// @return whether there's budget left for another handler call, the caller leaves the work for
+// the next iteration otherwise
+static inline bool urob_budget_left(urob_budget * budget, const urob_budget_config * config)
+{
+    if (budget->bytes == 0 || budget->messages == 0 ||
+        (config->cycles > 0 && urob_metrics_cycles() - budget->started >= config->cycles))
+    {
+        budget->exhausted = true;
+    }
+
+    return ! budget->exhausted;
+}
+
+// @return length capped to the bytes left
+static inline size_t urob_budget_bytes(const urob_budget * budget, size_t length)
+{
+    return length < budget->bytes ? length : budget->bytes;
+}
+
+static inline void urob_budget_spend(urob_budget * budget, size_t bytes, int messages)
+{
+    budget->bytes -= bytes < budget->bytes ? bytes : budget->bytes;
+    budget->messages -= messages < budget->messages ? messages : budget->messages;
+}
+
+#endif // __UROB_BUDGET_H__
@@ -0,0 +1,390 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_download.h"
+#include "urob_metrics.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#define TAG "download"
+#include "general.h"
+
+// Writer, runs in its own task so that the loop keeps receiving while flash is busy
+
+static void _urob_download_wake_writer(urob_download * download)
+{
+#ifdef ESP_PLATFORM
+    xTaskNotifyGive(download->writer);
+#else
+    sem_post(&download->wake);
+#endif
+}
+
+static void _urob_download_wait(urob_download * download)
+{
+#ifdef ESP_PLATFORM
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+    sem_wait(&download->wake);
+#endif
+}
+
+static int _urob_download_write(urob_download * download, urob_download_buffer * buffer)
+{
+#ifdef ESP_PLATFORM
+    // Buffers are sector sized and aligned, so each one erases exactly what it's going to write
+    esp_err_t err = esp_partition_erase_range(download->partition, buffer->offset, UROB_DOWNLOAD_BUFFER_SIZE);
+    if (err == ESP_OK)
+    {
+        err = esp_partition_write(download->partition, buffer->offset, buffer->data, buffer->length);
+    }
+    return err;
+#else
+    if (fseek(download->file, buffer->offset, SEEK_SET) != 0 ||
+        fwrite(buffer->data, 1, buffer->length, download->file) != buffer->length)
+    {
+        return errno ? errno : EIO;
+    }
+    return 0;
+#endif
+}
+
+static void _urob_download_writer_run(urob_download * download)
+{
+    int next = 0;
+
+    while (! atomic_load_explicit(&download->stop, memory_order_acquire))
+    {
+        urob_download_buffer * buffer = &download->buffers[next];
+
+        if (atomic_load_explicit(&buffer->state, memory_order_acquire) != DOWNLOAD_BUFFER_WRITING)
+        {
+            _urob_download_wait(download);
+            continue;
+        }
+
+        if (atomic_load_explicit(&download->write_err, memory_order_relaxed) == 0)
+        {
+            int err = _urob_download_write(download, buffer);
+            if (err != 0)
+            {
+                UROB_LOGE(TAG, "unable to write %d bytes at %d: %d", (int) buffer->length, (int) buffer->offset, err);
+                atomic_store_explicit(&download->write_err, err, memory_order_relaxed);
+            } else
+            {
+                mbedtls_sha256_update_ret(&download->sha256, buffer->data, buffer->length);
+            }
+        }
+
+        atomic_store_explicit(&buffer->state, DOWNLOAD_BUFFER_FREE, memory_order_release);
+        next = (next + 1) % UROB_DOWNLOAD_BUFFER_COUNT;
+    }
+}
+
+#ifdef ESP_PLATFORM
+static void _urob_download_writer(void * arg)
+{
+    urob_download * download = (urob_download *) arg;
+    _urob_download_writer_run(download);
+    atomic_store_explicit(&download->writer_running, false, memory_order_release);
+    vTaskDelete(NULL);
+}
+#else
+static void * _urob_download_writer(void * arg)
+{
+    _urob_download_writer_run((urob_download *) arg);
+    return NULL;
+}
+#endif
+
+static bool _urob_download_writer_idle(urob_download * download)
+{
+    for (int index = 0; index < UROB_DOWNLOAD_BUFFER_COUNT; index ++)
+    {
+        if (atomic_load_explicit(&download->buffers[index].state, memory_order_acquire) == DOWNLOAD_BUFFER_WRITING)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loop side
+
+static void _urob_download_submit(urob_download * download)
+{
+    urob_download_buffer * buffer = &download->buffers[download->fill];
+    atomic_store_explicit(&buffer->state, DOWNLOAD_BUFFER_WRITING, memory_order_release);
+    _urob_download_wake_writer(download);
+    download->fill = (download->fill + 1) % UROB_DOWNLOAD_BUFFER_COUNT;
+}
+
+// Starts over from the first byte, only while the writer is idle
+static void _urob_download_restart(urob_download * download)
+{
+    UROB_LOGW(TAG, "range ignored by the server, restarting from 0 (%d bytes lost)", (int) download->received);
+    urob_download_buffer * buffer = &download->buffers[download->fill];
+    buffer->length = 0;
+    buffer->offset = 0;
+    download->received = 0;
+    mbedtls_sha256_starts_ret(&download->sha256, 0);
+}
+
+static bool _urob_download_check_response(urob_download * download, urob_http_client * client)
+{
+    bool resumed = download->received > 0 && client->status == 206;
+    _chk(! resumed && client->status != 200, download->err = ERR_VAL; return false, "unexpected status: %d", client->status);
+
+    if (! resumed && download->received > 0)
+    {
+        if (! _urob_download_writer_idle(download))
+        {
+            return false; // the body is kept until the writer catches up
+        }
+        _urob_download_restart(download);
+    }
+
+    if (client->content_length >= 0)
+    {
+        download->total = download->received + client->content_length;
+    }
+
+#ifdef ESP_PLATFORM
+    _chk(download->total > (long) download->partition->size, download->err = ERR_MEM; return false,
+        "%ld bytes don't fit in partition %s (%d)", download->total, download->partition->label, (int) download->partition->size);
+#endif
+
+    download->response_checked = true;
+    return true;
+}
+
+// Copies the body into the buffer being filled, and hands it to the writer when full
+// @return 0 when both buffers are taken: the client holds on to the data and the tcp window closes
+static size_t _urob_download_body(urob_http_client * client, const char * data, size_t length, void * arg)
+{
+    urob_download * download = (urob_download *) arg;
+
+    if (! download->response_checked && ! _urob_download_check_response(download, client))
+    {
+        return download->err == ERR_OK ? 0 : length;
+    }
+
+    if (download->err != ERR_OK)
+    {
+        return length; // discarded, the loop gives up
+    }
+
+    size_t consumed = 0;
+    while (consumed < length)
+    {
+        urob_download_buffer * buffer = &download->buffers[download->fill];
+        int state = atomic_load_explicit(&buffer->state, memory_order_acquire);
+
+        if (state == DOWNLOAD_BUFFER_WRITING)
+        {
+            break;
+        }
+
+        if (state == DOWNLOAD_BUFFER_FREE)
+        {
+            buffer->length = 0;
+            buffer->offset = download->received;
+            atomic_store_explicit(&buffer->state, DOWNLOAD_BUFFER_FILLING, memory_order_relaxed);
+        }
+
+        size_t slice = UROB_DOWNLOAD_BUFFER_SIZE - buffer->length;
+        if (slice > length - consumed)
+        {
+            slice = length - consumed;
+        }
+
+        memcpy(buffer->data + buffer->length, data + consumed, slice);
+        buffer->length += slice;
+        download->received += slice;
+        consumed += slice;
+
+        if (buffer->length == UROB_DOWNLOAD_BUFFER_SIZE)
+        {
+            _urob_download_submit(download);
+        }
+    }
+
+    return consumed;
+}
+
+static void _urob_download_request(urob_download * download)
+{
+    const char * headers = NULL;
+    if (download->received > 0)
+    {
+        snprintf(download->headers, sizeof(download->headers), "Range: bytes=%u-\r\n", (unsigned) download->received);
+        headers = download->headers;
+    }
+
+    download->client = (urob_http_client) {0};
+    urob_http_client_init(&download->client, &download->config.address, download->config.port);
+    urob_http_client_set_request(&download->client, download->config.host, download->config.path, headers);
+    urob_http_client_set_body_callback(&download->client, _urob_download_body, download);
+    download->response_checked = false;
+}
+
+static void _urob_download_retry(urob_download * download)
+{
+    _chk(download->retries >= UROB_DOWNLOAD_MAX_RETRIES, download->err = ERR_CONN; return,
+        "giving up after %d retries", download->retries);
+
+    download->retries ++;
+    UROB_LOGW(TAG, "connection lost at %d bytes, resuming (%d)", (int) download->received, download->retries);
+    _urob_download_request(download);
+}
+
+static void _urob_download_received(urob_download * download)
+{
+    urob_http_client_uninit(&download->client);
+
+    if (download->total >= 0 && (long) download->received < download->total)
+    {
+        _urob_download_retry(download); // closed early
+        return;
+    }
+
+    if (atomic_load_explicit(&download->buffers[download->fill].state, memory_order_relaxed) == DOWNLOAD_BUFFER_FILLING)
+    {
+        _urob_download_submit(download);
+    }
+    download->state = DOWNLOAD_STATE_FLUSHING;
+}
+
+static void _urob_download_flushed(urob_download * download)
+{
+    int write_err = atomic_load_explicit(&download->write_err, memory_order_relaxed);
+    _chk(write_err != 0, download->err = ERR_ABRT; return, "write failed: %d", write_err);
+
+    mbedtls_sha256_finish_ret(&download->sha256, download->digest);
+    _chk(download->config.sha256 != NULL && memcmp(download->digest, download->config.sha256, UROB_DOWNLOAD_SHA256_SIZE) != 0,
+        download->err = ERR_VAL; return, "sha256 mismatch");
+
+    uint32_t elapsed_us = urob_metrics_time_us() - download->start_us;
+    UROB_LOGI(TAG, "%d bytes in %d ms, %d retries", (int) download->received, (int) (elapsed_us / 1000), download->retries);
+    download->state = DOWNLOAD_STATE_DONE;
+}
+
+void urob_download_init(urob_download * download, const urob_download_config * config)
+{
+    *download = (urob_download) {0};
+    download->config = *config;
+    download->total = -1;
+    download->state = DOWNLOAD_STATE_ERROR;
+
+    mbedtls_sha256_init(&download->sha256);
+    mbedtls_sha256_starts_ret(&download->sha256, 0);
+
+#ifdef ESP_PLATFORM
+    download->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, config->target);
+    _chk(download->partition == NULL, return, "partition %s not found", config->target);
+
+    atomic_store_explicit(&download->writer_running, true, memory_order_relaxed);
+    BaseType_t result = xTaskCreate(_urob_download_writer, "urob download", UROB_DOWNLOAD_WRITER_STACK_SIZE, download,
+        UROB_DOWNLOAD_WRITER_PRIORITY, &download->writer);
+    _chk(result != pdPASS, atomic_store(&download->writer_running, false); return, "unable to create the writer task");
+#else
+    download->file = fopen(config->target, "w+b");
+    _chk(download->file == NULL, return, "unable to open %s: %d", config->target, errno);
+
+    sem_init(&download->wake, 0, 0);
+    int result = pthread_create(&download->writer, NULL, _urob_download_writer, download);
+    _chk(result != 0, sem_destroy(&download->wake); fclose(download->file); download->file = NULL; return,
+        "unable to create the writer thread: %d", result);
+#endif
+
+    download->start_us = urob_metrics_time_us();
+    download->state = DOWNLOAD_STATE_RECEIVING;
+    _urob_download_request(download);
+}
+
+void urob_download_loop(urob_download * download)
+{
+    switch (download->state)
+    {
+        case DOWNLOAD_STATE_RECEIVING:
+            urob_http_client_loop(&download->client);
+
+            if (download->client.state == CLIENT_STATE_ERROR) // checked before the client uninitializes itself
+            {
+                urob_http_client_uninit(&download->client);
+                if (download->err == ERR_OK)
+                {
+                    _urob_download_retry(download);
+                }
+            } else if (download->client.state == CLIENT_STATE_RESP_RECVD)
+            {
+                _urob_download_received(download);
+            }
+        break;
+        case DOWNLOAD_STATE_FLUSHING:
+            if (_urob_download_writer_idle(download))
+            {
+                _urob_download_flushed(download);
+            }
+        break;
+        default:
+        break;
+    }
+
+    if (download->err != ERR_OK && download->state != DOWNLOAD_STATE_ERROR)
+    {
+        urob_http_client_uninit(&download->client);
+        download->state = DOWNLOAD_STATE_ERROR;
+    }
+}
+
+void urob_download_uninit(urob_download * download)
+{
+    urob_http_client_uninit(&download->client);
+    atomic_store_explicit(&download->stop, true, memory_order_release);
+
+#ifdef ESP_PLATFORM
+    if (download->writer != NULL)
+    {
+        _urob_download_wake_writer(download);
+        while (atomic_load_explicit(&download->writer_running, memory_order_acquire))
+        {
+            vTaskDelay(1);
+        }
+    }
+#else
+    if (download->file != NULL)
+    {
+        _urob_download_wake_writer(download);
+        pthread_join(download->writer, NULL);
+        sem_destroy(&download->wake);
+        fclose(download->file);
+    }
+#endif
+
+    mbedtls_sha256_free(&download->sha256);
+    *download = (urob_download) {0};
+}
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_DOWNLOAD_H__
+#define __UROB_DOWNLOAD_H__
+
+#include "urob_http_client.h"
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "mbedtls/sha256.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#endif
+
+#define UROB_DOWNLOAD_BUFFER_SIZE (4096) // a flash sector, each buffer is erased and written at once
+#define UROB_DOWNLOAD_BUFFER_COUNT (2) // one filled by the loop while the other is written
+#define UROB_DOWNLOAD_MAX_RETRIES (5) // ranged requests after a broken connection
+#define UROB_DOWNLOAD_WRITER_STACK_SIZE (4096)
+#define UROB_DOWNLOAD_WRITER_PRIORITY (tskIDLE_PRIORITY + 1) // above the shards, it blocks on flash anyway
+#define UROB_DOWNLOAD_HEADERS_SIZE (40)
+#define UROB_DOWNLOAD_SHA256_SIZE (32)
+
+typedef enum
+{
+    DOWNLOAD_STATE_NONE = 0,
+    DOWNLOAD_STATE_RECEIVING,
+    DOWNLOAD_STATE_FLUSHING, // received, waiting for the last writes
+    DOWNLOAD_STATE_DONE,
+    DOWNLOAD_STATE_ERROR
+} urob_download_state;
+
+typedef enum
+{
+    DOWNLOAD_BUFFER_FREE = 0,
+    DOWNLOAD_BUFFER_FILLING, // owned by the loop
+    DOWNLOAD_BUFFER_WRITING // owned by the writer
+} urob_download_buffer_state;
+
+typedef struct
+{
+    uint8_t data[UROB_DOWNLOAD_BUFFER_SIZE] __attribute__((aligned(4))); // flash writes want word alignment
+    size_t length;
+    size_t offset; // in the target, a multiple of UROB_DOWNLOAD_BUFFER_SIZE
+    atomic_int state;
+} urob_download_buffer;
+
+typedef struct
+{
+    ip_addr_t address;
+    int port;
+    const char * host;
+    const char * path;
+
+    const char * target; // data partition label on the esp32, file path on the host
+    const uint8_t * sha256; // expected digest of the body, NULL not to verify
+} urob_download_config;
+
+typedef struct
+{
+    urob_download_config config;
+    urob_download_state state;
+    err_t err;
+
+    urob_http_client client;
+    char headers[UROB_DOWNLOAD_HEADERS_SIZE]; // Range of a resumed request
+    int retries;
+    bool response_checked; // status of the current response
+
+    size_t received; // body bytes taken, a resumed request starts from here
+    long total; // -1 until known
+    int fill; // buffer being filled, buffers are written in this same order
+
+    urob_download_buffer buffers[UROB_DOWNLOAD_BUFFER_COUNT];
+
+    // Written by the writer only while it owns a buffer
+    mbedtls_sha256_context sha256;
+    uint8_t digest[UROB_DOWNLOAD_SHA256_SIZE];
+    atomic_int write_err; // first failed write: esp_err_t on the esp32, errno on the host, 0 if none
+    atomic_bool stop;
+
+#ifdef ESP_PLATFORM
+    const esp_partition_t * partition;
+    TaskHandle_t writer;
+    atomic_bool writer_running;
+#else
+    FILE * file;
+    pthread_t writer;
+    sem_t wake;
+#endif
+
+    uint32_t start_us;
+} urob_download;
+
+// Downloads config->path into config->target
+// @discussion the body is received on the loop and written to flash from a separate task, so that
+// erasing and writing a sector overlaps receiving the next one
+void urob_download_init(urob_download * download, const urob_download_config * config);
+void urob_download_uninit(urob_download * download);
+void urob_download_loop(urob_download * download);
+
+static inline bool urob_download_done(urob_download * download)
+{
+    return download->state == DOWNLOAD_STATE_DONE || download->state == DOWNLOAD_STATE_ERROR;
+}
+
+#endif // __UROB_DOWNLOAD_H__
@@ -0,0 +1,191 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_fsimage.h"
+#include <string.h>
+
+#ifndef ESP_PLATFORM
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "esp_log.h"
+
+#define TAG "fsimage"
+#include "general.h"
+
+static const char not_found_page[] = "Not found";
+
+static bool _urob_fsimage_string_valid(const urob_fsimage * image, uint32_t offset)
+{
+    return offset < image->size && memchr(image->base + offset, '\0', image->size - offset) != NULL;
+}
+
+// Once at open, so that lookups can trust the index
+static bool _urob_fsimage_validate(const urob_fsimage * image)
+{
+    const urob_fsimage_header * header = (const urob_fsimage_header *) image->base;
+    _chk(image->size < sizeof(*header) || header->magic != UROB_FSIMAGE_MAGIC, return false, "not a file image");
+    _chk(header->size > image->size || header->size < sizeof(*header) || (header->size - sizeof(*header)) / sizeof(urob_fsimage_entry) < header->count, return false,
+        "truncated image: %u bytes, %u entries", (unsigned) header->size, (unsigned) header->count);
+
+    const urob_fsimage_entry * entries = (const urob_fsimage_entry *) (header + 1);
+    for (uint32_t index = 0; index < header->count; index ++)
+    {
+        const urob_fsimage_entry * entry = &entries[index];
+        _chk(! _urob_fsimage_string_valid(image, entry->path) || ! _urob_fsimage_string_valid(image, entry->content_type) ||
+            entry->data > header->size || entry->length > header->size - entry->data, return false, "invalid entry %u", (unsigned) index);
+        _chk(index > 0 && strcmp((const char *) image->base + entries[index - 1].path, (const char *) image->base + entry->path) >= 0,
+            return false, "index not sorted at %u", (unsigned) index);
+    }
+
+    return true;
+}
+
+bool urob_fsimage_open(urob_fsimage * image, const char * target)
+{
+    * image = (urob_fsimage) {0};
+    const void * base = NULL;
+
+#ifdef ESP_PLATFORM
+    const esp_partition_t * partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, target);
+    _chk(partition == NULL, return false, "partition %s not found", target);
+
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &base, &image->handle);
+    _chk(err != ESP_OK, return false, "unable to map %s: %d", target, err);
+    image->size = partition->size;
+#else
+    int fd = open(target, O_RDONLY);
+    _chk(fd < 0, return false, "unable to open %s: %d", target, errno);
+
+    struct stat status;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        base = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        base = base == MAP_FAILED ? NULL : base;
+    }
+    close(fd);
+    _chk(base == NULL, return false, "unable to map %s: %d", target, errno);
+    image->size = image->mapped = status.st_size;
+#endif
+
+    image->base = (const uint8_t *) base;
+
+    if (! _urob_fsimage_validate(image))
+    {
+        urob_fsimage_close(image);
+        return false;
+    }
+
+    const urob_fsimage_header * header = (const urob_fsimage_header *) image->base;
+    image->size = header->size;
+    image->entries = (const urob_fsimage_entry *) (header + 1);
+    image->count = header->count;
+    UROB_LOGI(TAG, "%s: %u files, %u bytes", target, (unsigned) image->count, (unsigned) image->size);
+    return true;
+}
+
+void urob_fsimage_close(urob_fsimage * image)
+{
+    if (image->base != NULL)
+    {
+#ifdef ESP_PLATFORM
+        spi_flash_munmap(image->handle);
+#else
+        munmap((void *) image->base, image->mapped);
+#endif
+    }
+
+    * image = (urob_fsimage) {0};
+}
+
+// strcmp of the first length characters of path against a nul-terminated entry path
+static int _urob_fsimage_compare(const char * path, size_t length, const char * entry_path)
+{
+    int result = strncmp(path, entry_path, length);
+    return result != 0 ? result : (entry_path[length] == '\0' ? 0 : -1);
+}
+
+bool urob_fsimage_find(const urob_fsimage * image, const char * path, urob_fsimage_file * file)
+{
+    if (image->base == NULL)
+    {
+        return false;
+    }
+
+    char key[UROB_HTTP_SERVER_PATH_SIZE + sizeof(UROB_FSIMAGE_INDEX)];
+    size_t length = strcspn(path, "?");
+    _chk(length >= UROB_HTTP_SERVER_PATH_SIZE, return false, "path too long");
+
+    memcpy(key, path, length);
+    if (length == 0 || key[length - 1] == '/')
+    {
+        memcpy(key + length, UROB_FSIMAGE_INDEX, sizeof(UROB_FSIMAGE_INDEX) - 1);
+        length += sizeof(UROB_FSIMAGE_INDEX) - 1;
+    }
+
+    uint32_t low = 0;
+    uint32_t high = image->count;
+
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        const urob_fsimage_entry * entry = &image->entries[middle];
+        int result = _urob_fsimage_compare(key, length, (const char *) image->base + entry->path);
+
+        if (result == 0)
+        {
+            file->content_type = (const char *) image->base + entry->content_type;
+            file->data = image->base + entry->data;
+            file->length = entry->length;
+            return true;
+        }
+
+        if (result < 0)
+        {
+            high = middle;
+        } else
+        {
+            low = middle + 1;
+        }
+    }
+
+    return false;
+}
+
+void urob_fsimage_serve(urob_http_server_connection * connection, void * arg)
+{
+    const urob_fsimage * image = (const urob_fsimage *) arg;
+    urob_fsimage_file file;
+
+    if (! urob_fsimage_find(image, connection->path, &file))
+    {
+        urob_http_server_respond_static(connection, 404, "text/plain", not_found_page, sizeof(not_found_page) - 1);
+        return;
+    }
+
+    urob_http_server_respond_static(connection, 200, file.content_type, file.data, file.length);
+}
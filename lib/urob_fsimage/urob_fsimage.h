@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_FSIMAGE_H__
+#define __UROB_FSIMAGE_H__
+
+#include "urob_http_server.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#endif
+
+// Read-only file image, built with tools/urob_fsimage.py. Little endian, all offsets from the start of the image:
+//   header, entries sorted by path (strcmp order), nul-terminated strings, file data (4-byte aligned)
+#define UROB_FSIMAGE_MAGIC (0x31534655) // "UFS1"
+#define UROB_FSIMAGE_INDEX "index.html" // served for paths ending with '/'
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count; // of entries
+    uint32_t size; // of the whole image
+    uint32_t reserved;
+} urob_fsimage_header;
+
+typedef struct
+{
+    uint32_t path; // e.g. "/css/main.css"
+    uint32_t content_type;
+    uint32_t data;
+    uint32_t length;
+} urob_fsimage_entry;
+
+typedef struct
+{
+    const char * content_type;
+    const void * data; // in the mapping, valid until the image is closed
+    size_t length;
+} urob_fsimage_file;
+
+typedef struct
+{
+    const uint8_t * base; // NULL when not open
+    size_t size;
+    const urob_fsimage_entry * entries;
+    uint32_t count;
+
+#ifdef ESP_PLATFORM
+    spi_flash_mmap_handle_t handle;
+#else
+    size_t mapped;
+#endif
+} urob_fsimage;
+
+// Maps the image in the data partition labeled target (a file on the host), and validates its index
+bool urob_fsimage_open(urob_fsimage * image, const char * target);
+void urob_fsimage_close(urob_fsimage * image);
+
+// Binary search of the index, a query string is ignored
+bool urob_fsimage_find(const urob_fsimage * image, const char * path, urob_fsimage_file * file);
+
+// Handler serving the image passed as arg, the data is sent straight from the mapping
+// e.g. urob_http_server_set_fallback(server, urob_fsimage_serve, image)
+void urob_fsimage_serve(urob_http_server_connection * connection, void * arg);
+
+#endif // __UROB_FSIMAGE_H__
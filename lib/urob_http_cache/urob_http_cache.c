@@ -0,0 +1,772 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_http_cache.h"
+#include "urob_metrics.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef ESP_PLATFORM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "esp_log.h"
+
+#define TAG "http cache"
+#include "general.h"
+
+// Seconds since boot: freshness lifetimes outlast the 32 bit microseconds of urob_metrics_time_us
+static uint32_t _urob_http_cache_now_s(void)
+{
+#ifdef ESP_PLATFORM
+    return (uint32_t) (esp_timer_get_time() / 1000000);
+#elif UROB_NETSIM
+    return urob_netsim_now_us() / 1000000;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) now.tv_sec;
+#endif
+}
+
+// Flash storage, one slot per entry
+
+static bool _urob_http_cache_map(urob_http_cache * cache)
+{
+    const char * target = cache->config.target;
+    cache->slot_size = (sizeof(urob_http_cache_slot) + cache->config.max_body + UROB_HTTP_CACHE_SECTOR_SIZE - 1) /
+        UROB_HTTP_CACHE_SECTOR_SIZE * UROB_HTTP_CACHE_SECTOR_SIZE;
+    const void * base = NULL;
+
+#ifdef ESP_PLATFORM
+    cache->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, target);
+    _chk(cache->partition == NULL, return false, "partition %s not found", target);
+
+    size_t slots = cache->partition->size / cache->slot_size;
+    cache->entry_count = slots < UROB_HTTP_CACHE_ENTRIES ? slots : UROB_HTTP_CACHE_ENTRIES;
+    _chk(cache->entry_count == 0, return false, "partition %s smaller than a slot", target);
+
+    esp_err_t err = esp_partition_mmap(cache->partition, 0, cache->entry_count * cache->slot_size, SPI_FLASH_MMAP_DATA, &base, &cache->handle);
+    _chk(err != ESP_OK, return false, "unable to map %s: %d", target, err);
+#else
+    cache->fd = open(target, O_RDWR | O_CREAT, 0644);
+    _chk(cache->fd < 0, return false, "unable to open %s: %d", target, errno);
+
+    cache->entry_count = UROB_HTTP_CACHE_ENTRIES;
+    cache->mapped = cache->entry_count * cache->slot_size;
+
+    struct stat status;
+    if (fstat(cache->fd, &status) == 0 && (size_t) status.st_size < cache->mapped)
+    {
+        _chk(ftruncate(cache->fd, cache->mapped) != 0, return false, "unable to size %s: %d", target, errno);
+    }
+
+    base = mmap(NULL, cache->mapped, PROT_READ, MAP_SHARED, cache->fd, 0);
+    _chk(base == MAP_FAILED, return false, "unable to map %s: %d", target, errno);
+#endif
+
+    cache->base = (const uint8_t *) base;
+    return true;
+}
+
+static bool _urob_http_cache_erase(urob_http_cache * cache, size_t offset, size_t size)
+{
+#ifdef ESP_PLATFORM
+    esp_err_t err = esp_partition_erase_range(cache->partition, offset, size);
+    _chk(err != ESP_OK, return false, "unable to erase at %u: %d", (unsigned) offset, err);
+#else
+    uint8_t erased[UROB_HTTP_CACHE_SECTOR_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+
+    for (size_t done = 0; done < size; done += sizeof(erased))
+    {
+        _chk(pwrite(cache->fd, erased, sizeof(erased), offset + done) != sizeof(erased), return false, "unable to erase at %u: %d", (unsigned) offset, errno);
+    }
+#endif
+    return true;
+}
+
+static bool _urob_http_cache_write(urob_http_cache * cache, size_t offset, const void * data, size_t length)
+{
+#ifdef ESP_PLATFORM
+    esp_err_t err = esp_partition_write(cache->partition, offset, data, length);
+    _chk(err != ESP_OK, return false, "unable to write at %u: %d", (unsigned) offset, err);
+#else
+    _chk(pwrite(cache->fd, data, length, offset) != (ssize_t) length, return false, "unable to write at %u: %d", (unsigned) offset, errno);
+#endif
+    return true;
+}
+
+// Writer, runs in its own task so that the loop keeps serving while a slot is erased
+
+static void _urob_http_cache_wake_writer(urob_http_cache * cache)
+{
+#ifdef ESP_PLATFORM
+    xTaskNotifyGive(cache->writer);
+#else
+    sem_post(&cache->wake);
+#endif
+}
+
+static void _urob_http_cache_wait(urob_http_cache * cache)
+{
+#ifdef ESP_PLATFORM
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+    sem_wait(&cache->wake);
+#endif
+}
+
+// Erases and writes the slot a sector at a time, the header last
+static bool _urob_http_cache_write_slot(urob_http_cache * cache, urob_http_cache_entry * entry)
+{
+    size_t slot_offset = (entry - cache->entries) * cache->slot_size;
+    size_t total = sizeof(urob_http_cache_slot) + entry->length;
+
+    for (size_t sector = 0; sector < total; sector += UROB_HTTP_CACHE_SECTOR_SIZE)
+    {
+        if (! _urob_http_cache_erase(cache, slot_offset + sector, UROB_HTTP_CACHE_SECTOR_SIZE))
+        {
+            return false;
+        }
+
+        // Body bytes in this sector, after the header
+        size_t begin = sector > sizeof(urob_http_cache_slot) ? sector : sizeof(urob_http_cache_slot);
+        size_t end = sector + UROB_HTTP_CACHE_SECTOR_SIZE < total ? sector + UROB_HTTP_CACHE_SECTOR_SIZE : total;
+
+        if (end > begin && ! _urob_http_cache_write(cache, slot_offset + begin, entry->body + begin - sizeof(urob_http_cache_slot), end - begin))
+        {
+            return false;
+        }
+    }
+
+    return _urob_http_cache_write(cache, slot_offset, &entry->slot, sizeof(entry->slot));
+}
+
+static void _urob_http_cache_writer_run(urob_http_cache * cache)
+{
+    while (! atomic_load_explicit(&cache->stop, memory_order_acquire))
+    {
+        bool written = false;
+
+        for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+        {
+            urob_http_cache_entry * entry = &cache->entries[entry_index];
+
+            if (atomic_load_explicit(&entry->commit_state, memory_order_acquire) == HTTP_CACHE_COMMIT_QUEUED)
+            {
+                bool ok = _urob_http_cache_write_slot(cache, entry);
+                atomic_store_explicit(&entry->commit_state, ok ? HTTP_CACHE_COMMIT_WRITTEN : HTTP_CACHE_COMMIT_FAILED, memory_order_release);
+                written = true;
+            }
+        }
+
+        if (! written)
+        {
+            _urob_http_cache_wait(cache);
+        }
+    }
+}
+
+#ifdef ESP_PLATFORM
+static void _urob_http_cache_writer(void * arg)
+{
+    urob_http_cache * cache = (urob_http_cache *) arg;
+    _urob_http_cache_writer_run(cache);
+    atomic_store_explicit(&cache->writer_running, false, memory_order_release);
+    vTaskDelete(NULL);
+}
+#else
+static void * _urob_http_cache_writer(void * arg)
+{
+    _urob_http_cache_writer_run((urob_http_cache *) arg);
+    return NULL;
+}
+#endif
+
+static bool _urob_http_cache_start_writer(urob_http_cache * cache)
+{
+    atomic_store_explicit(&cache->writer_running, true, memory_order_relaxed);
+
+#ifdef ESP_PLATFORM
+    BaseType_t result = xTaskCreate(_urob_http_cache_writer, "urob http cache", UROB_HTTP_CACHE_WRITER_STACK_SIZE, cache,
+        UROB_HTTP_CACHE_WRITER_PRIORITY, &cache->writer);
+    _chk(result != pdPASS, atomic_store(&cache->writer_running, false); return false, "unable to create the writer task");
+#else
+    sem_init(&cache->wake, 0, 0);
+    int result = pthread_create(&cache->writer, NULL, _urob_http_cache_writer, cache);
+    _chk(result != 0, sem_destroy(&cache->wake); atomic_store(&cache->writer_running, false); return false,
+        "unable to create the writer thread: %d", result);
+#endif
+
+    return true;
+}
+
+// Waits for the slot being written, if any
+static void _urob_http_cache_stop_writer(urob_http_cache * cache)
+{
+    if (! atomic_load_explicit(&cache->writer_running, memory_order_acquire))
+    {
+        return;
+    }
+
+    atomic_store_explicit(&cache->stop, true, memory_order_release);
+    _urob_http_cache_wake_writer(cache);
+
+#ifdef ESP_PLATFORM
+    while (atomic_load_explicit(&cache->writer_running, memory_order_acquire))
+    {
+        vTaskDelay(1);
+    }
+#else
+    pthread_join(cache->writer, NULL);
+    sem_destroy(&cache->wake);
+#endif
+}
+
+// Bodies are either in the mapping or on the heap
+static void _urob_http_cache_free_body(urob_http_cache * cache, urob_http_cache_entry * entry)
+{
+    bool mapped = cache->base != NULL && entry->body >= cache->base && entry->body < cache->base + cache->entry_count * cache->slot_size;
+
+    if (! mapped)
+    {
+        free((void *) entry->body);
+    }
+
+    entry->body = NULL;
+}
+
+// Entries written before a reboot are loaded stale: they're revalidated before use
+static void _urob_http_cache_load(urob_http_cache * cache)
+{
+    for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+    {
+        const urob_http_cache_slot * slot = (const urob_http_cache_slot *) (cache->base + entry_index * cache->slot_size);
+
+        if (slot->magic != UROB_HTTP_CACHE_MAGIC || slot->length > cache->config.max_body ||
+            memchr(slot->url, '\0', sizeof(slot->url)) == NULL || memchr(slot->etag, '\0', sizeof(slot->etag)) == NULL ||
+            memchr(slot->last_modified, '\0', sizeof(slot->last_modified)) == NULL)
+        {
+            continue;
+        }
+
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+        strcpy(entry->url, slot->url);
+        strcpy(entry->etag, slot->etag);
+        strcpy(entry->last_modified, slot->last_modified);
+        entry->body = (const uint8_t *) (slot + 1);
+        entry->length = slot->length;
+        entry->valid = true;
+        UROB_LOGI(TAG, "loaded %s, %u bytes", entry->url, (unsigned) entry->length);
+    }
+}
+
+void urob_http_cache_init(urob_http_cache * cache, const urob_http_cache_config * config)
+{
+    * cache = (urob_http_cache) {0};
+    cache->config = * config;
+    cache->entry_count = UROB_HTTP_CACHE_ENTRIES;
+
+#ifndef ESP_PLATFORM
+    cache->fd = -1;
+#endif
+
+    if (config->storage == UROB_HTTP_CACHE_FLASH)
+    {
+        if (! _urob_http_cache_map(cache) || ! _urob_http_cache_start_writer(cache))
+        {
+            ESP_LOGW(TAG, "flash storage unavailable, caching in ram");
+            urob_http_cache_uninit(cache);
+            cache->config = * config;
+            cache->config.storage = UROB_HTTP_CACHE_RAM;
+            cache->entry_count = UROB_HTTP_CACHE_ENTRIES;
+            return;
+        }
+
+        _urob_http_cache_load(cache);
+    }
+}
+
+void urob_http_cache_uninit(urob_http_cache * cache)
+{
+    _urob_http_cache_stop_writer(cache); // before the bodies it writes are freed
+
+    for (int entry_index = 0; entry_index < UROB_HTTP_CACHE_ENTRIES; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+        _urob_http_cache_free_body(cache, entry);
+        free(entry->staging);
+    }
+
+    if (cache->base != NULL)
+    {
+#ifdef ESP_PLATFORM
+        spi_flash_munmap(cache->handle);
+#else
+        munmap((void *) cache->base, cache->mapped);
+#endif
+    }
+
+#ifndef ESP_PLATFORM
+    if (cache->fd >= 0)
+    {
+        close(cache->fd);
+    }
+#endif
+
+    * cache = (urob_http_cache) {0};
+}
+
+void urob_http_cache_loop(urob_http_cache * cache)
+{
+    for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+
+        if (! entry->committing)
+        {
+            continue;
+        }
+
+        int state = atomic_load_explicit(&entry->commit_state, memory_order_acquire);
+        if (state == HTTP_CACHE_COMMIT_QUEUED)
+        {
+            continue;
+        }
+
+        entry->committing = false;
+        atomic_store_explicit(&entry->commit_state, HTTP_CACHE_COMMIT_NONE, memory_order_relaxed);
+
+        // Kept on the heap then
+        _chk(state == HTTP_CACHE_COMMIT_FAILED, continue, "unable to store %s in flash", entry->url);
+
+        // The mapping has the same bytes from now on, bodies are only read within a loop call
+        _urob_http_cache_free_body(cache, entry);
+        entry->body = cache->base + (entry - cache->entries) * cache->slot_size + sizeof(urob_http_cache_slot);
+        UROB_LOGI(TAG, "stored %s in flash", entry->url);
+    }
+}
+
+static urob_http_cache_entry * _urob_http_cache_find(urob_http_cache * cache, const char * url)
+{
+    for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+        if (entry->valid && strcmp(entry->url, url) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// The least recently used entry that can be replaced, NULL if all are busy
+static urob_http_cache_entry * _urob_http_cache_pick(urob_http_cache * cache)
+{
+    urob_http_cache_entry * pick = NULL;
+    uint32_t now = _urob_http_cache_now_s();
+
+    for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++)
+    {
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+
+        if (entry->readers > 0 || entry->storing || entry->committing)
+        {
+            continue;
+        }
+
+        if (! entry->valid)
+        {
+            return entry;
+        }
+
+        if (pick == NULL || now - entry->used_s > now - pick->used_s)
+        {
+            pick = entry;
+        }
+    }
+
+    return pick;
+}
+
+static void _urob_http_cache_release(urob_http_cache_request * request)
+{
+    if (request->entry != NULL)
+    {
+        request->entry->readers --;
+        request->entry = NULL;
+    }
+}
+
+bool urob_http_cache_begin(urob_http_cache_request * request, const char * host, const char * path)
+{
+    urob_http_cache * cache = request->cache;
+    * request = (urob_http_cache_request) {.cache = cache, .max_age = -1};
+
+    int length = snprintf(request->url, sizeof(request->url), "%s%s", host, path);
+    if (length >= (int) sizeof(request->url))
+    {
+        request->url[0] = '\0'; // not cached
+        return false;
+    }
+
+    urob_http_cache_entry * entry = _urob_http_cache_find(cache, request->url);
+    if (entry == NULL)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_MISS, 1);
+        return false;
+    }
+
+    uint32_t now = _urob_http_cache_now_s();
+    entry->readers ++;
+    entry->used_s = now;
+    request->entry = entry;
+
+    if (entry->lifetime_s > 0 && now - entry->validated_s < entry->lifetime_s)
+    {
+        UROB_LOGI(TAG, "%s fresh, served from the cache", request->url);
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_FRESH, 1);
+        return true;
+    }
+
+    return false;
+}
+
+void urob_http_cache_validators(urob_http_cache_request * request, urob_payload * payload)
+{
+    urob_http_cache_entry * entry = request->entry;
+
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    if (entry->etag[0] != '\0')
+    {
+        urob_payload_printf(payload, "If-None-Match: %s\r\n", entry->etag);
+    }
+
+    if (entry->last_modified[0] != '\0')
+    {
+        urob_payload_printf(payload, "If-Modified-Since: %s\r\n", entry->last_modified);
+    }
+}
+
+// Seconds since the epoch of an IMF-fixdate (e.g. "Sun, 06 Nov 1994 08:49:37 GMT"), 0 if invalid
+static uint32_t _urob_http_cache_parse_date(const char * text)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4] = "";
+    int day, year, hour, minute, second;
+
+    if (sscanf(text, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6 || year < 1970)
+    {
+        return 0;
+    }
+
+    const char * found = strstr(months, month);
+    if (found == NULL || strlen(month) != 3 || (found - months) % 3 != 0)
+    {
+        return 0;
+    }
+
+    // Days since the epoch of a proleptic gregorian date
+    int month_index = (found - months) / 3 + 1;
+    int shifted_year = year - (month_index <= 2);
+    int era = shifted_year / 400;
+    int year_of_era = shifted_year - era * 400;
+    int day_of_year = (153 * (month_index + (month_index > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long days = era * 146097L + day_of_era - 719468;
+
+    return (uint32_t) (days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+static void _urob_http_cache_control(urob_http_cache_request * request, const char * value)
+{
+    while (* value != '\0')
+    {
+        while (* value == ' ' || * value == ',')
+        {
+            value ++;
+        }
+
+        if (strncasecmp(value, "no-store", 8) == 0)
+        {
+            request->no_store = true;
+        } else if (strncasecmp(value, "no-cache", 8) == 0)
+        {
+            request->no_cache = true;
+        } else if (strncasecmp(value, "max-age=", 8) == 0)
+        {
+            request->max_age = atol(value + 8);
+        }
+
+        const char * next = strchr(value, ',');
+        value = next != NULL ? next : value + strlen(value);
+    }
+}
+
+static void _urob_http_cache_validator(char * validator, const char * value, bool truncated)
+{
+    if (! truncated && strlen(value) < UROB_HTTP_CACHE_VALIDATOR_SIZE)
+    {
+        strcpy(validator, value);
+    }
+}
+
+void urob_http_cache_header(urob_http_cache_request * request, const char * line, bool truncated)
+{
+    const char * value = strchr(line, ':');
+    if (value == NULL)
+    {
+        return;
+    }
+
+    for (value ++; * value == ' '; value ++);
+
+    if (strncasecmp(line, "cache-control:", 14) == 0)
+    {
+        request->no_store |= truncated; // the directives can't be trusted
+        _urob_http_cache_control(request, value);
+    } else if (strncasecmp(line, "expires:", 8) == 0)
+    {
+        request->expires = _urob_http_cache_parse_date(value);
+    } else if (strncasecmp(line, "date:", 5) == 0)
+    {
+        request->date = _urob_http_cache_parse_date(value);
+    } else if (strncasecmp(line, "etag:", 5) == 0)
+    {
+        _urob_http_cache_validator(request->etag, value, truncated);
+    } else if (strncasecmp(line, "last-modified:", 14) == 0)
+    {
+        _urob_http_cache_validator(request->last_modified, value, truncated);
+    }
+}
+
+// Freshness lifetime given by the response, 0 when it must be revalidated before each use
+static uint32_t _urob_http_cache_lifetime(urob_http_cache_request * request)
+{
+    if (request->no_cache)
+    {
+        return 0;
+    }
+
+    if (request->max_age >= 0)
+    {
+        return (uint32_t) request->max_age;
+    }
+
+    // Both dates from the server's clock, none is needed here
+    return request->date != 0 && request->expires > request->date ? request->expires - request->date : 0;
+}
+
+// Drops an entry the server answered with a response that can't be stored
+static void _urob_http_cache_invalidate(urob_http_cache * cache, urob_http_cache_entry * entry)
+{
+    if (entry->readers > 0 || entry->committing)
+    {
+        return;
+    }
+
+    _urob_http_cache_free_body(cache, entry);
+    entry->valid = false;
+}
+
+bool urob_http_cache_response(urob_http_cache_request * request, int status, long content_length)
+{
+    urob_http_cache * cache = request->cache;
+    urob_http_cache_entry * entry = request->entry;
+
+    if (status == 304 && entry != NULL)
+    {
+        UROB_LOGI(TAG, "%s not modified, served from the cache", request->url);
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_REVALIDATED, 1);
+        entry->validated_s = _urob_http_cache_now_s();
+        entry->lifetime_s = _urob_http_cache_lifetime(request);
+
+        if (request->etag[0] != '\0') // may be updated by the server
+        {
+            strcpy(entry->etag, request->etag);
+        }
+
+        request->offset = 0;
+        return true;
+    }
+
+    // The body comes from the server
+    if (entry != NULL)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_MISS, 1);
+        _urob_http_cache_release(request);
+    }
+
+    bool storable = status == 200 && ! request->no_store && request->url[0] != '\0' &&
+        (_urob_http_cache_lifetime(request) > 0 || request->etag[0] != '\0' || request->last_modified[0] != '\0') &&
+        content_length <= (long) cache->config.max_body;
+
+    entry = _urob_http_cache_find(cache, request->url);
+    if (! storable)
+    {
+        if (entry != NULL)
+        {
+            _urob_http_cache_invalidate(cache, entry);
+        }
+        return false;
+    }
+
+    urob_http_cache_entry * store = entry != NULL && ! entry->storing && ! entry->committing ? entry : _urob_http_cache_pick(cache);
+    if (store == NULL)
+    {
+        UROB_LOGD(TAG, "no entry free to store %s", request->url);
+        return false;
+    }
+
+    // Sized to the body when known
+    size_t size = content_length >= 0 ? (size_t) content_length : cache->config.max_body;
+    store->staging = malloc(size > 0 ? size : 1);
+    _chk(store->staging == NULL, return false, "unable to allocate %u bytes for %s", (unsigned) size, request->url);
+
+    store->staged = 0;
+    store->storing = true;
+    request->store = store;
+    return false;
+}
+
+void urob_http_cache_store(urob_http_cache_request * request, const char * data, size_t length)
+{
+    urob_http_cache_entry * store = request->store;
+
+    if (store == NULL)
+    {
+        return;
+    }
+
+    if (length > request->cache->config.max_body - store->staged)
+    {
+        UROB_LOGD(TAG, "%s larger than %u bytes, not stored", request->url, (unsigned) request->cache->config.max_body);
+        free(store->staging);
+        store->staging = NULL;
+        store->storing = false;
+        request->store = NULL;
+        return;
+    }
+
+    memcpy(store->staging + store->staged, data, length);
+    store->staged += length;
+}
+
+const char * urob_http_cache_body(urob_http_cache_request * request, size_t * length)
+{
+    urob_http_cache_entry * entry = request->entry;
+
+    * length = entry->length - request->offset;
+    return (const char *) entry->body + request->offset; // read at each call, it moves to flash once written
+}
+
+void urob_http_cache_consume(urob_http_cache_request * request, size_t length)
+{
+    request->offset += length;
+    UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_BYTES_SERVED, length);
+}
+
+// Replaces the entry with the stored response
+static void _urob_http_cache_commit_stored(urob_http_cache * cache, urob_http_cache_request * request, urob_http_cache_entry * store)
+{
+    if (store->readers > 0) // the previous response is still being served
+    {
+        UROB_LOGD(TAG, "%s busy, not replaced", store->url);
+        free(store->staging);
+        store->staging = NULL;
+        return;
+    }
+
+    for (int entry_index = 0; entry_index < cache->entry_count; entry_index ++) // an older copy elsewhere
+    {
+        urob_http_cache_entry * entry = &cache->entries[entry_index];
+        if (entry != store && entry->valid && strcmp(entry->url, request->url) == 0)
+        {
+            _urob_http_cache_invalidate(cache, entry);
+        }
+    }
+
+    _urob_http_cache_free_body(cache, store);
+    strcpy(store->url, request->url);
+    strcpy(store->etag, request->etag);
+    strcpy(store->last_modified, request->last_modified);
+    store->length = store->staged;
+    store->validated_s = store->used_s = _urob_http_cache_now_s();
+    store->lifetime_s = _urob_http_cache_lifetime(request);
+    store->valid = true;
+
+    // Trimmed to the body, served from the heap (until it's in flash)
+    uint8_t * body = realloc(store->staging, store->staged > 0 ? store->staged : 1);
+    store->body = body != NULL ? body : store->staging;
+    store->staging = NULL;
+
+    if (cache->base != NULL)
+    {
+        store->slot = (urob_http_cache_slot) {.magic = UROB_HTTP_CACHE_MAGIC, .length = store->length};
+        strcpy(store->slot.url, store->url);
+        strcpy(store->slot.etag, store->etag);
+        strcpy(store->slot.last_modified, store->last_modified);
+
+        store->committing = true;
+        atomic_store_explicit(&store->commit_state, HTTP_CACHE_COMMIT_QUEUED, memory_order_release);
+        _urob_http_cache_wake_writer(cache);
+    }
+
+    UROB_LOGI(TAG, "stored %s, %u bytes, fresh for %us", store->url, (unsigned) store->length, (unsigned) store->lifetime_s);
+    UROB_METRICS_ADD(UROB_METRICS_HTTP_CACHE_STORED, 1);
+}
+
+void urob_http_cache_end(urob_http_cache_request * request, bool complete)
+{
+    urob_http_cache_entry * store = request->store;
+
+    if (store != NULL)
+    {
+        store->storing = false;
+
+        if (complete)
+        {
+            _urob_http_cache_commit_stored(request->cache, request, store);
+        } else
+        {
+            free(store->staging);
+            store->staging = NULL;
+        }
+
+        request->store = NULL;
+    }
+
+    _urob_http_cache_release(request);
+}
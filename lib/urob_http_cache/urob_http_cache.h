@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HTTP_CACHE_H__
+#define __UROB_HTTP_CACHE_H__
+
+#include "urob_payload.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+#define UROB_HTTP_CACHE_ENTRIES (4)
+#define UROB_HTTP_CACHE_URL_SIZE (96) // host followed by the path, longer ones aren't cached
+#define UROB_HTTP_CACHE_VALIDATOR_SIZE (64) // etag or last-modified date, longer ones aren't used
+#define UROB_HTTP_CACHE_SECTOR_SIZE (4096) // flash slots are made of whole sectors
+#define UROB_HTTP_CACHE_MAGIC (0x31434855) // "UHC1"
+#define UROB_HTTP_CACHE_WRITER_STACK_SIZE (4096)
+#define UROB_HTTP_CACHE_WRITER_PRIORITY (tskIDLE_PRIORITY + 1) // like the download writer, it blocks on flash anyway
+
+// Response cache for urob_http_client (see urob_http_client_set_cache): GET responses are stored per
+// url while they're received, following Cache-Control (max-age, no-cache, no-store) or Expires.
+// Fresh entries are served without a request; stale ones are revalidated with If-None-Match /
+// If-Modified-Since, and a 304 is answered with the stored body.
+// @discussion a cache belongs to a single loop (shard), like the clients using it
+
+typedef enum
+{
+    UROB_HTTP_CACHE_RAM = 0, // bodies on the heap, lost at reboot
+    UROB_HTTP_CACHE_FLASH // bodies in a data partition, kept (but stale) across reboots
+} urob_http_cache_storage;
+
+typedef struct
+{
+    urob_http_cache_storage storage;
+    size_t max_body; // larger bodies aren't stored
+    const char * target; // flash: data partition label on the esp32, file path on the host
+} urob_http_cache_config;
+
+typedef enum
+{
+    HTTP_CACHE_COMMIT_NONE = 0,
+    HTTP_CACHE_COMMIT_QUEUED, // owned by the writer
+    HTTP_CACHE_COMMIT_WRITTEN,
+    HTTP_CACHE_COMMIT_FAILED
+} urob_http_cache_commit_state;
+
+// Start of each flash slot, the body follows. Written last, so a slot is valid only once complete
+typedef struct
+{
+    uint32_t magic;
+    uint32_t length;
+    char url[UROB_HTTP_CACHE_URL_SIZE];
+    char etag[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+    char last_modified[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+} urob_http_cache_slot;
+
+typedef struct
+{
+    bool valid;
+    char url[UROB_HTTP_CACHE_URL_SIZE];
+    char etag[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+    char last_modified[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+    const uint8_t * body; // on the heap, or in the partition's mapping
+    size_t length;
+
+    uint32_t validated_s; // last response of the server, fresh until lifetime_s after it
+    uint32_t lifetime_s;
+    uint32_t used_s; // the least recently used entry is replaced
+    int readers; // requests serving the body, the entry isn't replaced meanwhile
+
+    // Response being stored, it replaces the entry once complete
+    bool storing;
+    uint8_t * staging;
+    size_t staged;
+
+    // Flash: the body and slot are left to the writer until it's done, the entry isn't replaced meanwhile
+    bool committing;
+    urob_http_cache_slot slot; // header as it was stored, the loop may update the entry's etag
+    atomic_int commit_state;
+} urob_http_cache_entry;
+
+typedef struct
+{
+    urob_http_cache_config config;
+    urob_http_cache_entry entries[UROB_HTTP_CACHE_ENTRIES];
+    int entry_count; // fewer than UROB_HTTP_CACHE_ENTRIES if the partition is small
+    size_t slot_size;
+
+    const uint8_t * base; // mapping of the partition, NULL with ram storage
+#ifdef ESP_PLATFORM
+    const esp_partition_t * partition;
+    spi_flash_mmap_handle_t handle;
+#else
+    int fd;
+    size_t mapped;
+#endif
+
+    // Writer, erases and writes the slots in its own task so that the loop never waits for flash
+    atomic_bool stop;
+    atomic_bool writer_running;
+#ifdef ESP_PLATFORM
+    TaskHandle_t writer;
+#else
+    pthread_t writer;
+    sem_t wake;
+#endif
+} urob_http_cache;
+
+void urob_http_cache_init(urob_http_cache * cache, const urob_http_cache_config * config);
+void urob_http_cache_uninit(urob_http_cache * cache);
+
+// Serves the bodies the writer has stored in flash from the mapping, it doesn't block
+void urob_http_cache_loop(urob_http_cache * cache);
+
+// State of a request going through the cache, kept by the client
+typedef struct
+{
+    urob_http_cache * cache;
+    urob_http_cache_entry * entry; // stored response for the url (being read), NULL on a miss
+    urob_http_cache_entry * store; // entry the response is stored in, NULL if not stored
+    char url[UROB_HTTP_CACHE_URL_SIZE];
+    size_t offset; // body served from the entry
+
+    // Response headers
+    bool no_store;
+    bool no_cache;
+    long max_age; // -1 if not given
+    uint32_t date; // seconds since the epoch, 0 if not given
+    uint32_t expires;
+    char etag[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+    char last_modified[UROB_HTTP_CACHE_VALIDATOR_SIZE];
+} urob_http_cache_request;
+
+// Looks the url up before the request, request->cache is set by the caller
+// @return true if the entry is fresh, and is served without a request
+bool urob_http_cache_begin(urob_http_cache_request * request, const char * host, const char * path);
+
+// Appends the conditional request headers of a stale entry (If-None-Match, If-Modified-Since)
+void urob_http_cache_validators(urob_http_cache_request * request, urob_payload * payload);
+
+// A response header line, as received
+// @param truncated the line didn't fit the client's buffer: its validators are ignored, and a
+// Cache-Control header is taken as no-store
+void urob_http_cache_header(urob_http_cache_request * request, const char * line, bool truncated);
+
+// At the end of the headers
+// @return true if the body is to be served from the entry instead (the response was a 304)
+bool urob_http_cache_response(urob_http_cache_request * request, int status, long content_length);
+
+// Body of the response as it's consumed, stored if cacheable
+void urob_http_cache_store(urob_http_cache_request * request, const char * data, size_t length);
+
+// The stored body from offset, advanced with urob_http_cache_consume
+const char * urob_http_cache_body(urob_http_cache_request * request, size_t * length);
+void urob_http_cache_consume(urob_http_cache_request * request, size_t length);
+
+// Ends the request: a stored response replaces the entry if complete, and is dropped otherwise
+void urob_http_cache_end(urob_http_cache_request * request, bool complete);
+
+#endif // __UROB_HTTP_CACHE_H__
@@ -22,6 +22,14 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "urob_http_client.h"
+#include "urob_metrics.h"
+#include "urob_payload.h"
+#include "urob_teardown.h"
+#include "urob_trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
@@ -34,11 +42,13 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define TAG "http client"
 #include "general.h"
 
-static char header_format_string[] = "GET / HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n";
+static char header_format_string[] = "GET %s HTTP/1.1\r\nHost: %s\r\n%s";
+static char header_end_string[] = "Connection: close\r\n\r\n"; // after the cache's conditional headers
 
 void _urob_http_client_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
 {
-    ESP_LOGD(TAG, "Connection event: %d", evt);
+    UROB_TRACE_EVENT(UROB_TRACE_HTTP_CLIENT, conn, evt, len);
+    UROB_LOGD(TAG, "Connection event: %d", evt);
 }
 
 void urob_http_client_init(urob_http_client * client, ip_addr_t * address, int port)
@@ -50,6 +60,45 @@ void urob_http_client_init(urob_http_client * client, ip_addr_t * address, int p
 
     netconn_set_flags(client->conn, NETCONN_FLAG_NON_BLOCKING);
     client->state = CLIENT_STATE_INIT;
+
+    client->body_state = CLIENT_BODY_STATE_HEADERS;
+    client->status = 0;
+    client->chunked = false;
+    client->content_length = -1;
+    client->line_length = 0;
+    client->cache_request = (urob_http_cache_request) {0};
+    client->from_cache = false;
+    client->preconnect = NULL;
+    client->tls_context = NULL;
+    client->tls = (urob_tls) {0};
+}
+
+void urob_http_client_set_request(urob_http_client * client, const char * host, const char * path, const char * headers)
+{
+    client->host = host;
+    client->path = path;
+    client->headers = headers;
+}
+
+void urob_http_client_set_cache(urob_http_client * client, urob_http_cache * cache)
+{
+    client->cache_request.cache = cache;
+}
+
+void urob_http_client_set_preconnect(urob_http_client * client, urob_preconnect * pool)
+{
+    client->preconnect = pool;
+}
+
+void urob_http_client_set_tls(urob_http_client * client, urob_tls_context * context)
+{
+    client->tls_context = context;
+}
+
+void urob_http_client_set_body_callback(urob_http_client * client, urob_http_client_body_fn body, void * arg)
+{
+    client->body = body;
+    client->body_arg = arg;
 }
 
 // Assumes the client is initialized (no additional checks)
@@ -59,7 +108,7 @@ static void _urob_http_client_connect(urob_http_client * client)
     client->err = netconn_connect(client->conn, &client->address, client->port);
     if (client->err == ERR_INPROGRESS || client->err == ERR_ALREADY || client->err == ERR_OK)
     {
-        ESP_LOGD(TAG, "connection in progress.."); // may need to throttle this log
+        UROB_LOGD(TAG, "connection in progress..");
         client->err = ERR_OK;
         client->state = CLIENT_STATE_CONNECTING;
     } else
@@ -69,16 +118,35 @@ static void _urob_http_client_connect(urob_http_client * client)
     }
 }
 
+static const char * _urob_http_client_host(urob_http_client * client)
+{
+    return client->host != NULL ? client->host : ipaddr_ntoa(&client->address);
+}
+
+// The request follows, or the tls handshake first
+static void _urob_http_client_connected(urob_http_client * client)
+{
+    if (client->tls_context == NULL)
+    {
+        client->state = CLIENT_STATE_CONNECTED;
+        return;
+    }
+
+    urob_tls_init(&client->tls, client->tls_context, _urob_http_client_host(client));
+    urob_tls_bind(&client->tls, client->conn);
+    client->state = CLIENT_STATE_HANDSHAKING;
+}
+
 static void _urob_http_client_connecting(urob_http_client * client)
 {
     if (client->conn->state == NETCONN_NONE) {
-        ESP_LOGI(TAG, "connected to host");
-        client->state = CLIENT_STATE_CONNECTED;
+        UROB_LOGI(TAG, "connected to host");
+        _urob_http_client_connected(client);
     } else if (client->conn->state == NETCONN_CLOSE) { //Not sure this is the right state after a connection timeout, should check the value from the callback instead
         ESP_LOGE(TAG, "connection closed");
         client->state = CLIENT_STATE_ERROR;
     } else {
-         ESP_LOGD(TAG, "connection state: %d", client->conn->state);
+         UROB_LOGD_LIMITED(1000, 1, TAG, "connection state: %d", client->conn->state);
     }
 }
 
@@ -87,14 +155,25 @@ static void _urob_http_client_set_message(urob_http_client * client, char * form
     if (client->message)
     {
         ESP_LOGW(TAG, "client already has message, replacing");
-        free(client->message);
+        pbuf_free(client->message);
     }
 
+    urob_payload payload;
+    urob_payload_init(&payload, PBUF_RAM);
+
     va_list vars;
     va_start(vars, format);
-    client->msg_len = vasprintf(&client->message, format, vars);
+    urob_payload_vprintf(&payload, format, vars);
     va_end(vars);
 
+    if (client->cache_request.cache != NULL)
+    {
+        urob_http_cache_validators(&client->cache_request, &payload);
+    }
+    urob_payload_append_string(&payload, header_end_string);
+
+    client->msg_len = payload.length;
+    client->message = urob_payload_take(&payload);
     client->msg_written = 0;
 }
 
@@ -103,55 +182,333 @@ static void _urob_http_client_send_request(urob_http_client * client)
 {
     if (client->message == NULL) // create request
     {
-        _urob_http_client_set_message(client, header_format_string, "ipwho.is");
-        _chk(client->msg_len == -1, client->state = CLIENT_STATE_ERROR, "Error creating message");
+        _urob_http_client_set_message(client, header_format_string,
+            client->path != NULL ? client->path : "/",
+            _urob_http_client_host(client),
+            client->headers != NULL ? client->headers : "");
+        _chk(client->message == NULL, client->state = CLIENT_STATE_ERROR; return, "Error creating message");
     }
 
-    ESP_LOGI(TAG, "sending request");
+    UROB_LOGD(TAG, "sending request");
     size_t bytes_written = 0;
-    // Don't copy, don't block
-    client->err = netconn_write_partly(
-        client->conn, client->message, client->msg_len + client->msg_written, NETCONN_DONTBLOCK, &bytes_written);
+    if (client->tls_context != NULL) // encrypted into the session's record buffer
+    {
+        client->err = urob_tls_write_chain(&client->tls, client->message, client->msg_written, client->msg_len - client->msg_written, &bytes_written);
+    } else // don't copy, don't block
+    {
+        client->err = urob_payload_write(client->conn, client->message, client->msg_written, NETCONN_DONTBLOCK, &bytes_written);
+    }
+    if (client->err == ERR_WOULDBLOCK) // send buffer full, retried in the next iteration
+    {
+        client->err = ERR_OK;
+    }
+
     _chk(client->err != ERR_OK && client->err != ERR_INPROGRESS, client->state = CLIENT_STATE_ERROR, "error sending request: %d", client->err);
 
     client->msg_written += bytes_written;
-    ESP_LOGD(TAG, "%d/%d bytes sent", client->msg_written, client->msg_len);
+    UROB_METRICS_ADD(UROB_METRICS_HTTP_CLIENT_BYTES_SENT, bytes_written);
+    UROB_LOGD(TAG, "%u/%u bytes sent", (unsigned) client->msg_written, (unsigned) client->msg_len);
 
     if (client->msg_written == client->msg_len)
     {
-        ESP_LOGI(TAG, "request sent, waiting for response");
+        UROB_LOGI(TAG, "request sent, waiting for response");
         client->state = CLIENT_STATE_WAIT_RESP;
     }
 }
 
+static void _urob_http_client_header_line(urob_http_client * client)
+{
+    client->line[client->line_length] = '\0';
+
+    if (client->status == 0 && strncmp(client->line, "HTTP/", 5) == 0)
+    {
+        const char * code = strchr(client->line, ' ');
+        client->status = code ? atoi(code + 1) : 0;
+    } else if (strncasecmp(client->line, "content-length:", 15) == 0)
+    {
+        client->content_length = atol(client->line + 15);
+    } else if (strncasecmp(client->line, "transfer-encoding:", 18) == 0 && strstr(client->line + 18, "chunked") != NULL)
+    {
+        client->chunked = true;
+    } else if (client->cache_request.cache != NULL)
+    {
+        urob_http_cache_header(&client->cache_request, client->line, client->line_length == UROB_HTTP_CLIENT_LINE_SIZE - 1);
+    }
+}
+
+// The body of a fresh (or revalidated) cache entry goes through the body callback as if received
+static void _urob_http_client_from_cache(urob_http_client * client)
+{
+    size_t length = 0;
+    urob_http_cache_body(&client->cache_request, &length);
+
+    client->from_cache = true;
+    client->status = 200;
+    client->chunked = false;
+    client->content_length = client->remaining = length;
+    client->body_state = length > 0 ? CLIENT_BODY_STATE_DATA : CLIENT_BODY_STATE_DONE;
+    client->state = CLIENT_STATE_CACHED;
+}
+
+static void _urob_http_client_headers_done(urob_http_client * client)
+{
+    UROB_LOGD(TAG, "status: %d, content length: %ld, chunked: %d", client->status, client->content_length, client->chunked);
+
+    if (client->cache_request.cache != NULL &&
+        urob_http_cache_response(&client->cache_request, client->status, client->chunked ? -1 : client->content_length))
+    {
+        _urob_http_client_from_cache(client);
+    } else if (client->chunked)
+    {
+        client->body_state = CLIENT_BODY_STATE_CHUNK_SIZE;
+    } else
+    {
+        client->remaining = client->content_length; // -1: until the server closes
+        client->body_state = client->content_length == 0 ? CLIENT_BODY_STATE_DONE : CLIENT_BODY_STATE_DATA;
+    }
+}
+
+// Reads a line (headers, chunk sizes and trailers) a character at a time
+// @return true when c ends a line, which is in client->line
+static bool _urob_http_client_line(urob_http_client * client, char c)
+{
+    if (c == '\n')
+    {
+        client->line[client->line_length] = '\0';
+        return true;
+    }
+
+    if (c != '\r' && client->line_length < UROB_HTTP_CLIENT_LINE_SIZE - 1)
+    {
+        client->line[client->line_length ++] = c;
+    }
+
+    return false;
+}
+
+// @return bytes consumed, less than length if the body callback didn't take everything
+static size_t _urob_http_client_parse(urob_http_client * client, const char * data, size_t length)
+{
+    size_t index = 0;
+
+    while (index < length && client->body_state != CLIENT_BODY_STATE_DONE)
+    {
+        if (client->body_state == CLIENT_BODY_STATE_DATA)
+        {
+            // Passed on without copies, as much as belongs to the body (or the chunk)
+            size_t available = length - index;
+            size_t slice = client->remaining >= 0 && (size_t) client->remaining < available ? (size_t) client->remaining : available;
+
+            if (client->body != NULL)
+            {
+                slice = client->body(client, data + index, slice, client->body_arg);
+            }
+
+            if (slice == 0) // the callback isn't ready
+            {
+                break;
+            }
+
+            if (! client->from_cache)
+            {
+                urob_http_cache_store(&client->cache_request, data + index, slice);
+            }
+
+            index += slice;
+            if (client->remaining >= 0)
+            {
+                client->remaining -= slice;
+                if (client->remaining == 0)
+                {
+                    client->body_state = client->chunked ? CLIENT_BODY_STATE_CHUNK_END : CLIENT_BODY_STATE_DONE;
+                }
+            }
+            continue;
+        }
+
+        if (! _urob_http_client_line(client, data[index ++]))
+        {
+            continue;
+        }
+
+        switch (client->body_state)
+        {
+            case CLIENT_BODY_STATE_HEADERS:
+                if (client->line_length == 0)
+                {
+                    _urob_http_client_headers_done(client);
+                    if (client->from_cache) // the rest of a 304 is discarded
+                    {
+                        client->line_length = 0;
+                        return index;
+                    }
+                } else
+                {
+                    _urob_http_client_header_line(client);
+                }
+            break;
+            case CLIENT_BODY_STATE_CHUNK_SIZE:
+                client->remaining = strtol(client->line, NULL, 16); // extensions after ';' are ignored
+                client->body_state = client->remaining > 0 ? CLIENT_BODY_STATE_DATA : CLIENT_BODY_STATE_TRAILER;
+            break;
+            case CLIENT_BODY_STATE_CHUNK_END:
+                client->body_state = CLIENT_BODY_STATE_CHUNK_SIZE;
+            break;
+            case CLIENT_BODY_STATE_TRAILER:
+                if (client->line_length == 0)
+                {
+                    client->body_state = CLIENT_BODY_STATE_DONE;
+                }
+            break;
+            default:
+            break;
+        }
+
+        client->line_length = 0;
+    }
+
+    return index;
+}
+
+static void _urob_http_client_response_done(urob_http_client * client)
+{
+    UROB_LOGI(TAG, "response received: %d%s", client->status, client->from_cache ? " (cached)" : "");
+    UROB_METRICS_ADD(UROB_METRICS_HTTP_CLIENT_RESPONSES, 1);
+    urob_http_cache_end(&client->cache_request, true);
+    client->state = CLIENT_STATE_RESP_RECVD;
+}
+
 // Assumes the request was sent
 static void _urob_http_client_recv_response(urob_http_client * client)
 {
-    struct pbuf * recv_pbuf = NULL;
-    client->err = netconn_recv_tcp_pbuf_flags(client->conn, &recv_pbuf, NETCONN_DONTBLOCK);
+    if (client->input == NULL)
+    {
+        if (client->tls_context != NULL) // decrypted in a pbuf of its own
+        {
+            client->err = urob_tls_recv(&client->tls, &client->input);
+        } else
+        {
+            client->err = netconn_recv_tcp_pbuf_flags(client->conn, &client->input, NETCONN_DONTBLOCK);
+        }
+
+        if (client->err == ERR_WOULDBLOCK || client->err == ERR_INPROGRESS)
+        {
+            client->input = NULL;
+            client->err = ERR_OK;
+            return;
+        }
+
+        if (client->err == ERR_CLSD) // the server closed the connection
+        {
+            client->input = NULL;
+            bool until_close = client->body_state == CLIENT_BODY_STATE_DATA && client->remaining < 0;
+            _chk(! until_close, return, "connection closed before the end of the response");
+
+            client->err = ERR_OK;
+            _urob_http_client_response_done(client);
+            return;
+        }
+
+        _chk(client->err != ERR_OK, client->input = NULL; return, "error receiving response: %d", client->err);
+
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CLIENT_BYTES_RECEIVED, client->input->tot_len);
+        UROB_LOGD(TAG, "Received data: len:%d tot_len: %d", client->input->len, client->input->tot_len);
+        client->input_offset = 0;
+    }
+
+    // Segment by segment, from where the body callback stopped
+    size_t segment_start = 0;
 
-    if (client->err == ERR_WOULDBLOCK || client->err == ERR_INPROGRESS)
+    for (struct pbuf * segment = client->input; segment != NULL && client->body_state != CLIENT_BODY_STATE_DONE; segment = segment->next)
     {
-        client->err = ERR_OK;
+        if (client->input_offset >= segment_start + segment->len)
+        {
+            segment_start += segment->len;
+            continue;
+        }
+
+        const char * data = (const char *) segment->payload + (client->input_offset - segment_start);
+        size_t length = segment_start + segment->len - client->input_offset;
+        ESP_LOGV(TAG, "<%.*s>", (int) length, data);
+
+        size_t consumed = _urob_http_client_parse(client, data, length);
+        client->input_offset += consumed;
+
+        if (client->from_cache) // the body comes from the cache from now on
+        {
+            break;
+        }
+
+        if (consumed < length && client->body_state != CLIENT_BODY_STATE_DONE)
+        {
+            return; // kept until the body callback is ready, the tcp window closes meanwhile
+        }
+
+        segment_start += segment->len;
     }
 
-    _chk(client->err != ERR_OK, return, "error receiving response: %d", client->err);
+    pbuf_free(client->input);
+    client->input = NULL;
 
-    if (recv_pbuf != NULL)
+    if (client->body_state == CLIENT_BODY_STATE_DONE)
     {
-        //TODO: this would be the perfect place for a callback to send to the client
-        ESP_LOGD(TAG, "Received data: len:%d tot_len: %d <%.*s>",
-            recv_pbuf->len, recv_pbuf->tot_len, recv_pbuf->len, (char *)recv_pbuf->payload);
+        _urob_http_client_response_done(client);
+    }
+}
+
+// A fresh cache entry skips the connection, a ready one skips connecting
+static void _urob_http_client_start(urob_http_client * client)
+{
+    const char * host = _urob_http_client_host(client);
 
-        pbuf_free(recv_pbuf);
+    if (client->cache_request.cache != NULL &&
+        urob_http_cache_begin(&client->cache_request, host, client->path != NULL ? client->path : "/"))
+    {
+        _urob_http_client_from_cache(client);
+        return;
+    }
 
-        // TODO: how to detect the message terminated?
-        ESP_LOGI(TAG, "message received");
-        client->state = CLIENT_STATE_RESP_RECVD;
+    struct netconn * conn = client->preconnect != NULL ? urob_preconnect_take(client->preconnect, host, client->port) : NULL;
+    if (conn != NULL)
+    {
+        ESP_LOGI(TAG, "connected to host %s (preconnected)", host);
+        netconn_delete(client->conn); // never connected
+        client->conn = conn;
+        _urob_http_client_connected(client);
+        return;
     }
+
+    _urob_http_client_connect(client);
 }
 
-void urob_http_client_loop(urob_http_client * client)
+static void _urob_http_client_handshake(urob_http_client * client)
+{
+    err_t err = urob_tls_handshake(&client->tls);
+
+    if (err == ERR_OK)
+    {
+        client->state = CLIENT_STATE_CONNECTED;
+    } else if (err != ERR_INPROGRESS)
+    {
+        client->err = err;
+    }
+}
+
+static void _urob_http_client_send_cached(urob_http_client * client)
+{
+    size_t length = 0;
+    const char * data = urob_http_cache_body(&client->cache_request, &length);
+
+    size_t consumed = _urob_http_client_parse(client, data, length);
+    urob_http_cache_consume(&client->cache_request, consumed);
+
+    if (client->body_state == CLIENT_BODY_STATE_DONE)
+    {
+        _urob_http_client_response_done(client);
+    }
+}
+
+static void _urob_http_client_loop(urob_http_client * client)
 {
     switch (client->state)
     {
@@ -163,16 +520,22 @@ void urob_http_client_loop(urob_http_client * client)
             urob_http_client_uninit(client);
         break;
         case CLIENT_STATE_INIT:
-            _urob_http_client_connect(client);
+            UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_CONNECT, _urob_http_client_start(client));
         break;
         case CLIENT_STATE_CONNECTING:
-            _urob_http_client_connecting(client);
+            UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_CONNECT, _urob_http_client_connecting(client));
+        break;
+        case CLIENT_STATE_HANDSHAKING:
+            UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_CONNECT, _urob_http_client_handshake(client));
         break;
         case CLIENT_STATE_CONNECTED:
-            _urob_http_client_send_request(client);
+            UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_SEND, _urob_http_client_send_request(client));
         break;
         case CLIENT_STATE_WAIT_RESP:
-            _urob_http_client_recv_response(client);
+            UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_RECEIVE, _urob_http_client_recv_response(client));
+        break;
+        case CLIENT_STATE_CACHED:
+            _urob_http_client_send_cached(client);
         break;
         case CLIENT_STATE_RESP_RECVD:
             //urob_http_client_uninit(client);
@@ -185,10 +548,18 @@ void urob_http_client_loop(urob_http_client * client)
     if (client->err != ERR_OK && client->err != ERR_INPROGRESS)
     {
         ESP_LOGE(TAG, "netconn error %d", client->err);
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_CLIENT_ERRORS, 1);
         client->state = CLIENT_STATE_ERROR;
     }
 }
 
+void urob_http_client_loop(urob_http_client * client)
+{
+    urob_http_client_state state = client->state;
+    UROB_TRACE_LOOP(UROB_TRACE_HTTP_CLIENT, client->conn, UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_LOOP, _urob_http_client_loop(client)));
+    UROB_TRACE_STATE(UROB_TRACE_HTTP_CLIENT, client->conn, state, client->state);
+}
+
 
 void urob_http_client_uninit(urob_http_client * client)
 {
@@ -201,10 +572,26 @@ void urob_http_client_uninit(urob_http_client * client)
 
     if (client->message)
     {
-        free(client->message);
+        pbuf_free(client->message);
     }
 
-    if (client->conn)
+    if (client->input)
+    {
+        pbuf_free(client->input);
+    }
+
+    urob_http_cache_end(&client->cache_request, false); // no-op once the response is done
+
+    if (client->tls.context != NULL) // the session was started
+    {
+        urob_tls_close(&client->tls);
+        urob_tls_uninit(&client->tls);
+    }
+
+    if (client->conn && client->state == CLIENT_STATE_ERROR)
+    {
+        urob_teardown_abort(client->conn);
+    } else if (client->conn)
     {
         netconn_delete(client->conn);
     }
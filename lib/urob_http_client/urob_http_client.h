@@ -26,21 +26,48 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "lwip/ip_addr.h"
 #include "lwip/err.h"
+#include "urob_http_cache.h"
+#include "urob_preconnect.h"
+#include "urob_tls.h"
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct pbuf;
 
 typedef enum
 {
   CLIENT_STATE_NONE = 0,
   CLIENT_STATE_INIT, // also handles ongoing connection
   CLIENT_STATE_CONNECTING,
+  CLIENT_STATE_HANDSHAKING, // https only, see urob_http_client_set_tls
   CLIENT_STATE_CONNECTED,
   CLIENT_STATE_SENDING_REQ,
   CLIENT_STATE_WAIT_RESP,
+  CLIENT_STATE_CACHED, // body served from the cache
   CLIENT_STATE_RESP_RECVD,
   CLIENT_STATE_ERROR
 } urob_http_client_state;
 
-typedef struct
+#define UROB_HTTP_CLIENT_LINE_SIZE (96) // longest response header (or chunk size) line inspected, e.g. an etag
+
+typedef enum
+{
+  CLIENT_BODY_STATE_HEADERS = 0,
+  CLIENT_BODY_STATE_DATA, // plain body, or data of a chunk
+  CLIENT_BODY_STATE_CHUNK_SIZE,
+  CLIENT_BODY_STATE_CHUNK_END, // crlf after the data of a chunk
+  CLIENT_BODY_STATE_TRAILER,
+  CLIENT_BODY_STATE_DONE
+} urob_http_client_body_state;
+
+struct _urob_http_client;
+
+// Receives the response body a slice at a time (chunked encoding already removed), as it arrives
+// @return bytes consumed: the rest is passed again at the next loop, and nothing else is received meanwhile
+typedef size_t (* urob_http_client_body_fn)(struct _urob_http_client * client, const char * data, size_t length, void * arg);
+
+typedef struct _urob_http_client
 {
   struct netconn * conn; //TODO: no uninit/destroy
   err_t err;
@@ -48,14 +75,58 @@ typedef struct
   ip_addr_t address;
   int port;
 
+  // Request, see urob_http_client_set_request
+  const char * host;
+  const char * path;
+  const char * headers;
+
   //message handling section
-  char * message;
-  int msg_len;
+  struct pbuf * message; // built with urob_payload
+  size_t msg_len;
   size_t msg_written;
+
+  //response section
+  urob_http_client_body_fn body;
+  void * body_arg;
+  urob_http_client_body_state body_state;
+  int status;
+  bool chunked;
+  long content_length; // -1 until known
+  long remaining; // in the body, or in the current chunk
+  char line[UROB_HTTP_CLIENT_LINE_SIZE];
+  int line_length;
+  struct pbuf * input; // received, not consumed yet
+  size_t input_offset;
+
+  urob_http_cache_request cache_request; // unused if its cache is NULL
+  bool from_cache; // the body comes from the cache, reported with a 200 status
+  urob_preconnect * preconnect; // optional
+
+  urob_tls_context * tls_context; // NULL for plain http
+  urob_tls tls; // session over conn once connected, when there's a context
 } urob_http_client;
 
 void urob_http_client_init(urob_http_client * client, ip_addr_t * address, int port);
 void urob_http_client_uninit(urob_http_client * client);
+
+// GETs path from host, with additional headers (each terminated by "\r\n", e.g. a Range) if not NULL
+// @discussion the strings are used when the request is sent, and must stay valid until then; the
+// default is "/" from the address
+void urob_http_client_set_request(urob_http_client * client, const char * host, const char * path, const char * headers);
+
+// The body is discarded when no callback is set
+void urob_http_client_set_body_callback(urob_http_client * client, urob_http_client_body_fn body, void * arg);
+
+// Goes through cache (see urob_http_cache), before the first loop
+void urob_http_client_set_cache(urob_http_client * client, urob_http_cache * cache);
+
+// Starts from a ready connection of pool when there's one to the host and port (see urob_preconnect)
+void urob_http_client_set_preconnect(urob_http_client * client, urob_preconnect * pool);
+
+// Sends the request over https, before the first loop: the session is negotiated with context's configuration,
+// resuming the last one of the host if the context kept it (see urob_tls_context)
+void urob_http_client_set_tls(urob_http_client * client, urob_tls_context * context);
+
 void urob_http_client_loop(urob_http_client * client);
 
 #endif //__UROB_HTTP_CLIENT_H__
\ No newline at end of file
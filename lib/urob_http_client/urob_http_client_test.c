@@ -22,11 +22,38 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "urob_http_client_test.h"
+#include "urob_metrics.h"
+#include "urob_trace.h"
 #include <esp_log.h>
 
 #define TAG "http client test"
 #include "general.h"
 
+static const urob_json_field _location_fields[] =
+{
+    UROB_JSON_FIELD(urob_http_client_test_location, ip, "ip", UROB_JSON_FIELD_STRING),
+    UROB_JSON_FIELD(urob_http_client_test_location, success, "success", UROB_JSON_FIELD_BOOL),
+    UROB_JSON_FIELD(urob_http_client_test_location, country, "country", UROB_JSON_FIELD_STRING),
+    UROB_JSON_FIELD(urob_http_client_test_location, city, "city", UROB_JSON_FIELD_STRING),
+    UROB_JSON_FIELD(urob_http_client_test_location, latitude, "latitude", UROB_JSON_FIELD_DOUBLE),
+    UROB_JSON_FIELD(urob_http_client_test_location, longitude, "longitude", UROB_JSON_FIELD_DOUBLE),
+    UROB_JSON_FIELD(urob_http_client_test_location, isp, "connection.isp", UROB_JSON_FIELD_STRING),
+};
+
+// Body slices go straight from the received pbufs to the parser, nothing is buffered
+static size_t _urob_http_client_test_body(urob_http_client * client, const char * data, size_t length, void * arg)
+{
+    urob_http_client_test * http_client_test = (urob_http_client_test *) arg;
+    err_t err = urob_json_feed(&http_client_test->json, data, length);
+
+    if (err != ERR_OK)
+    {
+        ESP_LOGE(TAG, "invalid json response: %d", err);
+    }
+
+    return length;
+}
+
 void urob_http_client_test_init(urob_http_client_test * http_client_test)
 {
     * http_client_test = (urob_http_client_test) {0};
@@ -34,6 +61,21 @@ void urob_http_client_test_init(urob_http_client_test * http_client_test)
     http_client_test->state = HTTP_CLIENT_TEST_STATE_RESOLVING_ADDRESS;
 }
 
+void urob_http_client_test_set_cache(urob_http_client_test * http_client_test, urob_http_cache * cache)
+{
+    http_client_test->cache = cache;
+}
+
+void urob_http_client_test_set_preconnect(urob_http_client_test * http_client_test, urob_preconnect * pool)
+{
+    http_client_test->preconnect = pool;
+}
+
+void urob_http_client_test_set_tls(urob_http_client_test * http_client_test, urob_tls_context * context)
+{
+    http_client_test->tls = context;
+}
+
 void urob_http_client_test_uninit(urob_http_client_test * http_client_test)
 {
     ESP_LOGI(TAG, "uninitializing");
@@ -50,11 +92,43 @@ static void _netconn_http_client_resolving_address(urob_http_client_test * http_
     }
 
     ESP_LOGI(TAG, "address resolved");
-    urob_http_client_init(&http_client_test->http_client, &http_client_test->address.address, 80);
+    urob_json_extract_init(&http_client_test->json, _location_fields, sizeof(_location_fields) / sizeof(_location_fields[0]), &http_client_test->location);
+    urob_http_client_init(&http_client_test->http_client, &http_client_test->address.address, http_client_test->tls != NULL ? 443 : 80);
+    urob_http_client_set_request(&http_client_test->http_client, "ipwho.is", "/", NULL);
+    urob_http_client_set_body_callback(&http_client_test->http_client, _urob_http_client_test_body, http_client_test);
+    urob_http_client_set_cache(&http_client_test->http_client, http_client_test->cache);
+    urob_http_client_set_preconnect(&http_client_test->http_client, http_client_test->preconnect);
+    if (http_client_test->tls != NULL)
+    {
+        urob_http_client_set_tls(&http_client_test->http_client, http_client_test->tls);
+    }
     http_client_test->state = HTTP_CLIENT_TEST_STATE_WAITING_RESPONSE;
 }
 
-void urob_http_client_test_loop(urob_http_client_test * http_client_test)
+static void _urob_http_client_test_waiting_response(urob_http_client_test * http_client_test)
+{
+    urob_http_client_loop(&http_client_test->http_client);
+
+    if (http_client_test->http_client.state != CLIENT_STATE_RESP_RECVD)
+    {
+        return;
+    }
+
+    urob_http_client_test_location * location = &http_client_test->location;
+
+    if (urob_json_finish(&http_client_test->json) != ERR_OK || ! location->success)
+    {
+        ESP_LOGE(TAG, "no location in the response (status %d)", http_client_test->http_client.status);
+        http_client_test->state = HTTP_CLIENT_TEST_STATE_ERROR;
+        return;
+    }
+
+    ESP_LOGI(TAG, "ip: %s, location: %s, %s (%.4f, %.4f), isp: %s", location->ip, location->city, location->country,
+        location->latitude, location->longitude, location->isp);
+    http_client_test->state = HTTP_CLIENT_TEST_STATE_RESPONSE_RECEIVED;
+}
+
+static void _urob_http_client_test_loop(urob_http_client_test * http_client_test)
 {
     switch(http_client_test->state)
     {
@@ -69,9 +143,18 @@ void urob_http_client_test_loop(urob_http_client_test * http_client_test)
             _netconn_http_client_resolving_address(http_client_test);
         break;
         case HTTP_CLIENT_TEST_STATE_WAITING_RESPONSE:
-            urob_http_client_loop(&http_client_test->http_client);
+            _urob_http_client_test_waiting_response(http_client_test);
+        break;
+        case HTTP_CLIENT_TEST_STATE_RESPONSE_RECEIVED:
+            return;
         break;
         default:
             ESP_LOGE(TAG, "unhandled state: %d", http_client_test->state);
     }
+}
+
+void urob_http_client_test_loop(urob_http_client_test * http_client_test)
+{
+    UROB_TRACE_LOOP(UROB_TRACE_HTTP_CLIENT_TEST, http_client_test,
+        UROB_METRICS_TIME(UROB_METRICS_HTTP_CLIENT_TEST_LOOP, _urob_http_client_test_loop(http_client_test)));
 }
\ No newline at end of file
@@ -26,6 +26,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "urob_http_client.h"
 #include "urob_address.h"
+#include "urob_json.h"
 
 typedef enum
 {
@@ -36,14 +37,37 @@ typedef enum
     HTTP_CLIENT_TEST_STATE_RESPONSE_RECEIVED
 } urob_http_client_test_state;
 
+// Fields of the ipwho.is response, extracted while it's received
+typedef struct
+{
+    char ip[40];
+    bool success;
+    char country[32];
+    char city[32];
+    double latitude;
+    double longitude;
+    char isp[48];
+} urob_http_client_test_location;
+
 typedef struct
 {
     urob_address address;
     urob_http_client http_client;
     urob_http_client_test_state state;
+    urob_json json;
+    urob_http_client_test_location location;
+    urob_http_cache * cache; // optional
+    urob_preconnect * preconnect; // same
+    urob_tls_context * tls; // same, over https when set
 } urob_http_client_test;
 
 void urob_http_client_test_init(urob_http_client_test * http_client_test);
+// After init, the request goes through cache
+void urob_http_client_test_set_cache(urob_http_client_test * http_client_test, urob_http_cache * cache);
+// After init, the request starts from a ready connection of pool if there's one
+void urob_http_client_test_set_preconnect(urob_http_client_test * http_client_test, urob_preconnect * pool);
+// After init, the request is sent over https with the sessions of context
+void urob_http_client_test_set_tls(urob_http_client_test * http_client_test, urob_tls_context * context);
 void urob_http_client_test_uninit(urob_http_client_test * http_client_test);
 void urob_http_client_test_loop(urob_http_client_test * http_client_test);
 
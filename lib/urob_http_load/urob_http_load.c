@@ -0,0 +1,510 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_http_load.h"
+#include "urob_accounting.h"
+#include "urob_teardown.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lwip/api.h"
+#include "lwip/stats.h"
+
+#include "esp_log.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#define TAG "http load"
+#include "general.h"
+
+#define UROB_HTTP_LOAD_DEFAULT_SEED (0x2545f491) // xorshift32 never leaves 0
+
+static char request_format_string[] = "%s %s HTTP/1.1\r\nHost: urob\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n";
+
+static uint32_t _urob_http_load_random(urob_http_load * load)
+{
+    // xorshift32
+    uint32_t x = load->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    load->random = x;
+    return x;
+}
+
+static size_t _urob_http_load_heap_used(void)
+{
+#ifdef ESP_PLATFORM
+    return heap_caps_get_total_size(MALLOC_CAP_8BIT) - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+#elif defined(__GLIBC__)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static size_t _urob_http_load_pbufs_used(void)
+{
+#if LWIP_STATS && MEMP_STATS
+    return lwip_stats.memp[MEMP_PBUF_POOL]->used + lwip_stats.memp[MEMP_PBUF]->used;
+#else
+    return 0;
+#endif
+}
+
+void urob_http_load_init(urob_http_load * load, const urob_http_load_config * config)
+{
+    * load = (urob_http_load) {0};
+    load->config = * config;
+
+    _chk(config->concurrency < 1 || config->concurrency > UROB_HTTP_LOAD_MAX_CLIENTS,
+        load->config.concurrency = UROB_HTTP_LOAD_MAX_CLIENTS, "concurrency must be 1-%d", UROB_HTTP_LOAD_MAX_CLIENTS);
+    _chk(config->mix_count < 1 || config->mix_count > UROB_HTTP_LOAD_MAX_MIX, return, "invalid request mix");
+
+    for (int request_index = 0; request_index < load->config.mix_count; request_index ++)
+    {
+        const urob_http_load_request * request = &load->config.mix[request_index];
+        int body_size = request->body_size > 0 ? request->body_size : 0;
+        char * header = NULL;
+
+        int header_length = asprintf(&header, request_format_string,
+            body_size > 0 ? "POST" : "GET",
+            request->path,
+            body_size,
+            load->config.keep_alive ? "keep-alive" : "close");
+        _chk(header_length < 0, goto error, "unable to format request");
+
+        load->requests[request_index] = realloc(header, header_length + body_size);
+        _chk(load->requests[request_index] == NULL, free(header); goto error, "unable to allocate request");
+
+        memset(load->requests[request_index] + header_length, 'u', body_size);
+        load->request_lengths[request_index] = header_length + body_size;
+        load->total_weight += request->weight > 0 ? request->weight : 1;
+    }
+
+    load->config.seed = load->config.seed != 0 ? load->config.seed : UROB_HTTP_LOAD_DEFAULT_SEED;
+    load->random = load->config.seed; // printed with the results, to replay the run
+    load->start_us = urob_metrics_time_us();
+    load->next_due_us = load->start_us;
+    load->heap_used_high_water = _urob_http_load_heap_used();
+    load->pbuf_high_water = _urob_http_load_pbufs_used();
+    load->state = HTTP_LOAD_STATE_RUNNING;
+
+    ESP_LOGI(TAG, "starting: %d connections, %s loop, keep-alive %s",
+        load->config.concurrency, load->config.rate > 0 ? "open" : "closed", load->config.keep_alive ? "on" : "off");
+    return;
+
+error:
+    urob_http_load_uninit(load);
+}
+
+// Failed connections are aborted, not to fill the pcb pool with TIME_WAIT ones
+static void _urob_http_load_close(urob_http_load_client * client, bool abort)
+{
+    if (client->conn != NULL)
+    {
+        if (abort)
+        {
+            urob_teardown_abort(client->conn);
+        } else
+        {
+            urob_teardown_close(client->conn);
+        }
+        client->conn = NULL;
+    }
+
+    client->state = HTTP_LOAD_CLIENT_STATE_IDLE;
+}
+
+void urob_http_load_uninit(urob_http_load * load)
+{
+    for (int client_index = 0; client_index < UROB_HTTP_LOAD_MAX_CLIENTS; client_index ++)
+    {
+        _urob_http_load_close(&load->clients[client_index], true);
+    }
+
+    for (int request_index = 0; request_index < UROB_HTTP_LOAD_MAX_MIX; request_index ++)
+    {
+        free(load->requests[request_index]);
+    }
+
+    * load = (urob_http_load) {0};
+}
+
+static int _urob_http_load_pick_request(urob_http_load * load)
+{
+    int pick = _urob_http_load_random(load) % load->total_weight;
+
+    for (int request_index = 0; request_index < load->config.mix_count; request_index ++)
+    {
+        int weight = load->config.mix[request_index].weight;
+        pick -= weight > 0 ? weight : 1;
+        if (pick < 0)
+        {
+            return request_index;
+        }
+    }
+
+    return 0;
+}
+
+static void _urob_http_load_start(urob_http_load * load, urob_http_load_client * client, uint32_t due_us)
+{
+    client->request_index = _urob_http_load_pick_request(load);
+    client->progress = 0;
+    client->started_us = due_us;
+
+    if (client->conn != NULL) // kept alive
+    {
+        client->state = HTTP_LOAD_CLIENT_STATE_SENDING;
+        return;
+    }
+
+    client->conn = netconn_new(NETCONN_TCP);
+    _chk(client->conn == NULL, load->errors ++, "unable to create connection");
+    if (client->conn == NULL)
+    {
+        return;
+    }
+
+    netconn_set_flags(client->conn, NETCONN_FLAG_NON_BLOCKING);
+    err_t err = netconn_connect(client->conn, &load->config.address, load->config.port);
+    _chk(err != ERR_OK && err != ERR_INPROGRESS && err != ERR_ALREADY, {
+            load->errors ++;
+            _urob_http_load_close(client, true);
+            return;
+        }, "error connecting: %d", err);
+
+    load->connections ++;
+    client->state = HTTP_LOAD_CLIENT_STATE_CONNECTING;
+}
+
+static void _urob_http_load_complete(urob_http_load * load, urob_http_load_client * client)
+{
+    urob_metrics_histogram_record(&load->latency_us, urob_metrics_time_us() - client->started_us);
+    load->completed ++;
+    UROB_ACCOUNTING_REQUEST();
+
+    if (client->status < 200 || client->status >= 400)
+    {
+        load->errors ++;
+    }
+
+    if (load->config.keep_alive && ! client->server_closes && client->content_length >= 0)
+    {
+        client->state = HTTP_LOAD_CLIENT_STATE_IDLE;
+    } else
+    {
+        _urob_http_load_close(client, false);
+    }
+}
+
+static void _urob_http_load_header_line(urob_http_load_client * client)
+{
+    client->line[client->line_length] = '\0';
+
+    if (client->status == 0 && strncmp(client->line, "HTTP/", 5) == 0)
+    {
+        const char * code = strchr(client->line, ' ');
+        client->status = code ? atoi(code + 1) : 0;
+    } else if (strncasecmp(client->line, "content-length:", 15) == 0)
+    {
+        client->content_length = atol(client->line + 15);
+    } else if (strncasecmp(client->line, "connection:", 11) == 0 && strstr(client->line + 11, "close") != NULL)
+    {
+        client->server_closes = true;
+    }
+}
+
+// @return true once the whole response has been received
+static bool _urob_http_load_parse(urob_http_load_client * client, const char * data, size_t length)
+{
+    size_t index = 0;
+
+    for (; index < length && ! client->headers_done; index ++)
+    {
+        char c = data[index];
+
+        if (c == '\n')
+        {
+            if (client->line_length == 0)
+            {
+                client->headers_done = true;
+            } else
+            {
+                _urob_http_load_header_line(client);
+                client->line_length = 0;
+            }
+        } else if (c != '\r' && client->line_length < UROB_HTTP_LOAD_LINE_SIZE - 1)
+        {
+            client->line[client->line_length ++] = c;
+        }
+    }
+
+    client->body_received += length - index;
+
+    return client->headers_done && client->content_length >= 0 && client->body_received >= client->content_length;
+}
+
+static void _urob_http_load_send(urob_http_load * load, urob_http_load_client * client)
+{
+    size_t bytes_written = 0;
+    const char * request = load->requests[client->request_index];
+    size_t request_length = load->request_lengths[client->request_index];
+
+    // Requests live until uninit, no need for lwip to copy them
+    err_t err = netconn_write_partly(client->conn, request + client->progress, request_length - client->progress,
+        NETCONN_DONTBLOCK, &bytes_written);
+
+    if (err == ERR_WOULDBLOCK)
+    {
+        return;
+    }
+
+    _chk(err != ERR_OK, {
+            load->errors ++;
+            _urob_http_load_close(client, true);
+            return;
+        }, "error sending: %d", err);
+
+    client->progress += bytes_written;
+    load->bytes_sent += bytes_written;
+
+    if (client->progress == request_length)
+    {
+        client->headers_done = false;
+        client->server_closes = ! load->config.keep_alive;
+        client->status = 0;
+        client->content_length = -1;
+        client->body_received = 0;
+        client->line_length = 0;
+        client->state = HTTP_LOAD_CLIENT_STATE_RECEIVING;
+    }
+}
+
+static void _urob_http_load_receive(urob_http_load * load, urob_http_load_client * client)
+{
+    struct pbuf * received = NULL;
+    err_t err = netconn_recv_tcp_pbuf_flags(client->conn, &received, NETCONN_DONTBLOCK);
+
+    if (err == ERR_WOULDBLOCK || err == ERR_INPROGRESS)
+    {
+        return;
+    }
+
+    if (err != ERR_OK) // closed by the server
+    {
+        if (client->headers_done && client->content_length < 0)
+        {
+            client->server_closes = true;
+            _urob_http_load_complete(load, client);
+        } else
+        {
+            UROB_LOGD(TAG, "connection closed before the response: %d", err);
+            load->errors ++;
+            _urob_http_load_close(client, true);
+        }
+        return;
+    }
+
+    bool complete = false;
+    load->bytes_received += received->tot_len;
+
+    for (struct pbuf * segment = received; segment != NULL; segment = segment->next)
+    {
+        complete = _urob_http_load_parse(client, (const char *) segment->payload, segment->len);
+    }
+    pbuf_free(received);
+
+    if (complete)
+    {
+        _urob_http_load_complete(load, client);
+    }
+}
+
+static void _urob_http_load_service(urob_http_load * load, urob_http_load_client * client)
+{
+    switch (client->state)
+    {
+        case HTTP_LOAD_CLIENT_STATE_IDLE:
+        break;
+        case HTTP_LOAD_CLIENT_STATE_CONNECTING:
+            if (client->conn->state == NETCONN_NONE)
+            {
+                client->state = HTTP_LOAD_CLIENT_STATE_SENDING;
+            } else if (client->conn->state == NETCONN_CLOSE)
+            {
+                load->errors ++;
+                _urob_http_load_close(client, true);
+            }
+        break;
+        case HTTP_LOAD_CLIENT_STATE_SENDING:
+            _urob_http_load_send(load, client);
+        break;
+        case HTTP_LOAD_CLIENT_STATE_RECEIVING:
+            _urob_http_load_receive(load, client);
+        break;
+        default:
+            ESP_LOGE(TAG, "unhandled client state: %d", client->state);
+            _urob_http_load_close(client, true);
+    }
+}
+
+// Hands out due requests to idle connections, in the open loop the latency is measured from
+// when the request was due, so that a slow server can't hide its queueing (coordinated omission)
+static void _urob_http_load_schedule(urob_http_load * load, uint32_t now)
+{
+    uint32_t interval_us = load->config.rate > 0 ? 1000000 / load->config.rate : 0;
+
+    if (interval_us > 0)
+    {
+        while ((int32_t) (now - load->next_due_us) >= 0)
+        {
+            load->backlog ++;
+            load->next_due_us += interval_us;
+        }
+    }
+
+    for (int client_index = 0; client_index < load->config.concurrency; client_index ++)
+    {
+        urob_http_load_client * client = &load->clients[client_index];
+
+        if (client->state != HTTP_LOAD_CLIENT_STATE_IDLE)
+        {
+            continue;
+        }
+
+        if (interval_us == 0)
+        {
+            _urob_http_load_start(load, client, now);
+        } else if (load->backlog > 0)
+        {
+            _urob_http_load_start(load, client, load->next_due_us - load->backlog * interval_us);
+            load->backlog --;
+        }
+    }
+}
+
+static void _urob_http_load_sample(urob_http_load * load)
+{
+    size_t heap_used = _urob_http_load_heap_used();
+    size_t pbufs_used = _urob_http_load_pbufs_used();
+
+    if (heap_used > load->heap_used_high_water)
+    {
+        load->heap_used_high_water = heap_used;
+    }
+
+    if (pbufs_used > load->pbuf_high_water)
+    {
+        load->pbuf_high_water = pbufs_used;
+    }
+}
+
+void urob_http_load_loop(urob_http_load * load)
+{
+    if (load->state != HTTP_LOAD_STATE_RUNNING && load->state != HTTP_LOAD_STATE_DRAINING)
+    {
+        return;
+    }
+
+    uint32_t now = urob_metrics_time_us();
+
+    if (load->state == HTTP_LOAD_STATE_RUNNING)
+    {
+        if (now - load->start_us >= (uint32_t) load->config.duration_ms * 1000)
+        {
+            ESP_LOGI(TAG, "duration elapsed, draining");
+            load->state = HTTP_LOAD_STATE_DRAINING;
+        } else
+        {
+            _urob_http_load_schedule(load, now);
+        }
+    }
+
+    bool busy = false;
+    for (int client_index = 0; client_index < load->config.concurrency; client_index ++)
+    {
+        urob_http_load_client * client = &load->clients[client_index];
+        _urob_http_load_service(load, client);
+        busy |= client->state != HTTP_LOAD_CLIENT_STATE_IDLE;
+    }
+
+    _urob_http_load_sample(load);
+
+    if (load->state == HTTP_LOAD_STATE_DRAINING && ! busy)
+    {
+        load->end_us = urob_metrics_time_us();
+        for (int client_index = 0; client_index < load->config.concurrency; client_index ++)
+        {
+            _urob_http_load_close(&load->clients[client_index], true);
+        }
+
+        ESP_LOGI(TAG, "done: %u requests, %u errors", load->completed, load->errors);
+        load->state = HTTP_LOAD_STATE_DONE;
+    }
+}
+
+#define _urob_http_load_json(...) do { \
+    int _length = snprintf(text, sizeof(text), __VA_ARGS__); \
+    if (_length < 0 || _length >= (int) sizeof(text) || ! write(text, _length, arg)) return; \
+} while (0)
+
+void urob_http_load_write_json(urob_http_load * load, urob_http_load_write_fn write, void * arg)
+{
+    char text[192];
+    uint32_t elapsed_us = (load->end_us ? load->end_us : urob_metrics_time_us()) - load->start_us;
+    urob_metrics_histogram * latency = &load->latency_us;
+
+    _urob_http_load_json("{\"label\":\"%s\",\"concurrency\":%d,\"rate\":%d,\"keep_alive\":%s,\"seed\":%u,\"duration_ms\":%u,\"mix\":[",
+        load->config.label ? load->config.label : "", load->config.concurrency, load->config.rate,
+        load->config.keep_alive ? "true" : "false", load->config.seed, elapsed_us / 1000);
+
+    for (int request_index = 0; request_index < load->config.mix_count; request_index ++)
+    {
+        const urob_http_load_request * request = &load->config.mix[request_index];
+        _urob_http_load_json("%s{\"path\":\"%s\",\"weight\":%d,\"body_size\":%d}",
+            request_index ? "," : "", request->path, request->weight, request->body_size);
+    }
+
+    _urob_http_load_json("],\"requests\":%u,\"errors\":%u,\"connections\":%u,\"throughput_rps\":%.1f,\"bytes_sent\":%u,\"bytes_received\":%u,",
+        load->completed, load->errors, load->connections,
+        elapsed_us ? load->completed * 1000000.0 / elapsed_us : 0.0, load->bytes_sent, load->bytes_received);
+
+    _urob_http_load_json("\"latency_us\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u},",
+        urob_metrics_histogram_percentile(latency, 0.5f),
+        urob_metrics_histogram_percentile(latency, 0.9f),
+        urob_metrics_histogram_percentile(latency, 0.99f),
+        urob_metrics_histogram_percentile(latency, 0.999f),
+        atomic_load_explicit(&latency->max, memory_order_relaxed));
+
+    _urob_http_load_json("\"heap_used_high_water\":%u,\"pbuf_high_water\":%u}\n",
+        (unsigned int) load->heap_used_high_water, (unsigned int) load->pbuf_high_water);
+}
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_HTTP_LOAD_H__
+#define __UROB_HTTP_LOAD_H__
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "urob_metrics.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UROB_HTTP_LOAD_MAX_CLIENTS (8)
+#define UROB_HTTP_LOAD_MAX_MIX (4)
+#define UROB_HTTP_LOAD_LINE_SIZE (48) // longest response header line inspected
+
+typedef enum
+{
+    HTTP_LOAD_STATE_NONE = 0,
+    HTTP_LOAD_STATE_RUNNING,
+    HTTP_LOAD_STATE_DRAINING, // no new requests, waiting for those in flight
+    HTTP_LOAD_STATE_DONE
+} urob_http_load_state;
+
+typedef enum
+{
+    HTTP_LOAD_CLIENT_STATE_IDLE = 0,
+    HTTP_LOAD_CLIENT_STATE_CONNECTING,
+    HTTP_LOAD_CLIENT_STATE_SENDING,
+    HTTP_LOAD_CLIENT_STATE_RECEIVING
+} urob_http_load_client_state;
+
+// An entry of the request mix
+typedef struct
+{
+    const char * path;
+    int weight;
+    int body_size; // > 0 sends a POST with a body of this size
+} urob_http_load_request;
+
+typedef struct
+{
+    ip_addr_t address;
+    int port;
+
+    int concurrency; // connections in use at the same time
+    int rate; // requests per second, 0 for a closed loop (each connection sends as soon as it's done)
+    bool keep_alive;
+    int duration_ms;
+
+    urob_http_load_request mix[UROB_HTTP_LOAD_MAX_MIX];
+    int mix_count;
+    uint32_t seed; // of the picks from the mix: runs with the same seed send the same requests, 0 for the default
+
+    const char * label; // e.g. the commit being measured
+} urob_http_load_config;
+
+typedef struct
+{
+    struct netconn * conn;
+    urob_http_load_client_state state;
+    int request_index;
+    size_t progress;
+    uint32_t started_us; // when the request was due, not when it was sent
+
+    // Response parsing, headers are inspected a line at a time
+    bool headers_done;
+    bool server_closes;
+    int status;
+    long content_length; // -1 until known
+    long body_received;
+    char line[UROB_HTTP_LOAD_LINE_SIZE];
+    int line_length;
+} urob_http_load_client;
+
+typedef struct
+{
+    urob_http_load_config config;
+    urob_http_load_state state;
+    urob_http_load_client clients[UROB_HTTP_LOAD_MAX_CLIENTS];
+
+    // Requests are formatted once, and sent without copies by all clients
+    char * requests[UROB_HTTP_LOAD_MAX_MIX];
+    int request_lengths[UROB_HTTP_LOAD_MAX_MIX];
+    int total_weight;
+    uint32_t random;
+
+    uint32_t start_us;
+    uint32_t end_us;
+    uint32_t next_due_us; // open loop only
+    uint32_t backlog; // open loop requests due but without a free connection
+
+    uint32_t completed;
+    uint32_t errors;
+    uint32_t connections;
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    urob_metrics_histogram latency_us;
+
+    size_t heap_used_high_water;
+    size_t pbuf_high_water;
+} urob_http_load;
+
+void urob_http_load_init(urob_http_load * load, const urob_http_load_config * config);
+void urob_http_load_uninit(urob_http_load * load);
+void urob_http_load_loop(urob_http_load * load);
+
+static inline bool urob_http_load_done(urob_http_load * load) { return load->state == HTTP_LOAD_STATE_DONE; }
+
+// Receives a chunk of the json results, return false to stop
+typedef bool (* urob_http_load_write_fn)(const char * text, size_t length, void * arg);
+
+// Writes the results as a single json object, to be compared between runs
+void urob_http_load_write_json(urob_http_load * load, urob_http_load_write_fn write, void * arg);
+
+#endif // __UROB_HTTP_LOAD_H__
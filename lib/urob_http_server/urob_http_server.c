@@ -22,20 +22,221 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "urob_http_server.h"
+#include "urob_accounting.h"
+#include "urob_metrics.h"
+#include "urob_teardown.h"
+#include "urob_trace.h"
 #include "string.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
 #include "lwip/err.h"
 #include "lwip/api.h"
 
 #include "esp_log.h"
+#ifdef ESP_PLATFORM
+#include "esp_system.h"
+#endif
 
 #define TAG "http server"
 #include "general.h"
 
-static char http_header[] = "HTTP/1.1 200 OK\r\nContent-type: text/html\r\n\r\n";
-static char html_page[] = "<html><head><title>Test server</title></head><body><h1>Urob(oron)</h1><p>Welcome to Urob(oron)'s http server!</p></body></html>";
+static const char html_page[] = "<html><head><title>Test server</title></head><body><h1>Urob(oron)</h1><p>Welcome to Urob(oron)'s http server!</p></body></html>";
+static const char not_found_page[] = "not found\n";
+static const char too_large_page[] = "body too large\n";
+static const char too_long_page[] = "path too long\n";
+static const char error_page[] = "error\n";
+static const char continue_head[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char chunk_end[] = "\r\n";
+static const char last_chunk[] = "0\r\n\r\n";
+
+typedef enum
+{
+    STATUS_SLOT_UPTIME,
+    STATUS_SLOT_FREE_HEAP,
+    STATUS_SLOT_MIN_FREE_HEAP,
+    STATUS_SLOT_COUNTERS,
+    STATUS_SLOT_COUNTER_NAME,
+    STATUS_SLOT_COUNTER_LABELS,
+    STATUS_SLOT_COUNTER_VALUE,
+    STATUS_SLOT_HISTOGRAMS,
+    STATUS_SLOT_HISTOGRAM_NAME,
+    STATUS_SLOT_HISTOGRAM_LABELS,
+    STATUS_SLOT_HISTOGRAM_COUNT,
+    STATUS_SLOT_HISTOGRAM_P50,
+    STATUS_SLOT_HISTOGRAM_P99,
+    STATUS_SLOT_HISTOGRAM_MAX
+} urob_http_server_status_slot;
+
+// Laid out at build time, only the values are formatted per request
+static const urob_template_op status_page[] =
+{
+    UROB_TEMPLATE_TEXT("<html><head><title>Urob(oron) status</title><style>"
+        "body{font-family:sans-serif;margin:2em}table{border-collapse:collapse;margin-bottom:2em}"
+        "th,td{border:1px solid #ccc;padding:.3em .8em;text-align:right}th{background:#eee}"
+        "td:nth-child(-n+2){text-align:left;font-family:monospace}"
+        "</style></head><body><h1>Urob(oron)</h1><p>Uptime: "),
+    UROB_TEMPLATE_VALUE(STATUS_SLOT_UPTIME),
+    UROB_TEMPLATE_TEXT(" s, free heap: "),
+    UROB_TEMPLATE_VALUE(STATUS_SLOT_FREE_HEAP),
+    UROB_TEMPLATE_TEXT(" bytes (lowest: "),
+    UROB_TEMPLATE_VALUE(STATUS_SLOT_MIN_FREE_HEAP),
+    UROB_TEMPLATE_TEXT(")</p><h2>Counters</h2><table><tr><th>metric</th><th>labels</th><th>value</th></tr>"),
+    UROB_TEMPLATE_LOOP(STATUS_SLOT_COUNTERS),
+        UROB_TEMPLATE_TEXT("<tr><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_COUNTER_NAME),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_COUNTER_LABELS),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_COUNTER_VALUE),
+        UROB_TEMPLATE_TEXT("</td></tr>"),
+    UROB_TEMPLATE_END_LOOP(),
+    UROB_TEMPLATE_TEXT("</table><h2>Latencies</h2><table><tr><th>metric</th><th>labels</th>"
+        "<th>count</th><th>p50</th><th>p99</th><th>max</th></tr>"),
+    UROB_TEMPLATE_LOOP(STATUS_SLOT_HISTOGRAMS),
+        UROB_TEMPLATE_TEXT("<tr><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_NAME),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_LABELS),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_COUNT),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_P50),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_P99),
+        UROB_TEMPLATE_TEXT("</td><td>"),
+        UROB_TEMPLATE_VALUE(STATUS_SLOT_HISTOGRAM_MAX),
+        UROB_TEMPLATE_TEXT("</td></tr>"),
+    UROB_TEMPLATE_END_LOOP(),
+    UROB_TEMPLATE_TEXT("</table></body></html>"),
+    UROB_TEMPLATE_END()
+};
+
+static int _urob_http_server_status_count(const urob_template * tmpl, int slot, void * arg)
+{
+    return slot == STATUS_SLOT_COUNTERS ? UROB_METRICS_COUNTER_COUNT : UROB_METRICS_HISTOGRAM_COUNT;
+}
+
+static size_t _urob_http_server_status_value(const urob_template * tmpl, int slot, char * buffer, size_t size, void * arg)
+{
+    int id = urob_template_index(tmpl);
+    const char * labels = NULL;
+    int length = 0;
+
+    switch (slot)
+    {
+        case STATUS_SLOT_UPTIME:
+            length = snprintf(buffer, size, "%u", (unsigned) (urob_metrics_time_us() / 1000000));
+        break;
+#ifdef ESP_PLATFORM
+        case STATUS_SLOT_FREE_HEAP:
+            length = snprintf(buffer, size, "%u", (unsigned) esp_get_free_heap_size());
+        break;
+        case STATUS_SLOT_MIN_FREE_HEAP:
+            length = snprintf(buffer, size, "%u", (unsigned) esp_get_minimum_free_heap_size());
+        break;
+#else
+        case STATUS_SLOT_FREE_HEAP:
+        case STATUS_SLOT_MIN_FREE_HEAP:
+            length = snprintf(buffer, size, "n/a");
+        break;
+#endif
+        case STATUS_SLOT_COUNTER_NAME:
+            length = snprintf(buffer, size, "%s", urob_metrics_counter_name(id, &labels));
+        break;
+        case STATUS_SLOT_COUNTER_LABELS:
+            urob_metrics_counter_name(id, &labels);
+            length = snprintf(buffer, size, "%s", labels);
+        break;
+        case STATUS_SLOT_COUNTER_VALUE:
+            length = snprintf(buffer, size, "%u", urob_metrics_counter(id));
+        break;
+        case STATUS_SLOT_HISTOGRAM_NAME:
+            length = snprintf(buffer, size, "%s", urob_metrics_histogram_name(id, &labels));
+        break;
+        case STATUS_SLOT_HISTOGRAM_LABELS:
+            urob_metrics_histogram_name(id, &labels);
+            length = snprintf(buffer, size, "%s", labels);
+        break;
+        case STATUS_SLOT_HISTOGRAM_COUNT:
+            length = snprintf(buffer, size, "%u", urob_metrics_count(id));
+        break;
+        case STATUS_SLOT_HISTOGRAM_P50:
+            length = snprintf(buffer, size, "%u", urob_metrics_percentile(id, 0.5f));
+        break;
+        case STATUS_SLOT_HISTOGRAM_P99:
+            length = snprintf(buffer, size, "%u", urob_metrics_percentile(id, 0.99f));
+        break;
+        case STATUS_SLOT_HISTOGRAM_MAX:
+            length = snprintf(buffer, size, "%u", urob_metrics_max(id));
+        break;
+    }
+
+    return length > 0 ? length : 0;
+}
+
+static void _urob_http_server_produce_metrics(urob_http_server_connection * connection, urob_http_server_chunk * chunk, void * arg)
+{
+    chunk->length = urob_metrics_read(&connection->context.metrics, chunk->buffer, chunk->size);
+    chunk->done = chunk->length == 0;
+}
+
+static void _urob_http_server_metrics(urob_http_server_connection * connection, void * arg)
+{
+    connection->context.metrics = 0;
+    urob_http_server_respond(connection, 200, "text/plain; version=0.0.4", -1, _urob_http_server_produce_metrics, NULL);
+}
+
+#if UROB_TRACE
+static void _urob_http_server_produce_trace(urob_http_server_connection * connection, urob_http_server_chunk * chunk, void * arg)
+{
+    chunk->length = urob_trace_read(&connection->context.trace, chunk->buffer, chunk->size);
+    chunk->done = chunk->length == 0;
+}
+
+static void _urob_http_server_trace(urob_http_server_connection * connection, void * arg)
+{
+    urob_trace_cursor_init(&connection->context.trace);
+    urob_http_server_respond(connection, 200, "application/octet-stream", -1, _urob_http_server_produce_trace, NULL);
+}
+#endif
+
+static void _urob_http_server_produce_page(urob_http_server_connection * connection, urob_http_server_chunk * chunk, void * arg)
+{
+    const char * reference = NULL;
+    chunk->length = urob_template_read(&connection->context.page, chunk->buffer, chunk->size, &reference);
+    chunk->reference = reference;
+    chunk->done = chunk->length == 0;
+}
+
+static void _urob_http_server_status(urob_http_server_connection * connection, void * arg)
+{
+    urob_template_init(&connection->context.page, status_page, _urob_http_server_status_value, _urob_http_server_status_count, NULL);
+    urob_http_server_respond(connection, 200, "text/html", -1, _urob_http_server_produce_page, NULL);
+}
+
+static void _urob_http_server_home(urob_http_server_connection * connection, void * arg)
+{
+    urob_http_server_respond_static(connection, 200, "text/html", html_page, sizeof(html_page) - 1);
+}
+
+// Matched after the routes added to the server
+static const urob_http_server_route _builtin_routes[] =
+{
+    {.method = "GET", .path = "/metrics", .handler = _urob_http_server_metrics},
+#if UROB_TRACE
+    {.method = "GET", .path = "/trace", .handler = _urob_http_server_trace},
+#endif
+    {.method = "GET", .path = "/status", .handler = _urob_http_server_status},
+};
+
+// Matched last, after the server's fallback
+static const urob_http_server_route _home_route = {.method = NULL, .path = "/*", .handler = _urob_http_server_home};
 
 void urob_http_server_init(urob_http_server *server)
 {
+    * server = (urob_http_server) {0};
+
 #if LWIP_IPV6
     server->conn = netconn_new(NETCONN_TCP_IPV6);
     server->err = netconn_bind(server->conn, IP6_ADDR_ANY, 80);
@@ -43,64 +244,961 @@ void urob_http_server_init(urob_http_server *server)
     server->conn = netconn_new(NETCONN_TCP);
     server->err = netconn_bind(server->conn, IP_ADDR_ANY, 80);
 #endif /* LWIP_IPV6 */
-    netconn_set_recvtimeout(server->conn, 5);
     _chk(server->conn == NULL, return, "Unable to setup connection");
+    netconn_set_recvtimeout(server->conn, 5); // accept only waits while no connections are served
     server->err = netconn_listen(server->conn);
     _chk(server->err != ESP_OK, , "error while listening: %d", server->err);
 }
 
+void urob_http_server_init_worker(urob_http_server *server)
+{
+    * server = (urob_http_server) {0};
+}
+
+void urob_http_server_set_dispatch(urob_http_server *server, urob_http_server_dispatch_fn dispatch, void * arg)
+{
+    server->dispatch = dispatch;
+    server->dispatch_arg = arg;
+}
+
+void urob_http_server_route_add_body(urob_http_server *server, const char * method, const char * path, urob_http_server_handler_fn handler,
+    urob_http_server_body_fn body, long max_body_size, void * arg)
+{
+    _chk(server->route_count == UROB_HTTP_SERVER_MAX_ROUTES, return, "too many routes, %s not added", path);
+
+    server->routes[server->route_count ++] = (urob_http_server_route) {
+        .method = method,
+        .path = path,
+        .handler = handler,
+        .body = body,
+        .max_body_size = max_body_size,
+        .arg = arg
+    };
+}
+
+void urob_http_server_route_add(urob_http_server *server, const char * method, const char * path, urob_http_server_handler_fn handler, void * arg)
+{
+    urob_http_server_route_add_body(server, method, path, handler, NULL, UROB_HTTP_SERVER_DISCARD_SIZE, arg);
+}
+
+void urob_http_server_set_fallback(urob_http_server *server, urob_http_server_handler_fn handler, void * arg)
+{
+    server->fallback = (urob_http_server_route) {
+        .method = "GET",
+        .path = "/*",
+        .handler = handler,
+        .max_body_size = UROB_HTTP_SERVER_DISCARD_SIZE,
+        .arg = arg
+    };
+}
+
+void urob_http_server_set_admission(urob_http_server *server, urob_admission * admission)
+{
+    server->admission = admission;
+}
+
+void urob_http_server_set_budget(urob_http_server *server, const urob_budget_config * config)
+{
+    server->budget_config = * config;
+}
+
+static void _urob_http_server_free_input(urob_http_server_connection * connection)
+{
+    if (connection->server->admission != NULL)
+    {
+        urob_admission_queue(connection->server->admission, - (long) connection->input->tot_len);
+    }
+
+    pbuf_free(connection->input);
+    connection->input = NULL;
+}
+
+// Frees the slot, aborting the connection (e.g. errored or idle) or closing it first
+static void _urob_http_server_connection_close(urob_http_server_connection * connection, bool abort)
+{
+    if (connection->conn != NULL)
+    {
+        if (abort)
+        {
+            urob_teardown_abort(connection->conn);
+        } else
+        {
+            urob_teardown_close(connection->conn);
+        }
+    }
+
+    if (connection->input != NULL)
+    {
+        _urob_http_server_free_input(connection);
+    }
+
+    urob_http_server * server = connection->server;
+    if (server->admission != NULL)
+    {
+        urob_admission_release(server->admission);
+    }
+
+    server->active &= ~ (1u << (connection - server->connections));
+    * connection = (urob_http_server_connection) {0};
+    server->connection_count --;
+}
+
 void urob_http_server_uninit(urob_http_server * server)
 {
-  ESP_LOGI(TAG, "Uninitializing");
-  err_t err = netconn_close(server->conn);
-  _chk(err != ERR_OK, , "netconn_close: %d", err);
-  err = netconn_delete(server->conn);
-  _chk(err != ERR_OK, , "netconn_delete: %d", err);
-  * server = (urob_http_server) {0};
+    ESP_LOGI(TAG, "Uninitializing");
+
+    while (server->active != 0)
+    {
+        _urob_http_server_connection_close(&server->connections[__builtin_ctz(server->active)], true);
+    }
+
+    for (int index = 0; index < server->rejected_count; index ++)
+    {
+        urob_teardown_abort(server->rejected[index]);
+    }
+
+    if (server->conn != NULL)
+    {
+        err_t err = netconn_close(server->conn);
+        _chk(err != ERR_OK, , "netconn_close: %d", err);
+        err = netconn_delete(server->conn);
+        _chk(err != ERR_OK, , "netconn_delete: %d", err);
+    }
+
+    * server = (urob_http_server) {0};
 }
 
-// TODO: make non-blocking
-static void _urob_http_server_serve(urob_http_server * server, struct netconn *new_conn)
+void urob_http_server_adopt(urob_http_server * server, struct netconn *conn)
 {
-    struct netbuf * new_buf;
-    server->err = netconn_recv(new_conn, &new_buf);
-    _chk(server->err != ERR_OK, goto leave, "error receiving: %d", server->err);
+    urob_http_server_connection * connection = NULL;
+    uint32_t free_slots = ~ server->active & (UINT32_MAX >> (32 - UROB_HTTP_SERVER_MAX_CONNECTIONS));
 
-    char *buf;
-    u16_t len;
-    server->err = netbuf_data(new_buf, (void **)&buf, &len);
-    _chk(server->err != ERR_OK, goto leave, "netbuf_data: %d", server->err);
+    if (free_slots != 0)
+    {
+        connection = &server->connections[__builtin_ctz(free_slots)];
+    }
 
-    if (strncmp(buf, "GET /", 5) == 0)
+    if (connection == NULL)
     {
-        // TODO: these write functions should use NETCONN_DONTBLOCK
-        server->err = netconn_write(new_conn, http_header, sizeof(http_header) - 1, NETCONN_NOCOPY);
-        _chk(server->err != ERR_OK, goto leave, "sending header: %d", server->err);
-        server->err = netconn_write(new_conn, html_page, sizeof(html_page) - 1, NETCONN_NOCOPY);
-        _chk(server->err != ERR_OK, goto leave, "sending html: %d", server->err);
+        UROB_LOGW(TAG, "no free connections, closing");
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_ERRORS, 1);
+        urob_teardown_abort(conn);
+
+        if (server->admission != NULL)
+        {
+            urob_admission_release(server->admission);
+        }
+        return;
     }
 
-leave:
-    server->err = netconn_close(new_conn);
-    netbuf_delete(new_buf);
+    netconn_set_nonblocking(conn, true);
+
+    * connection = (urob_http_server_connection) {
+        .conn = conn,
+        .server = server,
+        .state = HTTP_SERVER_CONNECTION_STATE_REQUEST,
+        .progress_us = urob_metrics_time_us(),
+        .content_length = -1,
+        .request_length = -1
+    };
+    server->active |= 1u << (connection - server->connections);
+    server->connection_count ++;
 }
 
-void urob_http_server_loop(urob_http_server * server)
+static const char * _urob_http_server_reason(int status)
 {
-  _chk(server->err != ERR_OK, urob_http_server_uninit(server), "server error: %d", server->err);
+    switch (status)
+    {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 500: return "Internal Server Error";
+        default: return "Unknown";
+    }
+}
+
+static void _urob_http_server_add_piece(urob_http_server_connection * connection, const char * ptr, size_t length, bool copy)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    connection->pieces[connection->piece_first + connection->piece_count ++] = (urob_http_server_piece) {
+        .ptr = ptr,
+        .length = length,
+        .copy = copy
+    };
+}
+
+void urob_http_server_respond(urob_http_server_connection * connection, int status, const char * content_type, long content_length,
+    urob_http_server_producer_fn producer, void * producer_arg)
+{
+    _chk(connection->state >= HTTP_SERVER_CONNECTION_STATE_RESPONSE, return, "already responding");
+
+    connection->status = status;
+    connection->content_length = content_length;
+    connection->chunked = content_length < 0 && ! connection->http_1_0; // http/1.0 clients read until closed
+    connection->producer = producer;
+    connection->producer_arg = producer_arg;
 
-  struct netconn *newconn;
-  server->err = netconn_accept(server->conn, &newconn);
+    int length = snprintf(connection->head, sizeof(connection->head), "HTTP/1.1 %d %s\r\nContent-type: %s\r\n", status, _urob_http_server_reason(status), content_type);
 
-  if (server->err == ERR_OK)
-  {
-      ESP_LOGI(TAG, "received connection request");
-      _urob_http_server_serve(server, newconn);
-      netconn_delete(newconn);
-  }
+    if (content_length >= 0)
+    {
+        length += snprintf(connection->head + length, sizeof(connection->head) - length, "Content-Length: %ld\r\n", content_length);
+    } else if (connection->chunked)
+    {
+        length += snprintf(connection->head + length, sizeof(connection->head) - length, "Transfer-Encoding: chunked\r\n");
+    }
+
+    length += snprintf(connection->head + length, sizeof(connection->head) - length, "Connection: close\r\n\r\n");
+    _chk(length >= (int) sizeof(connection->head), connection->err = ERR_VAL; return, "response head too long");
+
+    connection->piece_first = connection->piece_count = 0;
+    _urob_http_server_add_piece(connection, connection->head, length, true);
+    connection->state = HTTP_SERVER_CONNECTION_STATE_RESPONSE;
+}
+
+static void _urob_http_server_produce_static(urob_http_server_connection * connection, urob_http_server_chunk * chunk, void * arg)
+{
+    chunk->reference = arg;
+    chunk->length = connection->content_length;
+    chunk->done = true;
+}
+
+void urob_http_server_respond_static(urob_http_server_connection * connection, int status, const char * content_type, const void * body, size_t length)
+{
+    urob_http_server_respond(connection, status, content_type, length, _urob_http_server_produce_static, (void *) body);
+}
+
+static bool _urob_http_server_path_matches(const char * pattern, const char * path)
+{
+    size_t length = strlen(pattern);
+
+    if (length > 0 && pattern[length - 1] == '*')
+    {
+        return strncmp(pattern, path, length - 1) == 0;
+    }
+
+    return strcmp(pattern, path) == 0;
+}
+
+static const urob_http_server_route * _urob_http_server_find_route(const urob_http_server_route * routes, int count, urob_http_server_connection * connection)
+{
+    for (int index = 0; index < count; index ++)
+    {
+        const urob_http_server_route * route = &routes[index];
+
+        if ((route->method == NULL || strcmp(route->method, connection->method) == 0) && _urob_http_server_path_matches(route->path, connection->path))
+        {
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+// The request is complete, body included
+static void _urob_http_server_handle(urob_http_server_connection * connection)
+{
+    if (connection->route == NULL)
+    {
+        urob_http_server_respond_static(connection, 404, "text/plain", not_found_page, sizeof(not_found_page) - 1);
+        return;
+    }
+
+    connection->route->handler(connection, connection->route->arg);
+    _chk(connection->state < HTTP_SERVER_CONNECTION_STATE_RESPONSE, connection->err = ERR_VAL, "no response for %s", connection->path);
+}
+
+static void _urob_http_server_refuse(urob_http_server_connection * connection)
+{
+    UROB_LOGW(TAG, "%s: body too large", connection->path);
+    urob_http_server_respond_static(connection, 413, "text/plain", too_large_page, sizeof(too_large_page) - 1);
+}
 
-  if (server->err == ERR_TIMEOUT)
-  {
-      server->err = ERR_OK;
-  }
-}
\ No newline at end of file
+static long _urob_http_server_max_body_size(urob_http_server_connection * connection)
+{
+    const urob_http_server_route * route = connection->route;
+    return route != NULL && route->body != NULL ? route->max_body_size : UROB_HTTP_SERVER_DISCARD_SIZE;
+}
+
+// The request line and headers are received
+static void _urob_http_server_head_done(urob_http_server_connection * connection)
+{
+    urob_http_server * server = connection->server;
+
+    UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_REQUESTS, 1);
+    UROB_LOGD(TAG, "%s %s", connection->method, connection->path);
+
+    if (connection->path_too_long)
+    {
+        UROB_LOGW(TAG, "%s: path too long", connection->method);
+        urob_http_server_respond_static(connection, 414, "text/plain", too_long_page, sizeof(too_long_page) - 1);
+        return;
+    }
+
+    connection->route = _urob_http_server_find_route(server->routes, server->route_count, connection);
+
+    if (connection->route == NULL)
+    {
+        connection->route = _urob_http_server_find_route(_builtin_routes, sizeof(_builtin_routes) / sizeof(_builtin_routes[0]), connection);
+    }
+
+    if (connection->route == NULL && server->fallback.handler != NULL)
+    {
+        connection->route = _urob_http_server_find_route(&server->fallback, 1, connection);
+    }
+
+    if (connection->route == NULL)
+    {
+        connection->route = &_home_route;
+    }
+
+    if (! connection->request_chunked && connection->request_length <= 0)
+    {
+        _urob_http_server_handle(connection);
+        return;
+    }
+
+    // Refused before the client sends it, if it waits for 100-continue
+    if (connection->request_length > _urob_http_server_max_body_size(connection))
+    {
+        _urob_http_server_refuse(connection);
+        return;
+    }
+
+    if (connection->expect_continue)
+    {
+        _urob_http_server_add_piece(connection, continue_head, sizeof(continue_head) - 1, false);
+    }
+
+    connection->body_state = connection->request_chunked ? HTTP_SERVER_BODY_STATE_CHUNK_SIZE : HTTP_SERVER_BODY_STATE_DATA;
+    connection->remaining = connection->request_length;
+    connection->state = HTTP_SERVER_CONNECTION_STATE_BODY;
+}
+
+// Request line, e.g. "GET /status HTTP/1.1"
+static void _urob_http_server_request_line(urob_http_server_connection * connection)
+{
+    bool line_full = connection->line_length == UROB_HTTP_SERVER_LINE_SIZE - 1; // the version may have been cut off
+    char * path = strchr(connection->line, ' ');
+    char * version = path != NULL ? strchr(path + 1, ' ') : NULL;
+    size_t method_length = path != NULL ? (size_t) (path - connection->line) : 0;
+
+    _chk((version == NULL && ! line_full) || method_length == 0 || method_length >= sizeof(connection->method), connection->err = ERR_VAL; return,
+        "malformed request line");
+
+    memcpy(connection->method, connection->line, method_length);
+    connection->method[method_length] = '\0';
+
+    size_t path_length = version != NULL ? (size_t) (version - path - 1) : sizeof(connection->path);
+
+    if (path_length >= sizeof(connection->path)) // answered with 414 once the headers are read
+    {
+        connection->path_too_long = true;
+        return;
+    }
+
+    memcpy(connection->path, path + 1, path_length);
+    connection->path[path_length] = '\0';
+
+    connection->http_1_0 = strcmp(version + 1, "HTTP/1.0") == 0;
+}
+
+static void _urob_http_server_header_line(urob_http_server_connection * connection)
+{
+    const char * line = connection->line;
+
+    if (strncasecmp(line, "content-length:", 15) == 0)
+    {
+        connection->request_length = atol(line + 15);
+    } else if (strncasecmp(line, "transfer-encoding:", 18) == 0 && strstr(line + 18, "chunked") != NULL)
+    {
+        connection->request_chunked = true;
+    } else if (strncasecmp(line, "expect:", 7) == 0 && strstr(line + 7, "100-continue") != NULL)
+    {
+        connection->expect_continue = true;
+    }
+}
+
+// Reads a line a character at a time
+// @return true when c ends a line, which is in connection->line
+static bool _urob_http_server_line(urob_http_server_connection * connection, char c)
+{
+    if (c == '\n')
+    {
+        connection->line[connection->line_length] = '\0';
+        return true;
+    }
+
+    if (c != '\r' && connection->line_length < UROB_HTTP_SERVER_LINE_SIZE - 1)
+    {
+        connection->line[connection->line_length ++] = c;
+    }
+
+    return false;
+}
+
+// Consumes the request head from data
+// @return bytes consumed, the head is complete when the state changes
+static size_t _urob_http_server_parse_head(urob_http_server_connection * connection, const char * data, size_t length)
+{
+    size_t index = 0;
+
+    while (index < length && connection->state == HTTP_SERVER_CONNECTION_STATE_REQUEST && connection->err == ERR_OK)
+    {
+        if (! _urob_http_server_line(connection, data[index ++]))
+        {
+            continue;
+        }
+
+        if (connection->method[0] == '\0')
+        {
+            _urob_http_server_request_line(connection);
+        } else if (connection->line_length == 0) // end of the headers
+        {
+            _urob_http_server_head_done(connection);
+        } else
+        {
+            _urob_http_server_header_line(connection);
+        }
+
+        connection->line_length = 0;
+    }
+
+    return index;
+}
+
+// Passes body data to the route, or discards it
+// @return false if the route isn't ready for it
+static bool _urob_http_server_deliver(urob_http_server_connection * connection, const char * data, size_t length)
+{
+    const urob_http_server_route * route = connection->route;
+
+    if (route == NULL || route->body == NULL)
+    {
+        return true;
+    }
+
+    err_t err = route->body(connection, data, length, route->arg);
+
+    if (err == ERR_INPROGRESS || err == ERR_WOULDBLOCK)
+    {
+        return false;
+    }
+
+    if (err != ERR_OK)
+    {
+        UROB_LOGE(TAG, "%s: body refused: %d", connection->path, err);
+        urob_http_server_respond_static(connection, 500, "text/plain", error_page, sizeof(error_page) - 1);
+    }
+
+    return true;
+}
+
+// Consumes the request body from data, de-chunking it
+// @return bytes consumed, less than length if the route isn't ready or the body ended
+static size_t _urob_http_server_parse_body(urob_http_server_connection * connection, const char * data, size_t length)
+{
+    size_t index = 0;
+
+    while (index < length && connection->state == HTTP_SERVER_CONNECTION_STATE_BODY && connection->err == ERR_OK)
+    {
+        if (connection->body_state == HTTP_SERVER_BODY_STATE_DATA)
+        {
+            size_t available = length - index;
+            size_t slice = (size_t) connection->remaining < available ? (size_t) connection->remaining : available;
+
+            if (! _urob_http_server_deliver(connection, data + index, slice))
+            {
+                break;
+            }
+
+            index += slice;
+            connection->remaining -= slice;
+            connection->body_received += slice;
+
+            if (connection->remaining == 0)
+            {
+                connection->body_state = connection->request_chunked ? HTTP_SERVER_BODY_STATE_CHUNK_END : HTTP_SERVER_BODY_STATE_DONE;
+            }
+        } else if (_urob_http_server_line(connection, data[index ++]))
+        {
+            switch (connection->body_state)
+            {
+                case HTTP_SERVER_BODY_STATE_CHUNK_SIZE:
+                    connection->remaining = strtol(connection->line, NULL, 16); // extensions after ';' are ignored
+                    connection->body_state = connection->remaining > 0 ? HTTP_SERVER_BODY_STATE_DATA : HTTP_SERVER_BODY_STATE_TRAILER;
+
+                    if (connection->remaining < 0 || connection->body_received + connection->remaining > _urob_http_server_max_body_size(connection))
+                    {
+                        _urob_http_server_refuse(connection);
+                    }
+                break;
+                case HTTP_SERVER_BODY_STATE_CHUNK_END:
+                    connection->body_state = HTTP_SERVER_BODY_STATE_CHUNK_SIZE;
+                break;
+                case HTTP_SERVER_BODY_STATE_TRAILER:
+                    if (connection->line_length == 0)
+                    {
+                        connection->body_state = HTTP_SERVER_BODY_STATE_DONE;
+                    }
+                break;
+                default:
+                break;
+            }
+
+            connection->line_length = 0;
+        }
+
+        if (connection->body_state == HTTP_SERVER_BODY_STATE_DONE)
+        {
+            _urob_http_server_handle(connection);
+        }
+    }
+
+    return index;
+}
+
+static void _urob_http_server_receive(urob_http_server_connection * connection)
+{
+    if (connection->input == NULL)
+    {
+        connection->err = netconn_recv_tcp_pbuf_flags(connection->conn, &connection->input, NETCONN_DONTBLOCK);
+
+        if (connection->err == ERR_WOULDBLOCK)
+        {
+            connection->err = ERR_OK;
+            return;
+        }
+
+        _chk(connection->err != ERR_OK, connection->input = NULL; return, "error receiving: %d", connection->err);
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_BYTES_RECEIVED, connection->input->tot_len);
+        connection->bytes_received += connection->input->tot_len;
+        connection->input_offset = 0;
+        connection->progress_us = urob_metrics_time_us();
+        urob_budget_spend(&connection->server->budget, connection->input->tot_len, 0);
+
+        if (connection->server->admission != NULL)
+        {
+            urob_admission_queue(connection->server->admission, connection->input->tot_len);
+        }
+    }
+
+    // Segment by segment, from where the previous loop stopped
+    size_t segment_start = 0;
+    struct pbuf * segment = connection->input;
+
+    while (segment != NULL && connection->state <= HTTP_SERVER_CONNECTION_STATE_BODY && connection->err == ERR_OK)
+    {
+        if (connection->input_offset >= segment_start + segment->len)
+        {
+            segment_start += segment->len;
+            segment = segment->next;
+            continue;
+        }
+
+        const char * data = (const char *) segment->payload + (connection->input_offset - segment_start);
+        size_t length = segment_start + segment->len - connection->input_offset;
+
+        size_t consumed = connection->state == HTTP_SERVER_CONNECTION_STATE_REQUEST ?
+            _urob_http_server_parse_head(connection, data, length) : _urob_http_server_parse_body(connection, data, length);
+        connection->input_offset += consumed;
+
+        if (consumed < length && connection->state == HTTP_SERVER_CONNECTION_STATE_BODY)
+        {
+            return; // the route isn't ready, keeps the rest for later
+        }
+    }
+
+    // Anything after the request (e.g. pipelined ones) is ignored, the connection is closed after the response
+    _urob_http_server_free_input(connection);
+}
+
+// Asks the producer for the next part of the body, framed as a chunk if needed
+static void _urob_http_server_produce(urob_http_server_connection * connection)
+{
+    urob_http_server_chunk chunk = {
+        .buffer = connection->buffer,
+        .size = sizeof(connection->buffer)
+    };
+
+    connection->producer(connection, &chunk, connection->producer_arg);
+    connection->piece_first = connection->piece_count = 0;
+
+    if (chunk.length > 0)
+    {
+        const char * data = chunk.reference != NULL ? (const char *) chunk.reference : chunk.buffer;
+
+        if (connection->chunked)
+        {
+            int length = snprintf(connection->head, sizeof(connection->head), "%x\r\n", (unsigned) chunk.length);
+            _urob_http_server_add_piece(connection, connection->head, length, true);
+        }
+
+        _urob_http_server_add_piece(connection, data, chunk.length, chunk.reference == NULL);
+        connection->body_sent += chunk.length;
+
+        if (connection->chunked)
+        {
+            _urob_http_server_add_piece(connection, chunk_end, sizeof(chunk_end) - 1, false);
+        }
+    }
+
+    if (chunk.done)
+    {
+        connection->body_done = true;
+
+        if (connection->chunked)
+        {
+            _urob_http_server_add_piece(connection, last_chunk, sizeof(last_chunk) - 1, false);
+        }
+
+        _chk(connection->content_length >= 0 && connection->body_sent != (size_t) connection->content_length, connection->err = ERR_VAL,
+            "body of %u bytes, %ld announced", (unsigned) connection->body_sent, connection->content_length);
+    }
+}
+
+// Drops what was written from the front of the pieces
+static void _urob_http_server_consume(urob_http_server_connection * connection, size_t written)
+{
+    while (written > 0)
+    {
+        urob_http_server_piece * piece = &connection->pieces[connection->piece_first];
+
+        if (written < piece->length)
+        {
+            piece->ptr += written;
+            piece->length -= written;
+            return;
+        }
+
+        written -= piece->length;
+        connection->piece_first ++;
+        connection->piece_count --;
+    }
+}
+
+// Writes the pending pieces
+// @return true once they're all written
+static bool _urob_http_server_flush(urob_http_server_connection * connection)
+{
+    urob_http_server * server = connection->server;
+
+    while (connection->piece_count > 0)
+    {
+        if (! urob_budget_left(&server->budget, &server->budget_config))
+        {
+            return false;
+        }
+
+        // Copied and referenced pieces go in separate writes, the flags apply to all vectors
+        struct netvector vectors[UROB_HTTP_SERVER_MAX_PIECES];
+        u16_t vector_count = 0;
+        size_t length = 0;
+        size_t budget = urob_budget_bytes(&server->budget, SIZE_MAX);
+        bool copy = connection->pieces[connection->piece_first].copy;
+        bool whole = true; // the pieces aren't cut by the budget
+
+        for (int index = connection->piece_first; index < connection->piece_first + connection->piece_count && connection->pieces[index].copy == copy && whole; index ++)
+        {
+            size_t piece_length = connection->pieces[index].length;
+            if (piece_length > budget - length)
+            {
+                piece_length = budget - length;
+                whole = false;
+            }
+
+            vectors[vector_count ++] = (struct netvector) {.ptr = connection->pieces[index].ptr, .len = piece_length};
+            length += piece_length;
+        }
+
+        bool last = connection->body_done && vector_count == connection->piece_count && whole;
+        size_t written = 0;
+        connection->err = netconn_write_vectors_partly(connection->conn, vectors, vector_count,
+            NETCONN_DONTBLOCK | (copy ? NETCONN_COPY : 0) | (last ? 0 : NETCONN_MORE), &written);
+
+        if (connection->err == ERR_WOULDBLOCK)
+        {
+            connection->err = ERR_OK;
+            return false;
+        }
+
+        _chk(connection->err != ERR_OK, return false, "error sending: %d", connection->err);
+
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_BYTES_SENT, written);
+        connection->bytes_sent += written;
+        _urob_http_server_consume(connection, written);
+        urob_budget_spend(&server->budget, written, 0);
+        connection->progress_us = urob_metrics_time_us();
+
+        if (written < length) // the send window is full
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool urob_http_server_connection_info(urob_http_server_connection * connection, urob_tcp_info * info)
+{
+    return urob_tcp_info_get(connection->conn, info);
+}
+
+// Sampled, each snapshot costs a round trip to the tcpip thread
+static void _urob_http_server_record_info(urob_http_server_connection * connection)
+{
+    urob_http_server * server = connection->server;
+    uint32_t now = urob_metrics_time_us();
+
+    if (now - server->info_us < UROB_TCP_INFO_INTERVAL_US)
+    {
+        return;
+    }
+
+    server->info_us = now;
+
+    urob_tcp_info info;
+    if (urob_tcp_info_get(connection->conn, &info))
+    {
+        urob_tcp_info_record(&info);
+    }
+}
+
+static void _urob_http_server_send(urob_http_server_connection * connection)
+{
+    while (_urob_http_server_flush(connection))
+    {
+        if (connection->body_done)
+        {
+            _urob_http_server_record_info(connection);
+            connection->state = HTTP_SERVER_CONNECTION_STATE_DONE;
+            return;
+        }
+
+        connection->progress_us = urob_metrics_time_us(); // not waiting for the client, but for the producer
+        _urob_http_server_produce(connection);
+
+        if (connection->piece_count == 0 && ! connection->body_done) // nothing to send yet
+        {
+            return;
+        }
+    }
+}
+
+static void _urob_http_server_connection_loop(urob_http_server_connection * connection)
+{
+    switch (connection->state)
+    {
+        case HTTP_SERVER_CONNECTION_STATE_REQUEST:
+            _urob_http_server_receive(connection);
+        break;
+        case HTTP_SERVER_CONNECTION_STATE_BODY:
+            if (_urob_http_server_flush(connection)) // e.g. 100 Continue
+            {
+                _urob_http_server_receive(connection);
+            }
+        break;
+        case HTTP_SERVER_CONNECTION_STATE_RESPONSE:
+            _urob_http_server_send(connection);
+        break;
+        case HTTP_SERVER_CONNECTION_STATE_LINGER:
+            if (urob_teardown_linger(connection->conn, connection->progress_us))
+            {
+                connection->conn = NULL;
+                connection->state = HTTP_SERVER_CONNECTION_STATE_CLOSED;
+            }
+        break;
+        default:
+        break;
+    }
+
+    if (connection->err != ERR_OK)
+    {
+        connection->state = HTTP_SERVER_CONNECTION_STATE_ERROR;
+    }
+}
+
+// Round robin from where the budget ran out in the previous loop
+static void _urob_http_server_serve(urob_http_server * server)
+{
+    urob_budget_start(&server->budget, &server->budget_config);
+
+    // Slots in use from next_connection on first, then the ones before it
+    uint64_t active = (uint64_t) server->active << UROB_HTTP_SERVER_MAX_CONNECTIONS | server->active;
+    uint32_t rotated = (uint32_t) (active >> server->next_connection) & (UINT32_MAX >> (32 - UROB_HTTP_SERVER_MAX_CONNECTIONS));
+
+    for (; rotated != 0; rotated &= rotated - 1)
+    {
+        int index = (server->next_connection + __builtin_ctz(rotated)) % UROB_HTTP_SERVER_MAX_CONNECTIONS;
+        urob_http_server_connection * connection = &server->connections[index];
+        urob_http_server_connection_state state = connection->state;
+        struct netconn * conn = connection->conn; // identifies it in the trace, cleared once closed
+
+        if (! urob_budget_left(&server->budget, &server->budget_config))
+        {
+            server->next_connection = index;
+            break;
+        }
+
+        UROB_METRICS_TIME(UROB_METRICS_HTTP_SERVER_SERVE, _urob_http_server_connection_loop(connection));
+        urob_budget_spend(&server->budget, 0, 1); // once served, its writes check the budget meanwhile
+        UROB_TRACE_STATE(UROB_TRACE_HTTP_SERVER_CONNECTION, conn, state, connection->state);
+
+        if (connection->state == HTTP_SERVER_CONNECTION_STATE_DONE)
+        {
+            UROB_ACCOUNTING_REQUEST();
+
+            if (connection->content_length < 0 && ! connection->chunked) // the body ends when the connection does
+            {
+                _urob_http_server_connection_close(connection, false);
+            } else // the client closes first once it has the response (Connection: close), keeping TIME_WAIT
+            {
+                if (connection->input != NULL)
+                {
+                    _urob_http_server_free_input(connection);
+                }
+
+                connection->state = HTTP_SERVER_CONNECTION_STATE_LINGER;
+                connection->progress_us = urob_metrics_time_us();
+            }
+        } else if (connection->state == HTTP_SERVER_CONNECTION_STATE_CLOSED)
+        {
+            _urob_http_server_connection_close(connection, false);
+        } else if (connection->state == HTTP_SERVER_CONNECTION_STATE_ERROR)
+        {
+            UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_ERRORS, 1);
+            _urob_http_server_connection_close(connection, true);
+        } else if (connection->state != HTTP_SERVER_CONNECTION_STATE_LINGER &&
+            urob_metrics_time_us() - connection->progress_us > UROB_HTTP_SERVER_IDLE_US)
+        {
+            UROB_LOGD(TAG, "idle connection, aborting");
+            UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_ERRORS, 1);
+            _urob_http_server_connection_close(connection, true);
+        }
+    }
+
+    if (server->budget.exhausted)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_HTTP_SERVER_BUDGET_EXHAUSTED, 1);
+    }
+}
+
+// Rejected connections are dropped right away, without being read: the 503 costs a segment and
+// references the precomputed response, the RST costs nothing
+static bool _urob_http_server_admit(urob_http_server * server, struct netconn * conn)
+{
+    ip_addr_t address;
+    u16_t port;
+
+    if (netconn_peer(conn, &address, &port) != ERR_OK)
+    {
+        ip_addr_set_zero(&address);
+    }
+
+    switch (urob_admission_check(server->admission, &address))
+    {
+        case ADMISSION_ACCEPT:
+            return true;
+        case ADMISSION_REJECT:
+            if (server->rejected_count == UROB_HTTP_SERVER_MAX_REJECTED) // no room to wait for the client
+            {
+                urob_teardown_abort(conn);
+                break;
+            }
+
+            // The client closes once it has the 503 (Connection: close), leaving TIME_WAIT on its side.
+            // A new connection's send buffer takes it whole, anything else is reset
+            netconn_set_nonblocking(conn, true);
+            size_t written = 0;
+            err_t err = netconn_write_partly(conn, server->admission->reject, server->admission->reject_length,
+                NETCONN_NOCOPY | NETCONN_DONTBLOCK, &written);
+
+            if (err != ERR_OK || written < server->admission->reject_length)
+            {
+                UROB_LOGD(TAG, "503 not sent (%d, %u bytes), resetting", err, (unsigned) written);
+                urob_teardown_abort(conn);
+                break;
+            }
+
+            server->rejected[server->rejected_count] = conn;
+            server->rejected_us[server->rejected_count ++] = urob_metrics_time_us();
+        break;
+        case ADMISSION_RESET:
+            urob_teardown_abort(conn);
+        break;
+    }
+
+    return false;
+}
+
+// Deletes the rejected connections whose client closed, or that waited long enough
+static void _urob_http_server_linger_rejected(urob_http_server * server)
+{
+    int index = 0;
+
+    while (index < server->rejected_count)
+    {
+        if (! urob_teardown_linger(server->rejected[index], server->rejected_us[index]))
+        {
+            index ++;
+            continue;
+        }
+
+        server->rejected_count --;
+        server->rejected[index] = server->rejected[server->rejected_count];
+        server->rejected_us[index] = server->rejected_us[server->rejected_count];
+    }
+}
+
+static void _urob_http_server_loop(urob_http_server * server)
+{
+    _chk(server->err != ERR_OK, urob_http_server_uninit(server), "server error: %d", server->err);
+
+    _urob_http_server_serve(server);
+    _urob_http_server_linger_rejected(server);
+
+    if (server->conn == NULL) // worker, nothing to accept
+    {
+        return;
+    }
+
+    // Waits for new connections only when there's nothing else to do
+    netconn_set_nonblocking(server->conn, ! urob_http_server_idle(server));
+
+    struct netconn *newconn;
+    UROB_METRICS_TIME(UROB_METRICS_HTTP_SERVER_ACCEPT, server->err = netconn_accept(server->conn, &newconn));
+
+    if (server->err == ERR_OK && server->admission != NULL && ! _urob_http_server_admit(server, newconn))
+    {
+        return;
+    }
+
+    if (server->err == ERR_OK)
+    {
+        UROB_LOGI(TAG, "received connection request");
+
+        if (server->dispatch != NULL)
+        {
+            server->dispatch(newconn, server->dispatch_arg);
+        } else
+        {
+            urob_http_server_adopt(server, newconn);
+        }
+    }
+
+    if (server->err == ERR_TIMEOUT || server->err == ERR_WOULDBLOCK)
+    {
+        server->err = ERR_OK;
+    }
+}
+
+void urob_http_server_loop(urob_http_server * server)
+{
+    UROB_TRACE_LOOP(UROB_TRACE_HTTP_SERVER, server, UROB_METRICS_TIME(UROB_METRICS_HTTP_SERVER_LOOP, _urob_http_server_loop(server)));
+}
@@ -24,16 +24,234 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef __UROB_HTTP_SERVER_H__
 #define __UROB_HTTP_SERVER_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "lwip/err.h"
+#include "urob_admission.h"
+#include "urob_budget.h"
+#include "urob_tcp_info.h"
+#include "urob_template.h"
+#include "urob_trace.h"
+
+#define UROB_HTTP_SERVER_MAX_CONNECTIONS (4)
+#define UROB_HTTP_SERVER_MAX_REJECTED (4) // answered with a 503 and waiting for the client to close, reset beyond
+#define UROB_HTTP_SERVER_MAX_ROUTES (8)
+#define UROB_HTTP_SERVER_LINE_SIZE (128) // longest request line or header inspected
+#define UROB_HTTP_SERVER_PATH_SIZE (64)
+#define UROB_HTTP_SERVER_HEAD_SIZE (160) // response status line and headers
+#define UROB_HTTP_SERVER_BUFFER_SIZE (1024) // body data filled by producers, copied when sent
+#define UROB_HTTP_SERVER_MAX_PIECES (4)
+#define UROB_HTTP_SERVER_DISCARD_SIZE (1024) // largest body accepted (and discarded) by routes without a body callback
+#define UROB_HTTP_SERVER_IDLE_US (10 * 1000000) // connections waiting for the client longer than this are aborted
+
+struct netconn;
+
+typedef struct _urob_http_server urob_http_server;
+typedef struct _urob_http_server_connection urob_http_server_connection;
+
+// Receives ownership of an accepted connection, e.g. to hand it over to another loop
+typedef void (* urob_http_server_dispatch_fn)(struct netconn * conn, void * arg);
+
+// Invoked once a request's line and headers are received, must call urob_http_server_respond
+typedef void (* urob_http_server_handler_fn)(urob_http_server_connection * connection, void * arg);
+
+// Receives a slice of the request body, pointing into the received pbufs (no copies)
+// @return ERR_OK when consumed, ERR_INPROGRESS to get the same slice again at the next loop (the
+// connection stops receiving meanwhile, which closes the tcp window), any other error aborts the request
+typedef err_t (* urob_http_server_body_fn)(urob_http_server_connection * connection, const void * data, size_t length, void * arg);
+
+// The next part of a response body, filled by a producer
+typedef struct
+{
+    char * buffer; // copied when sent
+    size_t size;
+    size_t length; // of the data in buffer, or of reference
+    const void * reference; // sent instead of buffer without copies, must stay valid (e.g. in flash)
+    bool done; // the body ends with this part
+} urob_http_server_chunk;
+
+// Invoked whenever the connection can take more of the body: leaving the chunk empty (and not done)
+// means there's nothing to send yet, the producer is invoked again at the next loop
+typedef void (* urob_http_server_producer_fn)(urob_http_server_connection * connection, urob_http_server_chunk * chunk, void * arg);
 
 typedef struct
 {
-  struct netconn *conn;
+    const char * method; // NULL for any
+    const char * path; // exact, or a prefix when ending with '*'
+    urob_http_server_handler_fn handler; // invoked once the body is received, if any
+    urob_http_server_body_fn body; // NULL to discard bodies
+    long max_body_size; // larger bodies are refused (413)
+    void * arg;
+} urob_http_server_route;
+
+typedef enum
+{
+    HTTP_SERVER_CONNECTION_STATE_NONE = 0, // the slot is free
+    HTTP_SERVER_CONNECTION_STATE_REQUEST, // receiving the request line and headers
+    HTTP_SERVER_CONNECTION_STATE_BODY, // receiving the request body
+    HTTP_SERVER_CONNECTION_STATE_RESPONSE, // sending the response as it's produced
+    HTTP_SERVER_CONNECTION_STATE_DONE,
+    HTTP_SERVER_CONNECTION_STATE_LINGER, // waiting for the client to close first, see urob_teardown_linger
+    HTTP_SERVER_CONNECTION_STATE_CLOSED, // the slot is freed at the next loop
+    HTTP_SERVER_CONNECTION_STATE_ERROR
+} urob_http_server_connection_state;
+
+typedef enum
+{
+    HTTP_SERVER_BODY_STATE_DATA,
+    HTTP_SERVER_BODY_STATE_CHUNK_SIZE,
+    HTTP_SERVER_BODY_STATE_CHUNK_END,
+    HTTP_SERVER_BODY_STATE_TRAILER,
+    HTTP_SERVER_BODY_STATE_DONE
+} urob_http_server_body_state;
+
+// Data to send, in order
+typedef struct
+{
+    const char * ptr;
+    size_t length;
+    bool copy; // false for data that outlives the connection
+} urob_http_server_piece;
+
+struct _urob_http_server_connection
+{
+    struct netconn * conn;
+    urob_http_server * server;
+    urob_http_server_connection_state state;
+    err_t err;
+    uint32_t progress_us; // last time the client sent or took data, or since lingering
+    uint32_t bytes_received;
+    uint32_t bytes_sent;
+
+    // Request
+    char method[8];
+    char path[UROB_HTTP_SERVER_PATH_SIZE];
+    bool path_too_long; // answered with 414, path is empty
+    bool http_1_0;
+    char line[UROB_HTTP_SERVER_LINE_SIZE];
+    int line_length;
+    const urob_http_server_route * route; // NULL if not found
+
+    // Request body
+    long request_length; // Content-Length, -1 if not announced
+    bool request_chunked;
+    bool expect_continue;
+    urob_http_server_body_state body_state;
+    long remaining; // of the body or of the current chunk
+    long body_received;
+    struct pbuf * input; // received, not consumed yet
+    size_t input_offset;
+
+    // Response
+    int status;
+    long content_length; // -1 when unknown: chunked, or until closed for http/1.0 clients
+    bool chunked;
+    bool body_done;
+    size_t body_sent;
+    urob_http_server_producer_fn producer;
+    void * producer_arg;
+
+    // State of the built-in producers, handlers may use offset
+    union
+    {
+        urob_template page;
+        urob_trace_cursor trace;
+        int metrics;
+        size_t offset;
+    } context;
+
+    urob_http_server_piece pieces[UROB_HTTP_SERVER_MAX_PIECES];
+    int piece_first;
+    int piece_count;
+    char head[UROB_HTTP_SERVER_HEAD_SIZE];
+    char buffer[UROB_HTTP_SERVER_BUFFER_SIZE];
+};
+
+struct _urob_http_server
+{
+  // Hot: read by every loop, whatever the number of connections
+  struct netconn *conn; // listening connection, NULL for workers
   err_t err;
-} urob_http_server;
+  uint32_t active; // connection slots in use, one bit each
+  int connection_count; // in use
+  int next_connection; // served first, where the budget ran out
+
+  urob_budget budget;
+  urob_budget_config budget_config; // per loop, see urob_http_server_set_budget
+  uint32_t info_us; // last pcb snapshot recorded in the metrics, see urob_tcp_info
+
+  urob_http_server_connection connections[UROB_HTTP_SERVER_MAX_CONNECTIONS];
 
+  // Rejected by the admission, lingering until the client closes first (see urob_teardown_linger)
+  struct netconn * rejected[UROB_HTTP_SERVER_MAX_REJECTED];
+  uint32_t rejected_us[UROB_HTTP_SERVER_MAX_REJECTED];
+  int rejected_count;
+
+  // Cold: configuration, read once per request or accepted connection
+  urob_http_server_dispatch_fn dispatch;
+  void * dispatch_arg;
+
+  urob_http_server_route routes[UROB_HTTP_SERVER_MAX_ROUTES];
+  int route_count;
+  urob_http_server_route fallback; // GET requests matching no route, see urob_http_server_set_fallback
+  urob_admission * admission; // NULL to accept everything, see urob_http_server_set_admission
+};
+
+_Static_assert(UROB_HTTP_SERVER_MAX_CONNECTIONS <= 32, "active connections mask is 32 bits");
+
+// Initializes a server listening on port 80
 void urob_http_server_init(urob_http_server *server);
+
+// Initializes a server that doesn't listen, and only serves connections passed to urob_http_server_adopt
+void urob_http_server_init_worker(urob_http_server *server);
+
+// Accepted connections are passed to dispatch instead of being served by this server
+void urob_http_server_set_dispatch(urob_http_server *server, urob_http_server_dispatch_fn dispatch, void * arg);
+
+// Adds a route, matched in order before the built-in ones ("/metrics", "/trace", "/status" and "/")
+void urob_http_server_route_add(urob_http_server *server, const char * method, const char * path, urob_http_server_handler_fn handler, void * arg);
+
+// Adds a route that receives request bodies as they arrive, see urob_http_server_body_fn
+// @discussion bodies announced larger than max_body_size are refused before being accepted (and
+// before answering "Expect: 100-continue"), chunked ones as soon as they exceed it
+void urob_http_server_route_add_body(urob_http_server *server, const char * method, const char * path, urob_http_server_handler_fn handler,
+    urob_http_server_body_fn body, long max_body_size, void * arg);
+
+// Handles the GET requests that match neither a route nor a built-in path, instead of the built-in page
+// (e.g. to serve files, see urob_fsimage_serve)
+void urob_http_server_set_fallback(urob_http_server *server, urob_http_server_handler_fn handler, void * arg);
+
+// Checks new connections against admission before serving (or dispatching) them: rejected ones get a
+// 503 with Retry-After, or are reset when even that can't be afforded
+// @discussion set the same admission on the workers too, so that it's released when their connections close
+void urob_http_server_set_admission(urob_http_server *server, urob_admission * admission);
+
+// Limits the work done by each loop call across connections (messages count the connections served),
+// the connections left are served first at the next one
+void urob_http_server_set_budget(urob_http_server *server, const urob_budget_config * config);
+
+// Serves a connection accepted elsewhere, takes ownership of conn
+void urob_http_server_adopt(urob_http_server *server, struct netconn *conn);
+
+// Starts the response of a handler, the body is produced as the connection can take it
+// @param content_length -1 if unknown (chunked encoding)
+void urob_http_server_respond(urob_http_server_connection * connection, int status, const char * content_type, long content_length,
+    urob_http_server_producer_fn producer, void * producer_arg);
+
+// Responds with a body that outlives the connection (e.g. in flash), sent without copies
+void urob_http_server_respond_static(urob_http_server_connection * connection, int status, const char * content_type, const void * body, size_t length);
+
+// Snapshots the pcb of a connection (through the tcpip thread), see urob_tcp_info_get
+// @discussion the servers record a snapshot of a connection done with its response in the metrics,
+// at most every UROB_TCP_INFO_INTERVAL_US
+bool urob_http_server_connection_info(urob_http_server_connection * connection, urob_tcp_info * info);
+
 void urob_http_server_uninit(urob_http_server * server);
 void urob_http_server_loop(urob_http_server *server);
 
-#endif // __UROB_HTTP_SERVER_H__
\ No newline at end of file
+// True while no connection is served: a worker's loop has nothing to do until one is adopted
+static inline bool urob_http_server_idle(const urob_http_server * server) { return server->connection_count == 0 && server->rejected_count == 0; }
+
+#endif // __UROB_HTTP_SERVER_H__
@@ -0,0 +1,628 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/pbuf.h"
+
+#include "esp_log.h"
+
+#define TAG "json"
+#include "general.h"
+
+void urob_json_init(urob_json * json, urob_json_event_fn event, void * arg)
+{
+    * json = (urob_json) {0};
+    json->event = event;
+    json->event_arg = arg;
+}
+
+void urob_json_extract_init(urob_json * json, const urob_json_field * fields, int field_count, void * target)
+{
+    urob_json_init(json, NULL, NULL);
+
+    _chk(field_count > UROB_JSON_MAX_FIELDS, field_count = UROB_JSON_MAX_FIELDS, "too many fields: %d", field_count);
+    json->fields = fields;
+    json->field_count = field_count;
+    json->target = target;
+}
+
+bool urob_json_path_is(const urob_json * json, const char * path)
+{
+    const char * cursor = path;
+
+    for (int level = 0; level < json->depth; level ++)
+    {
+        if (json->path[level].array)
+        {
+            if (* cursor != '[')
+            {
+                return false;
+            }
+
+            char * end = NULL;
+            long index = strtol(cursor + 1, &end, 10);
+            if (end == cursor + 1 || * end != ']' || index != json->path[level].index)
+            {
+                return false;
+            }
+            cursor = end + 1;
+        } else
+        {
+            if (level > 0 && * cursor ++ != '.')
+            {
+                return false;
+            }
+
+            size_t length = strcspn(cursor, ".[");
+            const char * key = json->path[level].key;
+            if (strlen(key) != length || strncmp(key, cursor, length) != 0)
+            {
+                return false;
+            }
+            cursor += length;
+        }
+    }
+
+    return * cursor == '\0';
+}
+
+int urob_json_path(const urob_json * json, char * buffer, size_t size)
+{
+    int length = 0;
+
+    for (int level = 0; level < json->depth; level ++)
+    {
+        size_t room = (size_t) length < size ? size - length : 0;
+
+        if (json->path[level].array)
+        {
+            length += snprintf(buffer + length, room, "[%d]", json->path[level].index);
+        } else
+        {
+            length += snprintf(buffer + length, room, "%s%s", level > 0 ? "." : "", json->path[level].key);
+        }
+    }
+
+    if (json->depth == 0 && size > 0)
+    {
+        buffer[0] = '\0';
+    }
+
+    return length;
+}
+
+static void _urob_json_extract(urob_json * json, urob_json_event event)
+{
+    for (int field_index = 0; field_index < json->field_count; field_index ++)
+    {
+        const urob_json_field * field = &json->fields[field_index];
+
+        if (urob_json_found(json, field_index) || ! urob_json_path_is(json, field->path))
+        {
+            continue;
+        }
+
+        void * member = (char *) json->target + field->offset;
+        bool stored = true;
+
+        switch (field->type)
+        {
+            case UROB_JSON_FIELD_STRING:
+            {
+                size_t length = json->value_length < field->size - 1 ? json->value_length : field->size - 1;
+                memcpy(member, json->value, length);
+                ((char *) member)[length] = '\0';
+            }
+            break;
+            case UROB_JSON_FIELD_INT:
+                stored = event == UROB_JSON_EVENT_NUMBER;
+                if (stored)
+                {
+                    * (int32_t *) member = (int32_t) strtol(json->value, NULL, 10);
+                }
+            break;
+            case UROB_JSON_FIELD_DOUBLE:
+                stored = event == UROB_JSON_EVENT_NUMBER;
+                if (stored)
+                {
+                    * (double *) member = strtod(json->value, NULL);
+                }
+            break;
+            case UROB_JSON_FIELD_BOOL:
+                stored = event == UROB_JSON_EVENT_TRUE || event == UROB_JSON_EVENT_FALSE;
+                if (stored)
+                {
+                    * (bool *) member = event == UROB_JSON_EVENT_TRUE;
+                }
+            break;
+        }
+
+        _chk(! stored, , "unexpected type for %s", field->path);
+        if (stored)
+        {
+            json->found |= 1u << field_index;
+        }
+    }
+}
+
+static void _urob_json_emit(urob_json * json, urob_json_event event)
+{
+    if (json->fields != NULL)
+    {
+        if (event != UROB_JSON_EVENT_OBJECT_START && event != UROB_JSON_EVENT_OBJECT_END &&
+            event != UROB_JSON_EVENT_ARRAY_START && event != UROB_JSON_EVENT_ARRAY_END)
+        {
+            _urob_json_extract(json, event);
+        }
+    } else if (json->event != NULL)
+    {
+        json->event(json, event, json->value, json->value_length, json->event_arg);
+    }
+}
+
+static void _urob_json_append(urob_json * json, char character)
+{
+    if (json->value_length < UROB_JSON_MAX_VALUE - 1)
+    {
+        json->value[json->value_length ++] = character;
+        json->value[json->value_length] = '\0';
+    } else
+    {
+        json->truncated = true;
+    }
+}
+
+static void _urob_json_append_key(urob_json * json, char character)
+{
+    char * key = json->path[json->depth - 1].key;
+    size_t length = strlen(key);
+
+    if (length < UROB_JSON_MAX_KEY - 1)
+    {
+        key[length] = character;
+        key[length + 1] = '\0';
+    }
+}
+
+// Appends a decoded \u escape as utf-8
+static void _urob_json_append_code_point(urob_json * json, uint32_t code_point)
+{
+    void (* append)(urob_json *, char) = json->string_state == JSON_STATE_KEY ? _urob_json_append_key : _urob_json_append;
+
+    if (code_point < 0x80)
+    {
+        append(json, code_point);
+    } else if (code_point < 0x800)
+    {
+        append(json, 0xc0 | (code_point >> 6));
+        append(json, 0x80 | (code_point & 0x3f));
+    } else if (code_point < 0x10000)
+    {
+        append(json, 0xe0 | (code_point >> 12));
+        append(json, 0x80 | ((code_point >> 6) & 0x3f));
+        append(json, 0x80 | (code_point & 0x3f));
+    } else
+    {
+        append(json, 0xf0 | (code_point >> 18));
+        append(json, 0x80 | ((code_point >> 12) & 0x3f));
+        append(json, 0x80 | ((code_point >> 6) & 0x3f));
+        append(json, 0x80 | (code_point & 0x3f));
+    }
+}
+
+static bool _urob_json_push(urob_json * json, bool array)
+{
+    if (json->depth == UROB_JSON_MAX_DEPTH)
+    {
+        ESP_LOGE(TAG, "too deep at offset %u", (unsigned) json->offset);
+        json->state = JSON_STATE_ERROR;
+        return false;
+    }
+
+    json->path[json->depth].array = array;
+    json->path[json->depth].index = 0;
+    json->path[json->depth].key[0] = '\0';
+    json->depth ++;
+    return true;
+}
+
+// After a complete value, the document is done once it's the root
+static void _urob_json_value_end(urob_json * json)
+{
+    json->state = json->depth == 0 ? JSON_STATE_DONE : JSON_STATE_AFTER_VALUE;
+}
+
+static void _urob_json_pop(urob_json * json, urob_json_event event)
+{
+    json->depth --;
+    json->value_length = 0;
+    json->value[0] = '\0';
+    _urob_json_emit(json, event);
+    _urob_json_value_end(json);
+}
+
+static bool _urob_json_is_space(char character)
+{
+    return character == ' ' || character == '\t' || character == '\r' || character == '\n';
+}
+
+static char _urob_json_unescape(char character)
+{
+    switch (character)
+    {
+        case '"': return '"';
+        case '\\': return '\\';
+        case '/': return '/';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        default: return 0;
+    }
+}
+
+// Starts a value with its first character
+static void _urob_json_value(urob_json * json, char character)
+{
+    json->value_length = 0;
+    json->value[0] = '\0';
+    json->truncated = false;
+
+    if (character == '{')
+    {
+        _urob_json_emit(json, UROB_JSON_EVENT_OBJECT_START);
+        json->state = _urob_json_push(json, false) ? JSON_STATE_KEY_OR_END : JSON_STATE_ERROR;
+    } else if (character == '[')
+    {
+        _urob_json_emit(json, UROB_JSON_EVENT_ARRAY_START);
+        json->state = _urob_json_push(json, true) ? JSON_STATE_VALUE_OR_END : JSON_STATE_ERROR;
+    } else if (character == '"')
+    {
+        json->state = JSON_STATE_STRING;
+    } else if (character == '-' || (character >= '0' && character <= '9'))
+    {
+        _urob_json_append(json, character);
+        json->state = JSON_STATE_NUMBER;
+    } else if (character == 't' || character == 'f' || character == 'n')
+    {
+        _urob_json_append(json, character);
+        json->state = JSON_STATE_LITERAL;
+    } else
+    {
+        json->state = JSON_STATE_ERROR;
+    }
+}
+
+// As json's grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, which strtod is more lenient than
+static bool _urob_json_number_valid(const char * number)
+{
+    const char * c = number + (* number == '-');
+
+    if (* c == '0')
+    {
+        c ++;
+    } else if (* c >= '1' && * c <= '9')
+    {
+        while (* c >= '0' && * c <= '9') c ++;
+    } else
+    {
+        return false;
+    }
+
+    if (* c == '.')
+    {
+        const char * digits = ++ c;
+        while (* c >= '0' && * c <= '9') c ++;
+        if (c == digits)
+        {
+            return false;
+        }
+    }
+
+    if (* c == 'e' || * c == 'E')
+    {
+        c += c[1] == '+' || c[1] == '-' ? 2 : 1;
+        const char * digits = c;
+        while (* c >= '0' && * c <= '9') c ++;
+        if (c == digits)
+        {
+            return false;
+        }
+    }
+
+    return * c == '\0';
+}
+
+// Ends a number or literal: numbers are only terminated by the character after them (or by
+// urob_json_finish), literals as soon as they're complete
+static void _urob_json_scalar_end(urob_json * json)
+{
+    if (json->state == JSON_STATE_NUMBER)
+    {
+        if (json->truncated || ! _urob_json_number_valid(json->value))
+        {
+            json->state = JSON_STATE_ERROR;
+            return;
+        }
+        _urob_json_emit(json, UROB_JSON_EVENT_NUMBER);
+    } else if (strcmp(json->value, "true") == 0)
+    {
+        _urob_json_emit(json, UROB_JSON_EVENT_TRUE);
+    } else if (strcmp(json->value, "false") == 0)
+    {
+        _urob_json_emit(json, UROB_JSON_EVENT_FALSE);
+    } else if (strcmp(json->value, "null") == 0)
+    {
+        _urob_json_emit(json, UROB_JSON_EVENT_NULL);
+    } else
+    {
+        json->state = JSON_STATE_ERROR;
+        return;
+    }
+
+    _urob_json_value_end(json);
+}
+
+static void _urob_json_character(urob_json * json, char character)
+{
+    switch (json->state)
+    {
+        case JSON_STATE_VALUE_OR_END:
+            if (character == ']')
+            {
+                _urob_json_pop(json, UROB_JSON_EVENT_ARRAY_END);
+                return;
+            }
+        // fallthrough
+        case JSON_STATE_VALUE:
+            if (! _urob_json_is_space(character))
+            {
+                _urob_json_value(json, character);
+            }
+        break;
+        case JSON_STATE_KEY_OR_END:
+            if (character == '}')
+            {
+                _urob_json_pop(json, UROB_JSON_EVENT_OBJECT_END);
+                return;
+            }
+        // fallthrough
+        case JSON_STATE_KEY_START:
+            if (character == '"')
+            {
+                json->path[json->depth - 1].key[0] = '\0';
+                json->state = JSON_STATE_KEY;
+            } else if (! _urob_json_is_space(character))
+            {
+                json->state = JSON_STATE_ERROR;
+            }
+        break;
+        case JSON_STATE_KEY:
+            if (character == '"')
+            {
+                json->state = JSON_STATE_COLON;
+            } else if (character == '\\')
+            {
+                json->state = JSON_STATE_KEY_ESCAPE;
+            } else
+            {
+                _urob_json_append_key(json, character);
+            }
+        break;
+        case JSON_STATE_COLON:
+            if (character == ':')
+            {
+                json->state = JSON_STATE_VALUE;
+            } else if (! _urob_json_is_space(character))
+            {
+                json->state = JSON_STATE_ERROR;
+            }
+        break;
+        case JSON_STATE_STRING:
+            if (character == '"')
+            {
+                _urob_json_emit(json, UROB_JSON_EVENT_STRING);
+                _urob_json_value_end(json);
+            } else if (character == '\\')
+            {
+                json->state = JSON_STATE_STRING_ESCAPE;
+            } else if ((unsigned char) character < 0x20)
+            {
+                json->state = JSON_STATE_ERROR;
+            } else
+            {
+                _urob_json_append(json, character);
+            }
+        break;
+        case JSON_STATE_KEY_ESCAPE:
+        case JSON_STATE_STRING_ESCAPE:
+        {
+            urob_json_state string_state = json->state == JSON_STATE_KEY_ESCAPE ? JSON_STATE_KEY : JSON_STATE_STRING;
+
+            if (character == 'u')
+            {
+                json->string_state = string_state;
+                json->unicode = 0;
+                json->unicode_digits = 0;
+                json->state = JSON_STATE_UNICODE;
+                return;
+            }
+
+            char unescaped = _urob_json_unescape(character);
+            if (unescaped == 0)
+            {
+                json->state = JSON_STATE_ERROR;
+                return;
+            }
+
+            if (string_state == JSON_STATE_KEY)
+            {
+                _urob_json_append_key(json, unescaped);
+            } else
+            {
+                _urob_json_append(json, unescaped);
+            }
+            json->state = string_state;
+        }
+        break;
+        case JSON_STATE_UNICODE:
+        {
+            int digit = character >= '0' && character <= '9' ? character - '0' :
+                character >= 'a' && character <= 'f' ? character - 'a' + 10 :
+                character >= 'A' && character <= 'F' ? character - 'A' + 10 : -1;
+
+            if (digit < 0)
+            {
+                json->state = JSON_STATE_ERROR;
+                return;
+            }
+
+            json->unicode = json->unicode << 4 | digit;
+            if (++ json->unicode_digits < 4)
+            {
+                return;
+            }
+
+            json->state = json->string_state;
+
+            if (json->unicode >= 0xd800 && json->unicode < 0xdc00) // first half of a surrogate pair
+            {
+                json->high_surrogate = json->unicode;
+            } else if (json->unicode >= 0xdc00 && json->unicode < 0xe000 && json->high_surrogate)
+            {
+                _urob_json_append_code_point(json, 0x10000 + ((json->high_surrogate - 0xd800) << 10) + (json->unicode - 0xdc00));
+                json->high_surrogate = 0;
+            } else
+            {
+                _urob_json_append_code_point(json, json->unicode);
+                json->high_surrogate = 0;
+            }
+        }
+        break;
+        case JSON_STATE_LITERAL:
+            if (character >= 'a' && character <= 'z' && json->value_length < 5)
+            {
+                _urob_json_append(json, character);
+                if (strcmp(json->value, "true") == 0 || strcmp(json->value, "false") == 0 || strcmp(json->value, "null") == 0)
+                {
+                    _urob_json_scalar_end(json);
+                }
+                return;
+            }
+
+            json->state = JSON_STATE_ERROR; // not a literal
+        break;
+        case JSON_STATE_NUMBER:
+            if (strchr("0123456789+-.eE", character) != NULL && character != '\0')
+            {
+                _urob_json_append(json, character);
+                return;
+            }
+
+            _urob_json_scalar_end(json);
+            if (json->state != JSON_STATE_ERROR)
+            {
+                _urob_json_character(json, character);
+            }
+        break;
+        case JSON_STATE_AFTER_VALUE:
+            if (_urob_json_is_space(character))
+            {
+                return;
+            } else if (character == ',')
+            {
+                if (json->path[json->depth - 1].array)
+                {
+                    json->path[json->depth - 1].index ++;
+                    json->state = JSON_STATE_VALUE;
+                } else
+                {
+                    json->state = JSON_STATE_KEY_START;
+                }
+            } else if (character == '}' && ! json->path[json->depth - 1].array)
+            {
+                _urob_json_pop(json, UROB_JSON_EVENT_OBJECT_END);
+            } else if (character == ']' && json->path[json->depth - 1].array)
+            {
+                _urob_json_pop(json, UROB_JSON_EVENT_ARRAY_END);
+            } else
+            {
+                json->state = JSON_STATE_ERROR;
+            }
+        break;
+        case JSON_STATE_DONE:
+            if (! _urob_json_is_space(character))
+            {
+                json->state = JSON_STATE_ERROR;
+            }
+        break;
+        case JSON_STATE_ERROR:
+        break;
+    }
+}
+
+err_t urob_json_feed(urob_json * json, const char * data, size_t length)
+{
+    if (json->state == JSON_STATE_ERROR)
+    {
+        return ERR_VAL;
+    }
+
+    for (size_t index = 0; index < length && json->state != JSON_STATE_ERROR; index ++)
+    {
+        _urob_json_character(json, data[index]);
+        json->offset ++;
+    }
+
+    _chk(json->state == JSON_STATE_ERROR, return ERR_VAL, "malformed document at offset %u", (unsigned) json->offset);
+    return ERR_OK;
+}
+
+err_t urob_json_finish(urob_json * json)
+{
+    if (json->state == JSON_STATE_NUMBER && json->depth == 0)
+    {
+        _urob_json_scalar_end(json);
+    }
+
+    _chk(json->state != JSON_STATE_DONE, return ERR_VAL, "incomplete document at offset %u", (unsigned) json->offset);
+    return ERR_OK;
+}
+
+err_t urob_json_feed_pbuf(urob_json * json, const struct pbuf * chain)
+{
+    err_t err = ERR_OK;
+
+    for (const struct pbuf * segment = chain; segment != NULL && err == ERR_OK; segment = segment->next)
+    {
+        err = urob_json_feed(json, (const char *) segment->payload, segment->len);
+    }
+
+    return err;
+}
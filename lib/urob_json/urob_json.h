@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_JSON_H__
+#define __UROB_JSON_H__
+
+// Incremental json tokenizer: the document is fed in slices as it arrives (e.g. pbuf by pbuf)
+// and reported as events, with the path of each value tracked. No allocations, and the state
+// is bounded by the limits below, whatever the size of the document.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/err.h"
+
+#define UROB_JSON_MAX_DEPTH (8)
+#define UROB_JSON_MAX_KEY (24) // longer keys are truncated
+#define UROB_JSON_MAX_VALUE (64) // longer strings are truncated, see urob_json.truncated
+#define UROB_JSON_MAX_FIELDS (32)
+
+typedef enum
+{
+    UROB_JSON_EVENT_OBJECT_START,
+    UROB_JSON_EVENT_OBJECT_END,
+    UROB_JSON_EVENT_ARRAY_START,
+    UROB_JSON_EVENT_ARRAY_END,
+    UROB_JSON_EVENT_STRING,
+    UROB_JSON_EVENT_NUMBER,
+    UROB_JSON_EVENT_TRUE,
+    UROB_JSON_EVENT_FALSE,
+    UROB_JSON_EVENT_NULL
+} urob_json_event;
+
+typedef enum
+{
+    JSON_STATE_VALUE = 0, // expecting a value
+    JSON_STATE_KEY_OR_END, // after '{'
+    JSON_STATE_VALUE_OR_END, // after '['
+    JSON_STATE_KEY_START, // after ',' in an object
+    JSON_STATE_KEY,
+    JSON_STATE_KEY_ESCAPE,
+    JSON_STATE_COLON,
+    JSON_STATE_STRING,
+    JSON_STATE_STRING_ESCAPE,
+    JSON_STATE_UNICODE, // \uXXXX, in a key or a string
+    JSON_STATE_NUMBER,
+    JSON_STATE_LITERAL,
+    JSON_STATE_AFTER_VALUE, // expecting ',' or the end of the container
+    JSON_STATE_DONE,
+    JSON_STATE_ERROR
+} urob_json_state;
+
+typedef struct _urob_json urob_json;
+
+// Values are NUL terminated, numbers are passed as text
+typedef void (* urob_json_event_fn)(urob_json * json, urob_json_event event, const char * value, size_t length, void * arg);
+
+typedef enum
+{
+    UROB_JSON_FIELD_STRING, // char array of field.size bytes
+    UROB_JSON_FIELD_INT, // int32_t
+    UROB_JSON_FIELD_DOUBLE,
+    UROB_JSON_FIELD_BOOL
+} urob_json_field_type;
+
+// A value to extract into a struct, by path (e.g. "connection.asn" or "ips[0]")
+typedef struct
+{
+    const char * path;
+    urob_json_field_type type;
+    size_t offset;
+    size_t size;
+} urob_json_field;
+
+#define UROB_JSON_FIELD(struct_type, member, field_path, field_type) \
+    { .path = field_path, .type = field_type, .offset = offsetof(struct_type, member), .size = sizeof(((struct_type *) 0)->member) }
+
+struct _urob_json
+{
+    urob_json_state state;
+    urob_json_state string_state; // where a \u escape returns to
+
+    // Containers from the root, with the key (objects) or index (arrays) of the current member
+    int depth;
+    struct
+    {
+        bool array;
+        int index;
+        char key[UROB_JSON_MAX_KEY];
+    } path[UROB_JSON_MAX_DEPTH];
+
+    // Scalar being read
+    char value[UROB_JSON_MAX_VALUE];
+    size_t value_length;
+    bool truncated;
+    uint32_t unicode; // code point being decoded
+    int unicode_digits;
+    uint32_t high_surrogate;
+
+    urob_json_event_fn event;
+    void * event_arg;
+
+    // Extraction, see urob_json_extract_init
+    const urob_json_field * fields;
+    int field_count;
+    void * target;
+    uint32_t found; // bit per field
+
+    size_t offset; // bytes consumed, for error reports
+};
+
+void urob_json_init(urob_json * json, urob_json_event_fn event, void * arg);
+
+// Extracts fields into target instead of reporting events
+void urob_json_extract_init(urob_json * json, const urob_json_field * fields, int field_count, void * target);
+
+// Consumes a slice of the document
+// @return ERR_OK, or ERR_VAL once the document is malformed (the rest is ignored)
+err_t urob_json_feed(urob_json * json, const char * data, size_t length);
+
+struct pbuf;
+err_t urob_json_feed_pbuf(urob_json * json, const struct pbuf * chain);
+
+// Ends the document: a root number is only complete once no more digits can follow
+// @return ERR_OK if the document is complete, ERR_VAL otherwise
+err_t urob_json_finish(urob_json * json);
+
+// True once the root value is complete (a root number needs urob_json_finish)
+static inline bool urob_json_done(const urob_json * json) { return json->state == JSON_STATE_DONE; }
+
+// True when field_index was found by urob_json_extract
+static inline bool urob_json_found(const urob_json * json, int field_index) { return (json->found >> field_index) & 1; }
+
+// Compares the path of the current value with e.g. "a.b[2].c" without formatting it
+bool urob_json_path_is(const urob_json * json, const char * path);
+
+// Formats the path of the current value
+// @return the length of the path, as snprintf
+int urob_json_path(const urob_json * json, char * buffer, size_t size);
+
+#endif // __UROB_JSON_H__
@@ -0,0 +1,415 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_log.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <time.h>
+#endif
+
+#define TAG "log"
+
+#define UROB_LOG_RING_MASK (UROB_LOG_RING_SIZE - 1)
+
+// Bounded multi-producer ring (after Vyukov): a slot is free for position p when its sequence equals
+// the lap p & ~mask and holds a record when it equals lap + 1, so a zeroed ring needs no init.
+static urob_log_record _ring[UROB_LOG_RING_SIZE];
+static atomic_uint _enqueue_position;
+static unsigned int _dequeue_position; // single consumer
+static atomic_uint _dropped;
+
+static uint32_t _urob_log_timestamp(void)
+{
+#ifdef ESP_PLATFORM
+    return esp_log_timestamp();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+#endif
+}
+
+// Finds which arguments of the site's format are strings, once: concurrent first records parse the same
+// format and store the same value
+static unsigned int _urob_log_string_args(urob_log_site * site)
+{
+    unsigned int string_args = atomic_load_explicit(&site->string_args, memory_order_relaxed);
+    if (string_args & UROB_LOG_SITE_PARSED)
+    {
+        return string_args;
+    }
+
+    string_args = UROB_LOG_SITE_PARSED;
+    int arg_index = 0;
+
+    for (const char * c = site->format; * c != '\0' && arg_index < UROB_LOG_MAX_ARGS; c ++)
+    {
+        if (* c != '%')
+        {
+            continue;
+        }
+
+        if (* ++ c == '%')
+        {
+            continue;
+        }
+
+        // Flags, width, precision and length, a * takes an argument
+        for (; * c != '\0' && strchr("-+ #0123456789.*hljztL", * c) != NULL; c ++)
+        {
+            arg_index += * c == '*';
+        }
+
+        if (* c == '\0')
+        {
+            break;
+        }
+
+        if (* c == 's' && arg_index < UROB_LOG_MAX_ARGS)
+        {
+            string_args |= 1u << arg_index;
+        }
+        arg_index ++;
+    }
+
+    atomic_store_explicit(&site->string_args, string_args, memory_order_relaxed);
+    return string_args;
+}
+
+// Appends a string argument to the record's strings, truncated when they're full
+// @return its offset
+static uintptr_t _urob_log_copy_string(urob_log_record * record, size_t * used, const char * string)
+{
+    size_t offset = * used;
+    string = string != NULL ? string : "(null)";
+    size_t length = strnlen(string, UROB_LOG_STRINGS_SIZE - 1 - offset);
+
+    memcpy(record->strings + offset, string, length);
+    record->strings[offset + length] = '\0';
+    * used = offset + length + 1 < UROB_LOG_STRINGS_SIZE ? offset + length + 1 : UROB_LOG_STRINGS_SIZE - 1;
+    return offset;
+}
+
+void urob_log_defer(urob_log_site * site, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+{
+    unsigned int string_args = _urob_log_string_args(site);
+    unsigned int position = atomic_load_explicit(&_enqueue_position, memory_order_relaxed);
+    urob_log_record * record;
+
+    for (;;)
+    {
+        record = &_ring[position & UROB_LOG_RING_MASK];
+        unsigned int sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        int difference = (int) (sequence - (position & ~UROB_LOG_RING_MASK));
+
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&_enqueue_position, &position, position + 1,
+                memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        } else if (difference < 0) // the drain is a full lap behind
+        {
+            atomic_fetch_add_explicit(&_dropped, 1, memory_order_relaxed);
+            return;
+        } else
+        {
+            position = atomic_load_explicit(&_enqueue_position, memory_order_relaxed);
+        }
+    }
+
+    record->site = site;
+    record->timestamp = _urob_log_timestamp();
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    record->args[3] = arg3;
+
+    size_t used = 0;
+    for (int arg_index = 0; arg_index < UROB_LOG_MAX_ARGS; arg_index ++)
+    {
+        if (string_args & (1u << arg_index))
+        {
+            record->args[arg_index] = _urob_log_copy_string(record, &used, (const char *) record->args[arg_index]);
+        }
+    }
+
+    atomic_store_explicit(&record->sequence, (position & ~UROB_LOG_RING_MASK) + 1, memory_order_release);
+}
+
+bool urob_log_allow(urob_log_site * site, uint32_t interval_ms, uint32_t burst)
+{
+    uint32_t now = _urob_log_timestamp();
+    uint32_t window_start = atomic_load_explicit(&site->window_start, memory_order_relaxed);
+
+    if (now - window_start >= interval_ms &&
+        atomic_compare_exchange_strong_explicit(&site->window_start, &window_start, now, memory_order_relaxed, memory_order_relaxed))
+    {
+        atomic_store_explicit(&site->window_count, 0, memory_order_relaxed);
+    }
+
+    return atomic_fetch_add_explicit(&site->window_count, 1, memory_order_relaxed) < burst;
+}
+
+static urob_log_record * _urob_log_peek(void)
+{
+    urob_log_record * record = &_ring[_dequeue_position & UROB_LOG_RING_MASK];
+    unsigned int sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+    if (sequence != (_dequeue_position & ~UROB_LOG_RING_MASK) + 1)
+    {
+        return NULL;
+    }
+
+    return record;
+}
+
+static void _urob_log_release(urob_log_record * record)
+{
+    atomic_store_explicit(&record->sequence, (_dequeue_position & ~UROB_LOG_RING_MASK) + UROB_LOG_RING_SIZE, memory_order_release);
+    _dequeue_position ++;
+}
+
+static char _urob_log_letter(esp_log_level_t level)
+{
+    switch (level)
+    {
+        case ESP_LOG_ERROR: return 'E';
+        case ESP_LOG_WARN: return 'W';
+        case ESP_LOG_INFO: return 'I';
+        case ESP_LOG_DEBUG: return 'D';
+        default: return 'V';
+    }
+}
+
+int urob_log_format(const urob_log_record * record, char * buffer, size_t size)
+{
+    urob_log_site * site = record->site;
+    unsigned int string_args = _urob_log_string_args(site);
+    uintptr_t args[UROB_LOG_MAX_ARGS];
+
+    for (int arg_index = 0; arg_index < UROB_LOG_MAX_ARGS; arg_index ++)
+    {
+        args[arg_index] = string_args & (1u << arg_index) ?
+            (uintptr_t) (record->strings + record->args[arg_index]) : record->args[arg_index];
+    }
+
+    int prefix = snprintf(buffer, size, "%c (%u) %s: ", _urob_log_letter(site->level), record->timestamp, site->tag);
+    if (prefix < 0 || (size_t) prefix >= size)
+    {
+        return prefix;
+    }
+
+    int text = snprintf(buffer + prefix, size - prefix, site->format, args[0], args[1], args[2], args[3]);
+
+    return text < 0 ? text : prefix + text;
+}
+
+int urob_log_drain(int max_records)
+{
+    int drained = 0;
+    urob_log_record * record;
+
+    uint32_t dropped = atomic_exchange_explicit(&_dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+    {
+        ESP_LOGW(TAG, "%u log records dropped", dropped);
+    }
+
+    while (drained < max_records && (record = _urob_log_peek()) != NULL)
+    {
+        const urob_log_site * site = record->site;
+        char line[160];
+        int length = urob_log_format(record, line, sizeof(line));
+        _urob_log_release(record);
+
+        if (length > 0)
+        {
+            esp_log_write(site->level, site->tag, "%s\n", line);
+        }
+        drained ++;
+    }
+
+    return drained;
+}
+
+void urob_log_dump(urob_log_write_fn write, void * arg)
+{
+    urob_log_dump_header header = {
+        .magic = UROB_LOG_MAGIC,
+        .version = UROB_LOG_VERSION,
+        .record_size = sizeof(urob_log_dump_record),
+        .dropped = atomic_exchange_explicit(&_dropped, 0, memory_order_relaxed)
+    };
+
+    if (! write(&header, sizeof(header), arg))
+    {
+        return;
+    }
+
+    urob_log_record * record;
+    while ((record = _urob_log_peek()) != NULL)
+    {
+        urob_log_record copy = * record; // the slot can be reused as soon as it's released
+        _urob_log_release(record);
+
+        const urob_log_site * site = copy.site;
+        urob_log_dump_record dumped = {
+            .timestamp = copy.timestamp,
+            .level = site->level,
+            .strings_length = UROB_LOG_STRINGS_SIZE,
+            .tag_length = strlen(site->tag),
+            .format_length = strlen(site->format)
+        };
+
+        for (int arg_index = 0; arg_index < UROB_LOG_MAX_ARGS; arg_index ++)
+        {
+            dumped.args[arg_index] = copy.args[arg_index];
+        }
+
+        if (! write(&dumped, sizeof(dumped), arg) ||
+            ! write(site->tag, dumped.tag_length, arg) ||
+            ! write(site->format, dumped.format_length, arg) ||
+            ! write(copy.strings, dumped.strings_length, arg))
+        {
+            return;
+        }
+    }
+}
+
+bool urob_log_decode(const void * dump, size_t size, urob_log_write_fn write, void * arg)
+{
+    const uint8_t * data = (const uint8_t *) dump;
+    urob_log_dump_header header;
+    char line[256];
+
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, UROB_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != UROB_LOG_VERSION ||
+        header.record_size != sizeof(urob_log_dump_record))
+    {
+        return false;
+    }
+
+    if (header.dropped > 0)
+    {
+        int length = snprintf(line, sizeof(line), "%u log records dropped\n", header.dropped);
+        if (! write(line, length, arg))
+        {
+            return true;
+        }
+    }
+
+    for (size_t position = sizeof(header); position < size; )
+    {
+        urob_log_dump_record dumped;
+        if (size - position < sizeof(dumped))
+        {
+            return false;
+        }
+
+        memcpy(&dumped, data + position, sizeof(dumped));
+        position += sizeof(dumped);
+
+        char tag[64];
+        char format[160];
+        if (dumped.tag_length >= sizeof(tag) || dumped.format_length >= sizeof(format) ||
+            dumped.strings_length != UROB_LOG_STRINGS_SIZE ||
+            size - position < (size_t) dumped.tag_length + dumped.format_length + dumped.strings_length)
+        {
+            return false;
+        }
+
+        urob_log_site site = { .tag = tag, .format = format, .level = dumped.level };
+        urob_log_record record = { .site = &site, .timestamp = dumped.timestamp };
+
+        memcpy(tag, data + position, dumped.tag_length);
+        tag[dumped.tag_length] = '\0';
+        position += dumped.tag_length;
+        memcpy(format, data + position, dumped.format_length);
+        format[dumped.format_length] = '\0';
+        position += dumped.format_length;
+        memcpy(record.strings, data + position, dumped.strings_length);
+        record.strings[UROB_LOG_STRINGS_SIZE - 1] = '\0';
+        position += dumped.strings_length;
+
+        unsigned int string_args = _urob_log_string_args(&site);
+        for (int arg_index = 0; arg_index < UROB_LOG_MAX_ARGS; arg_index ++)
+        {
+            record.args[arg_index] = dumped.args[arg_index];
+            if ((string_args & (1u << arg_index)) && record.args[arg_index] >= UROB_LOG_STRINGS_SIZE)
+            {
+                return false;
+            }
+        }
+
+        int length = urob_log_format(&record, line, sizeof(line) - 1);
+        if (length < 0)
+        {
+            return false;
+        }
+
+        length = (size_t) length < sizeof(line) - 1 ? length : (int) sizeof(line) - 2;
+        line[length ++] = '\n';
+        if (! write(line, length, arg))
+        {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+uint32_t urob_log_dropped(void)
+{
+    return atomic_load_explicit(&_dropped, memory_order_relaxed);
+}
+
+#ifdef ESP_PLATFORM
+static void _urob_log_drain_task(void * arg)
+{
+    int period_ms = (int) (intptr_t) arg;
+
+    for (;;)
+    {
+        while (urob_log_drain(UROB_LOG_RING_SIZE / 4) > 0);
+        vTaskDelay(pdMS_TO_TICKS(period_ms));
+    }
+}
+
+bool urob_log_start_drain_task(int priority, int period_ms)
+{
+    return xTaskCreate(_urob_log_drain_task, "urob log", 3072, (void *) (intptr_t) period_ms, priority, NULL) == pdPASS;
+}
+#endif
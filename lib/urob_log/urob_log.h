@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_LOG_H__
+#define __UROB_LOG_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+
+// With -DUROB_DEFERRED_LOG=1 the UROB_LOGx macros only store the format pointer and the raw
+// arguments in a ring, and the text is formatted later by urob_log_drain
+#ifndef UROB_DEFERRED_LOG
+#define UROB_DEFERRED_LOG (0)
+#endif
+
+#define UROB_LOG_MAX_ARGS (4)
+#define UROB_LOG_STRINGS_SIZE (48) // bytes per record for the %s arguments, longer ones are truncated
+#define UROB_LOG_RING_SIZE (128) // records, must be a power of two
+
+#define UROB_LOG_SITE_PARSED (1u << 31) // set in string_args once the format has been parsed
+
+#define UROB_LOG_MAGIC "ULOG"
+#define UROB_LOG_VERSION (1)
+
+// Static description of a log call site, the only pointer stored per record
+typedef struct
+{
+    const char * tag;
+    const char * format;
+    esp_log_level_t level;
+    atomic_uint string_args; // bit i set when argument i is a %s, parsed at the first record
+
+    // Rate limiting, only used by UROB_LOG_LIMITED
+    atomic_uint window_start;
+    atomic_uint window_count;
+} urob_log_site;
+
+typedef struct
+{
+    atomic_uint sequence;
+    urob_log_site * site;
+    uint32_t timestamp; // ms, as esp_log_timestamp
+    uintptr_t args[UROB_LOG_MAX_ARGS]; // offsets in strings for the %s arguments
+    char strings[UROB_LOG_STRINGS_SIZE];
+} urob_log_record;
+
+// Record as stored in a dump, little endian, followed by the tag, the format and the strings
+typedef struct __attribute__((packed))
+{
+    uint32_t timestamp;
+    uint32_t args[UROB_LOG_MAX_ARGS];
+    uint8_t level;
+    uint8_t strings_length;
+    uint16_t tag_length;
+    uint16_t format_length;
+} urob_log_dump_record;
+
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t dropped; // records dropped since the last drain or dump
+} urob_log_dump_header;
+
+// Stores a record, never blocks: when the ring is full the record is dropped and counted
+// @discussion arguments must be integers, pointers, or strings: %s arguments are copied into the record
+// (up to UROB_LOG_STRINGS_SIZE for all of them), so transient buffers are fine. Floating point values
+// are not supported
+void urob_log_defer(urob_log_site * site, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
+
+// Per call site rate limiting: at most burst records every interval_ms
+bool urob_log_allow(urob_log_site * site, uint32_t interval_ms, uint32_t burst);
+
+// Formats up to max_records records through esp_log_write, to be called from a low priority context
+// @return the number of records formatted
+int urob_log_drain(int max_records);
+
+// Formats a record in buffer (without the trailing newline)
+int urob_log_format(const urob_log_record * record, char * buffer, size_t size);
+
+// Receives a chunk of a dump or of its decoded text, return false to stop
+typedef bool (* urob_log_write_fn)(const void * data, size_t length, void * arg);
+
+// Consumes the pending records without formatting them: writes a header, then each record with the
+// strings of its call site, to be decoded later (e.g. on the host with urob_log_decode)
+void urob_log_dump(urob_log_write_fn write, void * arg);
+
+// Formats a dump, one line per record
+// @return false if the dump is malformed
+bool urob_log_decode(const void * dump, size_t size, urob_log_write_fn write, void * arg);
+
+uint32_t urob_log_dropped(void);
+
+#ifdef ESP_PLATFORM
+// Starts a task draining the ring every period_ms
+bool urob_log_start_drain_task(int priority, int period_ms);
+#endif
+
+#define _UROB_LOG_ARG_COUNT(...) _UROB_LOG_ARG_COUNT_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define _UROB_LOG_ARG_COUNT_(_0, _1, _2, _3, _4, count, ...) count
+#define _UROB_LOG_CAT(a, b) a##b
+#define _UROB_LOG_XCAT(a, b) _UROB_LOG_CAT(a, b)
+#define _UROB_LOG_ARGS_0() 0, 0, 0, 0
+#define _UROB_LOG_ARGS_1(a) (uintptr_t) (a), 0, 0, 0
+#define _UROB_LOG_ARGS_2(a, b) (uintptr_t) (a), (uintptr_t) (b), 0, 0
+#define _UROB_LOG_ARGS_3(a, b, c) (uintptr_t) (a), (uintptr_t) (b), (uintptr_t) (c), 0
+#define _UROB_LOG_ARGS_4(a, b, c, d) (uintptr_t) (a), (uintptr_t) (b), (uintptr_t) (c), (uintptr_t) (d)
+#define _UROB_LOG_ARGS(...) _UROB_LOG_XCAT(_UROB_LOG_ARGS_, _UROB_LOG_ARG_COUNT(__VA_ARGS__))(__VA_ARGS__)
+
+#define _UROB_LOG_DEFER(esp_level, site_tag, site_format, ...) do { \
+    if ((esp_level) <= LOG_LOCAL_LEVEL) { \
+        static urob_log_site _urob_log_site = { .tag = site_tag, .format = site_format, .level = esp_level }; \
+        urob_log_defer(&_urob_log_site, _UROB_LOG_ARGS(__VA_ARGS__)); \
+    } \
+} while (0)
+
+#if UROB_DEFERRED_LOG
+#define UROB_LOGE(tag, format, ...) _UROB_LOG_DEFER(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define UROB_LOGW(tag, format, ...) _UROB_LOG_DEFER(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define UROB_LOGI(tag, format, ...) _UROB_LOG_DEFER(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define UROB_LOGD(tag, format, ...) _UROB_LOG_DEFER(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#else
+#define UROB_LOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define UROB_LOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define UROB_LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define UROB_LOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+#endif
+
+// Logs at most burst times every interval_ms from this call site, e.g. for per-iteration logs
+#define UROB_LOGD_LIMITED(interval_ms, burst, site_tag, site_format, ...) do { \
+    if (ESP_LOG_DEBUG <= LOG_LOCAL_LEVEL) { \
+        static urob_log_site _urob_log_site = { .tag = site_tag, .format = site_format, .level = ESP_LOG_DEBUG }; \
+        if (urob_log_allow(&_urob_log_site, interval_ms, burst)) { \
+            UROB_LOGD(site_tag, site_format, ##__VA_ARGS__); \
+        } \
+    } \
+} while (0)
+
+#endif // __UROB_LOG_H__
@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_loop_bench.h"
+#include "urob_netsim.h"
+
+#if UROB_NETSIM
+
+#include "urob_metrics.h"
+#include "urob_tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lwip/api.h"
+#include "esp_log.h"
+
+#define TAG "loop_bench"
+#include "general.h"
+
+#define UROB_LOOP_BENCH_BACKLOG (4) // connections in flight, the simulator's listeners queue as many
+#define UROB_LOOP_BENCH_SETUP_US (60 * 1000000)
+#define UROB_LOOP_BENCH_CLOSE_BATCH (64) // closed between deliveries, not to fill the simulator's segments
+
+typedef struct
+{
+    struct netconn * listener;
+    ip_addr_t address;
+    int port;
+
+    urob_tcp * tcps;
+    urob_tcp_message * messages;
+    struct netconn ** accepted;
+    int count;
+    int started;
+    int accepted_count;
+    int connected;
+    bool failed;
+} urob_loop_bench_table;
+
+// Connects the clients a few at a time, as the listener's backlog allows
+static void _urob_loop_bench_setup(void * arg)
+{
+    urob_loop_bench_table * table = arg;
+
+    struct netconn * conn = NULL;
+    while (table->accepted_count < table->count && netconn_accept(table->listener, &conn) == ERR_OK)
+    {
+        table->accepted[table->accepted_count ++] = conn;
+    }
+
+    if (table->started < table->count && table->started - table->accepted_count < UROB_LOOP_BENCH_BACKLOG)
+    {
+        urob_tcp_init_client(&table->tcps[table->started ++], &table->address, table->port);
+    }
+
+    table->connected = 0;
+    for (int index = 0; index < table->started; index ++)
+    {
+        urob_tcp_loop(&table->tcps[index]);
+        table->connected += table->tcps[index].state == UROB_TCP_STATE_CONNECTED;
+        table->failed |= table->tcps[index].state == UROB_TCP_STATE_NONE;
+    }
+}
+
+static bool _urob_loop_bench_ready(void * arg)
+{
+    urob_loop_bench_table * table = arg;
+    return table->failed || (table->connected == table->count && table->accepted_count == table->count);
+}
+
+static void _urob_loop_bench_close(urob_loop_bench_table * table)
+{
+    for (int index = 0; index < table->count; index ++)
+    {
+        if (index < table->started)
+        {
+            urob_tcp_uninit(&table->tcps[index]);
+            urob_tcp_message_uninit(&table->messages[index]);
+        }
+
+        if (index < table->accepted_count)
+        {
+            netconn_delete(table->accepted[index]);
+        }
+
+        if (index % UROB_LOOP_BENCH_CLOSE_BATCH == UROB_LOOP_BENCH_CLOSE_BATCH - 1)
+        {
+            urob_netsim_advance(1000000);
+        }
+    }
+
+    netconn_delete(table->listener);
+    urob_netsim_advance(1000000);
+
+    free(table->tcps);
+    free(table->messages);
+    free(table->accepted);
+}
+
+// Times rounds of loops over the whole table, in urob_metrics_cycles units (ns on the host)
+static void _urob_loop_bench_measure(urob_loop_bench_table * table, int rounds, uint64_t * total, uint32_t * best)
+{
+    * total = 0;
+    * best = UINT32_MAX;
+
+    for (int round = 0; round < rounds; round ++)
+    {
+        uint32_t start = urob_metrics_cycles();
+
+        for (int index = 0; index < table->count; index ++)
+        {
+            urob_tcp_loop(&table->tcps[index]);
+        }
+
+        uint32_t elapsed = urob_metrics_cycles() - start;
+        * total += elapsed;
+        * best = elapsed < * best ? elapsed : * best;
+    }
+}
+
+#define _urob_loop_bench_json(...) do { \
+    int _length = snprintf(text, sizeof(text), __VA_ARGS__); \
+    if (_length < 0 || _length >= (int) sizeof(text) || ! write(text, _length, arg)) return false; \
+} while (0)
+
+bool urob_loop_bench_run(const urob_loop_bench_config * config, urob_loop_bench_write_fn write, void * arg)
+{
+    char text[192];
+    bool measured = true;
+    int rounds = config->rounds > 0 ? config->rounds : 1;
+
+    for (int size_index = 0; size_index < config->size_count; size_index ++)
+    {
+        int count = config->connections[size_index];
+
+        if (count <= 0 || 2 * count + 1 > UROB_NETSIM_MAX_SOCKETS) // both ends and the listener
+        {
+            _urob_loop_bench_json("{\"label\":\"%s\",\"connections\":%d,\"skipped\":true}\n", config->label ? config->label : "", count);
+            continue;
+        }
+
+        urob_loop_bench_table table = {
+            .port = config->port,
+            .tcps = calloc(count, sizeof(urob_tcp)),
+            .messages = calloc(count, sizeof(urob_tcp_message)),
+            .accepted = calloc(count, sizeof(struct netconn *)),
+            .count = count
+        };
+        ip_addr_set_loopback(0, &table.address);
+
+        table.listener = netconn_new(NETCONN_TCP);
+        _chk(table.listener == NULL || table.tcps == NULL || table.messages == NULL || table.accepted == NULL,
+            free(table.tcps); free(table.messages); free(table.accepted); return false, "out of memory");
+        netconn_bind(table.listener, IP_ADDR_ANY, config->port);
+        netconn_listen(table.listener);
+        netconn_set_nonblocking(table.listener, true);
+
+        urob_netsim_run(_urob_loop_bench_setup, _urob_loop_bench_ready, &table, 1000, UROB_LOOP_BENCH_SETUP_US);
+
+        if (! _urob_loop_bench_ready(&table) || table.failed)
+        {
+            ESP_LOGE(TAG, "%d of %d connected", table.connected, count);
+            _urob_loop_bench_close(&table);
+            _urob_loop_bench_json("{\"label\":\"%s\",\"connections\":%d,\"failed\":true}\n", config->label ? config->label : "", count);
+            measured = false;
+            continue;
+        }
+
+        for (int index = 0; index < count; index ++)
+        {
+            urob_tcp_message_init(&table.messages[index], UROB_TCP_MESSAGE_TYPE_INCOMING);
+            urob_tcp_add_message(&table.tcps[index], &table.messages[index]);
+        }
+
+        uint64_t total = 0;
+        uint32_t best = 0;
+        _urob_loop_bench_measure(&table, 1, &total, &best); // warms the caches up
+        _urob_loop_bench_measure(&table, rounds, &total, &best);
+
+        _urob_loop_bench_json("{\"label\":\"%s\",\"connections\":%d,\"rounds\":%d,\"ns_per_connection\":%.1f,\"best_ns_per_connection\":%.1f,\"tcp_size\":%u,\"tcp_cold_size\":%u}\n",
+            config->label ? config->label : "", count, rounds, (double) total / rounds / count, (double) best / count,
+            (unsigned int) sizeof(urob_tcp), (unsigned int) sizeof(urob_tcp_cold));
+
+        _urob_loop_bench_close(&table);
+    }
+
+    return measured;
+}
+
+#endif // UROB_NETSIM
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_LOOP_BENCH_H__
+#define __UROB_LOOP_BENCH_H__
+
+// Host microbenchmark of the main loop's cost per connection as the connection table grows, on the
+// netconn simulator (-DUROB_NETSIM=1, with -DUROB_NETSIM_MAX_SOCKETS raised to twice the largest table).
+// Connections are idle, each waiting for an incoming message: the loop only checks their state, which
+// is what most of the table costs most of the time.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UROB_LOOP_BENCH_MAX_SIZES (8)
+
+typedef struct
+{
+    int connections[UROB_LOOP_BENCH_MAX_SIZES]; // table sizes, e.g. 8, 32, 128, 512
+    int size_count;
+    int rounds; // loops over the whole table timed at each size
+    int port;
+    const char * label; // e.g. the commit being measured
+} urob_loop_bench_config;
+
+// Receives a chunk of the json results, return false to stop
+typedef bool (* urob_loop_bench_write_fn)(const char * text, size_t length, void * arg);
+
+// Runs the sizes in order, writing a json object per size: sizes that don't fit in the simulator's
+// sockets are reported as skipped
+// @return false if a table couldn't be connected, or write stopped the run
+// @discussion the simulator must be initialized (urob_netsim_init), connections are closed at the end
+bool urob_loop_bench_run(const urob_loop_bench_config * config, urob_loop_bench_write_fn write, void * arg);
+
+#endif // __UROB_LOOP_BENCH_H__
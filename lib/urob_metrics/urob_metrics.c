@@ -0,0 +1,318 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_metrics.h"
+#include <stdio.h>
+
+typedef struct
+{
+    const char * name;
+    const char * labels;
+    const char * help;
+} urob_metrics_description;
+
+// Entries of the same family must be contiguous
+static const urob_metrics_description _histogram_descriptions[UROB_METRICS_HISTOGRAM_COUNT] =
+{
+    [UROB_METRICS_HTTP_SERVER_LOOP] = {"urob_loop_cycles", "component=\"http_server\"", "Time spent in a component loop call (cpu cycles, ns on host)"},
+    [UROB_METRICS_HTTP_CLIENT_LOOP] = {"urob_loop_cycles", "component=\"http_client\"", NULL},
+    [UROB_METRICS_HTTP_CLIENT_TEST_LOOP] = {"urob_loop_cycles", "component=\"http_client_test\"", NULL},
+    [UROB_METRICS_TCP_LOOP] = {"urob_loop_cycles", "component=\"tcp\"", NULL},
+
+    [UROB_METRICS_HTTP_SERVER_ACCEPT] = {"urob_handler_cycles", "component=\"http_server\",handler=\"accept\"", "Time spent in a state machine handler (cpu cycles, ns on host)"},
+    [UROB_METRICS_HTTP_SERVER_SERVE] = {"urob_handler_cycles", "component=\"http_server\",handler=\"serve\"", NULL},
+    [UROB_METRICS_HTTP_CLIENT_CONNECT] = {"urob_handler_cycles", "component=\"http_client\",handler=\"connect\"", NULL},
+    [UROB_METRICS_HTTP_CLIENT_SEND] = {"urob_handler_cycles", "component=\"http_client\",handler=\"send\"", NULL},
+    [UROB_METRICS_HTTP_CLIENT_RECEIVE] = {"urob_handler_cycles", "component=\"http_client\",handler=\"receive\"", NULL},
+    [UROB_METRICS_TCP_ACCEPT] = {"urob_handler_cycles", "component=\"tcp\",handler=\"accept\"", NULL},
+    [UROB_METRICS_TCP_CONNECT] = {"urob_handler_cycles", "component=\"tcp\",handler=\"connect\"", NULL},
+    [UROB_METRICS_TCP_SEND_MESSAGE] = {"urob_handler_cycles", "component=\"tcp\",handler=\"send_message\"", NULL},
+    [UROB_METRICS_TCP_RECEIVE_MESSAGE] = {"urob_handler_cycles", "component=\"tcp\",handler=\"receive_message\"", NULL},
+
+    [UROB_METRICS_TCP_QUEUE_URGENT] = {"urob_queue_us", "component=\"tcp\",lane=\"urgent\"", "Time from adding a message to sending its first byte"},
+    [UROB_METRICS_TCP_QUEUE_NORMAL] = {"urob_queue_us", "component=\"tcp\",lane=\"normal\"", NULL},
+    [UROB_METRICS_TCP_QUEUE_BULK] = {"urob_queue_us", "component=\"tcp\",lane=\"bulk\"", NULL},
+
+    [UROB_METRICS_WIFI_UP] = {"urob_link_up_us", "component=\"wifi\"", "Time from start (or link loss) to an ip address"},
+
+    [UROB_METRICS_TLS_HANDSHAKE_FULL] = {"urob_tls_handshake_us", "resumed=\"false\"", "Time from the first handshake step to the session being ready"},
+    [UROB_METRICS_TLS_HANDSHAKE_RESUMED] = {"urob_tls_handshake_us", "resumed=\"true\"", NULL},
+
+    [UROB_METRICS_TCP_PCB_SRTT] = {"urob_tcp_pcb", "field=\"srtt_ms\"", "Snapshots of lwip's tcp_pcbs, once a second per connection (milliseconds, bytes or segments)"},
+    [UROB_METRICS_TCP_PCB_RTO] = {"urob_tcp_pcb", "field=\"rto_ms\"", NULL},
+    [UROB_METRICS_TCP_PCB_CWND] = {"urob_tcp_pcb", "field=\"cwnd\"", NULL},
+    [UROB_METRICS_TCP_PCB_SEND_WINDOW] = {"urob_tcp_pcb", "field=\"send_window\"", NULL},
+    [UROB_METRICS_TCP_PCB_RECEIVE_WINDOW] = {"urob_tcp_pcb", "field=\"receive_window\"", NULL},
+    [UROB_METRICS_TCP_PCB_UNACKED] = {"urob_tcp_pcb", "field=\"unacked\"", NULL},
+    [UROB_METRICS_TCP_PCB_RETRANSMITS] = {"urob_tcp_pcb", "field=\"retransmits\"", NULL},
+};
+
+static const urob_metrics_description _counter_descriptions[UROB_METRICS_COUNTER_COUNT] =
+{
+    [UROB_METRICS_TCP_BYTES_SENT] = {"urob_bytes_sent_total", "component=\"tcp\"", "Bytes handed over to netconn"},
+    [UROB_METRICS_HTTP_CLIENT_BYTES_SENT] = {"urob_bytes_sent_total", "component=\"http_client\"", NULL},
+    [UROB_METRICS_HTTP_SERVER_BYTES_SENT] = {"urob_bytes_sent_total", "component=\"http_server\"", NULL},
+
+    [UROB_METRICS_TCP_BYTES_RECEIVED] = {"urob_bytes_received_total", "component=\"tcp\"", "Bytes received from netconn"},
+    [UROB_METRICS_HTTP_CLIENT_BYTES_RECEIVED] = {"urob_bytes_received_total", "component=\"http_client\"", NULL},
+    [UROB_METRICS_HTTP_SERVER_BYTES_RECEIVED] = {"urob_bytes_received_total", "component=\"http_server\"", NULL},
+
+    [UROB_METRICS_TCP_MESSAGES_SENT] = {"urob_messages_total", "component=\"tcp\",direction=\"sent\"", "Messages (or requests/responses) completed"},
+    [UROB_METRICS_TCP_MESSAGES_RECEIVED] = {"urob_messages_total", "component=\"tcp\",direction=\"received\"", NULL},
+    [UROB_METRICS_HTTP_CLIENT_RESPONSES] = {"urob_messages_total", "component=\"http_client\",direction=\"received\"", NULL},
+    [UROB_METRICS_HTTP_SERVER_REQUESTS] = {"urob_messages_total", "component=\"http_server\",direction=\"received\"", NULL},
+
+    [UROB_METRICS_TCP_ERRORS] = {"urob_errors_total", "component=\"tcp\"", "Errors, each one usually ends a connection or a message"},
+    [UROB_METRICS_HTTP_CLIENT_ERRORS] = {"urob_errors_total", "component=\"http_client\"", NULL},
+    [UROB_METRICS_HTTP_SERVER_ERRORS] = {"urob_errors_total", "component=\"http_server\"", NULL},
+
+    [UROB_METRICS_ADMISSION_REJECTED] = {"urob_shed_connections_total", "action=\"reject\"", "Connections refused by admission control"},
+    [UROB_METRICS_ADMISSION_RESET] = {"urob_shed_connections_total", "action=\"reset\"", NULL},
+
+    [UROB_METRICS_TCP_MESSAGES_COALESCED] = {"urob_coalesced_messages_total", "component=\"tcp\"", "Messages gathered in a segment-sized buffer instead of written one by one"},
+
+    [UROB_METRICS_TCP_FLUSH_FULL] = {"urob_flushes_total", "component=\"tcp\",reason=\"full\"", "Writes of gathered messages, by cause"},
+    [UROB_METRICS_TCP_FLUSH_DEADLINE] = {"urob_flushes_total", "component=\"tcp\",reason=\"deadline\"", NULL},
+    [UROB_METRICS_TCP_FLUSH_EXPLICIT] = {"urob_flushes_total", "component=\"tcp\",reason=\"explicit\"", NULL},
+
+    [UROB_METRICS_TCP_BUDGET_EXHAUSTED] = {"urob_budget_exhausted_total", "component=\"tcp\"", "Loop calls that left work for the next one, see urob_budget"},
+    [UROB_METRICS_HTTP_SERVER_BUDGET_EXHAUSTED] = {"urob_budget_exhausted_total", "component=\"http_server\"", NULL},
+
+    [UROB_METRICS_TEARDOWN_ACTIVE] = {"urob_teardowns_total", "path=\"active\"", "Connections torn down: closed first here (TIME_WAIT kept here), after the peer, aborted, and TIME_WAIT pcbs reclaimed"},
+    [UROB_METRICS_TEARDOWN_PASSIVE] = {"urob_teardowns_total", "path=\"passive\"", NULL},
+    [UROB_METRICS_TEARDOWN_ABORT] = {"urob_teardowns_total", "path=\"abort\"", NULL},
+    [UROB_METRICS_TEARDOWN_RECLAIM] = {"urob_teardowns_total", "path=\"reclaim\"", NULL},
+
+    [UROB_METRICS_HTTP_CACHE_FRESH] = {"urob_http_cache_requests_total", "result=\"fresh\"", "Client requests by cache outcome: served without a request, revalidated with a 304, or fetched"},
+    [UROB_METRICS_HTTP_CACHE_REVALIDATED] = {"urob_http_cache_requests_total", "result=\"revalidated\"", NULL},
+    [UROB_METRICS_HTTP_CACHE_MISS] = {"urob_http_cache_requests_total", "result=\"miss\"", NULL},
+    [UROB_METRICS_HTTP_CACHE_STORED] = {"urob_http_cache_stored_total", "component=\"http_cache\"", "Responses stored in the http cache"},
+    [UROB_METRICS_HTTP_CACHE_BYTES_SERVED] = {"urob_http_cache_served_bytes_total", "component=\"http_cache\"", "Body bytes served from the http cache instead of the network"},
+
+    [UROB_METRICS_PRECONNECT_HIT] = {"urob_preconnect_takes_total", "result=\"hit\"", "Client connections taken ready from the preconnect pool, or opened on demand"},
+    [UROB_METRICS_PRECONNECT_MISS] = {"urob_preconnect_takes_total", "result=\"miss\"", NULL},
+    [UROB_METRICS_PRECONNECT_IDLE] = {"urob_preconnect_dropped_total", "reason=\"idle\"", "Ready connections replaced before use"},
+    [UROB_METRICS_PRECONNECT_CLOSED] = {"urob_preconnect_dropped_total", "reason=\"closed\"", NULL},
+
+    [UROB_METRICS_TCP_STATE_INIT] = {"urob_tcp_state_ms_total", "state=\"init\"", "Time spent by urob_tcp connections in each state"},
+    [UROB_METRICS_TCP_STATE_CONNECTING] = {"urob_tcp_state_ms_total", "state=\"connecting\"", NULL},
+    [UROB_METRICS_TCP_STATE_HANDSHAKING] = {"urob_tcp_state_ms_total", "state=\"handshaking\"", NULL},
+    [UROB_METRICS_TCP_STATE_CONNECTED] = {"urob_tcp_state_ms_total", "state=\"connected\"", NULL},
+    [UROB_METRICS_TCP_STATE_ACCEPTING] = {"urob_tcp_state_ms_total", "state=\"accepting\"", NULL},
+};
+
+static urob_metrics_histogram _histograms[UROB_METRICS_HISTOGRAM_COUNT];
+static atomic_uint _counters[UROB_METRICS_COUNTER_COUNT];
+
+void urob_metrics_histogram_record(urob_metrics_histogram * histogram, uint32_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[urob_metrics_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+
+    unsigned int max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max &&
+        ! atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+void urob_metrics_record(urob_metrics_histogram_id id, uint32_t value)
+{
+    urob_metrics_histogram_record(&_histograms[id], value);
+}
+
+void urob_metrics_add(urob_metrics_counter_id id, uint32_t amount)
+{
+    atomic_fetch_add_explicit(&_counters[id], amount, memory_order_relaxed);
+}
+
+void urob_metrics_histogram_reset(urob_metrics_histogram * histogram)
+{
+    atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->max, 0, memory_order_relaxed);
+
+    for (int bucket = 0; bucket < UROB_METRICS_BUCKETS; bucket ++)
+    {
+        atomic_store_explicit(&histogram->buckets[bucket], 0, memory_order_relaxed);
+    }
+}
+
+void urob_metrics_reset(void)
+{
+    for (int id = 0; id < UROB_METRICS_HISTOGRAM_COUNT; id ++)
+    {
+        urob_metrics_histogram_reset(&_histograms[id]);
+    }
+
+    for (int id = 0; id < UROB_METRICS_COUNTER_COUNT; id ++)
+    {
+        atomic_store_explicit(&_counters[id], 0, memory_order_relaxed);
+    }
+}
+
+// Highest value that falls in a bucket
+static uint32_t _urob_metrics_bucket_upper_bound(int bucket)
+{
+    if (bucket < UROB_METRICS_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int exponent = bucket / UROB_METRICS_SUB_BUCKETS + UROB_METRICS_SUB_BUCKET_BITS - 1;
+    uint64_t sub_bucket = bucket % UROB_METRICS_SUB_BUCKETS;
+    uint64_t lower_bound = (1ull << exponent) + (sub_bucket << (exponent - UROB_METRICS_SUB_BUCKET_BITS));
+    uint64_t upper_bound = lower_bound + (1ull << (exponent - UROB_METRICS_SUB_BUCKET_BITS)) - 1;
+
+    return upper_bound > UINT32_MAX ? UINT32_MAX : (uint32_t) upper_bound;
+}
+
+uint32_t urob_metrics_histogram_percentile(urob_metrics_histogram * histogram, float fraction)
+{
+    uint32_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    uint32_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint32_t threshold = (uint32_t) (fraction * count);
+    uint32_t seen = 0;
+
+    for (int bucket = 0; bucket < UROB_METRICS_BUCKETS; bucket ++)
+    {
+        seen += atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+        if (seen > threshold)
+        {
+            uint32_t upper_bound = _urob_metrics_bucket_upper_bound(bucket);
+            return upper_bound < max ? upper_bound : max;
+        }
+    }
+
+    return max;
+}
+
+uint32_t urob_metrics_percentile(urob_metrics_histogram_id id, float fraction)
+{
+    return urob_metrics_histogram_percentile(&_histograms[id], fraction);
+}
+
+uint32_t urob_metrics_max(urob_metrics_histogram_id id)
+{
+    return atomic_load_explicit(&_histograms[id].max, memory_order_relaxed);
+}
+
+uint32_t urob_metrics_count(urob_metrics_histogram_id id)
+{
+    return atomic_load_explicit(&_histograms[id].count, memory_order_relaxed);
+}
+
+uint32_t urob_metrics_counter(urob_metrics_counter_id id)
+{
+    return atomic_load_explicit(&_counters[id], memory_order_relaxed);
+}
+
+const char * urob_metrics_histogram_name(urob_metrics_histogram_id id, const char ** labels)
+{
+    * labels = _histogram_descriptions[id].labels;
+    return _histogram_descriptions[id].name;
+}
+
+const char * urob_metrics_counter_name(urob_metrics_counter_id id, const char ** labels)
+{
+    * labels = _counter_descriptions[id].labels;
+    return _counter_descriptions[id].name;
+}
+
+#define _urob_metrics_append(...) do { \
+    int _length = snprintf(buffer + length, length < size ? size - length : 0, __VA_ARGS__); \
+    if (_length < 0) return size; \
+    length += _length; \
+} while (0)
+
+// Formats a metric's lines, preceded by its family's header for the first of the family
+// @param entry histograms first, then counters
+// @return the length, size or more if it didn't fit
+static size_t _urob_metrics_format(int entry, char * buffer, size_t size)
+{
+    size_t length = 0;
+    bool histogram = entry < UROB_METRICS_HISTOGRAM_COUNT;
+    int id = histogram ? entry : entry - UROB_METRICS_HISTOGRAM_COUNT;
+    const urob_metrics_description * descriptions = histogram ? _histogram_descriptions : _counter_descriptions;
+    const urob_metrics_description * description = &descriptions[id];
+    const char * family = description->name;
+
+    if (id == 0 || descriptions[id - 1].name != family)
+    {
+        _urob_metrics_append("# HELP %s %s\n# TYPE %s %s\n", family, description->help, family, histogram ? "summary" : "counter");
+    }
+
+    if (histogram)
+    {
+        _urob_metrics_append("%s{%s,quantile=\"0.5\"} %u\n", family, description->labels, urob_metrics_percentile(id, 0.5f));
+        _urob_metrics_append("%s{%s,quantile=\"0.99\"} %u\n", family, description->labels, urob_metrics_percentile(id, 0.99f));
+        _urob_metrics_append("%s{%s,quantile=\"1\"} %u\n", family, description->labels, urob_metrics_max(id));
+        _urob_metrics_append("%s_count{%s} %u\n", family, description->labels, urob_metrics_count(id));
+    } else
+    {
+        _urob_metrics_append("%s{%s} %u\n", family, description->labels, urob_metrics_counter(id));
+    }
+
+    return length;
+}
+
+#define UROB_METRICS_ENTRY_COUNT (UROB_METRICS_HISTOGRAM_COUNT + UROB_METRICS_COUNTER_COUNT)
+
+void urob_metrics_write(urob_metrics_write_fn write, void * arg)
+{
+    char text[UROB_METRICS_TEXT_SIZE];
+
+    for (int entry = 0; entry < UROB_METRICS_ENTRY_COUNT; entry ++)
+    {
+        size_t length = _urob_metrics_format(entry, text, sizeof(text));
+
+        if (length >= sizeof(text) || ! write(text, length, arg))
+        {
+            return;
+        }
+    }
+}
+
+size_t urob_metrics_read(int * cursor, char * buffer, size_t size)
+{
+    size_t length = 0;
+
+    // Formatted in place, a metric that doesn't fit is formatted again in the next buffer
+    while (* cursor < UROB_METRICS_ENTRY_COUNT)
+    {
+        size_t entry_length = _urob_metrics_format(* cursor, buffer + length, size - length);
+
+        if (entry_length >= size - length)
+        {
+            break;
+        }
+
+        length += entry_length;
+        (* cursor) ++;
+    }
+
+    return length;
+}
@@ -0,0 +1,234 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_METRICS_H__
+#define __UROB_METRICS_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#else
+#include <time.h>
+#include "urob_netsim.h"
+#endif
+
+// Metrics can be compiled out with -DUROB_METRICS=0
+#ifndef UROB_METRICS
+#define UROB_METRICS (1)
+#endif
+
+// Log-linear histograms: values below 4 have their own bucket, then every power of two
+// is split in 4 sub-buckets (worst case error 25%)
+#define UROB_METRICS_SUB_BUCKET_BITS (2)
+#define UROB_METRICS_SUB_BUCKETS (1 << UROB_METRICS_SUB_BUCKET_BITS)
+#define UROB_METRICS_BUCKETS ((32 - UROB_METRICS_SUB_BUCKET_BITS + 1) * UROB_METRICS_SUB_BUCKETS)
+
+typedef enum
+{
+    UROB_METRICS_HTTP_SERVER_LOOP,
+    UROB_METRICS_HTTP_CLIENT_LOOP,
+    UROB_METRICS_HTTP_CLIENT_TEST_LOOP,
+    UROB_METRICS_TCP_LOOP,
+
+    UROB_METRICS_HTTP_SERVER_ACCEPT,
+    UROB_METRICS_HTTP_SERVER_SERVE,
+    UROB_METRICS_HTTP_CLIENT_CONNECT,
+    UROB_METRICS_HTTP_CLIENT_SEND,
+    UROB_METRICS_HTTP_CLIENT_RECEIVE,
+    UROB_METRICS_TCP_ACCEPT,
+    UROB_METRICS_TCP_CONNECT,
+    UROB_METRICS_TCP_SEND_MESSAGE,
+    UROB_METRICS_TCP_RECEIVE_MESSAGE,
+
+    UROB_METRICS_TCP_QUEUE_URGENT, // in urob_tcp_priority order
+    UROB_METRICS_TCP_QUEUE_NORMAL,
+    UROB_METRICS_TCP_QUEUE_BULK,
+
+    UROB_METRICS_WIFI_UP,
+
+    UROB_METRICS_TLS_HANDSHAKE_FULL,
+    UROB_METRICS_TLS_HANDSHAKE_RESUMED,
+
+    UROB_METRICS_TCP_PCB_SRTT, // see urob_tcp_info
+    UROB_METRICS_TCP_PCB_RTO,
+    UROB_METRICS_TCP_PCB_CWND,
+    UROB_METRICS_TCP_PCB_SEND_WINDOW,
+    UROB_METRICS_TCP_PCB_RECEIVE_WINDOW,
+    UROB_METRICS_TCP_PCB_UNACKED,
+    UROB_METRICS_TCP_PCB_RETRANSMITS,
+
+    UROB_METRICS_HISTOGRAM_COUNT
+} urob_metrics_histogram_id;
+
+typedef enum
+{
+    UROB_METRICS_TCP_BYTES_SENT,
+    UROB_METRICS_HTTP_CLIENT_BYTES_SENT,
+    UROB_METRICS_HTTP_SERVER_BYTES_SENT,
+
+    UROB_METRICS_TCP_BYTES_RECEIVED,
+    UROB_METRICS_HTTP_CLIENT_BYTES_RECEIVED,
+    UROB_METRICS_HTTP_SERVER_BYTES_RECEIVED,
+
+    UROB_METRICS_TCP_MESSAGES_SENT,
+    UROB_METRICS_TCP_MESSAGES_RECEIVED,
+    UROB_METRICS_HTTP_CLIENT_RESPONSES,
+    UROB_METRICS_HTTP_SERVER_REQUESTS,
+
+    UROB_METRICS_TCP_ERRORS,
+    UROB_METRICS_HTTP_CLIENT_ERRORS,
+    UROB_METRICS_HTTP_SERVER_ERRORS,
+
+    UROB_METRICS_ADMISSION_REJECTED,
+    UROB_METRICS_ADMISSION_RESET,
+
+    UROB_METRICS_TCP_MESSAGES_COALESCED,
+    UROB_METRICS_TCP_FLUSH_FULL,
+    UROB_METRICS_TCP_FLUSH_DEADLINE,
+    UROB_METRICS_TCP_FLUSH_EXPLICIT,
+
+    UROB_METRICS_TCP_BUDGET_EXHAUSTED,
+    UROB_METRICS_HTTP_SERVER_BUDGET_EXHAUSTED,
+
+    UROB_METRICS_TEARDOWN_ACTIVE,
+    UROB_METRICS_TEARDOWN_PASSIVE,
+    UROB_METRICS_TEARDOWN_ABORT,
+    UROB_METRICS_TEARDOWN_RECLAIM,
+
+    UROB_METRICS_HTTP_CACHE_FRESH,
+    UROB_METRICS_HTTP_CACHE_REVALIDATED,
+    UROB_METRICS_HTTP_CACHE_MISS,
+    UROB_METRICS_HTTP_CACHE_STORED,
+    UROB_METRICS_HTTP_CACHE_BYTES_SERVED,
+
+    UROB_METRICS_PRECONNECT_HIT,
+    UROB_METRICS_PRECONNECT_MISS,
+    UROB_METRICS_PRECONNECT_IDLE,
+    UROB_METRICS_PRECONNECT_CLOSED,
+
+    UROB_METRICS_TCP_STATE_INIT, // in urob_tcp_state order
+    UROB_METRICS_TCP_STATE_CONNECTING,
+    UROB_METRICS_TCP_STATE_HANDSHAKING,
+    UROB_METRICS_TCP_STATE_CONNECTED,
+    UROB_METRICS_TCP_STATE_ACCEPTING,
+
+    UROB_METRICS_COUNTER_COUNT
+} urob_metrics_counter_id;
+
+typedef struct
+{
+    atomic_uint count;
+    atomic_uint max;
+    atomic_uint buckets[UROB_METRICS_BUCKETS];
+} urob_metrics_histogram;
+
+// Cheap timestamp for latency measurements: cpu cycles on esp32, nanoseconds on the host
+static inline uint32_t urob_metrics_cycles(void)
+{
+#ifdef ESP_PLATFORM
+    return esp_cpu_get_ccount();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 1000000000ull + now.tv_nsec);
+#endif
+}
+
+// Microseconds since boot, for longer intervals (e.g. request latencies)
+static inline uint32_t urob_metrics_time_us(void)
+{
+#ifdef ESP_PLATFORM
+    return (uint32_t) esp_timer_get_time();
+#elif UROB_NETSIM
+    return urob_netsim_now_us(); // latencies in simulated time
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 1000000ull + now.tv_nsec / 1000);
+#endif
+}
+
+static inline int urob_metrics_bucket(uint32_t value)
+{
+    if (value < UROB_METRICS_SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    int exponent = 31 - __builtin_clz(value);
+    int sub_bucket = (value >> (exponent - UROB_METRICS_SUB_BUCKET_BITS)) & (UROB_METRICS_SUB_BUCKETS - 1);
+    return (exponent - UROB_METRICS_SUB_BUCKET_BITS + 1) * UROB_METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+// Histograms not in the registry, e.g. owned by a component
+void urob_metrics_histogram_reset(urob_metrics_histogram * histogram);
+void urob_metrics_histogram_record(urob_metrics_histogram * histogram, uint32_t value);
+uint32_t urob_metrics_histogram_percentile(urob_metrics_histogram * histogram, float fraction);
+
+void urob_metrics_record(urob_metrics_histogram_id id, uint32_t value);
+void urob_metrics_add(urob_metrics_counter_id id, uint32_t amount);
+void urob_metrics_reset(void);
+
+// Value below which the given fraction (0-1) of the samples fall, as the upper bound of its bucket
+uint32_t urob_metrics_percentile(urob_metrics_histogram_id id, float fraction);
+uint32_t urob_metrics_max(urob_metrics_histogram_id id);
+uint32_t urob_metrics_count(urob_metrics_histogram_id id);
+uint32_t urob_metrics_counter(urob_metrics_counter_id id);
+
+// Family name of a metric, and its labels (e.g. for status pages)
+const char * urob_metrics_histogram_name(urob_metrics_histogram_id id, const char ** labels);
+const char * urob_metrics_counter_name(urob_metrics_counter_id id, const char ** labels);
+
+// Receives the metrics text one line at a time, return false to stop
+typedef bool (* urob_metrics_write_fn)(const char * text, size_t length, void * arg);
+
+// Longest text of a single metric, with its family's header
+#define UROB_METRICS_TEXT_SIZE (640)
+
+// Formats all metrics in the prometheus text exposition format
+// @discussion a metric at a time is formatted on the stack, no heap is used
+void urob_metrics_write(urob_metrics_write_fn write, void * arg);
+
+// Same text as urob_metrics_write, formatted into buffer a whole metric at a time from cursor (0 to start)
+// @return the length, 0 at the end (or if buffer is smaller than a metric, see UROB_METRICS_TEXT_SIZE)
+size_t urob_metrics_read(int * cursor, char * buffer, size_t size);
+
+#if UROB_METRICS
+// Times a statement (typically a loop or handler call) into a histogram
+#define UROB_METRICS_TIME(id, statement) do { \
+    uint32_t _urob_metrics_start = urob_metrics_cycles(); \
+    statement; \
+    urob_metrics_record(id, urob_metrics_cycles() - _urob_metrics_start); \
+} while (0)
+#define UROB_METRICS_ADD(id, amount) urob_metrics_add(id, amount)
+#else
+#define UROB_METRICS_TIME(id, statement) do { statement; } while (0)
+#define UROB_METRICS_ADD(id, amount) do { } while (0)
+#endif
+
+#endif // __UROB_METRICS_H__
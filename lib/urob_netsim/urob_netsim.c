@@ -0,0 +1,1201 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_netsim.h"
+#include "urob_accounting.h"
+
+#if UROB_NETSIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/api.h"
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "esp_log.h"
+
+#define TAG "netsim"
+#include "general.h"
+
+typedef enum
+{
+    NETSIM_SEGMENT_NONE = 0,
+    NETSIM_SEGMENT_SYN, // reaches a listener
+    NETSIM_SEGMENT_ESTABLISHED, // reaches the connecting socket
+    NETSIM_SEGMENT_REFUSED,
+    NETSIM_SEGMENT_DATA,
+    NETSIM_SEGMENT_ACK, // frees send buffer space
+    NETSIM_SEGMENT_FIN,
+    NETSIM_SEGMENT_RST
+} urob_netsim_segment_type;
+
+typedef struct
+{
+    urob_netsim_segment_type type;
+    uint32_t deliver_at;
+    uint32_t order; // ties are delivered in the order segments were sent
+    int to; // socket index
+    int from;
+    uint32_t to_generation; // sockets are reused, stale segments are dropped
+    uint32_t from_generation;
+    struct pbuf * data;
+    uint32_t length;
+} urob_netsim_segment;
+
+typedef struct
+{
+    struct netconn * conn;
+    uint32_t generation;
+    int peer;
+    uint32_t peer_generation;
+    uint16_t port;
+    bool listening;
+    int accept_queue[4];
+    int accept_count;
+
+    struct pbuf * received[16]; // one pbuf per delivered segment, as lwip's recvmbox
+    int received_head;
+    int received_count;
+
+    bool fin_sent;
+    bool fin_received;
+    err_t fatal; // ERR_RST once reset, ERR_ABRT once aborted, or ERR_CONN when refused
+    struct tcp_pcb pcb; // identifies the socket for tcp_abort, with the fields read by urob_tcp_info
+    uint32_t unacked;
+    uint32_t link_free_at; // serialization of outgoing segments
+    uint32_t last_delivery; // keeps outgoing segments in order
+} urob_netsim_socket;
+
+// The netconns handed out, found back without searching the sockets
+typedef struct
+{
+    struct netconn conn; // first, freed as a netconn
+    int socket_index;
+} urob_netsim_conn;
+
+typedef struct
+{
+    char name[32];
+    ip_addr_t address;
+} urob_netsim_host;
+
+typedef struct
+{
+    const char * name;
+    ip_addr_t * address;
+    dns_found_callback found;
+    void * arg;
+    uint32_t resolve_at;
+} urob_netsim_lookup;
+
+typedef struct
+{
+    urob_netsim_link link;
+    uint32_t random;
+    uint32_t now;
+    uint32_t order;
+    uint32_t generation;
+    urob_netsim_stats stats;
+
+    urob_netsim_socket sockets[UROB_NETSIM_MAX_SOCKETS];
+    urob_netsim_segment segments[UROB_NETSIM_MAX_SEGMENTS];
+    urob_netsim_host hosts[UROB_NETSIM_MAX_HOSTS];
+    urob_netsim_lookup lookups[UROB_NETSIM_MAX_HOSTS];
+} urob_netsim;
+
+static urob_netsim _sim;
+
+static uint32_t _urob_netsim_random(void)
+{
+    // xorshift32, deterministic for a given seed
+    uint32_t x = _sim.random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    _sim.random = x;
+    return x;
+}
+
+static bool _urob_netsim_chance(uint16_t permille)
+{
+    return permille > 0 && _urob_netsim_random() % 1000 < permille;
+}
+
+void urob_netsim_init(const urob_netsim_link * link, uint32_t seed)
+{
+    urob_netsim_uninit();
+    _sim.link = * link;
+    _sim.random = seed ? seed : 1;
+
+    if (_sim.link.max_segment == 0)
+    {
+        _sim.link.max_segment = 1436;
+    }
+
+    if (_sim.link.send_buffer == 0)
+    {
+        _sim.link.send_buffer = 5744;
+    }
+
+    for (int socket_index = 0; socket_index < UROB_NETSIM_MAX_SOCKETS; socket_index ++)
+    {
+        _sim.sockets[socket_index].peer = -1;
+    }
+}
+
+void urob_netsim_uninit(void)
+{
+    for (int segment_index = 0; segment_index < UROB_NETSIM_MAX_SEGMENTS; segment_index ++)
+    {
+        if (_sim.segments[segment_index].data != NULL)
+        {
+            pbuf_free(_sim.segments[segment_index].data);
+        }
+    }
+
+    for (int socket_index = 0; socket_index < UROB_NETSIM_MAX_SOCKETS; socket_index ++)
+    {
+        urob_netsim_socket * socket = &_sim.sockets[socket_index];
+        if (socket->conn != NULL)
+        {
+            ESP_LOGW(TAG, "connection %d leaked", socket_index);
+            free(socket->conn);
+        }
+
+        for (int received_index = 0; received_index < socket->received_count; received_index ++)
+        {
+            pbuf_free(socket->received[(socket->received_head + received_index) % 16]);
+        }
+    }
+
+    _sim = (urob_netsim) {0};
+}
+
+void urob_netsim_add_host(const char * name, const ip_addr_t * address)
+{
+    for (int host_index = 0; host_index < UROB_NETSIM_MAX_HOSTS; host_index ++)
+    {
+        urob_netsim_host * host = &_sim.hosts[host_index];
+        if (host->name[0] == '\0')
+        {
+            strncpy(host->name, name, sizeof(host->name) - 1);
+            host->address = * address;
+            return;
+        }
+    }
+
+    ESP_LOGE(TAG, "too many hosts");
+}
+
+uint32_t urob_netsim_now_us(void)
+{
+    return _sim.now;
+}
+
+const urob_netsim_stats * urob_netsim_get_stats(void)
+{
+    return &_sim.stats;
+}
+
+static int _urob_netsim_socket_index(struct netconn * conn)
+{
+    if (conn == NULL)
+    {
+        return -1;
+    }
+
+    int socket_index = ((urob_netsim_conn *) conn)->socket_index;
+    if (socket_index < 0 || socket_index >= UROB_NETSIM_MAX_SOCKETS || _sim.sockets[socket_index].conn != conn)
+    {
+        return -1;
+    }
+
+    return socket_index;
+}
+
+static int _urob_netsim_new_socket(struct netconn * conn)
+{
+    for (int socket_index = 0; socket_index < UROB_NETSIM_MAX_SOCKETS; socket_index ++)
+    {
+        urob_netsim_socket * socket = &_sim.sockets[socket_index];
+        if (socket->conn == NULL)
+        {
+            * socket = (urob_netsim_socket) {0};
+            socket->conn = conn;
+            socket->generation = ++ _sim.generation;
+            socket->peer = -1;
+            conn->pcb.tcp = &socket->pcb;
+            ((urob_netsim_conn *) conn)->socket_index = socket_index;
+            return socket_index;
+        }
+    }
+
+    return -1;
+}
+
+// The link's parameters where lwip keeps its estimates, and the bytes in flight
+static void _urob_netsim_update_pcb(urob_netsim_socket * socket)
+{
+    struct tcp_pcb * pcb = &socket->pcb;
+
+    pcb->state = socket->peer >= 0 && socket->fatal == ERR_OK ? ESTABLISHED : CLOSED;
+    pcb->mss = _sim.link.max_segment;
+    pcb->sa = (s16_t) ((_sim.link.rtt_us / 500000) << 3); // in lwip's 500ms ticks, times 8
+    pcb->cwnd = pcb->snd_wnd = pcb->rcv_wnd = _sim.link.send_buffer;
+    pcb->snd_buf = _sim.link.send_buffer - socket->unacked;
+    pcb->lastack = 0;
+    pcb->snd_nxt = socket->unacked;
+}
+
+static void _urob_netsim_event(urob_netsim_socket * socket, enum netconn_evt event, u16_t length)
+{
+    if (socket->conn != NULL && socket->conn->callback != NULL)
+    {
+        socket->conn->callback(socket->conn, event, length);
+    }
+}
+
+static bool _urob_netsim_schedule(urob_netsim_segment_type type, int from, int to, uint32_t delay, struct pbuf * data, uint32_t length)
+{
+    for (int segment_index = 0; segment_index < UROB_NETSIM_MAX_SEGMENTS; segment_index ++)
+    {
+        urob_netsim_segment * segment = &_sim.segments[segment_index];
+        if (segment->type != NETSIM_SEGMENT_NONE)
+        {
+            continue;
+        }
+
+        * segment = (urob_netsim_segment) {
+            .type = type,
+            .deliver_at = _sim.now + delay,
+            .order = _sim.order ++,
+            .to = to,
+            .from = from,
+            .to_generation = from >= 0 && _sim.sockets[from].peer == to ? _sim.sockets[from].peer_generation : _sim.sockets[to].generation,
+            .from_generation = from >= 0 ? _sim.sockets[from].generation : 0,
+            .data = data,
+            .length = length
+        };
+        return true;
+    }
+
+    ESP_LOGE(TAG, "segment table full");
+    return false;
+}
+
+// One way delay of a segment sent from socket "from", keeping segments in order
+static uint32_t _urob_netsim_delay(int from, uint32_t length)
+{
+    urob_netsim_socket * socket = &_sim.sockets[from];
+    uint32_t departure = _sim.now;
+
+    if (_sim.link.bandwidth_kbps > 0)
+    {
+        if ((int32_t) (socket->link_free_at - departure) > 0)
+        {
+            departure = socket->link_free_at;
+        }
+        departure += (uint64_t) length * 8 * 1000 / _sim.link.bandwidth_kbps;
+        socket->link_free_at = departure;
+    }
+
+    uint32_t jitter = _sim.link.jitter_us ? _urob_netsim_random() % _sim.link.jitter_us : 0;
+    uint32_t delivery = departure + _sim.link.rtt_us / 2 + jitter;
+
+    if ((int32_t) (socket->last_delivery - delivery) > 0)
+    {
+        delivery = socket->last_delivery;
+    }
+    socket->last_delivery = delivery;
+
+    return delivery - _sim.now;
+}
+
+static void _urob_netsim_reset(int socket_index)
+{
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+    if (socket->conn == NULL || socket->fatal != ERR_OK)
+    {
+        return;
+    }
+
+    // Like lwip's err_tcp: the pcb is gone and the netconn goes back to NETCONN_NONE
+    socket->fatal = ERR_RST;
+    socket->conn->state = NETCONN_NONE;
+    socket->conn->pending_err = ERR_RST;
+    _urob_netsim_event(socket, NETCONN_EVT_ERROR, 0);
+}
+
+static void _urob_netsim_deliver(urob_netsim_segment * segment)
+{
+    urob_netsim_socket * socket = &_sim.sockets[segment->to];
+
+    if (socket->conn == NULL || socket->generation != segment->to_generation) // deleted meanwhile
+    {
+        return;
+    }
+
+    switch (segment->type)
+    {
+        case NETSIM_SEGMENT_SYN:
+        {
+            if (_sim.sockets[segment->from].generation != segment->from_generation) // gave up meanwhile
+            {
+                break;
+            }
+
+            struct netconn * conn = calloc(1, sizeof(urob_netsim_conn));
+            int accepted = conn ? _urob_netsim_new_socket(conn) : -1;
+
+            if (accepted < 0 || socket->accept_count == sizeof(socket->accept_queue) / sizeof(socket->accept_queue[0]))
+            {
+                free(conn);
+                if (accepted >= 0)
+                {
+                    _sim.sockets[accepted].conn = NULL;
+                }
+                _urob_netsim_schedule(NETSIM_SEGMENT_REFUSED, segment->to, segment->from, _urob_netsim_delay(segment->to, 0), NULL, 0);
+                break;
+            }
+
+            conn->type = NETCONN_TCP;
+            conn->state = NETCONN_NONE;
+            conn->callback = socket->conn->callback;
+            _sim.sockets[accepted].peer = segment->from;
+            _sim.sockets[accepted].peer_generation = segment->from_generation;
+            _sim.sockets[accepted].port = socket->port;
+            _sim.sockets[segment->from].peer = accepted;
+            _sim.sockets[segment->from].peer_generation = _sim.sockets[accepted].generation;
+
+            socket->accept_queue[socket->accept_count ++] = accepted;
+            _urob_netsim_update_pcb(&_sim.sockets[accepted]);
+            _urob_netsim_event(socket, NETCONN_EVT_RCVPLUS, 0);
+            _urob_netsim_schedule(NETSIM_SEGMENT_ESTABLISHED, accepted, segment->from, _urob_netsim_delay(accepted, 0), NULL, 0);
+        }
+        break;
+        case NETSIM_SEGMENT_ESTABLISHED:
+            socket->conn->state = NETCONN_NONE;
+            _urob_netsim_update_pcb(socket);
+            _urob_netsim_event(socket, NETCONN_EVT_SENDPLUS, 0);
+        break;
+        case NETSIM_SEGMENT_REFUSED:
+            _sim.stats.refused ++;
+            _urob_netsim_reset(segment->to);
+        break;
+        case NETSIM_SEGMENT_DATA:
+            if (_urob_netsim_chance(_sim.link.reset_permille))
+            {
+                _sim.stats.resets ++;
+                _urob_netsim_reset(segment->to);
+                if (_sim.sockets[segment->from].generation == segment->from_generation)
+                {
+                    _urob_netsim_reset(segment->from);
+                }
+                break;
+            }
+
+            if (socket->fatal != ERR_OK)
+            {
+                break;
+            }
+
+            if (socket->received_count == 16)
+            {
+                // Queue full: chained to the last pbuf like an out of sequence segment
+                pbuf_cat(socket->received[(socket->received_head + 15) % 16], segment->data);
+            } else
+            {
+                socket->received[(socket->received_head + socket->received_count ++) % 16] = segment->data;
+            }
+
+            segment->data = NULL;
+            _sim.stats.segments ++;
+            _sim.stats.bytes += segment->length;
+            _urob_netsim_event(socket, NETCONN_EVT_RCVPLUS, segment->length);
+        break;
+        case NETSIM_SEGMENT_ACK:
+            socket->unacked -= segment->length < socket->unacked ? segment->length : socket->unacked;
+            _urob_netsim_update_pcb(socket);
+            _urob_netsim_event(socket, NETCONN_EVT_SENDPLUS, segment->length);
+        break;
+        case NETSIM_SEGMENT_FIN:
+            socket->fin_received = true;
+            _urob_netsim_event(socket, NETCONN_EVT_RCVPLUS, 0);
+        break;
+        case NETSIM_SEGMENT_RST:
+            _urob_netsim_reset(segment->to);
+        break;
+        default:
+        break;
+    }
+}
+
+static void _urob_netsim_resolve(void)
+{
+    for (int lookup_index = 0; lookup_index < UROB_NETSIM_MAX_HOSTS; lookup_index ++)
+    {
+        urob_netsim_lookup * lookup = &_sim.lookups[lookup_index];
+        if (lookup->found == NULL || (int32_t) (lookup->resolve_at - _sim.now) > 0)
+        {
+            continue;
+        }
+
+        urob_netsim_lookup resolved = * lookup;
+        * lookup = (urob_netsim_lookup) {0};
+
+        const ip_addr_t * address = NULL;
+        for (int host_index = 0; host_index < UROB_NETSIM_MAX_HOSTS; host_index ++)
+        {
+            if (strcmp(_sim.hosts[host_index].name, resolved.name) == 0)
+            {
+                address = &_sim.hosts[host_index].address;
+            }
+        }
+
+        resolved.found(resolved.name, address, resolved.arg);
+    }
+}
+
+void urob_netsim_advance(uint32_t us)
+{
+    uint32_t until = _sim.now + us;
+
+    for (;;)
+    {
+        urob_netsim_segment * next = NULL;
+
+        for (int segment_index = 0; segment_index < UROB_NETSIM_MAX_SEGMENTS; segment_index ++)
+        {
+            urob_netsim_segment * segment = &_sim.segments[segment_index];
+            if (segment->type == NETSIM_SEGMENT_NONE || (int32_t) (segment->deliver_at - until) > 0)
+            {
+                continue;
+            }
+
+            if (next == NULL ||
+                (int32_t) (segment->deliver_at - next->deliver_at) < 0 ||
+                (segment->deliver_at == next->deliver_at && (int32_t) (segment->order - next->order) < 0))
+            {
+                next = segment;
+            }
+        }
+
+        if (next == NULL)
+        {
+            break;
+        }
+
+        if ((int32_t) (next->deliver_at - _sim.now) > 0)
+        {
+            _sim.now = next->deliver_at;
+        }
+
+        urob_netsim_segment segment = * next;
+        * next = (urob_netsim_segment) {0};
+        _urob_netsim_deliver(&segment);
+
+        if (segment.data != NULL)
+        {
+            pbuf_free(segment.data);
+        }
+    }
+
+    _sim.now = until;
+    _urob_netsim_resolve();
+}
+
+uint32_t urob_netsim_run(urob_netsim_loop_fn loop, urob_netsim_done_fn done, void * arg, uint32_t iteration_us, uint32_t max_us)
+{
+    uint32_t start = _sim.now;
+    uint32_t iterations = 0;
+
+    while (_sim.now - start < max_us && (done == NULL || ! done(arg)))
+    {
+        loop(arg);
+        iterations ++;
+        _sim.stats.loop_iterations ++;
+        urob_netsim_advance(iteration_us);
+    }
+
+    return iterations;
+}
+
+// Blocking calls wait in simulated time, which shows up as a long loop iteration
+static bool _urob_netsim_wait(struct netconn * conn, u8_t apiflags, bool (* ready)(int), int socket_index, uint32_t timeout_ms)
+{
+    if (netconn_is_nonblocking(conn) || (apiflags & NETCONN_DONTBLOCK))
+    {
+        return ready(socket_index);
+    }
+
+    uint32_t limit = timeout_ms ? timeout_ms * 1000 : UROB_NETSIM_BLOCKING_LIMIT_US;
+    uint32_t start = _sim.now;
+    bool waited = false;
+
+    while (! ready(socket_index) && _sim.now - start < limit)
+    {
+        urob_netsim_advance(100);
+        waited = true;
+    }
+
+    if (waited)
+    {
+        _sim.stats.blocking_waits ++;
+    }
+
+    return ready(socket_index);
+}
+
+static bool _urob_netsim_can_accept(int socket_index)
+{
+    return _sim.sockets[socket_index].accept_count > 0;
+}
+
+static bool _urob_netsim_can_receive(int socket_index)
+{
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+    return socket->received_count > 0 || socket->fin_received || socket->fatal != ERR_OK;
+}
+
+static bool _urob_netsim_can_send(int socket_index)
+{
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+    return socket->unacked < _sim.link.send_buffer || socket->fatal != ERR_OK;
+}
+
+static bool _urob_netsim_connected(int socket_index)
+{
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+    return socket->conn->state != NETCONN_CONNECT;
+}
+
+// netconn api
+
+struct netconn * netconn_new_with_proto_and_callback(enum netconn_type type, u8_t proto, netconn_callback callback)
+{
+    LWIP_UNUSED_ARG(proto);
+
+    if (_urob_netsim_chance(_sim.link.alloc_failure_permille))
+    {
+        _sim.stats.alloc_failures ++;
+        return NULL;
+    }
+
+    struct netconn * conn = calloc(1, sizeof(urob_netsim_conn));
+    _chk(conn == NULL, return NULL, "out of memory");
+
+    if (_urob_netsim_new_socket(conn) < 0)
+    {
+        ESP_LOGE(TAG, "too many connections");
+        free(conn);
+        return NULL;
+    }
+
+    conn->type = type;
+    conn->state = NETCONN_NONE;
+    conn->callback = callback;
+    return conn;
+}
+
+err_t netconn_delete(struct netconn * conn)
+{
+    int socket_index = _urob_netsim_socket_index(conn);
+    if (socket_index < 0)
+    {
+        return ERR_VAL;
+    }
+
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+
+    if (socket->peer >= 0 && ! socket->fin_sent && socket->fatal == ERR_OK)
+    {
+        _urob_netsim_schedule(NETSIM_SEGMENT_FIN, socket_index, socket->peer, _urob_netsim_delay(socket_index, 0), NULL, 0);
+    }
+
+    for (int received_index = 0; received_index < socket->received_count; received_index ++)
+    {
+        pbuf_free(socket->received[(socket->received_head + received_index) % 16]);
+    }
+
+    for (int accept_index = 0; accept_index < socket->accept_count; accept_index ++)
+    {
+        netconn_delete(_sim.sockets[socket->accept_queue[accept_index]].conn);
+    }
+
+    free(conn);
+    * socket = (urob_netsim_socket) {.peer = -1};
+    return ERR_OK;
+}
+
+err_t netconn_bind(struct netconn * conn, const ip_addr_t * address, u16_t port)
+{
+    LWIP_UNUSED_ARG(address);
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    _sim.sockets[socket_index].port = port;
+    return ERR_OK;
+}
+
+err_t netconn_listen_with_backlog(struct netconn * conn, u8_t backlog)
+{
+    LWIP_UNUSED_ARG(backlog);
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    _sim.sockets[socket_index].listening = true;
+    conn->state = NETCONN_LISTEN;
+    return ERR_OK;
+}
+
+err_t netconn_connect(struct netconn * conn, const ip_addr_t * address, u16_t port)
+{
+    LWIP_UNUSED_ARG(address); // every host in the simulation is the same host
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    if (conn->state == NETCONN_CONNECT)
+    {
+        return ERR_ALREADY;
+    }
+
+    int listener = -1;
+    for (int candidate = 0; candidate < UROB_NETSIM_MAX_SOCKETS; candidate ++)
+    {
+        if (_sim.sockets[candidate].listening && _sim.sockets[candidate].port == port)
+        {
+            listener = candidate;
+        }
+    }
+
+    _sim.stats.connections ++;
+    conn->state = NETCONN_CONNECT;
+
+    if (listener < 0)
+    {
+        _urob_netsim_schedule(NETSIM_SEGMENT_REFUSED, -1, socket_index, _sim.link.rtt_us, NULL, 0);
+    } else
+    {
+        _urob_netsim_schedule(NETSIM_SEGMENT_SYN, socket_index, listener, _urob_netsim_delay(socket_index, 0), NULL, 0);
+    }
+
+    if (netconn_is_nonblocking(conn))
+    {
+        return ERR_INPROGRESS;
+    }
+
+    _urob_netsim_wait(conn, 0, _urob_netsim_connected, socket_index, 0);
+    return _sim.sockets[socket_index].fatal;
+}
+
+err_t netconn_disconnect(struct netconn * conn)
+{
+    LWIP_UNUSED_ARG(conn);
+    return ERR_OK; // udp only in lwip
+}
+
+err_t netconn_accept(struct netconn * conn, struct netconn ** new_conn)
+{
+    * new_conn = NULL;
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0 || ! _sim.sockets[socket_index].listening, return ERR_VAL, "not listening");
+
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+
+    if (! _urob_netsim_wait(conn, 0, _urob_netsim_can_accept, socket_index, conn->recv_timeout))
+    {
+        return netconn_is_nonblocking(conn) ? ERR_WOULDBLOCK : ERR_TIMEOUT;
+    }
+
+    * new_conn = _sim.sockets[socket->accept_queue[0]].conn;
+    memmove(socket->accept_queue, socket->accept_queue + 1, -- socket->accept_count * sizeof(socket->accept_queue[0]));
+    return ERR_OK;
+}
+
+err_t netconn_recv_tcp_pbuf_flags(struct netconn * conn, struct pbuf ** new_buf, u8_t apiflags)
+{
+    * new_buf = NULL;
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+
+    if (! _urob_netsim_wait(conn, apiflags, _urob_netsim_can_receive, socket_index, conn->recv_timeout))
+    {
+        if (netconn_is_nonblocking(conn) || (apiflags & NETCONN_DONTBLOCK))
+        {
+            _sim.stats.would_block ++;
+            return ERR_WOULDBLOCK;
+        }
+        return ERR_TIMEOUT;
+    }
+
+    if (socket->received_count > 0)
+    {
+        * new_buf = socket->received[socket->received_head];
+        socket->received_head = (socket->received_head + 1) % 16;
+        socket->received_count --;
+        _urob_netsim_event(socket, NETCONN_EVT_RCVMINUS, (* new_buf)->tot_len);
+
+        // The window opens once the application has read the data
+        if (socket->peer >= 0)
+        {
+            _urob_netsim_schedule(NETSIM_SEGMENT_ACK, socket_index, socket->peer, _sim.link.rtt_us / 2, NULL, (* new_buf)->tot_len);
+        }
+        return ERR_OK;
+    }
+
+    return socket->fatal != ERR_OK ? socket->fatal : ERR_CLSD;
+}
+
+err_t netconn_recv_tcp_pbuf(struct netconn * conn, struct pbuf ** new_buf)
+{
+    return netconn_recv_tcp_pbuf_flags(conn, new_buf, 0);
+}
+
+err_t netconn_recv(struct netconn * conn, struct netbuf ** new_buf)
+{
+    * new_buf = NULL;
+
+    struct netbuf * buf = calloc(1, sizeof(struct netbuf));
+    _chk(buf == NULL, return ERR_MEM, "out of memory");
+
+    struct pbuf * p = NULL;
+    err_t err = netconn_recv_tcp_pbuf_flags(conn, &p, 0);
+    if (err != ERR_OK)
+    {
+        free(buf);
+        return err;
+    }
+
+    buf->p = buf->ptr = p;
+    * new_buf = buf;
+    return ERR_OK;
+}
+
+void netbuf_delete(struct netbuf * buf)
+{
+    if (buf != NULL)
+    {
+        if (buf->p != NULL)
+        {
+            pbuf_free(buf->p);
+        }
+        free(buf);
+    }
+}
+
+err_t netbuf_data(struct netbuf * buf, void ** dataptr, u16_t * len)
+{
+    if (buf == NULL || buf->ptr == NULL)
+    {
+        return ERR_BUF;
+    }
+
+    * dataptr = buf->ptr->payload;
+    * len = buf->ptr->len;
+    return ERR_OK;
+}
+
+err_t netconn_write_partly(struct netconn * conn, const void * dataptr, size_t size, u8_t apiflags, size_t * bytes_written)
+{
+    if (bytes_written != NULL)
+    {
+        * bytes_written = 0;
+    }
+
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    // As lwip: a write that doesn't block must be able to report a partial write
+    if ((netconn_is_nonblocking(conn) || (apiflags & NETCONN_DONTBLOCK)) && bytes_written == NULL)
+    {
+        return ERR_VAL;
+    }
+
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+
+    if (socket->fatal != ERR_OK)
+    {
+        return socket->fatal;
+    }
+
+    if (conn->state == NETCONN_CONNECT)
+    {
+        return ERR_INPROGRESS;
+    }
+
+    if (socket->peer < 0 || socket->fin_sent)
+    {
+        return ERR_CONN;
+    }
+
+    if (_urob_netsim_chance(_sim.link.alloc_failure_permille))
+    {
+        _sim.stats.alloc_failures ++;
+        return ERR_MEM;
+    }
+
+    const uint8_t * data = (const uint8_t *) dataptr;
+    size_t written = 0;
+
+    while (written < size)
+    {
+        if (! _urob_netsim_wait(conn, apiflags, _urob_netsim_can_send, socket_index, conn->send_timeout))
+        {
+            break;
+        }
+
+        if (socket->fatal != ERR_OK)
+        {
+            return socket->fatal;
+        }
+
+        size_t space = _sim.link.send_buffer - socket->unacked;
+        size_t chunk = size - written < space ? size - written : space;
+
+        if (bytes_written != NULL && chunk > 1 && _urob_netsim_chance(_sim.link.short_write_permille))
+        {
+            chunk = 1 + _urob_netsim_random() % (chunk - 1);
+            _sim.stats.short_writes ++;
+        }
+
+        // Split into segments, some at a random point
+        for (size_t offset = 0; offset < chunk; )
+        {
+            size_t length = chunk - offset < _sim.link.max_segment ? chunk - offset : _sim.link.max_segment;
+            if (length > 1 && _urob_netsim_chance(_sim.link.split_permille))
+            {
+                length = 1 + _urob_netsim_random() % (length - 1);
+                _sim.stats.splits ++;
+            }
+
+            struct pbuf * segment = pbuf_alloc(PBUF_RAW, length, PBUF_RAM);
+            if (segment == NULL)
+            {
+                chunk = offset;
+                break;
+            }
+
+            memcpy(segment->payload, data + written + offset, length);
+            _urob_netsim_schedule(NETSIM_SEGMENT_DATA, socket_index, socket->peer, _urob_netsim_delay(socket_index, length), segment, length);
+            socket->unacked += length;
+            _urob_netsim_update_pcb(socket);
+            offset += length;
+        }
+
+        written += chunk;
+
+        if (bytes_written != NULL) // partial writes are fine, the caller retries
+        {
+            break;
+        }
+    }
+
+    if (bytes_written != NULL)
+    {
+        * bytes_written = written;
+    }
+
+    if (written == 0 && size > 0)
+    {
+        _sim.stats.would_block ++;
+        return ERR_WOULDBLOCK;
+    }
+
+    return written == size || bytes_written != NULL ? ERR_OK : ERR_TIMEOUT;
+}
+
+err_t netconn_write_vectors_partly(struct netconn * conn, struct netvector * vectors, u16_t vector_count, u8_t apiflags, size_t * bytes_written)
+{
+    size_t total = 0;
+    err_t err = ERR_OK;
+
+    for (u16_t vector_index = 0; vector_index < vector_count; vector_index ++)
+    {
+        size_t written = 0;
+        err = netconn_write_partly(conn, vectors[vector_index].ptr, vectors[vector_index].len, apiflags, bytes_written ? &written : NULL);
+        total += bytes_written ? written : vectors[vector_index].len;
+
+        if (err != ERR_OK || (bytes_written != NULL && written < vectors[vector_index].len))
+        {
+            break;
+        }
+    }
+
+    if (bytes_written != NULL)
+    {
+        * bytes_written = total;
+    }
+
+    // Like lwip, a partial write is a success
+    return bytes_written != NULL && total > 0 ? ERR_OK : err;
+}
+
+err_t netconn_close(struct netconn * conn)
+{
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    urob_netsim_socket * socket = &_sim.sockets[socket_index];
+
+    if (socket->listening)
+    {
+        socket->listening = false;
+    } else if (socket->peer >= 0 && ! socket->fin_sent && socket->fatal == ERR_OK)
+    {
+        _urob_netsim_schedule(NETSIM_SEGMENT_FIN, socket_index, socket->peer, _urob_netsim_delay(socket_index, 0), NULL, 0);
+        socket->fin_sent = true;
+    }
+
+    conn->state = NETCONN_NONE;
+    return ERR_OK;
+}
+
+err_t netconn_shutdown(struct netconn * conn, u8_t shut_rx, u8_t shut_tx)
+{
+    LWIP_UNUSED_ARG(shut_rx);
+    return shut_tx ? netconn_close(conn) : ERR_OK;
+}
+
+err_t netconn_getaddr(struct netconn * conn, ip_addr_t * address, u16_t * port, u8_t local)
+{
+    int socket_index = _urob_netsim_socket_index(conn);
+    _chk(socket_index < 0, return ERR_VAL, "unknown connection");
+
+    * address = * IP_ADDR_ANY;
+    * port = local ? _sim.sockets[socket_index].port : 0;
+    return ERR_OK;
+}
+
+struct tcp_pcb * tcp_bound_pcbs;
+struct tcp_pcb * tcp_active_pcbs;
+
+// Raw api calls are made from the simulation's only thread, like the tcpip thread would, with lwip's
+// pcb lists up to date
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data * call)
+{
+    tcp_active_pcbs = NULL;
+
+    for (int socket_index = UROB_NETSIM_MAX_SOCKETS - 1; socket_index >= 0; socket_index --)
+    {
+        urob_netsim_socket * socket = &_sim.sockets[socket_index];
+        if (socket->conn != NULL && ! socket->listening && socket->peer >= 0 && socket->fatal == ERR_OK)
+        {
+            socket->pcb.next = tcp_active_pcbs;
+            tcp_active_pcbs = &socket->pcb;
+        }
+    }
+
+    return fn(call);
+}
+
+void tcp_abort(struct tcp_pcb * pcb)
+{
+    for (int socket_index = 0; socket_index < UROB_NETSIM_MAX_SOCKETS; socket_index ++)
+    {
+        urob_netsim_socket * socket = &_sim.sockets[socket_index];
+        if (socket->conn == NULL || &socket->pcb != pcb || socket->fatal != ERR_OK)
+        {
+            continue;
+        }
+
+        if (socket->peer >= 0)
+        {
+            _urob_netsim_schedule(NETSIM_SEGMENT_RST, socket_index, socket->peer, _urob_netsim_delay(socket_index, 0), NULL, 0);
+        }
+
+        // Like lwip's err_tcp with ERR_ABRT: the pcb is freed and the netconn forgets it
+        socket->fatal = ERR_ABRT;
+        socket->conn->state = NETCONN_NONE;
+        socket->conn->pending_err = ERR_ABRT;
+        socket->conn->pcb.tcp = NULL;
+        _urob_netsim_event(socket, NETCONN_EVT_ERROR, 0);
+    }
+}
+
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * address, dns_found_callback found, void * callback_arg)
+{
+    for (int lookup_index = 0; lookup_index < UROB_NETSIM_MAX_HOSTS; lookup_index ++)
+    {
+        urob_netsim_lookup * lookup = &_sim.lookups[lookup_index];
+        if (lookup->found == NULL)
+        {
+            * lookup = (urob_netsim_lookup) {
+                .name = hostname,
+                .address = address,
+                .found = found,
+                .arg = callback_arg,
+                .resolve_at = _sim.now + _sim.link.dns_delay_us
+            };
+            return ERR_INPROGRESS;
+        }
+    }
+
+    return ERR_MEM;
+}
+
+const ip_addr_t ip_addr_any; // lwip's IP_ADDR_ANY, all zeros
+
+char * ipaddr_ntoa(const ip_addr_t * address)
+{
+    static char text[16]; // not reentrant, like lwip's
+    uint32_t value = ip4_addr_get_u32(ip_2_ip4(address)); // network order
+
+    snprintf(text, sizeof(text), "%u.%u.%u.%u",
+        (unsigned) (value & 0xff), (unsigned) ((value >> 8) & 0xff), (unsigned) ((value >> 16) & 0xff), (unsigned) (value >> 24));
+    return text;
+}
+
+// pbufs, a heap backed subset of lwip's
+
+struct pbuf * pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+    LWIP_UNUSED_ARG(layer);
+
+    if (_urob_netsim_chance(_sim.link.alloc_failure_permille))
+    {
+        _sim.stats.alloc_failures ++;
+        return NULL;
+    }
+
+#if UROB_ACCOUNTING
+    urob_accounting_pbuf();
+#endif
+
+    bool has_payload = type != PBUF_ROM && type != PBUF_REF;
+    struct pbuf * p = calloc(1, sizeof(struct pbuf) + (has_payload ? length : 0));
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    p->payload = has_payload ? (void *) (p + 1) : NULL;
+    p->len = p->tot_len = length;
+    p->type_internal = (u8_t) type;
+    p->ref = 1;
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf * p)
+{
+    u8_t freed = 0;
+
+    while (p != NULL && -- p->ref == 0)
+    {
+        struct pbuf * next = p->next;
+        free(p);
+        freed ++;
+        p = next;
+    }
+
+    return freed;
+}
+
+void pbuf_ref(struct pbuf * p)
+{
+    if (p != NULL)
+    {
+        p->ref ++;
+    }
+}
+
+void pbuf_cat(struct pbuf * head, struct pbuf * tail)
+{
+    struct pbuf * p = head;
+
+    for (; p->next != NULL; p = p->next)
+    {
+        p->tot_len += tail->tot_len;
+    }
+
+    p->tot_len += tail->tot_len;
+    p->next = tail;
+}
+
+void pbuf_chain(struct pbuf * head, struct pbuf * tail)
+{
+    pbuf_cat(head, tail);
+    pbuf_ref(tail);
+}
+
+// Shrinks only, as urob needs
+void pbuf_realloc(struct pbuf * p, u16_t new_len)
+{
+    if (new_len >= p->tot_len)
+    {
+        return;
+    }
+
+    u16_t shrink = p->tot_len - new_len;
+    for (; new_len > p->len; p = p->next)
+    {
+        new_len -= p->len;
+        p->tot_len -= shrink;
+    }
+
+    p->len = p->tot_len = new_len;
+    if (p->next != NULL)
+    {
+        pbuf_free(p->next);
+        p->next = NULL;
+    }
+}
+
+u16_t pbuf_clen(const struct pbuf * p)
+{
+    u16_t count = 0;
+    for (; p != NULL; p = p->next)
+    {
+        count ++;
+    }
+    return count;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf * p, void * dataptr, u16_t length, u16_t offset)
+{
+    u16_t copied = 0;
+
+    for (; p != NULL && copied < length; p = p->next)
+    {
+        if (offset >= p->len)
+        {
+            offset -= p->len;
+            continue;
+        }
+
+        u16_t chunk = p->len - offset < length - copied ? p->len - offset : length - copied;
+        memcpy((uint8_t *) dataptr + copied, (const uint8_t *) p->payload + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+#endif // UROB_NETSIM
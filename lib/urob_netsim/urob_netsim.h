@@ -0,0 +1,115 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_NETSIM_H__
+#define __UROB_NETSIM_H__
+
+// Deterministic stand-in for the netconn api (and pbufs), for host builds with -DUROB_NETSIM=1.
+// It implements the netconn functions used by urob on top of a simulated clock and link,
+// so that the unchanged components can be run under adverse conditions (latency, jitter,
+// short writes, split segments, resets, memory exhaustion) in a fraction of the wall time.
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef UROB_NETSIM
+#define UROB_NETSIM (0)
+#endif
+
+#ifndef UROB_NETSIM_MAX_SOCKETS
+#define UROB_NETSIM_MAX_SOCKETS (32)
+#endif
+#define UROB_NETSIM_MAX_SEGMENTS (256)
+#define UROB_NETSIM_MAX_HOSTS (4)
+
+// Longest a blocking call waits (in simulated time) when no timeout is set
+#define UROB_NETSIM_BLOCKING_LIMIT_US (60 * 1000000)
+
+typedef struct
+{
+    uint32_t rtt_us;
+    uint32_t jitter_us; // added at random to each segment's one way delay, order is preserved
+    uint32_t bandwidth_kbps; // 0 for no serialization delay
+    uint32_t dns_delay_us;
+    uint16_t max_segment; // bytes, larger writes are split
+    uint32_t send_buffer; // bytes accepted by a connection before writes are short
+
+    // Probabilities, in parts per thousand
+    uint16_t split_permille; // a segment is split at a random point
+    uint16_t short_write_permille; // a write accepts only part of what fits in the send buffer
+    uint16_t reset_permille; // a delivered segment resets the connection instead
+    uint16_t alloc_failure_permille; // pbuf_alloc or a write fails with ERR_MEM
+} urob_netsim_link;
+
+typedef struct
+{
+    uint32_t loop_iterations;
+    uint32_t connections;
+    uint32_t refused;
+    uint32_t segments;
+    uint32_t bytes;
+    uint32_t splits;
+    uint32_t short_writes;
+    uint32_t would_block;
+    uint32_t resets;
+    uint32_t alloc_failures;
+    uint32_t blocking_waits; // blocking calls that had to wait for the network
+} urob_netsim_stats;
+
+// Defaults resembling a busy 2.4GHz wi-fi network
+#define UROB_NETSIM_WIFI_LINK ((urob_netsim_link) { \
+    .rtt_us = 8000, \
+    .jitter_us = 6000, \
+    .bandwidth_kbps = 8000, \
+    .dns_delay_us = 30000, \
+    .max_segment = 1436, \
+    .send_buffer = 5744, \
+    .split_permille = 100, \
+    .short_write_permille = 50, \
+    .reset_permille = 0, \
+    .alloc_failure_permille = 0 \
+})
+
+void urob_netsim_init(const urob_netsim_link * link, uint32_t seed);
+void urob_netsim_uninit(void);
+
+// Names resolved by dns_gethostbyname, after link->dns_delay_us
+void urob_netsim_add_host(const char * name, const ip_addr_t * address);
+
+uint32_t urob_netsim_now_us(void);
+
+// Moves the simulated clock forward, delivering the segments due meanwhile
+void urob_netsim_advance(uint32_t us);
+
+typedef void (* urob_netsim_loop_fn)(void * arg);
+typedef bool (* urob_netsim_done_fn)(void * arg);
+
+// Calls loop every iteration_us of simulated time until done returns true (if set) or max_us elapse
+// @return the number of loop iterations
+uint32_t urob_netsim_run(urob_netsim_loop_fn loop, urob_netsim_done_fn done, void * arg, uint32_t iteration_us, uint32_t max_us);
+
+const urob_netsim_stats * urob_netsim_get_stats(void);
+
+#endif // __UROB_NETSIM_H__
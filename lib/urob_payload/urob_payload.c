@@ -0,0 +1,262 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_payload.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lwip/api.h"
+
+#include "esp_log.h"
+
+#define TAG "payload"
+#include "general.h"
+
+void urob_payload_init(urob_payload * payload, pbuf_type type)
+{
+    * payload = (urob_payload) {0};
+    payload->type = type;
+}
+
+void urob_payload_uninit(urob_payload * payload)
+{
+    if (payload->head != NULL)
+    {
+        pbuf_free(payload->head);
+    }
+
+    urob_payload_init(payload, payload->type);
+}
+
+// Appends an empty segment with room for at least min_capacity bytes
+static bool _urob_payload_grow(urob_payload * payload, size_t min_capacity)
+{
+    if (payload->err != ERR_OK)
+    {
+        return false;
+    }
+
+    pbuf_type type = payload->type;
+    size_t capacity = UROB_PAYLOAD_SEGMENT_SIZE;
+
+    if (type == PBUF_POOL)
+    {
+        capacity = PBUF_POOL_BUFSIZE;
+    }
+
+    if (min_capacity > capacity) // doesn't fit a pool buffer, or larger than a segment
+    {
+        type = PBUF_RAM;
+        capacity = min_capacity;
+    }
+
+    _chk(capacity > 0xffff, payload->err = ERR_VAL; return false, "segment too large: %u", (unsigned) capacity);
+
+    struct pbuf * segment = pbuf_alloc(PBUF_RAW, capacity, type);
+    _chk(segment == NULL, payload->err = ERR_MEM; return false, "unable to allocate a segment");
+
+    payload->tail_capacity = segment->len; // a pool pbuf may be larger than asked
+    segment->len = segment->tot_len = 0; // tot_len is fixed in urob_payload_take
+
+    if (payload->head == NULL)
+    {
+        payload->head = segment;
+    } else
+    {
+        payload->tail->next = segment;
+    }
+
+    payload->tail = segment;
+    return true;
+}
+
+static inline size_t _urob_payload_room(urob_payload * payload)
+{
+    return payload->tail ? payload->tail_capacity - payload->tail->len : 0;
+}
+
+static inline char * _urob_payload_cursor(urob_payload * payload)
+{
+    return (char *) payload->tail->payload + payload->tail->len;
+}
+
+void urob_payload_append(urob_payload * payload, const void * data, size_t length)
+{
+    const uint8_t * source = (const uint8_t *) data;
+
+    while (length > 0)
+    {
+        if (_urob_payload_room(payload) == 0 && ! _urob_payload_grow(payload, 1))
+        {
+            return;
+        }
+
+        size_t chunk = _urob_payload_room(payload);
+        chunk = chunk < length ? chunk : length;
+
+        memcpy(_urob_payload_cursor(payload), source, chunk);
+        payload->tail->len += chunk;
+        payload->length += chunk;
+        source += chunk;
+        length -= chunk;
+    }
+}
+
+void urob_payload_append_string(urob_payload * payload, const char * string)
+{
+    urob_payload_append(payload, string, strlen(string));
+}
+
+void urob_payload_append_uint(urob_payload * payload, uint32_t value)
+{
+    int digits = 1;
+    for (uint32_t rest = value / 10; rest > 0; rest /= 10)
+    {
+        digits ++;
+    }
+
+    // Numbers are never split between segments
+    if (_urob_payload_room(payload) < (size_t) digits && ! _urob_payload_grow(payload, digits))
+    {
+        return;
+    }
+
+    char * cursor = _urob_payload_cursor(payload) + digits;
+    do
+    {
+        * -- cursor = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    payload->tail->len += digits;
+    payload->length += digits;
+}
+
+void urob_payload_append_int(urob_payload * payload, int32_t value)
+{
+    if (value < 0)
+    {
+        urob_payload_append(payload, "-", 1);
+        urob_payload_append_uint(payload, - (uint32_t) value);
+    } else
+    {
+        urob_payload_append_uint(payload, value);
+    }
+}
+
+void urob_payload_vprintf(urob_payload * payload, const char * format, va_list vars)
+{
+    if (payload->err != ERR_OK)
+    {
+        return;
+    }
+
+    // Formatted in place when it fits the tail (with its terminator), otherwise in a new segment
+    size_t room = _urob_payload_room(payload);
+    va_list copy;
+    va_copy(copy, vars);
+    int length = vsnprintf(room ? _urob_payload_cursor(payload) : NULL, room, format, copy);
+    va_end(copy);
+
+    _chk(length < 0, payload->err = ERR_VAL; return, "invalid format: %s", format);
+
+    if ((size_t) length >= room)
+    {
+        if (! _urob_payload_grow(payload, length + 1))
+        {
+            return;
+        }
+
+        vsnprintf(_urob_payload_cursor(payload), length + 1, format, vars);
+    }
+
+    payload->tail->len += length;
+    payload->length += length;
+}
+
+void urob_payload_printf(urob_payload * payload, const char * format, ...)
+{
+    va_list vars;
+    va_start(vars, format);
+    urob_payload_vprintf(payload, format, vars);
+    va_end(vars);
+}
+
+struct pbuf * urob_payload_take(urob_payload * payload)
+{
+    struct pbuf * chain = payload->err == ERR_OK && payload->length > 0 ? payload->head : NULL;
+
+    if (chain == NULL)
+    {
+        urob_payload_uninit(payload);
+        return NULL;
+    }
+
+    size_t remaining = payload->length;
+    for (struct pbuf * segment = chain; segment != NULL; segment = segment->next)
+    {
+        segment->tot_len = remaining;
+        remaining -= segment->len;
+    }
+
+    urob_payload_init(payload, payload->type);
+    return chain;
+}
+
+err_t urob_payload_write(struct netconn * conn, struct pbuf * chain, size_t offset, u8_t apiflags, size_t * bytes_written)
+{
+    return urob_payload_write_partly(conn, chain, offset, SIZE_MAX, apiflags, bytes_written);
+}
+
+err_t urob_payload_write_partly(struct netconn * conn, struct pbuf * chain, size_t offset, size_t length, u8_t apiflags, size_t * bytes_written)
+{
+    struct netvector vectors[UROB_PAYLOAD_MAX_VECTORS];
+    u16_t vector_count = 0;
+
+    for (struct pbuf * segment = chain; segment != NULL && vector_count < UROB_PAYLOAD_MAX_VECTORS && length > 0; segment = segment->next)
+    {
+        if (offset >= segment->len)
+        {
+            offset -= segment->len;
+            continue;
+        }
+
+        size_t vector_length = segment->len - offset < length ? segment->len - offset : length;
+        vectors[vector_count ++] = (struct netvector) {
+            .ptr = (const char *) segment->payload + offset,
+            .len = vector_length
+        };
+        length -= vector_length;
+        offset = 0;
+    }
+
+    * bytes_written = 0;
+    if (vector_count == 0)
+    {
+        return ERR_OK;
+    }
+
+    return netconn_write_vectors_partly(conn, vectors, vector_count, apiflags & ~NETCONN_COPY, bytes_written);
+}
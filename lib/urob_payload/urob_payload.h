@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_PAYLOAD_H__
+#define __UROB_PAYLOAD_H__
+
+// Builds an outgoing payload directly in a chain of pbufs, segment by segment,
+// without heap strings or intermediate buffers.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+
+// Size of PBUF_RAM segments, a full tcp segment
+#define UROB_PAYLOAD_SEGMENT_SIZE (TCP_MSS)
+
+// Pbufs written at once by urob_payload_write
+#define UROB_PAYLOAD_MAX_VECTORS (8)
+
+struct netconn;
+
+typedef struct
+{
+    pbuf_type type; // PBUF_RAM or PBUF_POOL
+    struct pbuf * head;
+    struct pbuf * tail;
+    u16_t tail_capacity; // the tail's len is the part in use
+    size_t length;
+    err_t err; // ERR_MEM once a segment couldn't be allocated, appends are ignored from then on
+} urob_payload;
+
+void urob_payload_init(urob_payload * payload, pbuf_type type);
+
+// Frees the chain, unless taken
+void urob_payload_uninit(urob_payload * payload);
+
+void urob_payload_append(urob_payload * payload, const void * data, size_t length);
+void urob_payload_append_string(urob_payload * payload, const char * string);
+void urob_payload_append_int(urob_payload * payload, int32_t value);
+void urob_payload_append_uint(urob_payload * payload, uint32_t value);
+void urob_payload_printf(urob_payload * payload, const char * format, ...) __attribute__((format(printf, 2, 3)));
+void urob_payload_vprintf(urob_payload * payload, const char * format, va_list vars);
+
+// Passes ownership of the chain to the caller (NULL if empty or on error), the payload is reset
+struct pbuf * urob_payload_take(urob_payload * payload);
+
+// Writes a chain starting at offset without copies (NETCONN_NOCOPY is implied): the chain must
+// not be freed while the data may still be retransmitted.
+err_t urob_payload_write(struct netconn * conn, struct pbuf * chain, size_t offset, u8_t apiflags, size_t * bytes_written);
+
+// Same, writing at most length bytes from offset
+err_t urob_payload_write_partly(struct netconn * conn, struct pbuf * chain, size_t offset, size_t length, u8_t apiflags, size_t * bytes_written);
+
+#endif // __UROB_PAYLOAD_H__
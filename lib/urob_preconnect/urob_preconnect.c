@@ -0,0 +1,270 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_preconnect.h"
+#include "urob_metrics.h"
+#include "urob_teardown.h"
+#include <string.h>
+
+#include "lwip/api.h"
+#include "esp_log.h"
+
+#define TAG "preconnect"
+#include "general.h"
+
+void urob_preconnect_init(urob_preconnect * pool, const urob_preconnect_config * config)
+{
+    * pool = (urob_preconnect) {0};
+    pool->config = * config;
+}
+
+bool urob_preconnect_add(urob_preconnect * pool, const char * host, uint16_t port, int standby)
+{
+    _chk(pool->endpoint_count == UROB_PRECONNECT_ENDPOINTS, return false, "no room for %s:%u", host, port);
+
+    urob_preconnect_endpoint * endpoint = &pool->endpoints[pool->endpoint_count ++];
+    * endpoint = (urob_preconnect_endpoint) {
+        .host = host,
+        .port = port,
+        .standby = standby < UROB_PRECONNECT_STANDBY ? standby : UROB_PRECONNECT_STANDBY
+    };
+    ESP_LOGI(TAG, "keeping %d connections ready to %s:%u", endpoint->standby, host, port);
+    return true;
+}
+
+static void _urob_preconnect_drop(urob_preconnect_slot * slot, bool closed)
+{
+    if (closed) // by the server first, TIME_WAIT is on its side
+    {
+        netconn_delete(slot->conn);
+    } else
+    {
+        urob_teardown_abort(slot->conn);
+    }
+    * slot = (urob_preconnect_slot) {0};
+}
+
+// A ready connection isn't expected to receive anything before the request
+// @return true if the server closed it (or sent something anyway)
+static bool _urob_preconnect_closed(struct netconn * conn)
+{
+    struct pbuf * input = NULL;
+    err_t err = netconn_recv_tcp_pbuf_flags(conn, &input, NETCONN_DONTBLOCK);
+
+    if (err == ERR_WOULDBLOCK || err == ERR_INPROGRESS)
+    {
+        return false;
+    }
+
+    if (err == ERR_OK)
+    {
+        pbuf_free(input);
+    }
+    return true;
+}
+
+// The name is resolved again after a failure, in case the server moved
+static void _urob_preconnect_failed(urob_preconnect * pool, urob_preconnect_endpoint * endpoint, uint32_t now)
+{
+    endpoint->retry_us = now + pool->config.retry_ms * 1000;
+
+    if (! endpoint->resolving)
+    {
+        urob_address_uninit(&endpoint->address);
+    }
+}
+
+static bool _urob_preconnect_resolved(urob_preconnect * pool, urob_preconnect_endpoint * endpoint, uint32_t now)
+{
+    if (endpoint->resolving)
+    {
+        if (atomic_load_explicit(&endpoint->address.state, memory_order_acquire) == ADDRESS_STATE_ERROR ||
+            (netconn_address_resolved(&endpoint->address) && endpoint->address.err == ERR_ARG)) // not found
+        {
+            ESP_LOGW(TAG, "unable to resolve %s", endpoint->host);
+            endpoint->resolving = false;
+            _urob_preconnect_failed(pool, endpoint, now);
+            return false;
+        }
+
+        endpoint->resolving = ! netconn_address_resolved(&endpoint->address);
+        return ! endpoint->resolving;
+    }
+
+    if (netconn_address_resolved(&endpoint->address))
+    {
+        return true;
+    }
+
+    if ((int32_t) (now - endpoint->retry_us) >= 0)
+    {
+        urob_address_init(&endpoint->address, endpoint->host);
+        endpoint->resolving = true;
+    }
+    return false;
+}
+
+static void _urob_preconnect_connect(urob_preconnect * pool, urob_preconnect_endpoint * endpoint, urob_preconnect_slot * slot, uint32_t now)
+{
+    slot->conn = netconn_new(NETCONN_TCP);
+    _chk(slot->conn == NULL, _urob_preconnect_failed(pool, endpoint, now); return, "unable to create a connection to %s", endpoint->host);
+
+    netconn_set_nonblocking(slot->conn, 1);
+    err_t err = netconn_connect(slot->conn, &endpoint->address.address, endpoint->port);
+    _chk(err != ERR_OK && err != ERR_INPROGRESS && err != ERR_ALREADY, {
+            _urob_preconnect_drop(slot, false);
+            _urob_preconnect_failed(pool, endpoint, now);
+            return;
+        }, "error connecting to %s: %d", endpoint->host, err);
+
+    slot->state = UROB_PRECONNECT_SLOT_CONNECTING;
+    slot->since_us = now;
+}
+
+static void _urob_preconnect_connecting(urob_preconnect * pool, urob_preconnect_endpoint * endpoint, urob_preconnect_slot * slot, uint32_t now)
+{
+    if (slot->conn->state == NETCONN_CONNECT)
+    {
+        _chk(now - slot->since_us > pool->config.connect_timeout_ms * 1000, {
+                _urob_preconnect_drop(slot, false);
+                _urob_preconnect_failed(pool, endpoint, now);
+            }, "timeout connecting to %s", endpoint->host);
+        return;
+    }
+
+    // Back to NETCONN_NONE either way, a failure leaves an error
+    err_t err = netconn_err(slot->conn);
+    _chk(err != ERR_OK, {
+            _urob_preconnect_drop(slot, false);
+            _urob_preconnect_failed(pool, endpoint, now);
+            return;
+        }, "error connecting to %s: %d", endpoint->host, err);
+
+    UROB_LOGD(TAG, "connection to %s ready", endpoint->host);
+    slot->state = UROB_PRECONNECT_SLOT_READY;
+    slot->since_us = now;
+}
+
+static void _urob_preconnect_ready(urob_preconnect * pool, urob_preconnect_slot * slot, uint32_t now)
+{
+    if (_urob_preconnect_closed(slot->conn))
+    {
+        UROB_METRICS_ADD(UROB_METRICS_PRECONNECT_CLOSED, 1);
+        _urob_preconnect_drop(slot, true);
+    } else if (now - slot->since_us > pool->config.idle_ms * 1000)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_PRECONNECT_IDLE, 1);
+        _urob_preconnect_drop(slot, false);
+    }
+}
+
+void urob_preconnect_loop(urob_preconnect * pool)
+{
+    uint32_t now = urob_metrics_time_us();
+
+    for (int endpoint_index = 0; endpoint_index < pool->endpoint_count; endpoint_index ++)
+    {
+        urob_preconnect_endpoint * endpoint = &pool->endpoints[endpoint_index];
+
+        if (! _urob_preconnect_resolved(pool, endpoint, now))
+        {
+            continue;
+        }
+
+        for (int slot_index = 0; slot_index < endpoint->standby; slot_index ++)
+        {
+            urob_preconnect_slot * slot = &endpoint->slots[slot_index];
+
+            switch (slot->state)
+            {
+                case UROB_PRECONNECT_SLOT_EMPTY:
+                    if ((int32_t) (now - endpoint->retry_us) >= 0 && netconn_address_resolved(&endpoint->address))
+                    {
+                        _urob_preconnect_connect(pool, endpoint, slot, now);
+                    }
+                break;
+                case UROB_PRECONNECT_SLOT_CONNECTING:
+                    _urob_preconnect_connecting(pool, endpoint, slot, now);
+                break;
+                case UROB_PRECONNECT_SLOT_READY:
+                    _urob_preconnect_ready(pool, slot, now);
+                break;
+            }
+        }
+    }
+}
+
+struct netconn * urob_preconnect_take(urob_preconnect * pool, const char * host, uint16_t port)
+{
+    for (int endpoint_index = 0; endpoint_index < pool->endpoint_count; endpoint_index ++)
+    {
+        urob_preconnect_endpoint * endpoint = &pool->endpoints[endpoint_index];
+
+        if (endpoint->port != port || strcmp(endpoint->host, host) != 0)
+        {
+            continue;
+        }
+
+        for (int slot_index = 0; slot_index < endpoint->standby; slot_index ++)
+        {
+            urob_preconnect_slot * slot = &endpoint->slots[slot_index];
+
+            if (slot->state != UROB_PRECONNECT_SLOT_READY)
+            {
+                continue;
+            }
+
+            if (_urob_preconnect_closed(slot->conn)) // since the last loop
+            {
+                UROB_METRICS_ADD(UROB_METRICS_PRECONNECT_CLOSED, 1);
+                _urob_preconnect_drop(slot, true);
+                continue;
+            }
+
+            struct netconn * conn = slot->conn;
+            * slot = (urob_preconnect_slot) {0}; // replaced at the next loop
+            UROB_METRICS_ADD(UROB_METRICS_PRECONNECT_HIT, 1);
+            return conn;
+        }
+    }
+
+    UROB_METRICS_ADD(UROB_METRICS_PRECONNECT_MISS, 1);
+    return NULL;
+}
+
+void urob_preconnect_uninit(urob_preconnect * pool)
+{
+    for (int endpoint_index = 0; endpoint_index < pool->endpoint_count; endpoint_index ++)
+    {
+        urob_preconnect_endpoint * endpoint = &pool->endpoints[endpoint_index];
+
+        for (int slot_index = 0; slot_index < endpoint->standby; slot_index ++)
+        {
+            if (endpoint->slots[slot_index].conn != NULL)
+            {
+                _urob_preconnect_drop(&endpoint->slots[slot_index], false);
+            }
+        }
+    }
+    * pool = (urob_preconnect) {0};
+}
@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_PRECONNECT_H__
+#define __UROB_PRECONNECT_H__
+
+#include "urob_address.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UROB_PRECONNECT_ENDPOINTS (4)
+#define UROB_PRECONNECT_STANDBY (2) // most connections kept ready per endpoint
+
+struct netconn;
+
+// Connections kept ready for hot endpoints: names are resolved and connections opened ahead of the
+// requests, so a client taking one (see urob_http_client_set_preconnect) starts from the request.
+// A taken connection is replaced in the background, and ready ones are replaced as well before
+// servers time them out idle, or as soon as servers close them.
+// @discussion a pool belongs to a single loop (shard), like the clients taking its connections
+
+typedef enum
+{
+    UROB_PRECONNECT_SLOT_EMPTY = 0,
+    UROB_PRECONNECT_SLOT_CONNECTING,
+    UROB_PRECONNECT_SLOT_READY
+} urob_preconnect_slot_state;
+
+typedef struct
+{
+    struct netconn * conn;
+    urob_preconnect_slot_state state;
+    uint32_t since_us; // of the current state
+} urob_preconnect_slot;
+
+typedef struct
+{
+    const char * host; // not copied
+    uint16_t port;
+    int standby;
+    urob_address address;
+    bool resolving;
+    uint32_t retry_us; // no new connection before, after a failure
+    urob_preconnect_slot slots[UROB_PRECONNECT_STANDBY];
+} urob_preconnect_endpoint;
+
+typedef struct
+{
+    uint32_t idle_ms; // ready connections are replaced after, below the servers' keep-alive timeout
+    uint32_t connect_timeout_ms;
+    uint32_t retry_ms; // after a failed resolution or connection
+} urob_preconnect_config;
+
+typedef struct
+{
+    urob_preconnect_config config;
+    urob_preconnect_endpoint endpoints[UROB_PRECONNECT_ENDPOINTS];
+    int endpoint_count;
+} urob_preconnect;
+
+void urob_preconnect_init(urob_preconnect * pool, const urob_preconnect_config * config);
+void urob_preconnect_uninit(urob_preconnect * pool);
+
+// Keeps standby connections (up to UROB_PRECONNECT_STANDBY) ready to host:port
+// @return false when there are UROB_PRECONNECT_ENDPOINTS already
+bool urob_preconnect_add(urob_preconnect * pool, const char * host, uint16_t port, int standby);
+
+// Resolves, connects and expires connections, while the network is up
+void urob_preconnect_loop(urob_preconnect * pool);
+
+// @return a connected, non-blocking netconn to host:port, owned by the caller, or NULL if none is ready
+struct netconn * urob_preconnect_take(urob_preconnect * pool, const char * host, uint16_t port);
+
+#endif // __UROB_PRECONNECT_H__
@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_shard.h"
+
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include "esp_log.h"
+
+#define TAG "shard"
+#include "general.h"
+
+void urob_shard_group_init(urob_shard_group * group, int count)
+{
+    * group = (urob_shard_group) {0};
+
+    _chk(count < 1 || count > UROB_MAX_SHARDS, count = 1, "unsupported shard count: %d, using 1", count);
+    group->count = count;
+
+    for (int shard_index = 0; shard_index < UROB_MAX_SHARDS; shard_index ++)
+    {
+        urob_shard * shard = &group->shards[shard_index];
+        shard->index = shard_index;
+        shard->group = group;
+#ifdef ESP_PLATFORM
+        shard->core = shard_index % portNUM_PROCESSORS;
+#else
+        shard->core = UROB_SHARD_NO_AFFINITY;
+#endif
+
+        for (int producer_index = 0; producer_index < UROB_MAX_SHARDS; producer_index ++)
+        {
+            urob_spsc_init(&shard->inbox[producer_index]);
+        }
+
+#ifndef ESP_PLATFORM
+        pthread_mutex_init(&shard->wake_lock, NULL);
+        pthread_cond_init(&shard->wake, NULL);
+#endif
+    }
+
+    atomic_store_explicit(&group->keep_going, true, memory_order_release);
+}
+
+void urob_shard_set_loop(urob_shard_group * group, int index, urob_shard_loop_fn loop, urob_shard_handoff_fn handoff, void * arg)
+{
+    urob_shard * shard = &group->shards[index];
+    shard->loop = loop;
+    shard->handoff = handoff;
+    shard->arg = arg;
+}
+
+static void _urob_shard_drain_inbox(urob_shard * shard)
+{
+    for (int producer_index = 0; producer_index < shard->group->count; producer_index ++)
+    {
+        void * item;
+        while ((item = urob_spsc_pop(&shard->inbox[producer_index])) != NULL)
+        {
+            atomic_fetch_add_explicit(&shard->handoffs_received, 1, memory_order_relaxed);
+            shard->handoff(shard, item, shard->arg);
+        }
+    }
+}
+
+// Logs every new low of the stack left, to size UROB_SHARD_STACK_SIZE from
+static void _urob_shard_check_stack(urob_shard * shard)
+{
+#ifdef ESP_PLATFORM
+    unsigned int stack_free = uxTaskGetStackHighWaterMark(NULL);
+    if (shard->stack_free == 0 || stack_free < shard->stack_free)
+    {
+        ESP_LOGI(TAG, "shard %d: %u bytes of stack never used", shard->index, stack_free);
+        shard->stack_free = stack_free;
+    }
+#endif
+}
+
+#ifdef ESP_PLATFORM
+static void _urob_shard_thread(void * arg)
+#else
+static void * _urob_shard_thread(void * arg)
+#endif
+{
+    urob_shard * shard = (urob_shard *) arg;
+    ESP_LOGI(TAG, "shard %d running on core %d", shard->index, shard->core);
+
+    while (atomic_load_explicit(&shard->group->keep_going, memory_order_acquire))
+    {
+        _urob_shard_drain_inbox(shard);
+        shard->loop(shard, shard->arg);
+
+        if (++ shard->iterations % UROB_SHARD_STACK_CHECK_ITERATIONS == 0)
+        {
+            _urob_shard_check_stack(shard);
+        }
+    }
+
+#ifdef ESP_PLATFORM
+    vTaskDelete(NULL);
+#else
+    return NULL;
+#endif
+}
+
+bool urob_shard_group_start(urob_shard_group * group, int stack_size, int priority)
+{
+    for (int shard_index = 0; shard_index < group->count; shard_index ++)
+    {
+        urob_shard * shard = &group->shards[shard_index];
+        _chk(shard->loop == NULL || shard->handoff == NULL, return false, "shard %d has no loop", shard_index);
+
+#ifdef ESP_PLATFORM
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "urob shard %d", shard_index);
+        BaseType_t result = xTaskCreatePinnedToCore(
+            _urob_shard_thread,
+            name,
+            stack_size,
+            shard,
+            priority,
+            &shard->task,
+            shard->core == UROB_SHARD_NO_AFFINITY ? tskNO_AFFINITY : shard->core);
+        _chk(result != pdPASS, return false, "unable to create shard %d task", shard_index);
+#else
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stack_size);
+        int result = pthread_create(&shard->thread, &attributes, _urob_shard_thread, shard);
+        pthread_attr_destroy(&attributes);
+        _chk(result != 0, return false, "unable to create shard %d thread: %d", shard_index, result);
+        (void) priority; // the host scheduler decides
+#endif
+    }
+
+    return true;
+}
+
+static void _urob_shard_wake(urob_shard * shard)
+{
+#ifdef ESP_PLATFORM
+    xTaskNotifyGive(shard->task);
+#else
+    pthread_mutex_lock(&shard->wake_lock);
+    shard->woken = true;
+    pthread_cond_signal(&shard->wake);
+    pthread_mutex_unlock(&shard->wake_lock);
+#endif
+}
+
+void urob_shard_group_uninit(urob_shard_group * group)
+{
+    atomic_store_explicit(&group->keep_going, false, memory_order_release);
+
+    for (int shard_index = 0; shard_index < group->count; shard_index ++)
+    {
+        _urob_shard_wake(&group->shards[shard_index]);
+    }
+
+#ifndef ESP_PLATFORM
+    for (int shard_index = 0; shard_index < UROB_MAX_SHARDS; shard_index ++)
+    {
+        urob_shard * shard = &group->shards[shard_index];
+        if (shard_index < group->count)
+        {
+            pthread_join(shard->thread, NULL);
+        }
+        pthread_cond_destroy(&shard->wake);
+        pthread_mutex_destroy(&shard->wake_lock);
+    }
+#endif
+}
+
+void urob_shard_idle(urob_shard * shard, uint32_t timeout_ms)
+{
+    _urob_shard_check_stack(shard);
+
+#ifdef ESP_PLATFORM
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms));
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&shard->wake_lock);
+    while (! shard->woken && pthread_cond_timedwait(&shard->wake, &shard->wake_lock, &deadline) == 0)
+    {
+    }
+    shard->woken = false;
+    pthread_mutex_unlock(&shard->wake_lock);
+#endif
+}
+
+int urob_shard_pick(urob_shard_group * group)
+{
+    return atomic_fetch_add_explicit(&group->next_shard, 1, memory_order_relaxed) % group->count;
+}
+
+bool urob_shard_handoff(urob_shard * from, int to, void * item)
+{
+    if (to == from->index)
+    {
+        from->handoff(from, item, from->arg);
+        return true;
+    }
+
+    urob_shard * destination = &from->group->shards[to];
+    if (! urob_spsc_push(&destination->inbox[from->index], item))
+    {
+        return false;
+    }
+
+    _urob_shard_wake(destination);
+    return true;
+}
@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_SHARD_H__
+#define __UROB_SHARD_H__
+
+#include "urob_spsc.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <pthread.h>
+#endif
+
+#define UROB_MAX_SHARDS (2)
+#define UROB_SHARD_NO_AFFINITY (-1)
+#define UROB_SHARD_STACK_CHECK_ITERATIONS (4096) // between reads of the stack high-water mark
+
+typedef struct _urob_shard urob_shard;
+typedef struct _urob_shard_group urob_shard_group;
+
+// Invoked at every iteration of the shard's loop, must block for the shortest time possible
+typedef void (* urob_shard_loop_fn)(urob_shard * shard, void * arg);
+
+// Invoked on the receiving shard for every item handed over by another (or the same) shard
+typedef void (* urob_shard_handoff_fn)(urob_shard * shard, void * item, void * arg);
+
+struct _urob_shard
+{
+    int index;
+    int core; // core the loop is pinned to, or UROB_SHARD_NO_AFFINITY
+    urob_shard_group * group;
+
+    urob_shard_loop_fn loop;
+    urob_shard_handoff_fn handoff;
+    void * arg;
+
+    // One queue per producer shard, so that each one stays single-producer/single-consumer
+    urob_spsc inbox[UROB_MAX_SHARDS];
+    atomic_uint handoffs_received;
+
+    uint32_t iterations;
+    unsigned int stack_free; // stack never used so far (bytes), 0 until first read, esp32 only
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t task;
+#else
+    pthread_t thread;
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    bool woken;
+#endif
+};
+
+struct _urob_shard_group
+{
+    urob_shard shards[UROB_MAX_SHARDS];
+    int count;
+    atomic_bool keep_going;
+    atomic_uint next_shard; // round robin cursor for urob_shard_pick
+};
+
+// Initializes a group of count shards, shard i is pinned to core i % portNUM_PROCESSORS
+// (no affinity on the host)
+void urob_shard_group_init(urob_shard_group * group, int count);
+
+// Sets the functions run by a shard, must be called before urob_shard_group_start
+void urob_shard_set_loop(urob_shard_group * group, int index, urob_shard_loop_fn loop, urob_shard_handoff_fn handoff, void * arg);
+
+// Starts one thread (task, on esp32) per shard
+// @return false if any of the threads couldn't be created
+bool urob_shard_group_start(urob_shard_group * group, int stack_size, int priority);
+
+// Stops the loops and, on the host, waits for the threads to terminate
+void urob_shard_group_uninit(urob_shard_group * group);
+
+// Blocks the calling shard until an item is handed over to it or timeout_ms pass, for loops with
+// nothing to poll; must be called from the thread running the shard
+void urob_shard_idle(urob_shard * shard, uint32_t timeout_ms);
+
+// Picks the shard that will own a new connection (round robin)
+int urob_shard_pick(urob_shard_group * group);
+
+// Hands an item over to another shard, must be called from the thread running shard "from"
+// @discussion handing over to the same shard invokes the handoff function synchronously, another
+// shard is woken if idle
+// @return false if the destination's inbox is full, ownership of the item stays with the caller
+bool urob_shard_handoff(urob_shard * from, int to, void * item);
+
+#endif // __UROB_SHARD_H__
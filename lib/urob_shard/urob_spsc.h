@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_SPSC_H__
+#define __UROB_SPSC_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Must be a power of two
+#define UROB_SPSC_CAPACITY (16)
+
+// Lock-free single producer, single consumer queue of pointers.
+// @discussion head is only written by the consumer and tail only by the producer,
+// so a pair of acquire/release barriers is all the synchronization needed.
+typedef struct
+{
+    atomic_uint head; // next slot to pop
+    char _pad[32 - sizeof(atomic_uint)]; // keep producer and consumer indexes apart
+    atomic_uint tail; // next slot to push
+    void * items[UROB_SPSC_CAPACITY];
+} urob_spsc;
+
+void urob_spsc_init(urob_spsc * queue);
+
+// Push an item, to be called only from the producer side
+// @return false if the queue is full
+bool urob_spsc_push(urob_spsc * queue, void * item);
+
+// Pop an item, to be called only from the consumer side
+// @return NULL if the queue is empty
+void * urob_spsc_pop(urob_spsc * queue);
+
+#endif // __UROB_SPSC_H__
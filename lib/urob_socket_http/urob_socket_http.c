@@ -0,0 +1,312 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_socket_http.h"
+#include "urob_accounting.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+
+#define TAG "socket http"
+#include "general.h"
+
+// Same response as urob_http_server's "/", in one piece
+static const char response[] =
+    "HTTP/1.1 200 OK\r\nContent-type: text/html\r\n\r\n"
+    "<html><head><title>Test server</title></head><body><h1>Urob(oron)</h1><p>Welcome to Urob(oron)'s http server!</p></body></html>";
+
+static char request_format_string[] = "GET %s HTTP/1.1\r\nHost: urob\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static void _urob_socket_http_close(urob_socket_http_connection * connection)
+{
+    if (connection->socket >= 0)
+    {
+        close(connection->socket);
+    }
+
+    * connection = (urob_socket_http_connection) {.socket = -1};
+}
+
+static bool _urob_socket_http_would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS;
+}
+
+void urob_socket_http_server_init(urob_socket_http_server * server, int port)
+{
+    * server = (urob_socket_http_server) {.listener = -1};
+
+    for (int connection_index = 0; connection_index < UROB_SOCKET_HTTP_MAX_CONNECTIONS; connection_index ++)
+    {
+        server->connections[connection_index].socket = -1;
+    }
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    server->listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    _chk(server->listener < 0, server->err = errno; return, "unable to create socket: %d", errno);
+
+    _chk(bind(server->listener, (struct sockaddr *) &address, sizeof(address)) != 0, goto error, "bind: %d", errno);
+    _chk(listen(server->listener, UROB_SOCKET_HTTP_MAX_CONNECTIONS) != 0, goto error, "listen: %d", errno);
+    fcntl(server->listener, F_SETFL, fcntl(server->listener, F_GETFL, 0) | O_NONBLOCK);
+    return;
+
+error:
+    server->err = errno;
+    close(server->listener);
+    server->listener = -1;
+}
+
+void urob_socket_http_server_uninit(urob_socket_http_server * server)
+{
+    for (int connection_index = 0; connection_index < UROB_SOCKET_HTTP_MAX_CONNECTIONS; connection_index ++)
+    {
+        _urob_socket_http_close(&server->connections[connection_index]);
+    }
+
+    if (server->listener >= 0)
+    {
+        close(server->listener);
+    }
+
+    * server = (urob_socket_http_server) {.listener = -1};
+}
+
+static void _urob_socket_http_server_accept(urob_socket_http_server * server)
+{
+    for (int connection_index = 0; connection_index < UROB_SOCKET_HTTP_MAX_CONNECTIONS; connection_index ++)
+    {
+        urob_socket_http_connection * connection = &server->connections[connection_index];
+        if (connection->socket >= 0)
+        {
+            continue;
+        }
+
+        connection->socket = accept(server->listener, NULL, NULL);
+        if (connection->socket < 0)
+        {
+            _chk(! _urob_socket_http_would_block(), server->err = errno, "accept: %d", errno);
+            connection->socket = -1;
+            return;
+        }
+
+        fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL, 0) | O_NONBLOCK);
+        connection->state = SOCKET_HTTP_STATE_RECEIVING;
+        connection->progress = 0;
+        return;
+    }
+}
+
+static void _urob_socket_http_server_service(urob_socket_http_server * server, urob_socket_http_connection * connection)
+{
+    switch (connection->state)
+    {
+        case SOCKET_HTTP_STATE_RECEIVING:
+        {
+            // Like urob_http_server, a single read is taken as the whole request
+            ssize_t received = recv(connection->socket, server->buffer, sizeof(server->buffer), 0);
+
+            if (received < 0 && _urob_socket_http_would_block())
+            {
+                return;
+            }
+
+            _chk(received <= 0, _urob_socket_http_close(connection); return, "error receiving: %d", errno);
+            connection->state = SOCKET_HTTP_STATE_SENDING;
+        }
+        // fallthrough
+        case SOCKET_HTTP_STATE_SENDING:
+        {
+            ssize_t sent = send(connection->socket, response + connection->progress, sizeof(response) - 1 - connection->progress, 0);
+
+            if (sent < 0 && _urob_socket_http_would_block())
+            {
+                return;
+            }
+
+            _chk(sent < 0, _urob_socket_http_close(connection); return, "error sending: %d", errno);
+            connection->progress += sent;
+
+            if (connection->progress == sizeof(response) - 1)
+            {
+                server->requests ++;
+                UROB_ACCOUNTING_REQUEST();
+                _urob_socket_http_close(connection);
+            }
+        }
+        break;
+        default:
+        break;
+    }
+}
+
+void urob_socket_http_server_loop(urob_socket_http_server * server)
+{
+    if (server->listener < 0)
+    {
+        return;
+    }
+
+    _urob_socket_http_server_accept(server);
+
+    for (int connection_index = 0; connection_index < UROB_SOCKET_HTTP_MAX_CONNECTIONS; connection_index ++)
+    {
+        if (server->connections[connection_index].socket >= 0)
+        {
+            _urob_socket_http_server_service(server, &server->connections[connection_index]);
+        }
+    }
+}
+
+void urob_socket_http_client_init(urob_socket_http_client * client, const ip_addr_t * address, int port, const char * path, uint32_t requests)
+{
+    * client = (urob_socket_http_client) {
+        .address = * address,
+        .port = port,
+        .connection = {.socket = -1},
+        .requests = requests
+    };
+
+    int length = asprintf(&client->request, request_format_string, path);
+    _chk(length < 0, client->request = NULL; client->errors = requests, "unable to format request");
+    client->request_length = length > 0 ? length : 0;
+}
+
+void urob_socket_http_client_uninit(urob_socket_http_client * client)
+{
+    _urob_socket_http_close(&client->connection);
+    free(client->request);
+    * client = (urob_socket_http_client) {.connection = {.socket = -1}};
+}
+
+static void _urob_socket_http_client_fail(urob_socket_http_client * client)
+{
+    client->errors ++;
+    _urob_socket_http_close(&client->connection);
+}
+
+static void _urob_socket_http_client_connect(urob_socket_http_client * client)
+{
+    urob_socket_http_connection * connection = &client->connection;
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(client->port)
+    };
+    inet_addr_from_ip4addr(&address.sin_addr, ip_2_ip4(&client->address));
+
+    connection->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    _chk(connection->socket < 0, _urob_socket_http_client_fail(client); return, "unable to create socket: %d", errno);
+    fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL, 0) | O_NONBLOCK);
+
+    int result = connect(connection->socket, (struct sockaddr *) &address, sizeof(address));
+    _chk(result != 0 && ! _urob_socket_http_would_block(), _urob_socket_http_client_fail(client); return, "connect: %d", errno);
+
+    connection->state = SOCKET_HTTP_STATE_CONNECTING;
+    connection->progress = 0;
+}
+
+void urob_socket_http_client_loop(urob_socket_http_client * client)
+{
+    urob_socket_http_connection * connection = &client->connection;
+
+    switch (connection->state)
+    {
+        case SOCKET_HTTP_STATE_NONE:
+            if (! urob_socket_http_client_done(client))
+            {
+                _urob_socket_http_client_connect(client);
+            }
+        break;
+        case SOCKET_HTTP_STATE_CONNECTING:
+        {
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET(connection->socket, &writable);
+            struct timeval timeout = {0};
+
+            if (select(connection->socket + 1, NULL, &writable, NULL, &timeout) <= 0)
+            {
+                return;
+            }
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            _chk(error != 0, _urob_socket_http_client_fail(client); return, "error connecting: %d", error);
+
+            connection->state = SOCKET_HTTP_STATE_SENDING;
+        }
+        // fallthrough
+        case SOCKET_HTTP_STATE_SENDING:
+        {
+            ssize_t sent = send(connection->socket, client->request + connection->progress, client->request_length - connection->progress, 0);
+
+            if (sent < 0 && _urob_socket_http_would_block())
+            {
+                return;
+            }
+
+            _chk(sent < 0, _urob_socket_http_client_fail(client); return, "error sending: %d", errno);
+            connection->progress += sent;
+
+            if (connection->progress == client->request_length)
+            {
+                connection->state = SOCKET_HTTP_STATE_RECEIVING;
+            }
+        }
+        break;
+        case SOCKET_HTTP_STATE_RECEIVING:
+        {
+            // The server closes the connection at the end of the response
+            ssize_t received = recv(connection->socket, client->buffer, sizeof(client->buffer), 0);
+
+            if (received < 0 && _urob_socket_http_would_block())
+            {
+                return;
+            }
+
+            _chk(received < 0, _urob_socket_http_client_fail(client); return, "error receiving: %d", errno);
+
+            if (received == 0)
+            {
+                client->completed ++;
+                UROB_ACCOUNTING_REQUEST();
+                _urob_socket_http_close(connection);
+                return;
+            }
+
+            client->bytes_received += received;
+        }
+        break;
+    }
+}
@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_SOCKET_HTTP_H__
+#define __UROB_SOCKET_HTTP_H__
+
+// Reference http server and client over lwip's BSD sockets, equivalent to urob_http_server and
+// urob_http_load's clients. They only exist to measure what the netconn api saves (see urob_accounting),
+// and are not meant to be used otherwise.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/ip_addr.h"
+
+#define UROB_SOCKET_HTTP_MAX_CONNECTIONS (4)
+#define UROB_SOCKET_HTTP_BUFFER_SIZE (512)
+
+typedef enum
+{
+    SOCKET_HTTP_STATE_NONE = 0,
+    SOCKET_HTTP_STATE_CONNECTING,
+    SOCKET_HTTP_STATE_SENDING,
+    SOCKET_HTTP_STATE_RECEIVING
+} urob_socket_http_state;
+
+typedef struct
+{
+    int socket; // -1 when unused
+    urob_socket_http_state state;
+    size_t progress;
+} urob_socket_http_connection;
+
+typedef struct
+{
+    int listener;
+    int err; // errno of the last failure
+    urob_socket_http_connection connections[UROB_SOCKET_HTTP_MAX_CONNECTIONS];
+    char buffer[UROB_SOCKET_HTTP_BUFFER_SIZE]; // requests are read here and discarded
+    uint32_t requests;
+} urob_socket_http_server;
+
+typedef struct
+{
+    ip_addr_t address;
+    int port;
+    urob_socket_http_connection connection;
+
+    // One request formatted once, sent sequentially requests times
+    char * request;
+    size_t request_length;
+    uint32_t requests;
+
+    char buffer[UROB_SOCKET_HTTP_BUFFER_SIZE];
+    uint32_t completed;
+    uint32_t errors;
+    uint32_t bytes_received;
+} urob_socket_http_client;
+
+// Listens on port, serves "/" with the same page as urob_http_server
+void urob_socket_http_server_init(urob_socket_http_server * server, int port);
+void urob_socket_http_server_uninit(urob_socket_http_server * server);
+void urob_socket_http_server_loop(urob_socket_http_server * server);
+
+// GETs path requests times, one connection at a time
+void urob_socket_http_client_init(urob_socket_http_client * client, const ip_addr_t * address, int port, const char * path, uint32_t requests);
+void urob_socket_http_client_uninit(urob_socket_http_client * client);
+void urob_socket_http_client_loop(urob_socket_http_client * client);
+
+static inline bool urob_socket_http_client_done(urob_socket_http_client * client)
+{
+    return client->completed + client->errors >= client->requests;
+}
+
+#endif // __UROB_SOCKET_HTTP_H__
@@ -1,4 +1,13 @@
 #include "urob_tcp.h"
+#include "urob_metrics.h"
+#include "urob_teardown.h"
+#include "urob_tls.h"
+#include "urob_trace.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -6,41 +15,83 @@
 #include "lwip/opt.h"
 #include "lwip/arch.h"
 #include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "esp_log.h"
 
 #define TAG "tcp message"
 #include "general.h"
 
+static void _urob_tcp_send_message(urob_tcp * tcp, urob_tcp_message * tcp_message);
+static void _urob_tcp_receive_message(urob_tcp * tcp, urob_tcp_message * tcp_message);
+
 void urob_tcp_message_init(urob_tcp_message * tcp_message, urob_tcp_message_type type)
 {
     * tcp_message = (urob_tcp_message) {0};
 
     tcp_message->type = type;
     tcp_message->state = UROB_TCP_MESSAGE_STATE_INIT;
+    tcp_message->priority = UROB_TCP_PRIORITY_NORMAL;
 }
 
-void urob_tcp_message_payload_printf(urob_tcp_message * tcp_message, const char * format, ...)
+void urob_tcp_message_set_priority(urob_tcp_message * tcp_message, urob_tcp_priority priority, size_t frame_size)
+{
+    _chk(priority >= UROB_TCP_PRIORITY_COUNT, priority = UROB_TCP_PRIORITY_BULK, "unknown priority: %d", priority);
+
+    tcp_message->priority = priority;
+    tcp_message->frame_size = frame_size;
+}
+
+static void _urob_tcp_message_release_payload(urob_tcp_message * tcp_message)
+{
+    if (tcp_message->pbuf_payload && tcp_message->head_pbuf != NULL)
+    {
+        pbuf_free(tcp_message->head_pbuf);
+    } else if (tcp_message->free_payload_in_uninit && tcp_message->payload != NULL)
+    {
+        free(tcp_message->payload);
+    }
+
+    tcp_message->payload = NULL;
+    tcp_message->pbuf_payload = false;
+    tcp_message->free_payload_in_uninit = false;
+}
+
+void urob_tcp_message_payload_take(urob_tcp_message * tcp_message, urob_payload * payload)
 {
     if (tcp_message->payload)
     {
         ESP_LOGW(TAG, "tcp_message already has payload, replacing");
-        free(tcp_message->payload);
+        _urob_tcp_message_release_payload(tcp_message);
     }
 
+    err_t err = payload->err;
+    tcp_message->length = payload->length;
+    tcp_message->head_pbuf = urob_payload_take(payload);
+    tcp_message->pbuf_payload = true;
+
+    _chk(err != ERR_OK, tcp_message->err = err, "unable to build payload: %d", err);
+}
+
+void urob_tcp_message_payload_printf(urob_tcp_message * tcp_message, const char * format, ...)
+{
+    urob_payload payload;
+    urob_payload_init(&payload, PBUF_RAM);
+
     va_list vars;
     va_start(vars, format);
-    tcp_message->length = vasprintf(&tcp_message->payload, format, vars);
+    urob_payload_vprintf(&payload, format, vars);
     va_end(vars);
 
-    tcp_message->free_payload_in_uninit = true;
+    urob_tcp_message_payload_take(tcp_message, &payload);
 }
 
 void urob_tcp_message_uninit(urob_tcp_message * tcp_message)
 {
-    if (tcp_message->type == UROB_TCP_MESSAGE_TYPE_OUTGOING &&
-        tcp_message->free_payload_in_uninit &&
-        tcp_message->payload != NULL)
+    if (tcp_message->type == UROB_TCP_MESSAGE_TYPE_OUTGOING)
     {
-        free(tcp_message->payload);
+        _urob_tcp_message_release_payload(tcp_message);
     }
 
     if (tcp_message->type == UROB_TCP_MESSAGE_TYPE_INCOMING &&
@@ -55,28 +106,48 @@ void urob_tcp_message_uninit(urob_tcp_message * tcp_message)
 
 void _urob_tcp_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
 {
-    ESP_LOGD(TAG, "Connection event: %d", evt);
+    UROB_TRACE_EVENT(UROB_TRACE_TCP, conn, evt, len);
+    UROB_LOGD(TAG, "Connection event: %d", evt);
+}
+
+// Zeroes the tcp and allocates its cold fields
+static bool _urob_tcp_init(urob_tcp * tcp, urob_tcp_type type)
+{
+    * tcp = (urob_tcp) {0};
+    tcp->cold = calloc(1, sizeof(urob_tcp_cold));
+    _chk(tcp->cold == NULL, tcp->err = ERR_MEM; return false, "unable to allocate the cold fields");
+
+    tcp->cold->type = type;
+    return true;
 }
 
 // TODO: harmonize with listening (accept) connections
 void urob_tcp_init_client(urob_tcp * tcp, ip_addr_t * address, int port)
 {
-    * tcp = (urob_tcp) {0};
-    tcp->type = UROB_TCP_TYPE_CLIENT;
+    if (! _urob_tcp_init(tcp, UROB_TCP_TYPE_CLIENT))
+    {
+        return;
+    }
 
-    tcp->address = * address;
-    tcp->port = port;
+    tcp->cold->address = * address;
+    tcp->cold->port = port;
     tcp->conn = netconn_new_with_callback(NETCONN_TCP, _urob_tcp_callback);
     _chk(tcp->conn == NULL, tcp->err = ERR_CONN, "unable to initialize");
 
     netconn_set_flags(tcp->conn, NETCONN_FLAG_NON_BLOCKING);
     tcp->state = UROB_TCP_STATE_INIT;
+    tcp->cold->state_since_us = tcp->info_us = urob_metrics_time_us();
 }
 
-void urob_tcp_init_server(urob_tcp * tcp, int port)
+void urob_tcp_init_server(urob_tcp * tcp, int port, urob_tcp_accept_fn accept, void * accept_arg)
 {
-    * tcp = (urob_tcp) {0};
-    tcp->type = UROB_TCP_TYPE_SERVER;
+    if (! _urob_tcp_init(tcp, UROB_TCP_TYPE_SERVER))
+    {
+        return;
+    }
+    tcp->cold->port = port;
+    tcp->cold->accept = accept;
+    tcp->cold->accept_arg = accept_arg;
 
     #if LWIP_IPV6
     tcp->conn = netconn_new(NETCONN_TCP_IPV6);
@@ -92,16 +163,35 @@ void urob_tcp_init_server(urob_tcp * tcp, int port)
 
     //netconn_set_flags(tcp->conn, NETCONN_FLAG_NON_BLOCKING);
     tcp->state = UROB_TCP_STATE_INIT;
+    tcp->cold->state_since_us = tcp->info_us = urob_metrics_time_us();
+}
+
+void urob_tcp_init_accepted(urob_tcp * tcp, struct netconn * conn)
+{
+    if (! _urob_tcp_init(tcp, UROB_TCP_TYPE_CLIENT))
+    {
+        urob_teardown_abort(conn);
+        return;
+    }
+    tcp->conn = conn;
+
+    u16_t port = 0;
+    netconn_peer(conn, &tcp->cold->address, &port);
+    tcp->cold->port = port;
+
+    netconn_set_flags(tcp->conn, NETCONN_FLAG_NON_BLOCKING);
+    tcp->state = UROB_TCP_STATE_CONNECTED;
+    tcp->cold->state_since_us = tcp->info_us = urob_metrics_time_us();
 }
 
 // Assumes the tcp is initialized (no additional checks)
 static void _urob_tcp_connect(urob_tcp * tcp)
 {
-    ESP_LOGI(TAG, "connecting to host %s:%d", ipaddr_ntoa(&tcp->address), tcp->port);
-    tcp->err = netconn_connect(tcp->conn, &tcp->address, tcp->port);
+    ESP_LOGI(TAG, "connecting to host %s:%d", ipaddr_ntoa(&tcp->cold->address), tcp->cold->port);
+    tcp->err = netconn_connect(tcp->conn, &tcp->cold->address, tcp->cold->port);
     if (tcp->err == ERR_INPROGRESS || tcp->err == ERR_ALREADY || tcp->err == ERR_OK)
     {
-        ESP_LOGD(TAG, "connection in progress.."); // may need to throttle this log
+        UROB_LOGD(TAG, "connection in progress..");
         tcp->err = ERR_OK;
         tcp->state = UROB_TCP_STATE_CONNECTING;
     } else
@@ -114,42 +204,158 @@ static void _urob_tcp_connect(urob_tcp * tcp)
 static void _urob_tcp_connecting(urob_tcp * tcp)
 {
     if (tcp->conn->state == NETCONN_NONE) {
-        ESP_LOGI(TAG, "connected to host");
-        tcp->state = UROB_TCP_STATE_CONNECTED;
+        UROB_LOGI(TAG, "connected to host");
+        tcp->state = tcp->tls != NULL ? UROB_TCP_STATE_HANDSHAKING : UROB_TCP_STATE_CONNECTED;
     } else if (tcp->conn->state == NETCONN_CLOSE) { //Not sure this is the right state after a connection timeout, should check the value from the callback instead
         ESP_LOGE(TAG, "connection closed");
         tcp->state = UROB_TCP_STATE_ERROR;
     } else {
-        ESP_LOGD(TAG, "connection state: %d", tcp->conn->state);
+        UROB_LOGD_LIMITED(1000, 1, TAG, "connection state: %d", tcp->conn->state);
     }
 }
 
-void urob_tcp_add_message(urob_tcp * tcp, urob_tcp_message * tcp_message)
+static void _urob_tcp_handshaking(urob_tcp * tcp)
+{
+    err_t err = urob_tls_handshake(tcp->tls);
+
+    if (err == ERR_OK)
+    {
+        UROB_LOGI(TAG, "tls session ready");
+        tcp->state = UROB_TCP_STATE_CONNECTED;
+    } else if (err != ERR_INPROGRESS)
+    {
+        tcp->err = err;
+    }
+}
+
+void urob_tcp_set_tls(urob_tcp * tcp, urob_tls * tls)
 {
-    int message_index = 0;
+    _chk(tcp->state != UROB_TCP_STATE_INIT || tcp->cold->type != UROB_TCP_TYPE_CLIENT, return, "tls must be set on a client, before connecting");
 
-    for (; message_index < MAX_UROB_TCP_MESSAGES; message_index ++)
+    tcp->tls = tls;
+    urob_tls_bind(tls, tcp->conn);
+}
+
+// Writes through the tls session if there's one: the data is encrypted (copied) in its record buffer,
+// and a write that would block must be repeated from the same data
+static err_t _urob_tcp_write(urob_tcp * tcp, const void * data, size_t length, u8_t apiflags, size_t * bytes_written)
+{
+    if (tcp->tls != NULL)
     {
-        if (tcp->messages[message_index] == NULL)
+        return urob_tls_write(tcp->tls, data, length, bytes_written);
+    }
+
+    return netconn_write_partly(tcp->conn, data, length, apiflags, bytes_written);
+}
+
+void urob_tcp_set_budget(urob_tcp * tcp, const urob_budget_config * config)
+{
+    tcp->budget_config = * config;
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    struct netconn * conn;
+    bool nagle;
+} urob_tcp_nagle_call;
+
+// The pcb belongs to the tcpip thread
+static err_t _urob_tcp_do_set_nagle(struct tcpip_api_call_data * call)
+{
+    urob_tcp_nagle_call * nagle_call = (urob_tcp_nagle_call *) call;
+
+    if (nagle_call->conn->pcb.tcp != NULL)
+    {
+        if (nagle_call->nagle)
         {
-            tcp->messages[message_index] = tcp_message;
-            return;
+            tcp_nagle_enable(nagle_call->conn->pcb.tcp);
+        } else
+        {
+            tcp_nagle_disable(nagle_call->conn->pcb.tcp);
         }
     }
 
-    ESP_LOGE(TAG, "message limit reached, unable to add");
-    tcp_message->err = ERR_MEM;
+    return ERR_OK;
+}
+
+void urob_tcp_set_coalescing(urob_tcp * tcp, uint32_t deadline_us)
+{
+    _chk(tcp->conn == NULL, return, "no connection");
+
+    if (deadline_us > 0 && tcp->coalesce_buffer == NULL)
+    {
+        tcp->coalesce_buffer = malloc(UROB_TCP_COALESCE_SIZE);
+        _chk(tcp->coalesce_buffer == NULL, return, "unable to allocate the coalescing buffer");
+        tcp->coalesce_length = tcp->cold->coalesce_sent = 0;
+    }
+
+    _chk(deadline_us == 0 && tcp->coalesce_length > 0, return, "gathered data not flushed yet");
+
+    if (deadline_us == 0 && tcp->coalesce_buffer != NULL)
+    {
+        free(tcp->coalesce_buffer);
+        tcp->coalesce_buffer = NULL;
+    }
+
+    tcp->cold->coalesce_deadline_us = deadline_us;
+
+    urob_tcp_nagle_call nagle_call = {.conn = tcp->conn, .nagle = deadline_us == 0};
+    tcpip_api_call(_urob_tcp_do_set_nagle, &nagle_call.call);
+}
+
+void urob_tcp_flush(urob_tcp * tcp)
+{
+    tcp->flush_requested = true;
+}
+
+// Slots of messages of type, NULL if the type isn't one a tcp services
+static uint16_t * _urob_tcp_mask(urob_tcp * tcp, urob_tcp_message_type type)
+{
+    switch (type)
+    {
+        case UROB_TCP_MESSAGE_TYPE_INCOMING:
+            return &tcp->incoming;
+        case UROB_TCP_MESSAGE_TYPE_OUTGOING:
+            return &tcp->outgoing;
+        default:
+            return NULL;
+    }
+}
+
+void urob_tcp_add_message(urob_tcp * tcp, urob_tcp_message * tcp_message)
+{
+    uint16_t * mask = _urob_tcp_mask(tcp, tcp_message->type);
+    _chk(mask == NULL, tcp_message->err = ERR_ARG; return, "unrecognized message type, unable to add");
+
+    uint32_t free_slots = ~ (uint32_t) (tcp->outgoing | tcp->incoming) & ((1u << MAX_UROB_TCP_MESSAGES) - 1);
+    _chk(free_slots == 0, tcp_message->err = ERR_MEM; return, "message limit reached, unable to add");
+
+    int message_index = __builtin_ctz(free_slots);
+    tcp->messages[message_index] = tcp_message;
+    * mask |= 1u << message_index;
+    tcp_message->queued_us = urob_metrics_time_us();
+    tcp_message->sequence = tcp->sequence ++;
 }
 
 static void _urob_tcp_remove_message(urob_tcp * tcp, urob_tcp_message * tcp_message)
 {
-    int message_index = 0;
+    uint32_t used = tcp->outgoing | tcp->incoming;
 
-    for (; message_index < MAX_UROB_TCP_MESSAGES; message_index ++)
+    for (; used != 0; used &= used - 1)
     {
+        int message_index = __builtin_ctz(used);
+
         if (tcp->messages[message_index] == tcp_message)
         {
             tcp->messages[message_index] = NULL;
+            tcp->outgoing &= ~ (1u << message_index);
+            tcp->incoming &= ~ (1u << message_index);
+
+            if (tcp->sending == tcp_message)
+            {
+                tcp->sending = NULL;
+            }
             return;
         }
     }
@@ -157,34 +363,224 @@ static void _urob_tcp_remove_message(urob_tcp * tcp, urob_tcp_message * tcp_mess
     ESP_LOGE(TAG, "message not found in messages");
 }
 
-static void _urob_tcp_service_messages(urob_tcp * tcp)
+// The oldest outgoing message of the most urgent lane
+static urob_tcp_message * _urob_tcp_pick_message(urob_tcp * tcp)
 {
-    int message_index = 0;
+    urob_tcp_message * pick = NULL;
 
-    for (; message_index < MAX_UROB_TCP_MESSAGES; message_index ++)
+    for (uint32_t outgoing = tcp->outgoing; outgoing != 0; outgoing &= outgoing - 1)
     {
-        urob_tcp_message * tcp_message = tcp->messages[message_index];
-        if ( tcp_message != NULL)
+        urob_tcp_message * tcp_message = tcp->messages[__builtin_ctz(outgoing)];
+
+        if (pick == NULL || tcp_message->priority < pick->priority ||
+            (tcp_message->priority == pick->priority && (int32_t) (tcp_message->sequence - pick->sequence) < 0))
+        {
+            pick = tcp_message;
+        }
+    }
+
+    return pick;
+}
+
+// Copies a whole message not started yet in the coalescing buffer, if it fits
+// @return true if the message was gathered (and removed)
+static bool _urob_tcp_coalesce(urob_tcp * tcp, urob_tcp_message * tcp_message)
+{
+    if (tcp_message->progress != 0 || tcp_message->err != ERR_OK ||
+        (size_t) tcp_message->length > UROB_TCP_COALESCE_SIZE - tcp->coalesce_length)
+    {
+        return false;
+    }
+
+    char * destination = tcp->coalesce_buffer + tcp->coalesce_length;
+    if (tcp_message->pbuf_payload)
+    {
+        pbuf_copy_partial(tcp_message->head_pbuf, destination, tcp_message->length, 0);
+    } else
+    {
+        memcpy(destination, tcp_message->payload, tcp_message->length);
+    }
+
+    uint32_t now = urob_metrics_time_us();
+    if (tcp->coalesce_length == 0)
+    {
+        tcp->cold->coalesce_started_us = now;
+    }
+    tcp->coalesce_length += tcp_message->length;
+
+    urob_metrics_record(UROB_METRICS_TCP_QUEUE_URGENT + tcp_message->priority, now - tcp_message->queued_us);
+    UROB_METRICS_ADD(UROB_METRICS_TCP_MESSAGES_SENT, 1);
+    UROB_METRICS_ADD(UROB_METRICS_TCP_MESSAGES_COALESCED, 1);
+    tcp_message->progress = tcp_message->length;
+    tcp_message->state = UROB_TCP_MESSAGE_STATE_SENT;
+    _urob_tcp_remove_message(tcp, tcp_message);
+    return true;
+}
+
+// Writes the gathered data, copied by lwip
+// @return true once it's all written
+static bool _urob_tcp_flush_coalesced(urob_tcp * tcp)
+{
+    size_t bytes_written = 0;
+    size_t length = urob_budget_bytes(&tcp->budget, tcp->coalesce_length - tcp->cold->coalesce_sent);
+
+    tcp->err = _urob_tcp_write(tcp, tcp->coalesce_buffer + tcp->cold->coalesce_sent, length,
+        NETCONN_COPY | NETCONN_DONTBLOCK, &bytes_written);
+
+    if (tcp->err == ERR_WOULDBLOCK || tcp->err == ERR_INPROGRESS)
+    {
+        tcp->err = ERR_OK;
+    }
+
+    _chk(tcp->err != ERR_OK, return false, "error flushing: %d", tcp->err);
+
+    tcp->cold->coalesce_sent += bytes_written;
+    urob_budget_spend(&tcp->budget, bytes_written, 0);
+    UROB_METRICS_ADD(UROB_METRICS_TCP_BYTES_SENT, bytes_written);
+    tcp->cold->bytes_sent += bytes_written;
+
+    if (tcp->cold->coalesce_sent < tcp->coalesce_length)
+    {
+        return false;
+    }
+
+    tcp->coalesce_length = tcp->cold->coalesce_sent = 0;
+    tcp->flush_requested = false;
+    return true;
+}
+
+// Sends as much as the send buffer takes, picking the message again at each frame boundary so that
+// an urgent message waits at most for the frame in progress
+static void _urob_tcp_send_messages(urob_tcp * tcp)
+{
+    while (true)
+    {
+        urob_tcp_message * tcp_message = tcp->sending != NULL ? tcp->sending : _urob_tcp_pick_message(tcp);
+
+        if (tcp_message == NULL || ! urob_budget_left(&tcp->budget, &tcp->budget_config))
+        {
+            return;
+        }
+
+        urob_tcp_message_state message_state = tcp_message->state;
+        size_t progress = tcp_message->progress;
+        urob_budget_spend(&tcp->budget, 0, 1);
+
+        if (tcp->coalesce_buffer != NULL && tcp->sending == NULL)
         {
-            switch(tcp_message->type)
+            if (_urob_tcp_coalesce(tcp, tcp_message))
             {
-                case UROB_TCP_MESSAGE_TYPE_INCOMING:
-                    _urob_tcp_receive_message(tcp, tcp_message);
-                break;
-                case UROB_TCP_MESSAGE_TYPE_OUTGOING:
-                    _urob_tcp_send_message(tcp, tcp_message);
-                break;
-                default:
-                    ESP_LOGE(TAG, "unrecognized message type, removing");
-                    _urob_tcp_remove_message(tcp, tcp_message);
+                UROB_TRACE_STATE(UROB_TRACE_TCP_MESSAGE, tcp_message, message_state, tcp_message->state);
+                continue;
             }
 
-            if (tcp_message->err != ERR_OK)
+            if (tcp->coalesce_length > 0) // full, or ahead of a message too large to gather
             {
-                ESP_LOGE(TAG, "error in message, removing");
-                _urob_tcp_remove_message(tcp, tcp_message);
+                UROB_METRICS_ADD(UROB_METRICS_TCP_FLUSH_FULL, tcp->cold->coalesce_sent == 0);
+                if (! _urob_tcp_flush_coalesced(tcp))
+                {
+                    return;
+                }
+                continue;
             }
         }
+
+        UROB_METRICS_TIME(UROB_METRICS_TCP_SEND_MESSAGE, _urob_tcp_send_message(tcp, tcp_message));
+        UROB_TRACE_STATE(UROB_TRACE_TCP_MESSAGE, tcp_message, message_state, tcp_message->state);
+
+        if (tcp_message->err != ERR_OK)
+        {
+            UROB_METRICS_ADD(UROB_METRICS_TCP_ERRORS, 1);
+            ESP_LOGE(TAG, "error in message, removing");
+            _urob_tcp_remove_message(tcp, tcp_message);
+            continue;
+        }
+
+        if (tcp_message->state == UROB_TCP_MESSAGE_STATE_SENT) // removed
+        {
+            continue;
+        }
+
+        bool boundary = tcp_message->progress == 0 ||
+            (tcp_message->frame_size > 0 && tcp_message->progress % tcp_message->frame_size == 0);
+        bool record_pending = tcp->tls != NULL && tcp->tls->write_pending > 0; // to be completed from this message
+        tcp->sending = boundary && ! record_pending ? NULL : tcp_message;
+
+        if (tcp_message->progress == progress) // the send buffer is full
+        {
+            return;
+        }
+    }
+}
+
+// Round robin from where the budget ran out in the previous loop
+static void _urob_tcp_receive_messages(urob_tcp * tcp)
+{
+    // Slots from next_message on first, then the ones before it
+    uint32_t incoming = tcp->incoming;
+    uint32_t rotated = (incoming >> tcp->next_message) | (incoming << (MAX_UROB_TCP_MESSAGES - tcp->next_message));
+    rotated &= (1u << MAX_UROB_TCP_MESSAGES) - 1;
+
+    for (; rotated != 0; rotated &= rotated - 1)
+    {
+        int message_index = (tcp->next_message + __builtin_ctz(rotated)) % MAX_UROB_TCP_MESSAGES;
+        urob_tcp_message * tcp_message = tcp->messages[message_index];
+        urob_tcp_message_state message_state = tcp_message->state;
+
+        if (! urob_budget_left(&tcp->budget, &tcp->budget_config))
+        {
+            tcp->next_message = message_index;
+            return;
+        }
+
+        urob_budget_spend(&tcp->budget, 0, 1);
+        UROB_METRICS_TIME(UROB_METRICS_TCP_RECEIVE_MESSAGE, _urob_tcp_receive_message(tcp, tcp_message));
+
+        if (tcp_message->err != ERR_OK)
+        {
+            UROB_METRICS_ADD(UROB_METRICS_TCP_ERRORS, 1);
+            ESP_LOGE(TAG, "error in message, removing");
+            _urob_tcp_remove_message(tcp, tcp_message);
+        }
+
+        UROB_TRACE_STATE(UROB_TRACE_TCP_MESSAGE, tcp_message, message_state, tcp_message->state);
+    }
+}
+
+static void _urob_tcp_service_messages(urob_tcp * tcp)
+{
+    urob_budget_start(&tcp->budget, &tcp->budget_config);
+
+    if (tcp->send_first)
+    {
+        _urob_tcp_send_messages(tcp);
+        _urob_tcp_receive_messages(tcp);
+    } else
+    {
+        _urob_tcp_receive_messages(tcp);
+        _urob_tcp_send_messages(tcp);
+    }
+
+    if (tcp->coalesce_length > 0 && urob_budget_left(&tcp->budget, &tcp->budget_config))
+    {
+        if (tcp->flush_requested)
+        {
+            UROB_METRICS_ADD(UROB_METRICS_TCP_FLUSH_EXPLICIT, tcp->cold->coalesce_sent == 0);
+            _urob_tcp_flush_coalesced(tcp);
+        } else if (urob_metrics_time_us() - tcp->cold->coalesce_started_us >= tcp->cold->coalesce_deadline_us)
+        {
+            UROB_METRICS_ADD(UROB_METRICS_TCP_FLUSH_DEADLINE, tcp->cold->coalesce_sent == 0);
+            _urob_tcp_flush_coalesced(tcp);
+        }
+    } else if (tcp->coalesce_length == 0)
+    {
+        tcp->flush_requested = false; // nothing gathered left to flush
+    }
+
+    if (tcp->budget.exhausted)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_TCP_BUDGET_EXHAUSTED, 1);
+        tcp->send_first = ! tcp->send_first;
     }
 }
 
@@ -194,66 +590,69 @@ static void _urob_tcp_send_message(urob_tcp * tcp, urob_tcp_message * tcp_messag
     switch (tcp_message->state)
     {
         case UROB_TCP_MESSAGE_STATE_INIT:
-            ESP_LOGD(TAG, "sending message");
+            UROB_LOGD(TAG, "sending message");
             tcp_message->state = UROB_TCP_MESSAGE_STATE_SENDING;
         break;
         case UROB_TCP_MESSAGE_STATE_SENDING:
             // all ok here
         break;
         default:
-            ESP_LOGE("message in wrong state for sending :%d", tcp_message->state);
+            ESP_LOGE(TAG, "message in wrong state for sending :%d", tcp_message->state);
             tcp_message->state = UROB_TCP_MESSAGE_STATE_ERROR;
             return;
     }
 
     size_t bytes_written = 0; // bytes written in this iteration
+    size_t length = urob_budget_bytes(&tcp->budget, tcp_message->length - tcp_message->progress);
 
-    tcp_message->err = netconn_write_partly(
-        tcp->conn,
-        tcp_message->payload,
-        tcp_message->length + tcp_message->progress,
-        NETCONN_DONTBLOCK, // Don't copy, don't block
-        &bytes_written);
-
-    _chk(tcp_message->err != ERR_OK && tcp_message->err != ERR_INPROGRESS, tcp_message->state = UROB_TCP_MESSAGE_STATE_ERROR, "error sending request: %d", tcp_message->err);
-
-    tcp_message->progress += bytes_written;
-    ESP_LOGD(TAG, "%d/%d bytes sent", tcp_message->progress, tcp_message->length);
+    if (tcp_message->frame_size > 0) // up to the end of the frame, where the next message is picked
+    {
+        size_t frame_left = tcp_message->frame_size - tcp_message->progress % tcp_message->frame_size;
+        length = frame_left < length ? frame_left : length;
+    }
 
-    if (tcp_message->progress == tcp_message->length)
+    if (tcp_message->pbuf_payload && tcp->tls != NULL)
     {
-        ESP_LOGI(TAG, "message sent");
-        tcp_message->state = UROB_TCP_MESSAGE_STATE_SENT;
-        _urob_tcp_remove_message(tcp, tcp_message);
+        tcp_message->err = urob_tls_write_chain(tcp->tls, tcp_message->head_pbuf, tcp_message->progress, length, &bytes_written);
+    } else if (tcp_message->pbuf_payload)
+    {
+        tcp_message->err = urob_payload_write_partly(tcp->conn, tcp_message->head_pbuf, tcp_message->progress, length, NETCONN_DONTBLOCK, &bytes_written);
+    } else
+    {
+        tcp_message->err = _urob_tcp_write(
+            tcp,
+            tcp_message->payload + tcp_message->progress,
+            length,
+            NETCONN_DONTBLOCK, // Don't copy, don't block
+            &bytes_written);
     }
-}
 
-// TODO: must register a callback to serve specific requests..
-static void _urob_tcp_serve(urob_tcp * tcp, struct netconn *new_conn)
-{
-    struct netbuf * new_buf;
-    tcp->err = netconn_recv(new_conn, &new_buf);
-    _chk(tcp->err != ERR_OK, goto leave, "error receiving: %d", tcp->err);
+    if (tcp_message->err == ERR_WOULDBLOCK) // send buffer full, retried in the next iteration
+    {
+        tcp_message->err = ERR_OK;
+    }
 
-    char *buf;
-    u16_t len;
-    tcp->err = netbuf_data(new_buf, (void **)&buf, &len);
-    _chk(tcp->err != ERR_OK, goto leave, "netbuf_data: %d", tcp->err);
+    _chk(tcp_message->err != ERR_OK && tcp_message->err != ERR_INPROGRESS, tcp_message->state = UROB_TCP_MESSAGE_STATE_ERROR, "error sending request: %d", tcp_message->err);
 
-    if (strncmp(buf, "GET /", 5) == 0)
+    if (tcp_message->progress == 0 && bytes_written > 0)
     {
-        // TODO: these write functions should use NETCONN_DONTBLOCK
-        tcp->err = netconn_write(new_conn, http_header, sizeof(http_header) - 1, NETCONN_NOCOPY);
-        _chk(tcp->err != ERR_OK, goto leave, "sending header: %d", tcp->err);
-        tcp->err = netconn_write(new_conn, html_page, sizeof(html_page) - 1, NETCONN_NOCOPY);
-        _chk(tcp->err != ERR_OK, goto leave, "sending html: %d", tcp->err);
+        urob_metrics_record(UROB_METRICS_TCP_QUEUE_URGENT + tcp_message->priority, urob_metrics_time_us() - tcp_message->queued_us);
     }
 
-leave:
-    server->err = netconn_close(new_conn);
-    netbuf_delete(new_buf);
-}
+    tcp_message->progress += bytes_written;
+    urob_budget_spend(&tcp->budget, bytes_written, 0);
+    UROB_METRICS_ADD(UROB_METRICS_TCP_BYTES_SENT, bytes_written);
+    tcp->cold->bytes_sent += bytes_written;
+    UROB_LOGD(TAG, "%u/%d bytes sent", (unsigned) tcp_message->progress, tcp_message->length);
 
+    if (tcp_message->progress == (size_t) tcp_message->length)
+    {
+        UROB_LOGI(TAG, "message sent");
+        UROB_METRICS_ADD(UROB_METRICS_TCP_MESSAGES_SENT, 1);
+        tcp_message->state = UROB_TCP_MESSAGE_STATE_SENT;
+        _urob_tcp_remove_message(tcp, tcp_message);
+    }
+}
 
 static void _urob_tcp_accept(urob_tcp * tcp)
 {
@@ -262,9 +661,16 @@ static void _urob_tcp_accept(urob_tcp * tcp)
 
   if (tcp->err == ERR_OK)
   {
-      ESP_LOGI(TAG, "received connection request");
-      _urob_tcp_serve(tcp, newconn);
-      netconn_delete(newconn);
+      UROB_LOGI(TAG, "received connection request");
+
+      if (tcp->cold->accept != NULL)
+      {
+          tcp->cold->accept(tcp, newconn, tcp->cold->accept_arg);
+      } else
+      {
+          ESP_LOGW(TAG, "no accept callback, dropping connection");
+          urob_teardown_abort(newconn);
+      }
   }
 
   if (tcp->err == ERR_TIMEOUT)
@@ -279,20 +685,26 @@ static void _urob_tcp_receive_message(urob_tcp * tcp, urob_tcp_message * tcp_mes
     switch (tcp_message->state)
     {
         case UROB_TCP_MESSAGE_STATE_INIT:
-            ESP_LOGD(TAG, "receiving message");
+            UROB_LOGD(TAG, "receiving message");
             tcp_message->state = UROB_TCP_MESSAGE_STATE_RECEIVING;
         break;
         case UROB_TCP_MESSAGE_STATE_RECEIVING:
             // all ok here
         break;
         default:
-            ESP_LOGE("message in wrong state for receiving :%d", tcp_message->state);
+            ESP_LOGE(TAG, "message in wrong state for receiving :%d", tcp_message->state);
             tcp_message->state = UROB_TCP_MESSAGE_STATE_ERROR;
             return;
     }
 
     struct pbuf * tail_pbuf = NULL;
-    tcp_message->err = netconn_recv_tcp_pbuf_flags(tcp->conn, &tail_pbuf, NETCONN_DONTBLOCK);
+    if (tcp->tls != NULL) // decrypted in a pbuf of its own
+    {
+        tcp_message->err = urob_tls_recv(tcp->tls, &tail_pbuf);
+    } else
+    {
+        tcp_message->err = netconn_recv_tcp_pbuf_flags(tcp->conn, &tail_pbuf, NETCONN_DONTBLOCK);
+    }
 
     if (tcp_message->err == ERR_WOULDBLOCK || tcp_message->err == ERR_INPROGRESS)
     {
@@ -302,18 +714,20 @@ static void _urob_tcp_receive_message(urob_tcp * tcp, urob_tcp_message * tcp_mes
     // Apparently we need to keep polling until we get an error (see lwip_recv_tcp() in sockets.c)
     if (tcp_message->err != ERR_OK) {
         tcp_message->state = UROB_TCP_MESSAGE_STATE_RECEIVED;
+        UROB_METRICS_ADD(UROB_METRICS_TCP_MESSAGES_RECEIVED, 1);
         _urob_tcp_remove_message(tcp, tcp_message);
-        ESP_LOGD(TAG, "done receiving message, code: %d", tcp_message->err);
+        UROB_LOGD(TAG, "done receiving message, code: %d", tcp_message->err);
         return;
     }
 
     if (tail_pbuf != NULL)
     {
-        ESP_LOGD(TAG, "Received payload: len:%d tot_len: %d <%.*s>",
-            tail_pbuf->len,
-            tail_pbuf->tot_len,
-            tail_pbuf->len,
-            (char *)tail_pbuf->payload); 
+        UROB_METRICS_ADD(UROB_METRICS_TCP_BYTES_RECEIVED, tail_pbuf->tot_len);
+        tcp->cold->bytes_received += tail_pbuf->tot_len;
+        urob_budget_spend(&tcp->budget, tail_pbuf->tot_len, 0);
+        UROB_LOGD(TAG, "Received payload: len:%d tot_len: %d", tail_pbuf->len, tail_pbuf->tot_len);
+        // Dumping the payload can't be deferred (the pbuf may be gone by then), and is expensive
+        ESP_LOGV(TAG, "<%.*s>", tail_pbuf->len, (char *)tail_pbuf->payload);
 
         if (tcp_message->head_pbuf != NULL)
         {
@@ -325,7 +739,7 @@ static void _urob_tcp_receive_message(urob_tcp * tcp, urob_tcp_message * tcp_mes
     }
 }
 
-void urob_tcp_loop(urob_tcp * tcp)
+static void _urob_tcp_loop(urob_tcp * tcp)
 {
     switch (tcp->state)
     {
@@ -337,26 +751,29 @@ void urob_tcp_loop(urob_tcp * tcp)
             urob_tcp_uninit(tcp);
         break;
         case UROB_TCP_STATE_INIT:
-            if (tcp->type == UROB_TCP_TYPE_CLIENT)
+            if (tcp->cold->type == UROB_TCP_TYPE_CLIENT)
             {
-                _urob_tcp_connect(tcp);
-            } else if (tcp->type == UROB_TCP_TYPE_SERVER)
+                UROB_METRICS_TIME(UROB_METRICS_TCP_CONNECT, _urob_tcp_connect(tcp));
+            } else if (tcp->cold->type == UROB_TCP_TYPE_SERVER)
             {
                 tcp->state = UROB_TCP_STATE_ACCEPTING;
             } else
             {
-                ESP_ERR(TAG, "unkown tcp type: %d", tcp->type);
+                ESP_LOGE(TAG, "unkown tcp type: %d", tcp->cold->type);
                 tcp->state = UROB_TCP_STATE_ERROR;
             }
         break;
         case UROB_TCP_STATE_CONNECTING:
-            _urob_tcp_connecting(tcp);
+            UROB_METRICS_TIME(UROB_METRICS_TCP_CONNECT, _urob_tcp_connecting(tcp));
+        break;
+        case UROB_TCP_STATE_HANDSHAKING:
+            _urob_tcp_handshaking(tcp);
         break;
         case UROB_TCP_STATE_CONNECTED:
             _urob_tcp_service_messages(tcp);
         break;
         case UROB_TCP_STATE_ACCEPTING:
-            _urob_tcp_accept();
+            UROB_METRICS_TIME(UROB_METRICS_TCP_ACCEPT, _urob_tcp_accept(tcp));
         break;
         default:
         ESP_LOGE(TAG, "unhandled state: %d", tcp->state);
@@ -366,25 +783,112 @@ void urob_tcp_loop(urob_tcp * tcp)
     if (tcp->err != ERR_OK && tcp->err != ERR_INPROGRESS)
     {
         ESP_LOGE(TAG, "netconn error %d", tcp->err);
+        UROB_METRICS_ADD(UROB_METRICS_TCP_ERRORS, 1);
         tcp->state = UROB_TCP_STATE_ERROR;
     }
 }
 
+// Moves the time spent in state since state_since_us to state_ms and the metrics, a millisecond at a time
+static void _urob_tcp_account(urob_tcp * tcp, urob_tcp_state state, uint32_t now)
+{
+    uint32_t elapsed_ms = (now - tcp->cold->state_since_us) / 1000;
+    tcp->cold->state_ms[state] += elapsed_ms;
+    tcp->cold->state_since_us += elapsed_ms * 1000;
+
+    if (state >= UROB_TCP_STATE_INIT && state <= UROB_TCP_STATE_ACCEPTING && elapsed_ms > 0)
+    {
+        UROB_METRICS_ADD(UROB_METRICS_TCP_STATE_INIT + state - UROB_TCP_STATE_INIT, elapsed_ms);
+    }
+}
+
+void urob_tcp_get_stats(urob_tcp * tcp, urob_tcp_stats * stats)
+{
+    * stats = (urob_tcp_stats) {0};
+
+    if (tcp->cold == NULL) // uninitialized
+    {
+        return;
+    }
+
+    stats->bytes_sent = tcp->cold->bytes_sent;
+    stats->bytes_received = tcp->cold->bytes_received;
+
+    if (tcp->conn != NULL && tcp->state != UROB_TCP_STATE_NONE)
+    {
+        _urob_tcp_account(tcp, tcp->state, urob_metrics_time_us());
+        urob_tcp_info_get(tcp->conn, &stats->info);
+    }
+
+    memcpy(stats->state_ms, tcp->cold->state_ms, sizeof(stats->state_ms));
+}
+
+// State changes and periodic pcb snapshots, for the metrics
+static void _urob_tcp_stats(urob_tcp * tcp, urob_tcp_state state)
+{
+    if (tcp->state == UROB_TCP_STATE_NONE) // uninitialized, accounted already
+    {
+        return;
+    }
+
+    uint32_t now = urob_metrics_time_us();
+    bool interval = now - tcp->info_us >= UROB_TCP_INFO_INTERVAL_US;
+
+    if (state != tcp->state || interval)
+    {
+        _urob_tcp_account(tcp, state, now);
+    }
+
+    if (interval)
+    {
+        tcp->info_us = now;
+
+        urob_tcp_info info;
+        if (tcp->state == UROB_TCP_STATE_CONNECTED && urob_tcp_info_get(tcp->conn, &info))
+        {
+            urob_tcp_info_record(&info);
+        }
+    }
+}
+
+void urob_tcp_loop(urob_tcp * tcp)
+{
+    urob_tcp_state state = tcp->state;
+    UROB_TRACE_LOOP(UROB_TRACE_TCP, tcp->conn, UROB_METRICS_TIME(UROB_METRICS_TCP_LOOP, _urob_tcp_loop(tcp)));
+    UROB_TRACE_STATE(UROB_TRACE_TCP, tcp->conn, state, tcp->state);
+    _urob_tcp_stats(tcp, state);
+}
+
 
 void urob_tcp_uninit(urob_tcp * tcp)
 {
     ESP_LOGI(TAG, "uninitializing tcp");
     err_t err = ERR_OK;
 
-    _chk(tcp->conn != NULL, goto leave, "no connection");
+    if (tcp->state != UROB_TCP_STATE_NONE)
+    {
+        _urob_tcp_account(tcp, tcp->state, urob_metrics_time_us());
+    }
+
+    _chk(tcp->conn == NULL, goto leave, "no connection");
+
+    if (tcp->state == UROB_TCP_STATE_ERROR) // nothing worth a graceful close, nor a pcb in TIME_WAIT
+    {
+        urob_teardown_abort(tcp->conn);
+        goto leave;
+    }
+
+    if (tcp->tls != NULL)
+    {
+        urob_tls_close(tcp->tls);
+    }
 
-    if (tcp->type == UROB_TCP_TYPE_CLIENT && tcp->state >= UROB_TCP_STATE_CONNECTED)
+    if (tcp->cold->type == UROB_TCP_TYPE_CLIENT && tcp->state >= UROB_TCP_STATE_HANDSHAKING)
     {
         err = netconn_disconnect(tcp->conn);
         _chk(err != ERR_OK, , "netconn_disconnect: %d", err);
     }
 
-    if (tcp->type == UROB_TCP_TYPE_SERVER)
+    if (tcp->cold->type == UROB_TCP_TYPE_SERVER)
     {
         err = netconn_close(tcp->conn);
         _chk(err != ERR_OK, , "netconn_close: %d", err);
@@ -394,5 +898,7 @@ void urob_tcp_uninit(urob_tcp * tcp)
     _chk(err != ERR_OK, , "netconn_delete: %d", err);
 
 leave:
+    free(tcp->coalesce_buffer);
+    free(tcp->cold);
     *tcp = (urob_tcp) {0};
 }
\ No newline at end of file
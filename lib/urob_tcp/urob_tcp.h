@@ -26,9 +26,27 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "lwip/err.h"
 #include "lwip/ip_addr.h"
+#include "urob_budget.h"
+#include "urob_payload.h"
+#include "urob_tcp_info.h"
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define MAX_UROB_TCP_MESSAGES (10)
+#define UROB_TCP_COALESCE_SIZE (1436) // a segment's worth of small messages, see urob_tcp_set_coalescing
+
+// Layouts checked by the asserts below, the host values are for LP64 builds
+#ifdef ESP_PLATFORM
+#define UROB_TCP_CACHE_LINE (32)
+#define UROB_TCP_MESSAGE_SIZE (40)
+#define UROB_TCP_HOT_SIZE (4 * UROB_TCP_CACHE_LINE)
+#else
+#define UROB_TCP_CACHE_LINE (64)
+#define UROB_TCP_MESSAGE_SIZE (64)
+#define UROB_TCP_HOT_SIZE (3 * UROB_TCP_CACHE_LINE)
+#endif
 
 typedef enum
 {
@@ -48,12 +66,23 @@ typedef enum
     UROB_TCP_MESSAGE_TYPE_OUTGOING
 } urob_tcp_message_type;
 
+// Lanes of outgoing messages, the most urgent one with a message waiting is always sent from first
+typedef enum
+{
+    UROB_TCP_PRIORITY_URGENT = 0, // e.g. control replies
+    UROB_TCP_PRIORITY_NORMAL,
+    UROB_TCP_PRIORITY_BULK, // e.g. log uploads
+    UROB_TCP_PRIORITY_COUNT
+} urob_tcp_priority;
+
 typedef struct _urob_tcp_message
 {
+    // Read by every loop over the messages, kept in the first cache line (see the asserts below)
     urob_tcp_message_type type;
     urob_tcp_message_state state;
     err_t err;
 
+    bool pbuf_payload; // outgoing payload in head_pbuf, always freed in uninit
     bool free_payload_in_uninit;
     union
     {
@@ -64,16 +93,36 @@ typedef struct _urob_tcp_message
     // These two aren't used when receiving
     int length; // bytes used by the message in memory
     size_t progress; // Amount written or read
+
+    // Outgoing scheduling, see urob_tcp_message_set_priority
+    urob_tcp_priority priority;
+    uint32_t sequence; // order of addition, messages of a lane are sent in this order
+    size_t frame_size; // other messages may be sent between frames of this size, 0 if the payload can't be split
+    uint32_t queued_us;
 } urob_tcp_message;
 
+// Picking the next outgoing message compares priority and sequence of each: one cache line per message
+_Static_assert(offsetof(urob_tcp_message, sequence) + sizeof(uint32_t) <= UROB_TCP_CACHE_LINE, "message scheduling fields span two cache lines");
+_Static_assert(sizeof(urob_tcp_message) == UROB_TCP_MESSAGE_SIZE, "urob_tcp_message layout changed");
+
 // Initializes a tcp message
 // @param type: type of message (e.g. outgoing or incoming)
 void urob_tcp_message_init(urob_tcp_message * tcp_message, urob_tcp_message_type type);
 
 // Initializes the payload of a message as a string formatted following the printf notation.
-// @discussion The psyload will be allocated from the heap, and released in the uninit function
+// @discussion The payload is formatted in pbufs (see urob_payload), and released in the uninit function
 void urob_tcp_message_payload_printf(urob_tcp_message * tcp_message, const char * format, ...);
 
+// Takes the chain built by payload as the message's payload, released in the uninit function
+// @discussion on failure (e.g. the payload ran out of memory) the err field of message is set
+void urob_tcp_message_payload_take(urob_tcp_message * tcp_message, urob_payload * payload);
+
+// Sets the lane of an outgoing message (UROB_TCP_PRIORITY_NORMAL by default), before adding it
+// @param frame_size the payload is a sequence of frames of this size that the protocol can tell apart
+// from other messages (e.g. fixed size records), more urgent messages are sent between frames once one
+// is in progress; 0 when the payload must go out in one piece
+void urob_tcp_message_set_priority(urob_tcp_message * tcp_message, urob_tcp_priority priority, size_t frame_size);
+
 void urob_tcp_message_uninit(urob_tcp_message * tcp_message);
 
 typedef enum
@@ -81,9 +130,11 @@ typedef enum
   UROB_TCP_STATE_NONE = 0,
   UROB_TCP_STATE_INIT, // also handles ongoing connection
   UROB_TCP_STATE_CONNECTING,
+  UROB_TCP_STATE_HANDSHAKING, // tls only
   UROB_TCP_STATE_CONNECTED,
   UROB_TCP_STATE_ACCEPTING,
-  UROB_TCP_STATE_ERROR
+  UROB_TCP_STATE_ERROR,
+  UROB_TCP_STATE_COUNT
 } urob_tcp_state;
 
 typedef enum
@@ -93,26 +144,114 @@ typedef enum
     UROB_TCP_TYPE_SERVER
 } urob_tcp_type;
 
+struct netconn;
+typedef struct _urob_tcp urob_tcp;
+typedef struct _urob_tls urob_tls;
+
+// Receives ownership of a connection accepted by a server urob_tcp
+typedef void (* urob_tcp_accept_fn)(urob_tcp * tcp, struct netconn * conn, void * arg);
+
+// Read when connecting, accepting, sending or changing state, and by urob_tcp_get_stats: allocated
+// apart from the urob_tcp, so that a table of connections only spans their hot fields
 typedef struct
 {
-  struct netconn * conn;
   urob_tcp_type type;
-  err_t err;
+  ip_addr_t address;
+  int port;
+
+  urob_tcp_accept_fn accept; // servers only
+  void * accept_arg;
+
+  // Coalescing, see urob_tcp_set_coalescing
+  size_t coalesce_sent;
+  uint32_t coalesce_started_us; // first byte gathered
+  uint32_t coalesce_deadline_us;
+
+  // Statistics, see urob_tcp_get_stats
+  uint32_t bytes_sent;
+  uint32_t bytes_received;
+  uint32_t state_ms[UROB_TCP_STATE_COUNT];
+  uint32_t state_since_us; // not accounted in state_ms yet
+} urob_tcp_cold;
+
+// Only what every loop reads: an idle connection's loop doesn't touch its cold fields
+struct _urob_tcp
+{
   urob_tcp_state state;
+  err_t err;
+  bool send_first; // alternates whenever the budget runs out, not to starve either direction
+  bool flush_requested;
+  uint8_t next_message; // incoming message serviced first, where the budget ran out
+  uint16_t outgoing; // message slots in use, by type, one bit each
+  uint16_t incoming;
+  uint32_t info_us; // last snapshot of the pcb recorded in the metrics
+  uint32_t sequence; // of the next message added
+
+  struct netconn * conn;
+  urob_tcp_message * sending; // outgoing message in the middle of a frame, nothing else can be sent until it's through
+  urob_tls * tls; // NULL for plain tcp
+
+  // Coalescing, NULL buffer when off
+  char * coalesce_buffer;
+  size_t coalesce_length;
+
+  urob_budget budget;
+  urob_budget_config budget_config; // per loop, unlimited by default
 
   urob_tcp_message * messages[MAX_UROB_TCP_MESSAGES];
+  urob_tcp_cold * cold; // NULL until initialized, and if its allocation failed
+};
 
-  ip_addr_t address;
-  int port;
-} urob_tcp;
+_Static_assert(MAX_UROB_TCP_MESSAGES <= 16, "outgoing and incoming masks are 16 bits");
+_Static_assert(sizeof(urob_tcp) <= UROB_TCP_HOT_SIZE, "urob_tcp spans more cache lines than its hot fields need");
+
+typedef struct
+{
+    urob_tcp_info info; // of the pcb, zeroed without one
+    uint32_t bytes_sent; // payload, before tls
+    uint32_t bytes_received;
+    uint32_t state_ms[UROB_TCP_STATE_COUNT]; // time spent in each state, the current one included
+} urob_tcp_stats;
 
+// The init functions allocate the cold fields: on failure the tcp stays uninitialized, with err ERR_MEM
 void urob_tcp_init_client(urob_tcp * tcp, ip_addr_t * address, int port);
+
+// Initializes a listening tcp, accepted connections are passed to accept
+void urob_tcp_init_server(urob_tcp * tcp, int port, urob_tcp_accept_fn accept, void * accept_arg);
+
+// Wraps a connection returned by accept in a connected tcp, taking ownership of it
+void urob_tcp_init_accepted(urob_tcp * tcp, struct netconn * conn);
+
 void urob_tcp_uninit(urob_tcp * tcp);
 
+// Limits the work done by each loop call, what's left is carried over to the next one
+void urob_tcp_set_budget(urob_tcp * tcp, const urob_budget_config * config);
+
+// Gathers small outgoing messages in a segment-sized buffer, written when full, on urob_tcp_flush,
+// or deadline_us after its first byte, whichever comes first. Nagle's algorithm is disabled, so that
+// latency is bounded by the deadline alone; 0 turns coalescing off
+// @discussion gathered messages are copied and reported sent right away, larger ones are written as usual
+// (after the gathered data, order is kept)
+void urob_tcp_set_coalescing(urob_tcp * tcp, uint32_t deadline_us);
+
+// Writes the gathered messages at the next loop, without waiting for the deadline
+void urob_tcp_flush(urob_tcp * tcp);
+
+// Runs the connection over tls, handshaking once connected; tls is initialized (see urob_tls_init) and
+// uninitialized by the caller, after this tcp
+// @discussion outgoing messages are encrypted into the tls record buffer, so they're copied once
+void urob_tcp_set_tls(urob_tcp * tcp, urob_tls * tls);
+
 // Add a message to the urob_tcp, if possible
-// @discussion in case of failure the err field of message is set accordingly
+// @discussion in case of failure the err field of message is set accordingly. Outgoing messages
+// are sent by lane, see urob_tcp_message_set_priority
 void urob_tcp_add_message(urob_tcp * tcp, urob_tcp_message * message);
 
+// Snapshots the connection's statistics, the pcb's through the tcpip thread
+// @discussion connected tcps also record a snapshot of their pcb in the metrics every
+// UROB_TCP_INFO_INTERVAL_US, and the time spent in each state
+void urob_tcp_get_stats(urob_tcp * tcp, urob_tcp_stats * stats);
+
 void urob_tcp_loop(urob_tcp * tcp);
 
 #endif // __UROB_TCP_H__
\ No newline at end of file
@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_tcp_info.h"
+#include "urob_metrics.h"
+
+#include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcpip_priv.h"
+#if ! UROB_NETSIM
+#include "lwip/priv/tcp_priv.h"
+#endif
+
+#ifndef TCP_SLOW_INTERVAL
+#define TCP_SLOW_INTERVAL (500) // lwip's default, the simulation has no timers
+#endif
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    struct netconn * conn;
+    urob_tcp_info * info;
+} urob_tcp_info_call;
+
+// Runs in the tcpip thread
+static err_t _urob_tcp_info_do_get(struct tcpip_api_call_data * call)
+{
+    urob_tcp_info_call * get = (urob_tcp_info_call *) call;
+    struct tcp_pcb * pcb = get->conn->pcb.tcp;
+
+    if (pcb == NULL) // reset by the peer, or aborted
+    {
+        return ERR_CONN;
+    }
+
+    // See tcp_receive(): sa holds 8 times the srtt, sv 4 times the variation
+    * get->info = (urob_tcp_info) {
+        .state = (uint8_t) pcb->state,
+        .mss = pcb->mss,
+        .srtt_ms = (uint32_t) (pcb->sa >> 3) * TCP_SLOW_INTERVAL,
+        .rttvar_ms = (uint32_t) (pcb->sv >> 2) * TCP_SLOW_INTERVAL,
+        .rto_ms = (uint32_t) pcb->rto * TCP_SLOW_INTERVAL,
+        .cwnd = pcb->cwnd,
+        .ssthresh = pcb->ssthresh,
+        .send_window = pcb->snd_wnd,
+        .receive_window = pcb->rcv_wnd,
+        .send_buffer = pcb->snd_buf,
+        .unacked = pcb->snd_nxt - pcb->lastack,
+        .queued_segments = pcb->snd_queuelen,
+        .retransmits = pcb->nrtx,
+        .dupacks = pcb->dupacks
+    };
+
+    return ERR_OK;
+}
+
+bool urob_tcp_info_get(struct netconn * conn, urob_tcp_info * info)
+{
+    * info = (urob_tcp_info) {0};
+    urob_tcp_info_call call = {.conn = conn, .info = info};
+    return tcpip_api_call(_urob_tcp_info_do_get, &call.call) == ERR_OK;
+}
+
+void urob_tcp_info_record(const urob_tcp_info * info)
+{
+    urob_metrics_record(UROB_METRICS_TCP_PCB_SRTT, info->srtt_ms);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_RTO, info->rto_ms);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_CWND, info->cwnd);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_SEND_WINDOW, info->send_window);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_RECEIVE_WINDOW, info->receive_window);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_UNACKED, info->unacked);
+    urob_metrics_record(UROB_METRICS_TCP_PCB_RETRANSMITS, info->retransmits);
+}
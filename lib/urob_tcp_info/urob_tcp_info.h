@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_TCP_INFO_H__
+#define __UROB_TCP_INFO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UROB_TCP_INFO_INTERVAL_US (1000 * 1000) // between snapshots recorded in the metrics
+
+struct netconn;
+
+// Snapshot of the tcp_pcb behind a netconn, to see why a connection is slow and size lwip's
+// buffers and windows (TCP_WND, TCP_SND_BUF, ...) from real traffic
+// @discussion lwip measures the rtt in slow timer ticks (TCP_SLOW_INTERVAL, 500ms), so srtt, rttvar
+// and rto are multiples of it: a connection whose srtt is 0 answers within a tick
+typedef struct
+{
+    uint8_t state; // lwip's enum tcp_state, CLOSED once the pcb is gone
+    uint16_t mss;
+    uint32_t srtt_ms;
+    uint32_t rttvar_ms;
+    uint32_t rto_ms;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t send_window; // offered by the peer
+    uint32_t receive_window; // offered to the peer
+    uint32_t send_buffer; // free space in it
+    uint32_t unacked; // bytes sent and not acknowledged yet
+    uint16_t queued_segments; // unsent and unacked
+    uint8_t retransmits; // of the oldest unacked segment, 0 once acknowledged
+    uint8_t dupacks;
+} urob_tcp_info;
+
+// Copies the pcb fields in the tcpip thread, which owns them (see tcpip_api_call)
+// @return false if the connection has no pcb (any more), info is zeroed then
+bool urob_tcp_info_get(struct netconn * conn, urob_tcp_info * info);
+
+// Adds a snapshot to the "urob_tcp_pcb" histograms
+void urob_tcp_info_record(const urob_tcp_info * info);
+
+#endif // __UROB_TCP_INFO_H__
@@ -0,0 +1,181 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_teardown.h"
+#include "urob_metrics.h"
+
+#include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcpip_priv.h"
+#if ! UROB_NETSIM
+#include "lwip/priv/tcp_priv.h"
+#endif
+
+#include "esp_log.h"
+
+#define TAG "teardown"
+#include "general.h"
+
+void urob_teardown_close(struct netconn * conn)
+{
+    netconn_close(conn);
+    netconn_delete(conn);
+    UROB_METRICS_ADD(UROB_METRICS_TEARDOWN_ACTIVE, 1);
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    struct netconn * conn; // to abort
+    int reserve; // or pcbs to keep free
+    int reclaimed;
+} urob_teardown_call;
+
+static err_t _urob_teardown_do_abort(struct tcpip_api_call_data * call)
+{
+    struct netconn * conn = ((urob_teardown_call *) call)->conn;
+
+    if (conn->pcb.tcp != NULL) // NULL once reset by the peer, or aborted by lwip
+    {
+        tcp_abort(conn->pcb.tcp); // sends a RST, netconn's error callback forgets the pcb
+    }
+
+    return ERR_OK;
+}
+
+void urob_teardown_abort(struct netconn * conn)
+{
+    urob_teardown_call call = {.conn = conn};
+    tcpip_api_call(_urob_teardown_do_abort, &call.call);
+    netconn_delete(conn);
+    UROB_METRICS_ADD(UROB_METRICS_TEARDOWN_ABORT, 1);
+}
+
+bool urob_teardown_linger(struct netconn * conn, uint32_t since_us)
+{
+    struct pbuf * received = NULL;
+    err_t err;
+
+    while ((err = netconn_recv_tcp_pbuf_flags(conn, &received, NETCONN_DONTBLOCK)) == ERR_OK)
+    {
+        pbuf_free(received);
+    }
+
+    if (err == ERR_WOULDBLOCK || err == ERR_INPROGRESS)
+    {
+        if (urob_metrics_time_us() - since_us < UROB_TEARDOWN_LINGER_US)
+        {
+            return false;
+        }
+
+        urob_teardown_close(conn);
+        return true;
+    }
+
+    if (err == ERR_CLSD) // the peer's FIN: this side's FIN leaves it in LAST_ACK, freed once acknowledged
+    {
+        netconn_close(conn);
+        netconn_delete(conn);
+        UROB_METRICS_ADD(UROB_METRICS_TEARDOWN_PASSIVE, 1);
+        return true;
+    }
+
+    UROB_LOGD(TAG, "error lingering: %d", err);
+    urob_teardown_abort(conn);
+    return true;
+}
+
+void urob_teardown_init(urob_teardown * teardown, int reserve)
+{
+    * teardown = (urob_teardown) {
+        .reserve = reserve,
+        .checked_us = urob_metrics_time_us()
+    };
+}
+
+#if ! UROB_NETSIM
+static int _urob_teardown_count(struct tcp_pcb * list)
+{
+    int count = 0;
+
+    for (struct tcp_pcb * pcb = list; pcb != NULL; pcb = pcb->next)
+    {
+        count ++;
+    }
+
+    return count;
+}
+#endif
+
+// Runs in the tcpip thread, which owns the pcb lists
+static err_t _urob_teardown_do_reclaim(struct tcpip_api_call_data * call)
+{
+    urob_teardown_call * reclaim = (urob_teardown_call *) call;
+
+#if UROB_NETSIM
+    LWIP_UNUSED_ARG(reclaim); // no TIME_WAIT in the simulation, sockets are freed when deleted
+#else
+    int available = MEMP_NUM_TCP_PCB - _urob_teardown_count(tcp_bound_pcbs) - _urob_teardown_count(tcp_active_pcbs) -
+        _urob_teardown_count(tcp_tw_pcbs);
+
+    while (available < reclaim->reserve && tcp_tw_pcbs != NULL)
+    {
+        struct tcp_pcb * oldest = tcp_tw_pcbs;
+
+        for (struct tcp_pcb * pcb = tcp_tw_pcbs->next; pcb != NULL; pcb = pcb->next)
+        {
+            if ((u32_t) (tcp_ticks - pcb->tmr) > (u32_t) (tcp_ticks - oldest->tmr))
+            {
+                oldest = pcb;
+            }
+        }
+
+        tcp_abort(oldest); // a TIME_WAIT pcb is just removed and freed, nothing is sent
+        reclaim->reclaimed ++;
+        available ++;
+    }
+#endif
+
+    return ERR_OK;
+}
+
+void urob_teardown_loop(urob_teardown * teardown)
+{
+    uint32_t now = urob_metrics_time_us();
+
+    if (now - teardown->checked_us < UROB_TEARDOWN_RECLAIM_INTERVAL_US)
+    {
+        return;
+    }
+
+    teardown->checked_us = now;
+
+    urob_teardown_call call = {.reserve = teardown->reserve};
+    tcpip_api_call(_urob_teardown_do_reclaim, &call.call);
+
+    if (call.reclaimed > 0)
+    {
+        UROB_LOGI(TAG, "reclaimed %d TIME_WAIT pcbs", call.reclaimed);
+        UROB_METRICS_ADD(UROB_METRICS_TEARDOWN_RECLAIM, call.reclaimed);
+    }
+}
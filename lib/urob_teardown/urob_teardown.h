@@ -0,0 +1,62 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_TEARDOWN_H__
+#define __UROB_TEARDOWN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UROB_TEARDOWN_LINGER_US (2 * 1000000) // longest wait for the peer to close first
+#define UROB_TEARDOWN_RECLAIM_INTERVAL_US (100 * 1000)
+
+struct netconn;
+
+// How connections end decides where their pcb waits in TIME_WAIT (2 * MSL, two minutes with lwip's
+// defaults): on the side that closes first. lwip's pcb pool is small (MEMP_NUM_TCP_PCB), so
+// connections are closed in the order that leaves TIME_WAIT to the peer, and aborted (no TIME_WAIT
+// at all) when they failed anyway.
+
+// Closes first, after the data written: this side keeps the pcb in TIME_WAIT
+void urob_teardown_close(struct netconn * conn);
+
+// Resets the connection and frees its pcb right away, discarding the unsent data: for errored or idle ones
+void urob_teardown_abort(struct netconn * conn);
+
+// Lets the peer close first, discarding what it sends meanwhile, then closes as well: TIME_WAIT is on the peer
+// @param since_us when the connection was done, it's closed first once UROB_TEARDOWN_LINGER_US elapse
+// @return true once conn is deleted, false to be called again at the next loop
+bool urob_teardown_linger(struct netconn * conn, uint32_t since_us);
+
+// Frees the oldest TIME_WAIT pcbs when fewer than reserve pcbs are left in the pool, ahead of lwip
+// which only does so once the pool is exhausted, in the path of the SYN or connect needing a pcb
+typedef struct
+{
+    int reserve;
+    uint32_t checked_us;
+} urob_teardown;
+
+void urob_teardown_init(urob_teardown * teardown, int reserve);
+void urob_teardown_loop(urob_teardown * teardown); // every UROB_TEARDOWN_RECLAIM_INTERVAL_US
+
+#endif // __UROB_TEARDOWN_H__
@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_template.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#define TAG "template"
+#include "general.h"
+
+void urob_template_init(urob_template * tmpl, const urob_template_op * ops, urob_template_value_fn value, urob_template_count_fn count, void * arg)
+{
+    * tmpl = (urob_template) {0};
+    tmpl->ops = ops;
+    tmpl->value = value;
+    tmpl->count = count;
+    tmpl->arg = arg;
+}
+
+static void _urob_template_add_piece(urob_template * tmpl, const char * ptr, size_t length, bool copy)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    tmpl->pieces[tmpl->piece_count ++] = (urob_template_piece) {.ptr = ptr, .length = length, .copy = copy};
+}
+
+// Moves past the END_LOOP matching the LOOP at tmpl->op
+static void _urob_template_skip_loop(urob_template * tmpl)
+{
+    int nesting = 0;
+
+    for (tmpl->op ++; tmpl->ops[tmpl->op].opcode != UROB_TEMPLATE_OP_END; tmpl->op ++)
+    {
+        uint8_t opcode = tmpl->ops[tmpl->op].opcode;
+
+        if (opcode == UROB_TEMPLATE_OP_LOOP)
+        {
+            nesting ++;
+        } else if (opcode == UROB_TEMPLATE_OP_END_LOOP && nesting -- == 0)
+        {
+            tmpl->op ++;
+            return;
+        }
+    }
+}
+
+// Walks the opcodes until the pieces or the scratch space are full, assumes the previous pieces were sent
+static void _urob_template_prepare(urob_template * tmpl)
+{
+    tmpl->piece_first = 0;
+    tmpl->piece_count = 0;
+    tmpl->scratch_length = 0;
+
+    while (tmpl->piece_count < UROB_TEMPLATE_MAX_PIECES)
+    {
+        const urob_template_op * op = &tmpl->ops[tmpl->op];
+
+        switch (op->opcode)
+        {
+            case UROB_TEMPLATE_OP_END:
+                return;
+            case UROB_TEMPLATE_OP_TEXT:
+                _urob_template_add_piece(tmpl, op->text, op->length, op->length < UROB_TEMPLATE_NOCOPY_MIN);
+                tmpl->op ++;
+            break;
+            case UROB_TEMPLATE_OP_VALUE:
+            {
+                if (UROB_TEMPLATE_SCRATCH_SIZE - tmpl->scratch_length < UROB_TEMPLATE_VALUE_SIZE)
+                {
+                    return;
+                }
+
+                char * buffer = tmpl->scratch + tmpl->scratch_length;
+                size_t length = tmpl->value(tmpl, op->slot, buffer, UROB_TEMPLATE_VALUE_SIZE, tmpl->arg);
+                length = length < UROB_TEMPLATE_VALUE_SIZE ? length : UROB_TEMPLATE_VALUE_SIZE; // snprintf-like truncation
+
+                tmpl->scratch_length += length;
+                _urob_template_add_piece(tmpl, buffer, length, true);
+                tmpl->op ++;
+            }
+            break;
+            case UROB_TEMPLATE_OP_LOOP:
+            {
+                int count = tmpl->count(tmpl, op->slot, tmpl->arg);
+                bool nested = tmpl->depth < UROB_TEMPLATE_MAX_DEPTH;
+                _chk(! nested, , "loops nested too deeply, skipped");
+
+                if (count <= 0 || ! nested)
+                {
+                    _urob_template_skip_loop(tmpl);
+                    break;
+                }
+
+                tmpl->loops[tmpl->depth ++] = (urob_template_loop) {.op = tmpl->op, .index = 0, .count = count};
+                tmpl->op ++;
+            }
+            break;
+            case UROB_TEMPLATE_OP_END_LOOP:
+            {
+                urob_template_loop * loop = &tmpl->loops[tmpl->depth - 1];
+
+                if (++ loop->index < loop->count)
+                {
+                    tmpl->op = loop->op + 1;
+                } else
+                {
+                    tmpl->depth --;
+                    tmpl->op ++;
+                }
+            }
+            break;
+            default:
+                _chk(true, tmpl->op ++, "invalid opcode: %d", op->opcode);
+        }
+    }
+}
+
+// Drops what was written from the front of the prepared pieces
+static void _urob_template_consume(urob_template * tmpl, size_t written)
+{
+    while (written > 0)
+    {
+        urob_template_piece * piece = &tmpl->pieces[tmpl->piece_first];
+
+        if (written < piece->length)
+        {
+            piece->ptr += written;
+            piece->length -= written;
+            return;
+        }
+
+        written -= piece->length;
+        tmpl->piece_first ++;
+        tmpl->piece_count --;
+    }
+}
+
+size_t urob_template_read(urob_template * tmpl, char * buffer, size_t size, const char ** reference)
+{
+    size_t length = 0;
+    * reference = NULL;
+
+    while (length < size)
+    {
+        if (tmpl->piece_count == 0)
+        {
+            if (tmpl->ops[tmpl->op].opcode == UROB_TEMPLATE_OP_END)
+            {
+                break;
+            }
+
+            _urob_template_prepare(tmpl);
+            continue;
+        }
+
+        urob_template_piece * piece = &tmpl->pieces[tmpl->piece_first];
+
+        if (! piece->copy)
+        {
+            if (length == 0) // referenced on its own
+            {
+                * reference = piece->ptr;
+                length = piece->length;
+                _urob_template_consume(tmpl, length);
+            }
+            break;
+        }
+
+        size_t chunk = piece->length < size - length ? piece->length : size - length;
+        memcpy(buffer + length, piece->ptr, chunk);
+        length += chunk;
+        _urob_template_consume(tmpl, chunk);
+    }
+
+    tmpl->sent += length;
+    return length;
+}
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_TEMPLATE_H__
+#define __UROB_TEMPLATE_H__
+
+// Templates are const arrays of opcodes built with the macros below, so they are laid out by the
+// compiler and live in flash with their literals; e.g.
+//
+//   static const urob_template_op page[] =
+//   {
+//       UROB_TEMPLATE_TEXT("<ul>"),
+//       UROB_TEMPLATE_LOOP(SLOT_ITEMS),
+//           UROB_TEMPLATE_TEXT("<li>"), UROB_TEMPLATE_VALUE(SLOT_ITEM), UROB_TEMPLATE_TEXT("</li>"),
+//       UROB_TEMPLATE_END_LOOP(),
+//       UROB_TEMPLATE_TEXT("</ul>"),
+//       UROB_TEMPLATE_END()
+//   };
+//
+// A urob_template renders one of them lazily, a part at a time as the connection's send window opens
+// (see urob_template_read): memory is constant no matter how large the page is, and values are
+// formatted only when about to be sent.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Literals at least this long are referenced, to be sent without copies (NETCONN_NOCOPY, straight from
+// flash), shorter ones are copied along with the values: lwip queues a pbuf per reference and the queue is short
+#define UROB_TEMPLATE_NOCOPY_MIN (64)
+
+// Pieces (literal spans and values) prepared between two sends
+#define UROB_TEMPLATE_MAX_PIECES (12)
+
+// Room for the values of a batch of pieces, a single value can use up to UROB_TEMPLATE_VALUE_SIZE
+#define UROB_TEMPLATE_SCRATCH_SIZE (192)
+#define UROB_TEMPLATE_VALUE_SIZE (48)
+
+#define UROB_TEMPLATE_MAX_DEPTH (4)
+
+typedef enum
+{
+    UROB_TEMPLATE_OP_END,
+    UROB_TEMPLATE_OP_TEXT,
+    UROB_TEMPLATE_OP_VALUE,
+    UROB_TEMPLATE_OP_LOOP,
+    UROB_TEMPLATE_OP_END_LOOP
+} urob_template_opcode;
+
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t slot; // VALUE, LOOP
+    uint16_t length; // TEXT
+    const char * text; // TEXT
+} urob_template_op;
+
+#define UROB_TEMPLATE_TEXT(literal) { .opcode = UROB_TEMPLATE_OP_TEXT, .length = sizeof(literal) - 1, .text = (literal) }
+#define UROB_TEMPLATE_VALUE(value_slot) { .opcode = UROB_TEMPLATE_OP_VALUE, .slot = (value_slot) }
+#define UROB_TEMPLATE_LOOP(count_slot) { .opcode = UROB_TEMPLATE_OP_LOOP, .slot = (count_slot) }
+#define UROB_TEMPLATE_END_LOOP() { .opcode = UROB_TEMPLATE_OP_END_LOOP }
+#define UROB_TEMPLATE_END() { .opcode = UROB_TEMPLATE_OP_END }
+
+typedef struct _urob_template urob_template;
+
+// Formats the value of a slot into buffer (at most size bytes, no terminator needed)
+// @return the length of the value
+typedef size_t (* urob_template_value_fn)(const urob_template * tmpl, int slot, char * buffer, size_t size, void * arg);
+
+// @return the iterations of a loop, evaluated when the loop is entered
+typedef int (* urob_template_count_fn)(const urob_template * tmpl, int slot, void * arg);
+
+typedef struct
+{
+    const char * ptr;
+    size_t length;
+    bool copy;
+} urob_template_piece;
+
+typedef struct
+{
+    int op; // the LOOP opcode
+    int index;
+    int count;
+} urob_template_loop;
+
+struct _urob_template
+{
+    const urob_template_op * ops;
+    urob_template_value_fn value;
+    urob_template_count_fn count;
+    void * arg;
+
+    int op; // next opcode to prepare
+    int depth;
+    urob_template_loop loops[UROB_TEMPLATE_MAX_DEPTH];
+
+    // Prepared, not yet sent
+    urob_template_piece pieces[UROB_TEMPLATE_MAX_PIECES];
+    int piece_first;
+    int piece_count;
+    char scratch[UROB_TEMPLATE_SCRATCH_SIZE];
+    size_t scratch_length;
+
+    size_t sent; // bytes rendered so far
+};
+
+// Holds no resources, nothing to uninitialize
+void urob_template_init(urob_template * tmpl, const urob_template_op * ops, urob_template_value_fn value, urob_template_count_fn count, void * arg);
+
+// Renders the next part into buffer, or references a long literal instead (reference is set, buffer unused)
+// @discussion the caller frames and sends the output, e.g. as the chunks of an http response
+// @return the length, 0 at the end
+size_t urob_template_read(urob_template * tmpl, char * buffer, size_t size, const char ** reference);
+
+static inline bool urob_template_done(const urob_template * tmpl)
+{
+    return tmpl->ops[tmpl->op].opcode == UROB_TEMPLATE_OP_END && tmpl->piece_count == 0;
+}
+
+// Index of the innermost loop's iteration, -1 outside loops
+static inline int urob_template_index(const urob_template * tmpl)
+{
+    return tmpl->depth > 0 ? tmpl->loops[tmpl->depth - 1].index : -1;
+}
+
+#endif // __UROB_TEMPLATE_H__
@@ -0,0 +1,470 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_tls.h"
+#include "urob_metrics.h"
+
+#include <string.h>
+
+#include "lwip/api.h"
+#include "mbedtls/net_sockets.h"
+
+#include "esp_log.h"
+
+#define TAG "tls"
+#include "general.h"
+
+void urob_tls_context_init(urob_tls_context * context, const urob_tls_config * config)
+{
+    * context = (urob_tls_context) {0};
+
+    mbedtls_entropy_init(&context->entropy);
+    mbedtls_ctr_drbg_init(&context->ctr_drbg);
+    mbedtls_x509_crt_init(&context->ca);
+    mbedtls_ssl_config_init(&context->ssl_config);
+
+    for (int entry_index = 0; entry_index < UROB_TLS_CACHE_SIZE; entry_index ++)
+    {
+        mbedtls_ssl_session_init(&context->cache[entry_index].session);
+    }
+
+    context->err = mbedtls_ctr_drbg_seed(&context->ctr_drbg, mbedtls_entropy_func, &context->entropy,
+        (const unsigned char *) TAG, strlen(TAG));
+    _chk(context->err != 0, return, "unable to seed the rng: -0x%04x", -context->err);
+
+    if (config->ca_pem != NULL)
+    {
+        context->err = mbedtls_x509_crt_parse(&context->ca, (const unsigned char *) config->ca_pem, strlen(config->ca_pem) + 1);
+        _chk(context->err != 0, return, "unable to parse the ca certificates: -0x%04x", -context->err);
+    } else
+    {
+        ESP_LOGW(TAG, "no ca certificates, servers aren't verified");
+    }
+
+    mbedtls_ssl_config * ssl_config = &context->ssl_config;
+    context->err = mbedtls_ssl_config_defaults(ssl_config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    _chk(context->err != 0, return, "unable to configure: -0x%04x", -context->err);
+
+    mbedtls_ssl_conf_authmode(ssl_config, config->ca_pem != NULL ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_ca_chain(ssl_config, &context->ca, NULL);
+    mbedtls_ssl_conf_rng(ssl_config, mbedtls_ctr_drbg_random, &context->ctr_drbg);
+
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    // The server keeps its records within the length, and the record buffers can shrink to it
+    // after the handshake (CONFIG_MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    unsigned char max_fragment_code = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+    switch (config->max_fragment)
+    {
+        case 0: break;
+        case 512: max_fragment_code = MBEDTLS_SSL_MAX_FRAG_LEN_512; break;
+        case 1024: max_fragment_code = MBEDTLS_SSL_MAX_FRAG_LEN_1024; break;
+        case 2048: max_fragment_code = MBEDTLS_SSL_MAX_FRAG_LEN_2048; break;
+        case 4096: max_fragment_code = MBEDTLS_SSL_MAX_FRAG_LEN_4096; break;
+        default: ESP_LOGW(TAG, "unsupported max fragment: %d, using full records", config->max_fragment);
+    }
+    context->err = mbedtls_ssl_conf_max_frag_len(ssl_config, max_fragment_code);
+    _chk(context->err != 0, return, "unable to set the max fragment: -0x%04x", -context->err);
+#else
+    _chk(config->max_fragment != 0, , "max fragment length not supported by this mbedtls build");
+#endif
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(ssl_config, config->session_tickets ? MBEDTLS_SSL_SESSION_TICKETS_ENABLED : MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+#else
+    _chk(config->session_tickets, , "session tickets not supported by this mbedtls build");
+#endif
+}
+
+void urob_tls_context_uninit(urob_tls_context * context)
+{
+    for (int entry_index = 0; entry_index < UROB_TLS_CACHE_SIZE; entry_index ++)
+    {
+        mbedtls_ssl_session_free(&context->cache[entry_index].session);
+    }
+
+    mbedtls_ssl_config_free(&context->ssl_config);
+    mbedtls_x509_crt_free(&context->ca);
+    mbedtls_ctr_drbg_free(&context->ctr_drbg);
+    mbedtls_entropy_free(&context->entropy);
+    * context = (urob_tls_context) {0};
+}
+
+static urob_tls_cache_entry * _urob_tls_cache_find(urob_tls_context * context, const char * host)
+{
+    for (int entry_index = 0; entry_index < UROB_TLS_CACHE_SIZE; entry_index ++)
+    {
+        urob_tls_cache_entry * entry = &context->cache[entry_index];
+        if (entry->valid && strcmp(entry->host, host) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// An unused entry, or the least recently saved one
+static urob_tls_cache_entry * _urob_tls_cache_pick(urob_tls_context * context)
+{
+    urob_tls_cache_entry * pick = &context->cache[0];
+    uint32_t now = urob_metrics_time_us();
+
+    for (int entry_index = 0; entry_index < UROB_TLS_CACHE_SIZE; entry_index ++)
+    {
+        urob_tls_cache_entry * entry = &context->cache[entry_index];
+        if (! entry->valid)
+        {
+            return entry;
+        }
+
+        if (now - entry->saved_us > now - pick->saved_us)
+        {
+            pick = entry;
+        }
+    }
+
+    return pick;
+}
+
+// Takes the session just negotiated, the master secret tells whether it was a resumption
+static void _urob_tls_cache_save(urob_tls * tls)
+{
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+
+    int ret = mbedtls_ssl_get_session(&tls->ssl, &session);
+    _chk(ret != 0, mbedtls_ssl_session_free(&session); return, "unable to get the session: -0x%04x", -ret);
+
+    urob_tls_cache_entry * entry = _urob_tls_cache_find(tls->context, tls->host);
+    tls->resumed = tls->offered && entry != NULL &&
+        memcmp(entry->session.master, session.master, sizeof(session.master)) == 0;
+
+    if (entry == NULL)
+    {
+        entry = _urob_tls_cache_pick(tls->context);
+        strcpy(entry->host, tls->host);
+    }
+
+    mbedtls_ssl_session_free(&entry->session);
+    entry->session = session; // owns the ticket and certificate now
+    entry->valid = true;
+    entry->saved_us = urob_metrics_time_us();
+}
+
+static void _urob_tls_cache_drop(urob_tls * tls)
+{
+    urob_tls_cache_entry * entry = _urob_tls_cache_find(tls->context, tls->host);
+
+    if (entry != NULL)
+    {
+        mbedtls_ssl_session_free(&entry->session);
+        mbedtls_ssl_session_init(&entry->session);
+        entry->valid = false;
+    }
+}
+
+// Bio callbacks: records go straight between mbedtls' buffers and lwip's
+
+static int _urob_tls_send(void * arg, const unsigned char * data, size_t length)
+{
+    urob_tls * tls = (urob_tls *) arg;
+    size_t bytes_written = 0;
+
+    // Copied, the record buffer is reused for the next record
+    err_t err = netconn_write_partly(tls->conn, data, length, NETCONN_COPY | NETCONN_DONTBLOCK, &bytes_written);
+
+    if (err == ERR_WOULDBLOCK || err == ERR_INPROGRESS || (err == ERR_OK && bytes_written == 0))
+    {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+
+    _chk(err != ERR_OK, return MBEDTLS_ERR_NET_SEND_FAILED, "error writing: %d", err);
+    return (int) bytes_written;
+}
+
+static err_t _urob_tls_fetch(urob_tls * tls)
+{
+    tls->input = NULL;
+    tls->input_offset = 0;
+
+    err_t err = netconn_recv_tcp_pbuf_flags(tls->conn, &tls->input, NETCONN_DONTBLOCK);
+    return err == ERR_INPROGRESS ? ERR_WOULDBLOCK : err;
+}
+
+static int _urob_tls_receive(void * arg, unsigned char * buffer, size_t length)
+{
+    urob_tls * tls = (urob_tls *) arg;
+
+    if (tls->input == NULL)
+    {
+        err_t err = _urob_tls_fetch(tls);
+
+        if (err == ERR_WOULDBLOCK)
+        {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        }
+
+        if (err == ERR_CLSD)
+        {
+            return 0;
+        }
+
+        _chk(err != ERR_OK, return MBEDTLS_ERR_NET_RECV_FAILED, "error receiving: %d", err);
+    }
+
+    u16_t copied = pbuf_copy_partial(tls->input, buffer, length < 0xffff ? length : 0xffff, tls->input_offset);
+    tls->input_offset += copied;
+
+    // Segments are given back to lwip as soon as they're consumed
+    while (tls->input != NULL && tls->input_offset >= tls->input->len)
+    {
+        struct pbuf * consumed = tls->input;
+        tls->input_offset -= consumed->len;
+        tls->input = consumed->next;
+
+        if (tls->input != NULL)
+        {
+            pbuf_ref(tls->input); // the reference held by consumed is dropped with it
+        }
+        pbuf_free(consumed);
+    }
+
+    return copied;
+}
+
+void urob_tls_init(urob_tls * tls, urob_tls_context * context, const char * host)
+{
+    * tls = (urob_tls) {0};
+    tls->context = context;
+    mbedtls_ssl_init(&tls->ssl);
+
+    _chk(context->err != 0, tls->state = UROB_TLS_STATE_ERROR; return, "context not initialized");
+    _chk(strlen(host) >= sizeof(tls->host), tls->state = UROB_TLS_STATE_ERROR; return, "host name too long: %s", host);
+    strcpy(tls->host, host);
+
+    tls->err = mbedtls_ssl_setup(&tls->ssl, &context->ssl_config);
+    _chk(tls->err != 0, tls->state = UROB_TLS_STATE_ERROR; return, "unable to setup: -0x%04x", -tls->err);
+
+    tls->err = mbedtls_ssl_set_hostname(&tls->ssl, host);
+    _chk(tls->err != 0, tls->state = UROB_TLS_STATE_ERROR; return, "unable to set the host name: -0x%04x", -tls->err);
+
+    mbedtls_ssl_set_bio(&tls->ssl, tls, _urob_tls_send, _urob_tls_receive, NULL);
+}
+
+void urob_tls_bind(urob_tls * tls, struct netconn * conn)
+{
+    tls->conn = conn;
+}
+
+err_t urob_tls_handshake(urob_tls * tls)
+{
+    _chk(tls->conn == NULL, return ERR_ARG, "no connection bound");
+
+    switch (tls->state)
+    {
+        case UROB_TLS_STATE_NONE:
+        {
+            urob_tls_cache_entry * entry = _urob_tls_cache_find(tls->context, tls->host);
+            if (entry != NULL)
+            {
+                int ret = mbedtls_ssl_set_session(&tls->ssl, &entry->session);
+                tls->offered = ret == 0;
+                _chk(ret != 0, , "unable to offer the cached session: -0x%04x", -ret);
+            }
+
+            tls->started_us = urob_metrics_time_us();
+            tls->state = UROB_TLS_STATE_HANDSHAKE;
+        }
+        break;
+        case UROB_TLS_STATE_HANDSHAKE:
+        break;
+        case UROB_TLS_STATE_READY:
+            return ERR_OK;
+        default:
+            ESP_LOGE(TAG, "wrong state for a handshake: %d", tls->state);
+            return ERR_CONN;
+    }
+
+    int ret = mbedtls_ssl_handshake(&tls->ssl);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        return ERR_INPROGRESS;
+    }
+
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, "handshake with %s failed: -0x%04x", tls->host, -ret);
+        tls->err = ret;
+        tls->state = UROB_TLS_STATE_ERROR;
+        _urob_tls_cache_drop(tls);
+        return ERR_CONN;
+    }
+
+    _urob_tls_cache_save(tls);
+    urob_metrics_record(tls->resumed ? UROB_METRICS_TLS_HANDSHAKE_RESUMED : UROB_METRICS_TLS_HANDSHAKE_FULL,
+        urob_metrics_time_us() - tls->started_us);
+    UROB_LOGI(TAG, "handshake done, %s", tls->resumed ? "resumed" : "full");
+
+    tls->state = UROB_TLS_STATE_READY;
+    return ERR_OK;
+}
+
+err_t urob_tls_write(urob_tls * tls, const void * data, size_t length, size_t * bytes_written)
+{
+    * bytes_written = 0;
+    _chk(tls->state != UROB_TLS_STATE_READY, return ERR_CONN, "not ready for writing: %d", tls->state);
+
+    // A record encrypted in a previous call is completed first, mbedtls expects the same length
+    if (tls->write_pending > 0)
+    {
+        length = tls->write_pending;
+    }
+
+    if (length == 0)
+    {
+        return ERR_OK;
+    }
+
+    int ret = mbedtls_ssl_write(&tls->ssl, data, length);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ)
+    {
+        tls->write_pending = length;
+        return ERR_WOULDBLOCK;
+    }
+
+    tls->write_pending = 0;
+
+    if (ret < 0)
+    {
+        ESP_LOGE(TAG, "error writing: -0x%04x", -ret);
+        tls->err = ret;
+        tls->state = UROB_TLS_STATE_ERROR;
+        return ERR_CONN;
+    }
+
+    * bytes_written = ret;
+    return ERR_OK;
+}
+
+err_t urob_tls_write_chain(urob_tls * tls, struct pbuf * chain, size_t offset, size_t length, size_t * bytes_written)
+{
+    * bytes_written = 0;
+
+    for (struct pbuf * segment = chain; segment != NULL; segment = segment->next)
+    {
+        if (offset >= segment->len)
+        {
+            offset -= segment->len;
+            continue;
+        }
+
+        // A segment at a time, mbedtls encrypts from it into its record buffer
+        size_t segment_length = segment->len - offset < length ? segment->len - offset : length;
+        return urob_tls_write(tls, (const char *) segment->payload + offset, segment_length, bytes_written);
+    }
+
+    return ERR_OK;
+}
+
+err_t urob_tls_recv(urob_tls * tls, struct pbuf ** plaintext)
+{
+    * plaintext = NULL;
+
+    if (tls->state == UROB_TLS_STATE_CLOSED)
+    {
+        return ERR_CLSD;
+    }
+
+    _chk(tls->state != UROB_TLS_STATE_READY, return ERR_CONN, "not ready for reading: %d", tls->state);
+
+    // Nothing is allocated until some data arrived
+    size_t available = mbedtls_ssl_get_bytes_avail(&tls->ssl);
+    if (available == 0 && tls->input == NULL && ! mbedtls_ssl_check_pending(&tls->ssl))
+    {
+        err_t err = _urob_tls_fetch(tls);
+
+        if (err == ERR_CLSD)
+        {
+            tls->state = UROB_TLS_STATE_CLOSED;
+        }
+
+        if (err != ERR_OK)
+        {
+            return err;
+        }
+    }
+
+    u16_t size = available > 0 && available < UROB_TLS_READ_SIZE ? available : UROB_TLS_READ_SIZE;
+    struct pbuf * decrypted = pbuf_alloc(PBUF_RAW, size, PBUF_RAM);
+    _chk(decrypted == NULL, return ERR_MEM, "unable to allocate %u bytes", size);
+
+    int ret = mbedtls_ssl_read(&tls->ssl, decrypted->payload, size);
+
+    if (ret > 0)
+    {
+        pbuf_realloc(decrypted, ret);
+        * plaintext = decrypted;
+        return ERR_OK;
+    }
+
+    pbuf_free(decrypted);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        return ERR_WOULDBLOCK;
+    }
+
+    if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF)
+    {
+        tls->state = UROB_TLS_STATE_CLOSED;
+        return ERR_CLSD;
+    }
+
+    ESP_LOGE(TAG, "error reading: -0x%04x", -ret);
+    tls->err = ret;
+    tls->state = UROB_TLS_STATE_ERROR;
+    return ERR_CONN;
+}
+
+void urob_tls_close(urob_tls * tls)
+{
+    if (tls->state == UROB_TLS_STATE_READY)
+    {
+        int ret = mbedtls_ssl_close_notify(&tls->ssl);
+        _chk(ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE, , "error sending close_notify: -0x%04x", -ret);
+        tls->state = UROB_TLS_STATE_CLOSED;
+    }
+}
+
+void urob_tls_uninit(urob_tls * tls)
+{
+    if (tls->input != NULL)
+    {
+        pbuf_free(tls->input);
+    }
+
+    mbedtls_ssl_free(&tls->ssl);
+    * tls = (urob_tls) {0};
+}
@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_TLS_H__
+#define __UROB_TLS_H__
+
+#include "lwip/err.h"
+#include "lwip/opt.h"
+#include "lwip/pbuf.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UROB_TLS_HOST_SIZE (64)
+#define UROB_TLS_CACHE_SIZE (4) // hosts whose session is kept for resumption
+#define UROB_TLS_READ_SIZE (TCP_MSS) // largest pbuf of plaintext returned by urob_tls_recv
+
+struct netconn;
+
+// TLS client sessions over non-blocking netconns (mbedtls): handshakes, reads and writes never
+// block, they report ERR_INPROGRESS / ERR_WOULDBLOCK and are called again at the next loop.
+
+typedef struct
+{
+    const char * ca_pem; // NUL terminated, NULL not to verify the server (tests only)
+    int max_fragment; // 512, 1024, 2048 or 4096 to ask for smaller records (RFC 6066), 0 for 16 KiB ones
+    bool session_tickets; // resumes with tickets (RFC 5077), session ids otherwise
+} urob_tls_config;
+
+typedef struct
+{
+    char host[UROB_TLS_HOST_SIZE];
+    mbedtls_ssl_session session;
+    bool valid;
+    uint32_t saved_us; // the least recently saved entry is replaced
+} urob_tls_cache_entry;
+
+// Shared by the sessions of a loop: rng, certificates, ssl configuration and the session cache
+// @discussion the cache isn't locked, a context belongs to a single loop (shard)
+typedef struct
+{
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt ca;
+    mbedtls_ssl_config ssl_config;
+    urob_tls_cache_entry cache[UROB_TLS_CACHE_SIZE];
+    int err; // mbedtls error of the initialization, 0 if ok
+} urob_tls_context;
+
+void urob_tls_context_init(urob_tls_context * context, const urob_tls_config * config);
+void urob_tls_context_uninit(urob_tls_context * context);
+
+typedef enum
+{
+    UROB_TLS_STATE_NONE = 0,
+    UROB_TLS_STATE_HANDSHAKE,
+    UROB_TLS_STATE_READY,
+    UROB_TLS_STATE_CLOSED, // close_notify received or sent
+    UROB_TLS_STATE_ERROR
+} urob_tls_state;
+
+typedef struct _urob_tls urob_tls;
+
+struct _urob_tls
+{
+    urob_tls_context * context;
+    mbedtls_ssl_context ssl;
+    urob_tls_state state;
+    int err; // last mbedtls error
+    struct netconn * conn;
+
+    // Received records not consumed by mbedtls yet, read straight from the pbufs lwip received
+    struct pbuf * input;
+    u16_t input_offset;
+
+    size_t write_pending; // length of a record encrypted but not fully written, see urob_tls_write
+    char host[UROB_TLS_HOST_SIZE];
+    bool offered; // a cached session was offered to the server
+    bool resumed;
+    uint32_t started_us;
+};
+
+// @param host server name, for SNI, verification and the session cache
+void urob_tls_init(urob_tls * tls, urob_tls_context * context, const char * host);
+
+// Binds the session to a connection, before the handshake
+void urob_tls_bind(urob_tls * tls, struct netconn * conn);
+
+// Steps the handshake, a cached session for the host is offered and the new one saved
+// @return ERR_OK once done, ERR_INPROGRESS to be called again, another error on failure
+err_t urob_tls_handshake(urob_tls * tls);
+
+// Encrypts and writes at most a record of data (see max_fragment)
+// @discussion like netconn_write_partly with NETCONN_DONTBLOCK: ERR_WOULDBLOCK when the send buffer is
+// full. After that, the call must be repeated from the same data (a record was encrypted already)
+err_t urob_tls_write(urob_tls * tls, const void * data, size_t length, size_t * bytes_written);
+
+// Same, from offset in a pbuf chain
+err_t urob_tls_write_chain(urob_tls * tls, struct pbuf * chain, size_t offset, size_t length, size_t * bytes_written);
+
+// Like netconn_recv_tcp_pbuf_flags with NETCONN_DONTBLOCK: a pbuf of decrypted data, ERR_WOULDBLOCK when no
+// whole record arrived yet, ERR_CLSD once the server closed
+err_t urob_tls_recv(urob_tls * tls, struct pbuf ** plaintext);
+
+// Sends close_notify (best effort, it's not retried), the connection is closed by its owner
+void urob_tls_close(urob_tls * tls);
+
+void urob_tls_uninit(urob_tls * tls);
+
+#endif // __UROB_TLS_H__
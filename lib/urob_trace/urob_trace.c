@@ -0,0 +1,285 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_trace.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <time.h>
+#include "urob_netsim.h"
+#endif
+
+#define UROB_TRACE_RING_MASK (UROB_TRACE_RING_SIZE - 1)
+
+typedef struct
+{
+    atomic_uint sequence; // position + 1 once the event is complete
+    urob_trace_event event;
+} urob_trace_slot;
+
+// Flight recorder: writers never wait, the oldest events are overwritten
+static urob_trace_slot _ring[UROB_TRACE_RING_SIZE];
+static atomic_uint _position;
+
+uint32_t urob_trace_now(void)
+{
+#ifdef ESP_PLATFORM
+    return (uint32_t) esp_timer_get_time();
+#elif UROB_NETSIM
+    return urob_netsim_now_us();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 1000000ull + now.tv_nsec / 1000);
+#endif
+}
+
+void urob_trace_record(urob_trace_type type, urob_trace_component component, const void * object, int from, int to, uint32_t duration)
+{
+    unsigned int position = atomic_fetch_add_explicit(&_position, 1, memory_order_relaxed);
+    urob_trace_slot * slot = &_ring[position & UROB_TRACE_RING_MASK];
+
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->event = (urob_trace_event) {
+        .timestamp = type == UROB_TRACE_TYPE_LOOP ? urob_trace_now() - duration : urob_trace_now(),
+        .duration = duration,
+        .object = (uint32_t) (uintptr_t) object,
+        .type = type,
+        .component = component,
+        .from = from,
+        .to = to
+    };
+
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+void urob_trace_cursor_init(urob_trace_cursor * cursor)
+{
+    unsigned int end = atomic_load_explicit(&_position, memory_order_acquire);
+
+    * cursor = (urob_trace_cursor) {
+        .start = end > UROB_TRACE_RING_SIZE ? end - UROB_TRACE_RING_SIZE : 0,
+        .end = end
+    };
+    cursor->position = cursor->start;
+}
+
+size_t urob_trace_read(urob_trace_cursor * cursor, void * buffer, size_t size)
+{
+    uint8_t * output = (uint8_t *) buffer;
+    size_t length = 0;
+
+    if (! cursor->header_read)
+    {
+        if (size < sizeof(urob_trace_header))
+        {
+            return 0;
+        }
+
+        urob_trace_header header = {
+            .magic = UROB_TRACE_MAGIC,
+            .version = UROB_TRACE_VERSION,
+            .event_size = sizeof(urob_trace_event),
+            .count = cursor->end - cursor->start,
+            .recorded = cursor->end
+        };
+
+        memcpy(output, &header, sizeof(header));
+        length = sizeof(header);
+        cursor->header_read = true;
+    }
+
+    // Events being overwritten while copying (or since the cursor was initialized) are marked as skipped
+    for (; cursor->position != cursor->end && size - length >= sizeof(urob_trace_event); cursor->position ++)
+    {
+        urob_trace_slot * slot = &_ring[cursor->position & UROB_TRACE_RING_MASK];
+        urob_trace_event event;
+
+        bool complete = atomic_load_explicit(&slot->sequence, memory_order_acquire) == cursor->position + 1;
+        event = slot->event;
+        atomic_thread_fence(memory_order_acquire);
+
+        if (! complete || atomic_load_explicit(&slot->sequence, memory_order_relaxed) != cursor->position + 1)
+        {
+            event.type = UROB_TRACE_TYPE_SKIPPED;
+        }
+
+        memcpy(output + length, &event, sizeof(event));
+        length += sizeof(event);
+    }
+
+    return length;
+}
+
+void urob_trace_dump(urob_trace_write_fn write, void * arg)
+{
+    urob_trace_cursor cursor;
+    urob_trace_cursor_init(&cursor);
+
+    // Copied in batches on the stack
+    uint8_t batch[sizeof(urob_trace_header) + 16 * sizeof(urob_trace_event)];
+    size_t length;
+
+    while ((length = urob_trace_read(&cursor, batch, sizeof(batch))) > 0)
+    {
+        if (! write(batch, length, arg))
+        {
+            return;
+        }
+    }
+}
+
+// Keep in sync with the state enums of the traced components
+static const char * const _tcp_states[] = {"none", "init", "connecting", "handshaking", "connected", "accepting", "error"};
+static const char * const _tcp_message_states[] = {"none", "init", "sending", "sent", "receiving", "received", "error"};
+static const char * const _http_client_states[] = {"none", "init", "connecting", "handshaking", "connected", "sending request", "waiting response", "cached", "response received", "error"};
+static const char * const _address_states[] = {"none", "error", "init", "resolving", "resolved"};
+static const char * const _http_server_connection_states[] = {"none", "request", "body", "response", "done", "linger", "closed", "error"};
+static const char * const _wifi_states[] = {"none", "starting", "connecting", "associated", "up", "backoff", "error"};
+static const char * const _netconn_events[] = {"rcvplus", "rcvminus", "sendplus", "sendminus", "error"};
+
+static const char * const _component_names[UROB_TRACE_COMPONENT_COUNT] = {
+    [UROB_TRACE_TCP] = "tcp",
+    [UROB_TRACE_TCP_MESSAGE] = "tcp message",
+    [UROB_TRACE_HTTP_CLIENT] = "http client",
+    [UROB_TRACE_ADDRESS] = "address",
+    [UROB_TRACE_HTTP_SERVER] = "http server",
+    [UROB_TRACE_HTTP_CLIENT_TEST] = "http client test",
+    [UROB_TRACE_HTTP_SERVER_CONNECTION] = "http server connection",
+    [UROB_TRACE_WIFI] = "wifi",
+};
+
+#define _urob_trace_name(names, index) ((index) < sizeof(names) / sizeof(names[0]) ? names[index] : "?")
+
+static const char * _urob_trace_state_name(uint8_t component, uint8_t state)
+{
+    switch (component)
+    {
+        case UROB_TRACE_TCP: return _urob_trace_name(_tcp_states, state);
+        case UROB_TRACE_TCP_MESSAGE: return _urob_trace_name(_tcp_message_states, state);
+        case UROB_TRACE_HTTP_CLIENT: return _urob_trace_name(_http_client_states, state);
+        case UROB_TRACE_ADDRESS: return _urob_trace_name(_address_states, state);
+        case UROB_TRACE_HTTP_SERVER_CONNECTION: return _urob_trace_name(_http_server_connection_states, state);
+        case UROB_TRACE_WIFI: return _urob_trace_name(_wifi_states, state);
+        default: return "?";
+    }
+}
+
+#define UROB_TRACE_MAX_TIMELINES (64)
+
+typedef struct
+{
+    uint32_t object;
+    uint8_t component;
+    uint8_t state;
+    uint32_t since;
+} urob_trace_timeline;
+
+#define _urob_trace_json(...) do { \
+    int _length = snprintf(line, sizeof(line), __VA_ARGS__); \
+    if (_length < 0 || _length >= (int) sizeof(line) || ! write(line, _length, arg)) return false; \
+} while (0)
+
+bool urob_trace_to_chrome_json(const void * dump, size_t size, urob_trace_write_fn write, void * arg)
+{
+    urob_trace_header header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, dump, sizeof(header));
+    if (memcmp(header.magic, UROB_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != UROB_TRACE_VERSION ||
+        header.event_size != sizeof(urob_trace_event) ||
+        size < sizeof(header) + (size_t) header.count * sizeof(urob_trace_event))
+    {
+        return false;
+    }
+
+    const uint8_t * events = (const uint8_t *) dump + sizeof(header);
+    urob_trace_timeline timelines[UROB_TRACE_MAX_TIMELINES];
+    int timeline_count = 0;
+    const char * separator = "";
+    char line[256];
+
+    _urob_trace_json("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (uint32_t index = 0; index < header.count; index ++)
+    {
+        urob_trace_event event;
+        memcpy(&event, events + index * sizeof(event), sizeof(event));
+        const char * component = event.component < UROB_TRACE_COMPONENT_COUNT ? _component_names[event.component] : "?";
+
+        switch (event.type)
+        {
+            case UROB_TRACE_TYPE_LOOP:
+                _urob_trace_json("%s{\"name\":\"%s loop\",\"cat\":\"loop\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":0,\"tid\":%u}",
+                    separator, component, event.timestamp, event.duration, event.component);
+            break;
+            case UROB_TRACE_TYPE_NETCONN_EVENT:
+                _urob_trace_json("%s{\"name\":\"%s\",\"cat\":\"netconn\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%u,\"pid\":1,\"tid\":%u,\"args\":{\"len\":%u}}",
+                    separator, _urob_trace_name(_netconn_events, event.to), event.timestamp, event.object, event.duration);
+            break;
+            case UROB_TRACE_TYPE_STATE:
+            {
+                // Each state becomes a slice on the object's timeline, ending at the next transition
+                urob_trace_timeline * timeline = NULL;
+                for (int timeline_index = 0; timeline_index < timeline_count; timeline_index ++)
+                {
+                    if (timelines[timeline_index].object == event.object && timelines[timeline_index].component == event.component)
+                    {
+                        timeline = &timelines[timeline_index];
+                        break;
+                    }
+                }
+
+                if (timeline == NULL)
+                {
+                    timeline = timeline_count < UROB_TRACE_MAX_TIMELINES ? &timelines[timeline_count ++] : &timelines[event.object % UROB_TRACE_MAX_TIMELINES];
+                    * timeline = (urob_trace_timeline) {.object = event.object, .component = event.component, .state = event.from, .since = event.timestamp};
+                }
+
+                _urob_trace_json("%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":1,\"tid\":%u}",
+                    separator, _urob_trace_state_name(timeline->component, timeline->state), component,
+                    timeline->since, event.timestamp - timeline->since, event.object);
+
+                timeline->state = event.to;
+                timeline->since = event.timestamp;
+            }
+            break;
+            default:
+                continue;
+        }
+
+        separator = ",\n";
+    }
+
+    _urob_trace_json("\n]}\n");
+    return true;
+}
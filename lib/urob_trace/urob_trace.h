@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_TRACE_H__
+#define __UROB_TRACE_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The trace recorder is compiled in with -DUROB_TRACE=1
+#ifndef UROB_TRACE
+#define UROB_TRACE (0)
+#endif
+
+#define UROB_TRACE_RING_SIZE (512) // events, must be a power of two
+
+// Loop iterations shorter than this are not recorded, or they'd fill the ring in a few ms
+#ifndef UROB_TRACE_LOOP_THRESHOLD_US
+#define UROB_TRACE_LOOP_THRESHOLD_US (50)
+#endif
+
+#define UROB_TRACE_MAGIC "UTRC"
+#define UROB_TRACE_VERSION (1)
+
+typedef enum
+{
+    UROB_TRACE_TYPE_STATE, // from -> to
+    UROB_TRACE_TYPE_NETCONN_EVENT, // to is the netconn_evt, duration the length
+    UROB_TRACE_TYPE_LOOP, // duration of a loop iteration
+    UROB_TRACE_TYPE_SKIPPED = 0xff // overwritten while dumping
+} urob_trace_type;
+
+typedef enum
+{
+    UROB_TRACE_TCP, // urob_tcp_state
+    UROB_TRACE_TCP_MESSAGE, // urob_tcp_message_state
+    UROB_TRACE_HTTP_CLIENT, // urob_http_client_state
+    UROB_TRACE_ADDRESS, // urob_address_state
+    UROB_TRACE_HTTP_SERVER,
+    UROB_TRACE_HTTP_CLIENT_TEST,
+    UROB_TRACE_HTTP_SERVER_CONNECTION, // urob_http_server_connection_state
+    UROB_TRACE_WIFI, // urob_wifi_state
+
+    UROB_TRACE_COMPONENT_COUNT
+} urob_trace_component;
+
+// Event as stored in a dump, little endian
+typedef struct __attribute__((packed))
+{
+    uint32_t timestamp; // us
+    uint32_t duration; // us for loops, length for netconn events
+    uint32_t object; // identifies the timeline: the netconn for connections, so that their state transitions
+                     // and netconn events line up, the address of the traced structure otherwise
+    uint8_t type;
+    uint8_t component;
+    uint8_t from;
+    uint8_t to;
+} urob_trace_event;
+
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t count; // events following the header, oldest first
+    uint32_t recorded; // events recorded since boot, including overwritten ones
+} urob_trace_header;
+
+uint32_t urob_trace_now(void);
+void urob_trace_record(urob_trace_type type, urob_trace_component component, const void * object, int from, int to, uint32_t duration);
+
+// Receives a chunk of a dump or of its json conversion, return false to stop
+typedef bool (* urob_trace_write_fn)(const void * data, size_t length, void * arg);
+
+// Writes a header and a consistent copy of the ring's events, oldest first
+void urob_trace_dump(urob_trace_write_fn write, void * arg);
+
+// Reads a dump a piece at a time, e.g. as a connection's send window opens
+typedef struct
+{
+    unsigned int start;
+    unsigned int end;
+    unsigned int position;
+    bool header_read;
+} urob_trace_cursor;
+
+// Takes the events recorded so far, newer ones aren't part of the dump
+void urob_trace_cursor_init(urob_trace_cursor * cursor);
+
+// Copies the next part of the dump into buffer, the header first and then whole events
+// @return the length, 0 at the end
+size_t urob_trace_read(urob_trace_cursor * cursor, void * buffer, size_t size);
+
+// Converts a dump into the chrome trace event format (chrome://tracing, ui.perfetto.dev),
+// e.g. on the host after downloading /trace
+// @return false if the dump is malformed
+bool urob_trace_to_chrome_json(const void * dump, size_t size, urob_trace_write_fn write, void * arg);
+
+#if UROB_TRACE
+#define UROB_TRACE_STATE(component, object, from, to) do { \
+    if ((int) (from) != (int) (to)) urob_trace_record(UROB_TRACE_TYPE_STATE, component, object, from, to, 0); \
+} while (0)
+#define UROB_TRACE_EVENT(component, object, event, length) \
+    urob_trace_record(UROB_TRACE_TYPE_NETCONN_EVENT, component, object, 0, event, length)
+#define UROB_TRACE_LOOP(component, object, statement) do { \
+    uint32_t _urob_trace_start = urob_trace_now(); \
+    statement; \
+    uint32_t _urob_trace_duration = urob_trace_now() - _urob_trace_start; \
+    if (_urob_trace_duration >= UROB_TRACE_LOOP_THRESHOLD_US) \
+        urob_trace_record(UROB_TRACE_TYPE_LOOP, component, object, 0, 0, _urob_trace_duration); \
+} while (0)
+#else
+#define UROB_TRACE_STATE(component, object, from, to) do { (void) (object); (void) (from); } while (0)
+#define UROB_TRACE_EVENT(component, object, event, length) do { } while (0)
+#define UROB_TRACE_LOOP(component, object, statement) do { statement; } while (0)
+#endif
+
+#endif // __UROB_TRACE_H__
@@ -0,0 +1,340 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "urob_wifi.h"
+#include "urob_metrics.h"
+#include "urob_trace.h"
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_system.h"
+#include "esp_wifi.h"
+#endif
+
+#define TAG "wifi"
+#include "general.h"
+
+// Only the driver produces: the event task on the esp32, the loop itself with the simulated link
+static void _urob_wifi_post(urob_wifi * wifi, urob_wifi_event event)
+{
+    _chk(! urob_spsc_push(&wifi->events, (void *) (uintptr_t) event), , "event %d dropped", event);
+}
+
+// Driver, the esp32's radio or a simulated one
+
+#ifdef ESP_PLATFORM
+// Runs in the event task, hands over to the loop
+static void _urob_wifi_event_handler(void * arg, esp_event_base_t event_base, int32_t event_id, void * event_data)
+{
+    urob_wifi * wifi = (urob_wifi *) arg;
+
+    if (event_base == WIFI_EVENT)
+    {
+        switch (event_id)
+        {
+            case WIFI_EVENT_STA_START: _urob_wifi_post(wifi, WIFI_LINK_READY); break;
+            case WIFI_EVENT_STA_CONNECTED: _urob_wifi_post(wifi, WIFI_LINK_ASSOCIATED); break;
+            case WIFI_EVENT_STA_DISCONNECTED: _urob_wifi_post(wifi, WIFI_LINK_DISCONNECTED); break;
+            default: break;
+        }
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        ip_event_got_ip_t * event = (ip_event_got_ip_t *) event_data;
+        atomic_store_explicit(&wifi->address, event->ip_info.ip.addr, memory_order_relaxed); // published with the event
+        _urob_wifi_post(wifi, WIFI_LINK_GOT_ADDRESS);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP)
+    {
+        _urob_wifi_post(wifi, WIFI_LINK_LOST_ADDRESS);
+    }
+}
+
+static void _urob_wifi_driver_start(urob_wifi * wifi)
+{
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t init_config = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&init_config));
+
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &_urob_wifi_event_handler, wifi, &wifi->wifi_event_instance));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, &_urob_wifi_event_handler, wifi, &wifi->ip_event_instance));
+
+    wifi_config_t wifi_config = {0};
+    strncpy((char *) wifi_config.sta.ssid, wifi->config.ssid, sizeof(wifi_config.sta.ssid));
+    strncpy((char *) wifi_config.sta.password, wifi->config.password, sizeof(wifi_config.sta.password));
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_start()); // doesn't wait, WIFI_EVENT_STA_START follows
+}
+
+// @return false if the attempt didn't start, no event follows then
+static bool _urob_wifi_driver_connect(urob_wifi * wifi)
+{
+    esp_err_t err = esp_wifi_connect();
+    _chk(err != ESP_OK, return false, "unable to connect: %d", err);
+    return true;
+}
+
+static void _urob_wifi_driver_disconnect(urob_wifi * wifi)
+{
+    esp_wifi_disconnect();
+}
+
+static void _urob_wifi_driver_poll(urob_wifi * wifi)
+{
+}
+
+static void _urob_wifi_driver_stop(urob_wifi * wifi)
+{
+    esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi->wifi_event_instance);
+    esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, wifi->ip_event_instance);
+    esp_wifi_stop();
+}
+
+static uint32_t _urob_wifi_random(urob_wifi * wifi)
+{
+    return esp_random();
+}
+#else
+static void _urob_wifi_driver_start(urob_wifi * wifi)
+{
+    _urob_wifi_post(wifi, WIFI_LINK_READY);
+}
+
+static void _urob_wifi_sim_schedule(urob_wifi * wifi, urob_wifi_event event, uint32_t delay_us)
+{
+    wifi->sim_pending = event;
+    wifi->sim_due_us = urob_metrics_time_us() + delay_us;
+}
+
+static uint32_t _urob_wifi_random(urob_wifi * wifi)
+{
+    // xorshift32
+    uint32_t x = wifi->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wifi->random = x;
+    return x;
+}
+
+static bool _urob_wifi_driver_connect(urob_wifi * wifi)
+{
+    bool fails = _urob_wifi_random(wifi) % 1000 < wifi->config.sim.failure_permille;
+    _urob_wifi_sim_schedule(wifi, fails ? WIFI_LINK_DISCONNECTED : WIFI_LINK_ASSOCIATED, wifi->config.sim.associate_us);
+    return true;
+}
+
+static void _urob_wifi_driver_disconnect(urob_wifi * wifi)
+{
+    wifi->sim_pending = WIFI_LINK_NONE;
+    _urob_wifi_post(wifi, WIFI_LINK_DISCONNECTED);
+}
+
+// Delivers the simulated event once due, and follows an association with dhcp
+static void _urob_wifi_driver_poll(urob_wifi * wifi)
+{
+    urob_wifi_event event = wifi->sim_pending;
+    if (event == WIFI_LINK_NONE || (int32_t) (urob_metrics_time_us() - wifi->sim_due_us) < 0)
+    {
+        return;
+    }
+
+    wifi->sim_pending = WIFI_LINK_NONE;
+
+    if (event == WIFI_LINK_ASSOCIATED)
+    {
+        _urob_wifi_sim_schedule(wifi, WIFI_LINK_GOT_ADDRESS, wifi->config.sim.dhcp_us);
+    } else if (event == WIFI_LINK_GOT_ADDRESS)
+    {
+        atomic_store_explicit(&wifi->address, wifi->config.sim.address, memory_order_relaxed);
+    }
+
+    _urob_wifi_post(wifi, event);
+}
+
+static void _urob_wifi_driver_stop(urob_wifi * wifi)
+{
+    wifi->sim_pending = WIFI_LINK_NONE;
+}
+
+void urob_wifi_sim_drop(urob_wifi * wifi)
+{
+    wifi->sim_pending = WIFI_LINK_NONE;
+    _urob_wifi_post(wifi, WIFI_LINK_DISCONNECTED);
+}
+#endif
+
+// Link state machine
+
+// Exponential, with up to 25% of jitter so that a fleet doesn't retry in lockstep
+static void _urob_wifi_backoff(urob_wifi * wifi)
+{
+    uint32_t shift = wifi->attempts > 8 ? 8 : wifi->attempts - 1;
+    uint32_t delay_ms = UROB_WIFI_BACKOFF_MIN_MS << shift;
+    delay_ms = delay_ms < UROB_WIFI_BACKOFF_MAX_MS ? delay_ms : UROB_WIFI_BACKOFF_MAX_MS;
+    delay_ms += _urob_wifi_random(wifi) % (delay_ms / 4 + 1);
+
+    wifi->deadline_us = urob_metrics_time_us() + delay_ms * 1000;
+    wifi->state = WIFI_STATE_BACKOFF;
+    UROB_LOGW(TAG, "connection failed, trying again in %u ms", (unsigned) delay_ms);
+}
+
+static void _urob_wifi_connect(urob_wifi * wifi)
+{
+    wifi->attempts ++;
+    wifi->deadline_us = urob_metrics_time_us() + UROB_WIFI_CONNECT_TIMEOUT_MS * 1000;
+    wifi->state = WIFI_STATE_CONNECTING;
+    UROB_LOGI(TAG, "connecting to %s (attempt %u)", wifi->config.ssid, (unsigned) wifi->attempts);
+
+    if (! _urob_wifi_driver_connect(wifi))
+    {
+        _urob_wifi_backoff(wifi);
+    }
+}
+
+static void _urob_wifi_down(urob_wifi * wifi)
+{
+    if (atomic_load_explicit(&wifi->up, memory_order_relaxed))
+    {
+        UROB_LOGW(TAG, "link lost");
+        atomic_store_explicit(&wifi->up, false, memory_order_release);
+        wifi->down_since_us = urob_metrics_time_us();
+    }
+}
+
+static void _urob_wifi_handle(urob_wifi * wifi, urob_wifi_event event)
+{
+    switch (event)
+    {
+        case WIFI_LINK_READY:
+            if (wifi->state == WIFI_STATE_STARTING)
+            {
+                _urob_wifi_connect(wifi);
+            }
+        break;
+        case WIFI_LINK_ASSOCIATED:
+            if (wifi->state == WIFI_STATE_CONNECTING)
+            {
+                wifi->state = WIFI_STATE_ASSOCIATED;
+            }
+        break;
+        case WIFI_LINK_GOT_ADDRESS:
+            if (wifi->state == WIFI_STATE_CONNECTING || wifi->state == WIFI_STATE_ASSOCIATED)
+            {
+                uint32_t elapsed_us = urob_metrics_time_us() - wifi->down_since_us;
+                urob_metrics_record(UROB_METRICS_WIFI_UP, elapsed_us);
+                UROB_LOGI(TAG, "up after %u ms, %u attempts", (unsigned) (elapsed_us / 1000), (unsigned) wifi->attempts);
+
+                wifi->attempts = 0;
+                wifi->state = WIFI_STATE_UP;
+                atomic_fetch_add_explicit(&wifi->generation, 1, memory_order_relaxed);
+                atomic_store_explicit(&wifi->up, true, memory_order_release);
+            }
+        break;
+        case WIFI_LINK_LOST_ADDRESS:
+            if (wifi->state == WIFI_STATE_UP) // still associated, dhcp again
+            {
+                _urob_wifi_down(wifi);
+                wifi->deadline_us = urob_metrics_time_us() + UROB_WIFI_CONNECT_TIMEOUT_MS * 1000;
+                wifi->state = WIFI_STATE_ASSOCIATED;
+            }
+        break;
+        case WIFI_LINK_DISCONNECTED:
+            if (wifi->state == WIFI_STATE_UP)
+            {
+                _urob_wifi_down(wifi);
+                _urob_wifi_connect(wifi); // right away the first time
+            } else if (wifi->state == WIFI_STATE_CONNECTING || wifi->state == WIFI_STATE_ASSOCIATED)
+            {
+                _urob_wifi_backoff(wifi);
+            }
+        break;
+        default:
+        break;
+    }
+}
+
+static void _urob_wifi_loop(urob_wifi * wifi)
+{
+    _urob_wifi_driver_poll(wifi);
+
+    void * item;
+    while ((item = urob_spsc_pop(&wifi->events)) != NULL)
+    {
+        _urob_wifi_handle(wifi, (urob_wifi_event) (uintptr_t) item);
+    }
+
+    bool expired = (int32_t) (urob_metrics_time_us() - wifi->deadline_us) >= 0;
+
+    switch (wifi->state)
+    {
+        case WIFI_STATE_CONNECTING:
+        case WIFI_STATE_ASSOCIATED:
+            if (expired)
+            {
+                UROB_LOGW(TAG, "connection timed out");
+                _urob_wifi_backoff(wifi); // the disconnection that follows is ignored
+                _urob_wifi_driver_disconnect(wifi);
+            }
+        break;
+        case WIFI_STATE_BACKOFF:
+            if (expired)
+            {
+                _urob_wifi_connect(wifi);
+            }
+        break;
+        default:
+        break;
+    }
+}
+
+void urob_wifi_loop(urob_wifi * wifi)
+{
+    urob_wifi_state state = wifi->state;
+    UROB_TRACE_LOOP(UROB_TRACE_WIFI, wifi, _urob_wifi_loop(wifi));
+    UROB_TRACE_STATE(UROB_TRACE_WIFI, wifi, state, wifi->state);
+}
+
+void urob_wifi_init(urob_wifi * wifi, const urob_wifi_config * config)
+{
+    * wifi = (urob_wifi) {0};
+    wifi->config = * config;
+    wifi->random = config->seed != 0 ? config->seed : 0x2545f491;
+    urob_spsc_init(&wifi->events);
+
+    wifi->down_since_us = urob_metrics_time_us();
+    wifi->state = WIFI_STATE_STARTING;
+    _urob_wifi_driver_start(wifi);
+}
+
+void urob_wifi_uninit(urob_wifi * wifi)
+{
+    _urob_wifi_driver_stop(wifi);
+    * wifi = (urob_wifi) {0};
+}
@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __UROB_WIFI_H__
+#define __UROB_WIFI_H__
+
+#include "urob_spsc.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_event.h"
+#endif
+
+#define UROB_WIFI_BACKOFF_MIN_MS (250)
+#define UROB_WIFI_BACKOFF_MAX_MS (30000)
+#define UROB_WIFI_CONNECT_TIMEOUT_MS (15000) // association and dhcp, before trying again
+
+typedef enum
+{
+    WIFI_STATE_NONE = 0,
+    WIFI_STATE_STARTING, // driver started, waiting for it to be ready
+    WIFI_STATE_CONNECTING, // associating
+    WIFI_STATE_ASSOCIATED, // waiting for an address
+    WIFI_STATE_UP,
+    WIFI_STATE_BACKOFF, // waiting to try again
+    WIFI_STATE_ERROR
+} urob_wifi_state;
+
+// Driver events, handed over from the event task (or the link simulator) to the loop
+typedef enum
+{
+    WIFI_LINK_NONE = 0,
+    WIFI_LINK_READY,
+    WIFI_LINK_ASSOCIATED,
+    WIFI_LINK_DISCONNECTED,
+    WIFI_LINK_GOT_ADDRESS,
+    WIFI_LINK_LOST_ADDRESS
+} urob_wifi_event;
+
+// Stand-in for the radio and the access point on the host, delays in (simulated) time
+typedef struct
+{
+    uint32_t associate_us;
+    uint32_t dhcp_us;
+    uint16_t failure_permille; // an association attempt fails
+    uint32_t address; // handed out by dhcp, network order
+} urob_wifi_sim_link;
+
+typedef struct
+{
+    const char * ssid;
+    const char * password;
+    uint32_t seed; // backoff jitter
+    urob_wifi_sim_link sim; // host only
+} urob_wifi_config;
+
+typedef struct
+{
+    urob_wifi_config config;
+    urob_wifi_state state;
+    urob_spsc events; // urob_wifi_event, the driver produces and the loop consumes
+
+    uint32_t attempts; // since the link was last up
+    uint32_t deadline_us; // of the current attempt, or of the backoff
+    uint32_t down_since_us; // start, or link loss
+    uint32_t random;
+
+    // Published for the other loops
+    atomic_bool up;
+    atomic_uint address; // network order, valid while up
+    atomic_uint generation; // incremented whenever an address is obtained
+
+#ifdef ESP_PLATFORM
+    esp_event_handler_instance_t wifi_event_instance;
+    esp_event_handler_instance_t ip_event_instance;
+#else
+    urob_wifi_event sim_pending;
+    uint32_t sim_due_us;
+#endif
+} urob_wifi;
+
+// Starts the station without waiting for it to connect, the loop takes it from there
+void urob_wifi_init(urob_wifi * wifi, const urob_wifi_config * config);
+void urob_wifi_uninit(urob_wifi * wifi);
+void urob_wifi_loop(urob_wifi * wifi);
+
+// Can be called from any loop
+static inline bool urob_wifi_is_up(urob_wifi * wifi)
+{
+    return atomic_load_explicit(&wifi->up, memory_order_acquire);
+}
+
+static inline unsigned int urob_wifi_generation(urob_wifi * wifi)
+{
+    return atomic_load_explicit(&wifi->generation, memory_order_acquire);
+}
+
+#ifndef ESP_PLATFORM
+// Drops the simulated link, as if the access point went away
+void urob_wifi_sim_drop(urob_wifi * wifi);
+#endif
+
+#endif // __UROB_WIFI_H__
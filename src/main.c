@@ -23,145 +23,378 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
-#include "esp_wifi.h"
-#include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
 
 #include "urob_http_server.h"
 #include "urob_http_client_test.h"
+#include "urob_shard.h"
+#include "urob_log.h"
+#include "urob_http_load.h"
+#include "urob_accounting.h"
+#include "urob_socket_http.h"
+#include "urob_fsimage.h"
+#include "urob_http_cache.h"
+#include "urob_preconnect.h"
+#include "urob_teardown.h"
+#include "urob_wifi.h"
 
 #include "lwip/dns.h"
 
 #define WIFI_SSID               "YOUR_SSID"
 #define WIFI_PASSWORD           "YOUR_PWD"
 
-#define WIFI_CONNECT_MAX_RETRIES  (2)
-#define WIFI_CONNECTED_FLAG      BIT0
-#define WIFI_ERROR_FLAG          BIT1
+// Number of network loops, each pinned to its own core
+#define UROB_SHARD_COUNT        (portNUM_PROCESSORS < UROB_MAX_SHARDS ? portNUM_PROCESSORS : UROB_MAX_SHARDS)
+// The single loop used to run in the main task (CONFIG_ESP_MAIN_TASK_STACK_SIZE, 3584), a tls handshake
+// (urob_tls) takes a couple of KB more; shards log their stack high-water mark, to trim this from
+#define UROB_SHARD_STACK_SIZE   (6144)
+#define UROB_SHARD_IDLE_MS      (100) // longest sleep of a worker shard with no connection
+
+// Build with -DUROB_HTTP_LOAD=1 to benchmark the http server over the loopback interface
+#ifndef UROB_HTTP_LOAD
+#define UROB_HTTP_LOAD (0)
+#endif
+
+// Build with -DUROB_ACCOUNTING=1 (and the linker wraps in urob_accounting.h) to compare the copies
+// and allocations per request of the netconn and sockets paths
+#define UROB_ACCOUNTING_SOCKET_PORT (8080)
+#define UROB_ACCOUNTING_DURATION_MS (5000)
+
+// Load shedding, see urob_admission_config. The benchmarks come from a single address, faster
+// than a client ip is allowed to
+static const urob_admission_config admission_config = {
+    .max_connections = UROB_HTTP_SERVER_MAX_CONNECTIONS * UROB_SHARD_COUNT,
+    .max_queued_bytes = 16 * 1024,
+    .min_free_heap = 24 * 1024,
+    .reset_free_heap = 12 * 1024,
+    .min_free_pcbs = 4,
+    .reset_free_pcbs = 1,
+    .rate = UROB_HTTP_LOAD || UROB_ACCOUNTING ? 0 : 16,
+    .burst = 32, // a page and its assets
+    .retry_after_s = 1
+};
+
+// Work done by each server per loop, so that a large response doesn't hold back the other connections
+// and the other components of the shard. Unlimited while benchmarking
+static const urob_budget_config server_budget = {
+    .bytes = UROB_HTTP_LOAD || UROB_ACCOUNTING ? 0 : 8 * 1024
+};
+
+// TIME_WAIT pcbs are reclaimed below this many free ones in lwip's pool, see urob_teardown
+#define UROB_TCP_PCB_RESERVE (4)
+
+// Data partition with the files served by the http servers, see tools/urob_fsimage.py
+#define UROB_WWW_PARTITION "www"
+
+// Responses fetched by the http client test, kept across reboots as stale entries
+static const urob_http_cache_config http_cache_config = {
+    .storage = UROB_HTTP_CACHE_FLASH,
+    .max_body = 4 * 1024,
+    .target = "cache"
+};
+
+// Connections to the client test's host kept ready; idle ones are replaced well before common
+// keep-alive timeouts would close them
+static const urob_preconnect_config preconnect_config = {
+    .idle_ms = 30 * 1000,
+    .connect_timeout_ms = 10 * 1000,
+    .retry_ms = 5 * 1000
+};
+
+// Build with -DUROB_HTTP_CLIENT_TLS=1 for the client test to fetch over https, resuming its session on the
+// next fetches. Without ca_pem the server isn't verified
+#ifndef UROB_HTTP_CLIENT_TLS
+#define UROB_HTTP_CLIENT_TLS (0)
+#endif
+#define UROB_HTTP_CLIENT_TEST_PORT (UROB_HTTP_CLIENT_TLS ? 443 : 80)
+
+#if UROB_HTTP_CLIENT_TLS
+static const urob_tls_config client_tls_config = {
+    .ca_pem = NULL,
+    .max_fragment = 2048,
+    .session_tickets = true
+};
+#endif
+
+#ifndef UROB_BUILD_LABEL
+#define UROB_BUILD_LABEL "unknown"
+#endif
 
 #define TAG "main"
 
 typedef struct 
 {
-    EventGroupHandle_t wifi_group;
-    int retries;
-    esp_event_handler_instance_t wifi_event_any_id_instance;
-    esp_event_handler_instance_t ip_event_sta_got_id_instance;
-    bool keep_going;
+    urob_wifi wifi; // looped by the first shard
+    urob_teardown teardown; // same
+    unsigned int wifi_generation; // of the link the client test last started on
 
-    urob_http_server server;
+    urob_shard_group shards;
+    urob_http_server servers[UROB_MAX_SHARDS]; // servers[0] listens, the others serve handed over connections
+    urob_fsimage www;
+    urob_admission admission; // shared by the servers
     urob_http_client_test http_client_test;
+    urob_http_cache http_cache; // looped by the client test's shard
+    urob_preconnect preconnect; // same, while the network is up
+#if UROB_HTTP_CLIENT_TLS
+    urob_tls_context client_tls; // same
+#endif
+    int http_client_test_shard;
+
+#if UROB_HTTP_LOAD
+    urob_http_load http_load;
+    int http_load_shard;
+#endif
+
+#if UROB_ACCOUNTING
+    // Clients run on the last shard, servers on the first, one transport after the other
+    int accounting_phase; // urob_accounting_transport being measured
+    urob_http_load accounting_load;
+    urob_socket_http_server socket_server;
+    urob_socket_http_client socket_client;
+#endif
 } urob_main;
 
-static void _urob_event_handler(
-    void* arg, 
-    esp_event_base_t event_base,
-    int32_t event_id,
-    void* event_data)
+#if UROB_HTTP_LOAD || UROB_ACCOUNTING
+static bool _urob_print(const char * text, size_t length, void * arg)
+{
+    printf("%.*s", (int) length, text);
+    return true;
+}
+#endif
+
+#if ! UROB_ACCOUNTING
+// Runs on the listening shard: spreads accepted connections across the shards
+static void _urob_dispatch_connection(struct netconn * conn, void * arg)
 {
     urob_main * urob = (urob_main *) arg;
+    urob_shard * listening_shard = &urob->shards.shards[0];
 
-    if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED))
+    if (! urob_shard_handoff(listening_shard, urob_shard_pick(&urob->shards), conn))
     {
-        if (urob->retries < WIFI_CONNECT_MAX_RETRIES)
-        {
-            ESP_LOGW(TAG, "trying wifi connection again..");
-            urob->retries++;
-            esp_wifi_connect();
-        } else
-        {
-            ESP_LOGE(TAG, "unable to connect to wifi");
-            xEventGroupSetBits(urob->wifi_group, WIFI_ERROR_FLAG);
-        }
+        ESP_LOGW(TAG, "shard inbox full, serving locally");
+        urob_http_server_adopt(&urob->servers[0], conn);
+    }
+}
+#endif
+
+static void _urob_shard_handoff(urob_shard * shard, void * item, void * arg)
+{
+    urob_main * urob = (urob_main *) arg;
+    urob_http_server_adopt(&urob->servers[shard->index], (struct netconn *) item);
+}
+
+#if UROB_ACCOUNTING
+static void _urob_accounting_loop(urob_main * urob, urob_shard * shard)
+{
+    if (shard->index == 0)
+    {
+        UROB_ACCOUNTING_SCOPE(UROB_ACCOUNTING_SOCKETS, UROB_ACCOUNTING_SERVER, urob_socket_http_server_loop(&urob->socket_server));
     }
-    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+
+    if (shard->index != urob->shards.count - 1)
     {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got address: " IPSTR, IP2STR(&event->ip_info.ip));
-        xEventGroupSetBits(urob->wifi_group, WIFI_CONNECTED_FLAG);
+        return;
+    }
+
+    switch (urob->accounting_phase)
+    {
+        case UROB_ACCOUNTING_NETCONN:
+            UROB_ACCOUNTING_SCOPE(UROB_ACCOUNTING_NETCONN, UROB_ACCOUNTING_CLIENT, urob_http_load_loop(&urob->accounting_load));
+
+            if (urob_http_load_done(&urob->accounting_load))
+            {
+                // Same number of requests over sockets
+                ip_addr_t address;
+                ip_addr_set_loopback(false, &address);
+                urob_socket_http_client_init(&urob->socket_client, &address, UROB_ACCOUNTING_SOCKET_PORT, "/", urob->accounting_load.completed);
+
+                urob->accounting_phase = UROB_ACCOUNTING_SOCKETS;
+                urob_accounting_start(UROB_ACCOUNTING_SOCKETS);
+            }
+        break;
+        case UROB_ACCOUNTING_SOCKETS:
+            UROB_ACCOUNTING_SCOPE(UROB_ACCOUNTING_SOCKETS, UROB_ACCOUNTING_CLIENT, urob_socket_http_client_loop(&urob->socket_client));
+
+            if (urob_socket_http_client_done(&urob->socket_client))
+            {
+                urob_accounting_stop();
+                urob->accounting_phase = UROB_ACCOUNTING_TRANSPORT_COUNT;
+
+                urob_accounting_write_json(_urob_print, NULL);
+                printf("\n");
+            }
+        break;
+        default:
+        break;
     }
 }
+#endif
 
-static void _urob_init_wifi(urob_main * urob)
+static void _urob_shard_loop(urob_shard * shard, void * arg)
 {
-    // Init interface
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    // Init wifi
-    wifi_init_config_t config = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&config));
-
-    // Register event handlers for any_id and got_ip
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(
-        WIFI_EVENT,
-        ESP_EVENT_ANY_ID,
-        &_urob_event_handler,
-        urob,
-        &urob->wifi_event_any_id_instance));
-
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(
-        IP_EVENT,
-        IP_EVENT_STA_GOT_IP,
-        &_urob_event_handler,
-        urob,
-        &urob->ip_event_sta_got_id_instance));
-
-    // Configure and start wifi in STA
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASSWORD,
-        },
-    };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    // Wait for connection or error
-    EventBits_t state = xEventGroupWaitBits(
-        urob->wifi_group,
-        WIFI_CONNECTED_FLAG | WIFI_ERROR_FLAG,
-        pdFALSE,
-        pdFALSE,
-        portMAX_DELAY);
-
-    if (state & WIFI_CONNECTED_FLAG) {
-        ESP_LOGI(TAG, "connection successful");
-        return;
+    urob_main * urob = (urob_main *) arg;
+
+    if (shard->index == 0)
+    {
+        urob_wifi_loop(&urob->wifi);
+        urob_teardown_loop(&urob->teardown);
     }
 
-    if (state & WIFI_ERROR_FLAG) {
-        ESP_LOGE(TAG, "error connecting");
-        return;
+#if UROB_ACCOUNTING
+    UROB_ACCOUNTING_SCOPE(UROB_ACCOUNTING_NETCONN, UROB_ACCOUNTING_SERVER, urob_http_server_loop(&urob->servers[shard->index]));
+    _urob_accounting_loop(urob, shard);
+#else // nothing else runs while measuring
+    urob_http_server_loop(&urob->servers[shard->index]);
+
+    if (shard->index == urob->http_client_test_shard && urob_wifi_is_up(&urob->wifi))
+    {
+        // Started as soon as there's an address, and again on every new link
+        unsigned int wifi_generation = urob_wifi_generation(&urob->wifi);
+        if (wifi_generation != urob->wifi_generation)
+        {
+            if (urob->wifi_generation != 0)
+            {
+                urob_http_client_test_uninit(&urob->http_client_test);
+            }
+            urob_http_client_test_init(&urob->http_client_test);
+            urob_http_client_test_set_cache(&urob->http_client_test, &urob->http_cache);
+            urob_http_client_test_set_preconnect(&urob->http_client_test, &urob->preconnect);
+#if UROB_HTTP_CLIENT_TLS
+            urob_http_client_test_set_tls(&urob->http_client_test, &urob->client_tls);
+#endif
+            urob->wifi_generation = wifi_generation;
+        }
+
+        urob_preconnect_loop(&urob->preconnect);
+        urob_http_client_test_loop(&urob->http_client_test);
+    }
+
+    if (shard->index == urob->http_client_test_shard)
+    {
+        urob_http_cache_loop(&urob->http_cache);
     }
 
-    ESP_LOGE(TAG, "unknown connection state: 0x%x", state);
+#if UROB_HTTP_LOAD
+    if (shard->index == urob->http_load_shard && ! urob_http_load_done(&urob->http_load))
+    {
+        urob_http_load_loop(&urob->http_load);
+
+        if (urob_http_load_done(&urob->http_load))
+        {
+            urob_http_load_write_json(&urob->http_load, _urob_print, NULL);
+        }
+    }
+#endif
+
+    // Workers only serve what the first shard hands over, the handoff wakes them
+    bool busy = shard->index == 0 || shard->index == urob->http_client_test_shard || ! urob_http_server_idle(&urob->servers[shard->index]);
+#if UROB_HTTP_LOAD
+    busy = busy || (shard->index == urob->http_load_shard && ! urob_http_load_done(&urob->http_load));
+#endif
+    if (! busy)
+    {
+        urob_shard_idle(shard, UROB_SHARD_IDLE_MS);
+    }
+#endif // UROB_ACCOUNTING
 }
 
 void urob_init(urob_main * urob)
 {
     * urob = (urob_main) {0};
-    urob->wifi_group = xEventGroupCreate();
-    urob->keep_going = true;
 
-    _urob_init_wifi(urob);
+    // Doesn't wait for the connection: everything below is set up meanwhile, and components that
+    // need the network start when the first shard's loop gets an address
+    urob_wifi_config wifi_config = {
+        .ssid = WIFI_SSID,
+        .password = WIFI_PASSWORD
+    };
+    urob_wifi_init(&urob->wifi, &wifi_config);
+    urob_teardown_init(&urob->teardown, UROB_TCP_PCB_RESERVE);
 
-    urob_http_server_init(&urob->server);
-    urob_http_client_test_init(&urob->http_client_test);
-}
+    urob_shard_group_init(&urob->shards, UROB_SHARD_COUNT);
 
-void netconn_thread(void *arg)
-{
-    urob_main * urob = (urob_main *) arg;
+    urob_admission_init(&urob->admission, &admission_config);
+    urob_http_server_init(&urob->servers[0]);
+#if ! UROB_ACCOUNTING // served where accepted, the scope of the first shard
+    urob_http_server_set_dispatch(&urob->servers[0], _urob_dispatch_connection, urob);
+#endif
+    for (int shard_index = 1; shard_index < urob->shards.count; shard_index ++)
+    {
+        urob_http_server_init_worker(&urob->servers[shard_index]);
+    }
 
-    while(urob->keep_going)
+    for (int shard_index = 0; shard_index < urob->shards.count; shard_index ++)
     {
-        urob_http_server_loop(&urob->server);
-        urob_http_client_test_loop(&urob->http_client_test);
+        urob_http_server_set_admission(&urob->servers[shard_index], &urob->admission);
+        urob_http_server_set_budget(&urob->servers[shard_index], &server_budget);
+    }
+
+    // Without an image, the built-in page is served
+    if (urob_fsimage_open(&urob->www, UROB_WWW_PARTITION))
+    {
+        for (int shard_index = 0; shard_index < urob->shards.count; shard_index ++)
+        {
+            urob_http_server_set_fallback(&urob->servers[shard_index], urob_fsimage_serve, &urob->www);
+        }
+    }
+
+    // Outgoing connections are sharded when created
+    urob->http_client_test_shard = urob_shard_pick(&urob->shards);
+    urob_http_cache_init(&urob->http_cache, &http_cache_config);
+    urob_preconnect_init(&urob->preconnect, &preconnect_config);
+    urob_preconnect_add(&urob->preconnect, "ipwho.is", UROB_HTTP_CLIENT_TEST_PORT, 1);
+#if UROB_HTTP_CLIENT_TLS
+    urob_tls_context_init(&urob->client_tls, &client_tls_config);
+#endif
+
+#if UROB_HTTP_LOAD
+    urob_http_load_config load_config = {
+        .port = 80,
+        .concurrency = 4,
+        .rate = 0,
+        .keep_alive = false,
+        .duration_ms = 10000,
+        .mix = {
+            { .path = "/", .weight = 8 },
+            { .path = "/metrics", .weight = 1 },
+            { .path = "/", .weight = 1, .body_size = 512 },
+        },
+        .mix_count = 3,
+        .label = UROB_BUILD_LABEL
+    };
+    ip_addr_set_loopback(false, &load_config.address);
+
+    urob->http_load_shard = urob_shard_pick(&urob->shards);
+    urob_http_load_init(&urob->http_load, &load_config);
+#endif
+
+#if UROB_ACCOUNTING
+    // The netconn server waits in accept while it has no connection, so the clients connecting to it run on another loop
+    if (urob->shards.count < 2)
+    {
+        ESP_LOGE(TAG, "accounting needs a loop for the servers and one for the clients");
+    }
+
+    urob_http_load_config accounting_config = {
+        .port = 80,
+        .concurrency = 1,
+        .duration_ms = UROB_ACCOUNTING_DURATION_MS,
+        .mix = {{ .path = "/", .weight = 1 }},
+        .mix_count = 1,
+        .label = UROB_BUILD_LABEL
+    };
+    ip_addr_set_loopback(false, &accounting_config.address);
+
+    urob_socket_http_server_init(&urob->socket_server, UROB_ACCOUNTING_SOCKET_PORT);
+    urob_http_load_init(&urob->accounting_load, &accounting_config);
+    urob->accounting_phase = UROB_ACCOUNTING_NETCONN;
+    urob_accounting_start(UROB_ACCOUNTING_NETCONN);
+#endif
+
+    for (int shard_index = 0; shard_index < urob->shards.count; shard_index ++)
+    {
+        urob_shard_set_loop(&urob->shards, shard_index, _urob_shard_loop, _urob_shard_handoff, urob);
     }
 }
 
@@ -175,9 +408,19 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if UROB_DEFERRED_LOG
+    if (! urob_log_start_drain_task(tskIDLE_PRIORITY, 50))
+    {
+        ESP_LOGE(TAG, "unable to start log drain");
+    }
+#endif
+
     urob_main * urob = (urob_main *)malloc(sizeof(urob_main));
     urob_init(urob);
 
     // tskIDLE_PRIORITY won't trigger the watchdog
-    xTaskCreate(netconn_thread, "http server", 2048, urob, tskIDLE_PRIORITY, NULL);
+    if (! urob_shard_group_start(&urob->shards, UROB_SHARD_STACK_SIZE, tskIDLE_PRIORITY))
+    {
+        ESP_LOGE(TAG, "unable to start network loops");
+    }
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+# Copyright (c) 2023 Quantumboar <quantum@quantumboar.net>
+# MIT license, see LICENSE.txt
+"""Packs a directory into a read-only image served by lib/urob_fsimage.
+
+    python3 tools/urob_fsimage.py www/ www.bin [--size 0x100000]
+
+The layout is documented in urob_fsimage.h. Write the image to the "www" partition with e.g.
+    parttool.py write_partition --partition-name=www --input www.bin
+"""
+
+import argparse
+import mimetypes
+import os
+import struct
+import sys
+
+MAGIC = 0x31534655  # "UFS1"
+HEADER = struct.Struct("<IIII")
+ENTRY = struct.Struct("<IIII")
+ALIGN = 4
+
+
+def _align(offset):
+    return (offset + ALIGN - 1) & ~(ALIGN - 1)
+
+
+def collect(root):
+    files = []
+    for directory, _, names in os.walk(root):
+        for name in names:
+            local = os.path.join(directory, name)
+            path = "/" + os.path.relpath(local, root).replace(os.sep, "/")
+            content_type = mimetypes.guess_type(name)[0] or "application/octet-stream"
+            if content_type.startswith("text/") or content_type in ("application/javascript", "application/json"):
+                content_type += "; charset=utf-8"
+            with open(local, "rb") as f:
+                files.append((path.encode(), content_type.encode(), f.read()))
+    files.sort(key=lambda file: file[0])  # bytewise, like strcmp
+    return files
+
+
+def pack(files):
+    strings = bytearray()
+    string_offsets = {}
+    strings_start = HEADER.size + ENTRY.size * len(files)
+
+    def string(value):
+        if value not in string_offsets:
+            string_offsets[value] = strings_start + len(strings)
+            strings.extend(value + b"\0")
+        return string_offsets[value]
+
+    names = [(string(path), string(content_type)) for path, content_type, _ in files]
+
+    data = bytearray()
+    data_start = _align(strings_start + len(strings))
+    entries = bytearray()
+    for (path, content_type), (_, _, content) in zip(names, files):
+        entries.extend(ENTRY.pack(path, content_type, data_start + len(data), len(content)))
+        data.extend(content)
+        data.extend(b"\0" * (_align(len(data)) - len(data)))
+
+    size = data_start + len(data)
+    padding = b"\0" * (data_start - strings_start - len(strings))
+    return HEADER.pack(MAGIC, len(files), size, 0) + entries + strings + padding + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("directory")
+    parser.add_argument("output")
+    parser.add_argument("--size", type=lambda value: int(value, 0), help="partition size, to fail early if the image is larger")
+    args = parser.parse_args()
+
+    files = collect(args.directory)
+    if any(len(path) >= 64 for path, _, _ in files):
+        sys.exit("paths are limited to 63 characters (UROB_HTTP_SERVER_PATH_SIZE)")
+
+    image = pack(files)
+    if args.size is not None and len(image) > args.size:
+        sys.exit("image is %d bytes, larger than the partition (%d)" % (len(image), args.size))
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("%s: %d files, %d bytes" % (args.output, len(files), len(image)))
+
+
+if __name__ == "__main__":
+    main()